@@ -32,10 +32,16 @@
 
 #include "blake2.h" 
 #include "cryptobox.h"
+#include "keypairs_cache.h"
 #include "ottery.h"
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+/* Learn queue defaults */
+#define DEFAULT_LEARN_BATCH 100
+#define DEFAULT_LEARN_FLUSH_TIME 1.0
+/* Rows returned by /history if Limit is not specified */
+#define DEFAULT_HISTORY_LIMIT 1000
 
 /* HTTP paths */
 #define PATH_AUTH "/auth"
@@ -89,7 +95,8 @@ worker_t controller_worker = {
 	TRUE,                   /* Non unique */
 	FALSE,                  /* Non threaded */
 	TRUE,                   /* Killable */
-	SOCK_STREAM             /* TCP socket */
+	SOCK_STREAM,            /* TCP socket */
+	TRUE                    /* Counts connections */
 };
 /*
  * Worker's context
@@ -122,6 +129,8 @@ struct rspamd_controller_worker_ctx {
 	/* A map of secure IP */
 	GList *secure_ip;
 	radix_compressed_t *secure_map;
+	/* Plain IPs of secure_ip, maps replace secure_map when loaded */
+	radix_compressed_t *secure_ips;
 
 	/* Static files dir */
 	gchar *static_files_dir;
@@ -134,6 +143,25 @@ struct rspamd_controller_worker_ctx {
 
 	/* Local keypair */
 	gpointer key;
+
+	/* Learn queue, learning is synchronous if max size is zero */
+	guint32 learn_queue_max;
+	guint32 learn_batch;
+	gdouble learn_flush_time;
+	GQueue *learn_queue;
+	struct event learn_ev;
+	/* Messages that are processed before being queued */
+	guint learn_pending;
+	guint64 learn_ok;
+	guint64 learn_failed;
+	/* Time spent by the last learned message in the queue */
+	gdouble learn_lag;
+};
+
+struct rspamd_controller_learn_entry {
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_classifier_config *cl;
+	gboolean is_spam;
 };
 
 struct rspamd_controller_session {
@@ -313,9 +341,12 @@ static gboolean rspamd_controller_check_password(
 		msg_info ("allow unauthorized connection from a unix socket");
 		return TRUE;
 	}
-	else if (ctx->secure_map
+	else if ((ctx->secure_map
 			&& radix_find_compressed_addr (ctx->secure_map, session->from_addr)
-					!= RADIX_NO_VALUE) {
+					!= RADIX_NO_VALUE) ||
+			(ctx->secure_ips
+			&& radix_find_compressed_addr (ctx->secure_ips, session->from_addr)
+					!= RADIX_NO_VALUE)) {
 		msg_info ("allow unauthorized connection from a trusted IP %s",
 				rspamd_inet_address_to_string (session->from_addr));
 		return TRUE;
@@ -325,7 +356,7 @@ static gboolean rspamd_controller_check_password(
 	password = rspamd_http_message_find_header (msg, "Password");
 
 	if (password == NULL) {
-		if (ctx->secure_map == NULL) {
+		if (ctx->secure_map == NULL && ctx->secure_ips == NULL) {
 			if (ctx->password == NULL && !is_enable) {
 				return TRUE;
 			}
@@ -361,7 +392,7 @@ static gboolean rspamd_controller_check_password(
 			else {
 				msg_warn (
 						"no password to check while executing a privileged command");
-				if (ctx->secure_map) {
+				if (ctx->secure_map || ctx->secure_ips) {
 					msg_info("deny unauthorized connection");
 					ret = FALSE;
 				}
@@ -835,10 +866,132 @@ rspamd_controller_handle_pie_chart (
 	return 0;
 }
 
+struct rspamd_controller_history_cbdata {
+	GPtrArray *rows;
+	const gchar *symbol;
+	gsize symlen;
+	gint64 from;
+	gint64 to;
+	gint action;
+	guint limit;
+	guint nrows;
+};
+
+static gboolean
+rspamd_controller_history_has_symbol (const gchar *symbols, gsize len,
+	const gchar *sym, gsize symlen)
+{
+	const gchar *p = symbols, *end = symbols + len, *c;
+
+	/* Symbols are separated by ", " */
+	while (p < end) {
+		c = memchr (p, ',', end - p);
+
+		if (c == NULL) {
+			c = end;
+		}
+
+		if ((gsize)(c - p) == symlen && memcmp (p, sym, symlen) == 0) {
+			return TRUE;
+		}
+
+		p = c + 2;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_controller_history_row_cb (const struct roll_history_row *row,
+	const gchar *symbols, gsize symbols_len, gpointer ud)
+{
+	struct rspamd_controller_history_cbdata *cbd = ud;
+	struct tm *tm;
+	gchar timebuf[32];
+	ucl_object_t *obj;
+
+	if ((cbd->from != -1 && row->tv.tv_sec < cbd->from) ||
+		(cbd->to != -1 && row->tv.tv_sec > cbd->to) ||
+		(cbd->action != -1 && row->action != cbd->action)) {
+		return TRUE;
+	}
+
+	if (cbd->symbol != NULL && !rspamd_controller_history_has_symbol (symbols,
+			symbols_len, cbd->symbol, cbd->symlen)) {
+		return TRUE;
+	}
+
+	tm = localtime (&row->tv.tv_sec);
+	strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			timebuf),		  "time", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			row->tv.tv_sec),  "unix_time", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			row->message_id), "id",	  0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
+			"ip", 0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromstring (rspamd_action_to_str (
+			row->action)), "action", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (
+			row->score),		  "score",			0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromdouble (
+			row->required_score), "required_score", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromlstring (
+			symbols, symbols_len), "symbols",		0, false);
+	ucl_object_insert_key (obj,	   ucl_object_fromint (
+			row->len),			  "size",			0, false);
+	ucl_object_insert_key (obj,	   ucl_object_fromint (
+			row->scan_time),	  "scan_time",		0, false);
+	if (row->user[0] != '\0') {
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				row->user), "user", 0, false);
+	}
+
+	/* Rows are iterated from the newest ones, they are reversed afterwards */
+	g_ptr_array_add (cbd->rows, obj);
+	cbd->nrows ++;
+
+	return cbd->limit == 0 || cbd->nrows < cbd->limit;
+}
+
+static gint64
+rspamd_controller_history_header_int (struct rspamd_http_message *msg,
+	const gchar *name)
+{
+	const gchar *val;
+	gchar *err_str;
+	gint64 res;
+
+	val = rspamd_http_message_find_header (msg, name);
+
+	if (val == NULL) {
+		return -1;
+	}
+
+	res = g_ascii_strtoll (val, &err_str, 10);
+
+	if (err_str == val || res < 0) {
+		return -1;
+	}
+
+	return res;
+}
+
 /*
  * History command handler:
  * request: /history
  * headers: Password
+ * optional headers:
+ *  From: unix time of the oldest row
+ *  To: unix time of the newest row
+ *  Action: action of rows
+ *  Symbol: symbol that should be found in rows
+ *  Limit: maximum number of the newest rows matched (1000 by default, 0 means
+ *  no limit)
  * reply: json [
  *      { label: "Foo", data: 11 },
  *      { label: "Bar", data: 20 },
@@ -851,12 +1004,11 @@ rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	struct roll_history copied_history;
-	gint i, rows_proc, row_num;
-	struct tm *tm;
-	gchar timebuf[32];
-	ucl_object_t *top, *obj;
+	struct rspamd_controller_history_cbdata cbd;
+	const gchar *action;
+	ucl_object_t *top;
+	gint64 limit;
+	gint i;
 
 	ctx = session->ctx;
 
@@ -864,56 +1016,179 @@ rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
 		return 0;
 	}
 
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.from = rspamd_controller_history_header_int (msg, "From");
+	cbd.to = rspamd_controller_history_header_int (msg, "To");
+	cbd.action = -1;
+	limit = rspamd_controller_history_header_int (msg, "Limit");
+
+	if (limit == -1) {
+		cbd.limit = DEFAULT_HISTORY_LIMIT;
+	}
+	else {
+		cbd.limit = MIN (limit, G_MAXUINT);
+	}
+
+	cbd.symbol = rspamd_http_message_find_header (msg, "Symbol");
+
+	if (cbd.symbol != NULL) {
+		cbd.symlen = strlen (cbd.symbol);
+	}
+
+	action = rspamd_http_message_find_header (msg, "Action");
+
+	if (action != NULL) {
+		/* Actions are matched as they are shown in history */
+		for (i = 0; i < METRIC_ACTION_MAX; i ++) {
+			if (g_ascii_strcasecmp (action, rspamd_action_to_str (i)) == 0) {
+				cbd.action = i;
+				break;
+			}
+		}
+
+		if (cbd.action == -1) {
+			msg_info ("invalid action: %s", action);
+			rspamd_controller_send_error (conn_ent, 400, "400 invalid action");
+			return 0;
+		}
+	}
+
+	cbd.rows = g_ptr_array_new ();
+	rspamd_roll_history_foreach (ctx->srv->history,
+		rspamd_controller_history_row_cb, &cbd);
+
+	/* Rows are returned in time order */
 	top = ucl_object_typed_new (UCL_ARRAY);
 
-	/* Set lock on history */
-	rspamd_mempool_lock_mutex (ctx->srv->history->mtx);
-	ctx->srv->history->need_lock = TRUE;
-	/* Copy locked */
-	memcpy (&copied_history, ctx->srv->history, sizeof (copied_history));
-	rspamd_mempool_unlock_mutex (ctx->srv->history->mtx);
-
-	/* Go through all rows */
-	row_num = copied_history.cur_row;
-	for (i = 0, rows_proc = 0; i < HISTORY_MAX_ROWS; i++, row_num++) {
-		if (row_num == HISTORY_MAX_ROWS) {
-			row_num = 0;
+	for (i = cbd.rows->len; i > 0; i --) {
+		ucl_array_append (top, g_ptr_array_index (cbd.rows, i - 1));
+	}
+
+	g_ptr_array_free (cbd.rows, TRUE);
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
+struct rspamd_controller_graph_cbdata {
+	ucl_object_t *data;
+	enum rspamd_ts_series_type type;
+};
+
+static void
+rspamd_controller_graph_cb (time_t ts, const guint32 *values, guint nvalues,
+	gpointer ud)
+{
+	struct rspamd_controller_graph_cbdata *cbd = ud;
+	ucl_object_t *obj;
+	guint64 total = 0;
+	guint i;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (ts), "x", 0, false);
+
+	if (cbd->type == RSPAMD_TS_HISTOGRAM) {
+		for (i = 0; i < nvalues; i ++) {
+			total += values[i];
 		}
-		row = &copied_history.rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			tm = localtime (&row->tv.tv_sec);
-			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
-			obj = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					timebuf),		  "time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->message_id), "id",	  0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
-					"ip", 0, false);
-			ucl_object_insert_key (obj,
-				ucl_object_fromstring (rspamd_action_to_str (
-					row->action)), "action", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromdouble (
-					row->score),		  "score",			0, false);
-			ucl_object_insert_key (obj,
-				ucl_object_fromdouble (
-					row->required_score), "required_score", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->symbols),		  "symbols",		0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromint (
-					row->len),			  "size",			0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromint (
-					row->scan_time),	  "scan_time",		0, false);
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->user), "user", 0, false);
-			}
-			ucl_array_append (top, obj);
-			rows_proc++;
+
+		ucl_object_insert_key (obj, ucl_object_fromint (total), "count", 0,
+			false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				rspamd_ts_percentile (values, 0.5)), "p50", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				rspamd_ts_percentile (values, 0.9)), "p90", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				rspamd_ts_percentile (values, 0.99)), "p99", 0, false);
+	}
+	else {
+		ucl_object_insert_key (obj, ucl_object_fromint (values[0]), "y", 0,
+			false);
+	}
+
+	ucl_array_append (cbd->data, obj);
+}
+
+/*
+ * Graph command handler:
+ * request: /graph
+ * headers: Password
+ * optional headers:
+ *  Series: name of series, if missing, then the list of series is returned
+ *  From: unix time of the start of range (an hour ago by default)
+ *  To: unix time of the end of range (now by default)
+ * reply: json {
+ *      series: "action:reject",
+ *      step: 10,
+ *      data: [{x: 1440000000, y: 10}, ...]
+ * }
+ * latency series have count, p50, p90 and p99 (in milliseconds) instead of y
+ */
+static int
+rspamd_controller_handle_graph (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_controller_graph_cbdata cbd;
+	const gchar *series;
+	gint64 from, to;
+	guint step;
+	GList *names, *cur;
+	ucl_object_t *top;
+
+	ctx = session->ctx;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	if (ctx->srv->ts == NULL) {
+		rspamd_controller_send_error (conn_ent, 404, "404 graphs are not enabled");
+		return 0;
+	}
+
+	series = rspamd_http_message_find_header (msg, "Series");
+
+	if (series == NULL) {
+		top = ucl_object_typed_new (UCL_ARRAY);
+		names = rspamd_ts_series_names (ctx->srv->ts);
+
+		for (cur = names; cur != NULL; cur = g_list_next (cur)) {
+			ucl_array_append (top, ucl_object_fromstring (cur->data));
 		}
+
+		g_list_free (names);
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+
+		return 0;
 	}
 
+	from = rspamd_controller_history_header_int (msg, "From");
+	to = rspamd_controller_history_header_int (msg, "To");
+
+	if (from == -1) {
+		from = time (NULL) - 3600;
+	}
+
+	cbd.data = ucl_object_typed_new (UCL_ARRAY);
+
+	if (!rspamd_ts_query (ctx->srv->ts, series, from, to == -1 ? 0 : to,
+			&step, &cbd.type, rspamd_controller_graph_cb, &cbd)) {
+		msg_info ("invalid series: %s", series);
+		ucl_object_unref (cbd.data);
+		rspamd_controller_send_error (conn_ent, 404, "404 series not found");
+		return 0;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromstring (series), "series", 0,
+		false);
+	ucl_object_insert_key (top, ucl_object_fromint (step), "step", 0, false);
+	ucl_object_insert_key (top, cbd.data, "data", 0, false);
+
 	rspamd_controller_send_ucl (conn_ent, top);
 	ucl_object_unref (top);
 
@@ -975,6 +1250,186 @@ rspamd_controller_check_fin_task (void *ud)
 	return FALSE;
 }
 
+static void
+rspamd_controller_learn_queue_schedule (struct rspamd_controller_worker_ctx *ctx,
+	gboolean now)
+{
+	struct timeval tv;
+
+	if (now) {
+		/* Do not process learns from finalizers of tasks */
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_del (&ctx->learn_ev);
+		evtimer_add (&ctx->learn_ev, &tv);
+	}
+	else if (!evtimer_pending (&ctx->learn_ev, NULL)) {
+		double_to_tv (ctx->learn_flush_time, &tv);
+		evtimer_add (&ctx->learn_ev, &tv);
+	}
+}
+
+static void
+rspamd_controller_learn_queue_flush (gint fd, short what, gpointer ud)
+{
+	struct rspamd_controller_worker_ctx *ctx = ud;
+	struct rspamd_controller_learn_entry *entry;
+	struct rspamd_task *task;
+	GPtrArray *batch;
+	GError *err = NULL;
+	gdouble now;
+	guint i, learned = 0;
+
+	batch = g_ptr_array_sized_new (ctx->learn_batch);
+	now = rspamd_get_ticks ();
+	rspamd_stat_learn_batch_start ();
+
+	while (batch->len < ctx->learn_batch &&
+			(task = g_queue_pop_head (ctx->learn_queue)) != NULL) {
+		entry = task->fin_arg;
+
+		/* Duplicates are filtered by the learn cache */
+		if (rspamd_learn_task_spam (entry->cl, task, entry->is_spam, &err) ==
+				RSPAMD_STAT_PROCESS_ERROR) {
+			msg_info ("cannot learn <%s>: %e", task->message_id, err);
+			ctx->learn_failed ++;
+
+			if (err != NULL) {
+				g_error_free (err);
+				err = NULL;
+			}
+		}
+		else {
+			ctx->learn_ok ++;
+			learned ++;
+		}
+
+		ctx->learn_lag = now - task->time_real;
+		g_ptr_array_add (batch, task);
+	}
+
+	/* Tokens are committed to statfiles once per batch */
+	rspamd_stat_learn_batch_finish ();
+
+	for (i = 0; i < batch->len; i ++) {
+		task = g_ptr_array_index (batch, i);
+		rspamd_session_destroy (task->s);
+	}
+
+	if (batch->len > 0) {
+		msg_info ("learned %ud messages of %ud in batch, %ud messages left in "
+				"queue", learned, batch->len,
+				g_queue_get_length (ctx->learn_queue));
+	}
+
+	g_ptr_array_free (batch, TRUE);
+
+	if (!g_queue_is_empty (ctx->learn_queue)) {
+		rspamd_controller_learn_queue_schedule (ctx,
+				g_queue_get_length (ctx->learn_queue) >= ctx->learn_batch);
+	}
+}
+
+static gboolean
+rspamd_controller_learn_queue_fin_task (void *ud)
+{
+	struct rspamd_task *task = ud;
+	struct rspamd_controller_learn_entry *entry = task->fin_arg;
+	struct rspamd_controller_worker_ctx *ctx = entry->ctx;
+
+	/* Task is processed and can be learned now */
+	ctx->learn_pending --;
+	g_queue_push_tail (ctx->learn_queue, task);
+	rspamd_controller_learn_queue_schedule (ctx,
+			g_queue_get_length (ctx->learn_queue) >= ctx->learn_batch);
+
+	return TRUE;
+}
+
+static int
+rspamd_controller_learn_enqueue (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg,
+	struct rspamd_classifier_config *cl,
+	gboolean is_spam)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_controller_learn_entry *entry;
+	struct rspamd_task *task;
+	ucl_object_t *top;
+	gchar *body;
+
+	ctx = session->ctx;
+
+	if (ctx->learn_pending + g_queue_get_length (ctx->learn_queue) >=
+			ctx->learn_queue_max) {
+		msg_info ("learn queue is full: %ud messages",
+				ctx->learn_pending + g_queue_get_length (ctx->learn_queue));
+		rspamd_controller_send_error (conn_ent, 503, "503 learn queue is full");
+		return 0;
+	}
+
+	/* Task is not bound to the connection as it outlives it */
+	task = rspamd_task_new (ctx->worker);
+	task->resolver = ctx->resolver;
+	task->ev_base = ctx->ev_base;
+	task->s = rspamd_session_create (task->task_pool,
+			rspamd_controller_learn_queue_fin_task,
+			NULL,
+			rspamd_task_free_hard,
+			task);
+
+	entry = rspamd_mempool_alloc (task->task_pool, sizeof (*entry));
+	entry->ctx = ctx;
+	entry->cl = cl;
+	entry->is_spam = is_spam;
+	task->fin_arg = entry;
+
+	/*
+	 * Request message is freed once the reply is written, whereas the task is
+	 * learned later, so it must own the message body
+	 */
+	body = rspamd_mempool_alloc (task->task_pool, msg->body->len + 1);
+	memcpy (body, msg->body->str, msg->body->len);
+	body[msg->body->len] = '\0';
+
+	if (!rspamd_task_load_message (task, msg, body, msg->body->len)) {
+		rspamd_controller_send_error (conn_ent, task->err->code, task->err->message);
+		rspamd_session_destroy (task->s);
+		return 0;
+	}
+
+	ctx->learn_pending ++;
+
+	if (!rspamd_task_process (task, RSPAMD_TASK_PROCESS_LEARN)) {
+		msg_warn ("message cannot be processed for %s", task->message_id);
+		ctx->learn_pending --;
+		rspamd_controller_send_error (conn_ent, task->err->code, task->err->message);
+		rspamd_session_destroy (task->s);
+		return 0;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_frombool (true), "success", 0, false);
+	ucl_object_insert_key (top, ucl_object_frombool (true), "queued", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (
+			ctx->learn_pending + g_queue_get_length (ctx->learn_queue)),
+			"queue_size", 0, false);
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	msg_info ("<%s> queued message to be learned as %s: %s",
+		rspamd_inet_address_to_string (session->from_addr),
+		is_spam ? "spam" : "ham",
+		task->message_id);
+
+	/* Task can be finished here if it has no async events */
+	rspamd_session_pending (task->s);
+
+	return 0;
+}
+
 static int
 rspamd_controller_handle_learn_common (
 	struct rspamd_http_connection_entry *conn_ent,
@@ -1007,6 +1462,10 @@ rspamd_controller_handle_learn_common (
 		return 0;
 	}
 
+	if (ctx->learn_queue_max > 0) {
+		return rspamd_controller_learn_enqueue (conn_ent, msg, cl, is_spam);
+	}
+
 	task = rspamd_task_new (session->ctx->worker);
 
 	task->resolver = ctx->resolver;
@@ -1603,9 +2062,11 @@ rspamd_controller_handle_stat_common (
 	gboolean do_reset)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	ucl_object_t *top, *sub;
+	ucl_object_t *top, *sub, *obj;
 	gint i;
-	guint64 learned  = 0, spam = 0, ham = 0;
+	guint64 learned  = 0, spam = 0, ham = 0, kp_hits = 0, kp_misses = 0;
+	gsize priv_mem, shared_mem;
+	pid_t pid;
 	rspamd_mempool_stat_t mem_st;
 	struct rspamd_stat *stat, stat_copy;
 
@@ -1686,6 +2147,73 @@ rspamd_controller_handle_stat_common (
 
 	ucl_object_insert_key (top, sub, "fuzzy_found", 0, false);
 
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_requests), "dns_requests", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_hits), "dns_cache_hits", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_coalesced), "dns_coalesced", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_evictions), "dns_cache_evictions",
+		0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->log_dropped), "log_dropped", 0, false);
+
+	if (session->ctx->learn_queue_max > 0) {
+		sub = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (sub, ucl_object_fromint (
+				g_queue_get_length (session->ctx->learn_queue)), "queued", 0,
+				false);
+		ucl_object_insert_key (sub, ucl_object_fromint (
+				session->ctx->learn_pending), "pending", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (
+				session->ctx->learn_ok), "learned", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (
+				session->ctx->learn_failed), "failed", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromdouble (
+				session->ctx->learn_lag), "lag", 0, false);
+		ucl_object_insert_key (top, sub, "learn_queue", 0, false);
+	}
+
+	rspamd_keypair_cache_stat (&kp_hits, &kp_misses);
+	sub = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (sub, ucl_object_fromint (kp_hits), "hits", 0, false);
+	ucl_object_insert_key (sub, ucl_object_fromint (kp_misses), "misses", 0,
+			false);
+	ucl_object_insert_key (sub, ucl_object_fromdouble (
+			kp_hits + kp_misses > 0 ?
+			(gdouble)kp_hits / (kp_hits + kp_misses) : 0.0),
+			"hit_ratio", 0, false);
+	ucl_object_insert_key (top, sub, "keypair_cache", 0, false);
+
+	/*
+	 * Memory of processes: shared pages are mostly inherited from main.
+	 * Processes sample their own memory as workers are not dumpable.
+	 */
+	sub = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < RSPAMD_MAX_PROCESSES_STAT; i ++) {
+		pid = stat->processes[i].pid;
+		priv_mem = stat->processes[i].private_mem;
+		shared_mem = stat->processes[i].shared_mem;
+
+		if (pid != 0 && (priv_mem != 0 || shared_mem != 0)) {
+			obj = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (obj, ucl_object_fromint (pid), "pid", 0,
+					false);
+			ucl_object_insert_key (obj, ucl_object_fromstring (
+					g_quark_to_string (stat->processes[i].type)), "type", 0,
+					false);
+			ucl_object_insert_key (obj, ucl_object_fromint (priv_mem),
+					"private", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromint (shared_mem),
+					"shared", 0, false);
+			ucl_array_append (sub, obj);
+		}
+	}
+
+	ucl_object_insert_key (top, sub, "workers", 0, false);
+
 	/* Now write statistics for each statfile */
 
 	sub = rspamd_stat_statistics (session->ctx->cfg, &learned);
@@ -1702,6 +2230,11 @@ rspamd_controller_handle_stat_common (
 				sizeof (stat->fuzzy_hashes_checked));
 		memset (stat->fuzzy_hashes_found, 0,
 				sizeof (stat->fuzzy_hashes_found));
+		session->ctx->srv->stat->dns_requests = 0;
+		session->ctx->srv->stat->dns_cache_hits = 0;
+		session->ctx->srv->stat->dns_coalesced = 0;
+		session->ctx->srv->stat->dns_cache_evictions = 0;
+		session->ctx->srv->stat->log_dropped = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -1816,6 +2349,7 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 	struct rspamd_controller_session *session = conn_ent->ud;
 
 	session->ctx->worker->srv->stat->control_connections_count++;
+	session->ctx->worker->nconns--;
 	if (session->task != NULL) {
 		rspamd_session_destroy (session->task->s);
 	}
@@ -1853,6 +2387,7 @@ rspamd_controller_accept_socket (gint fd, short what, void *arg)
 	nsession->ctx = ctx;
 
 	nsession->from_addr = addr;
+	worker->nconns++;
 
 	rspamd_http_router_handle_socket (ctx->http, nfd, nsession);
 }
@@ -1911,6 +2446,8 @@ init_controller_worker (struct rspamd_config *cfg)
 	ctx = g_malloc0 (sizeof (struct rspamd_controller_worker_ctx));
 
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
+	ctx->learn_batch = DEFAULT_LEARN_BATCH;
+	ctx->learn_flush_time = DEFAULT_LEARN_FLUSH_TIME;
 
 	rspamd_rcl_register_worker_option (cfg, type, "password",
 		rspamd_rcl_parse_struct_string, ctx,
@@ -1945,6 +2482,21 @@ init_controller_worker (struct rspamd_config *cfg)
 		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
 		static_files_dir), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "learn_queue",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+		learn_queue_max), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "learn_batch",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+		learn_batch), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "learn_flush_time",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+		learn_flush_time), RSPAMD_CL_FLAG_TIME_FLOAT);
+
 	rspamd_rcl_register_worker_option (cfg, type, "keypair",
 		rspamd_rcl_parse_struct_keypair, ctx,
 		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
@@ -1979,6 +2531,14 @@ start_controller_worker (struct rspamd_worker *worker)
 	ctx->srv = worker->srv;
 	ctx->custom_commands = g_hash_table_new (rspamd_strcase_hash,
 			rspamd_strcase_equal);
+	ctx->learn_queue = g_queue_new ();
+
+	if (ctx->learn_batch == 0) {
+		ctx->learn_batch = DEFAULT_LEARN_BATCH;
+	}
+
+	evtimer_set (&ctx->learn_ev, rspamd_controller_learn_queue_flush, ctx);
+	event_base_set (ctx->ev_base, &ctx->learn_ev);
 	if (ctx->secure_ip != NULL) {
 		cur = ctx->secure_ip;
 
@@ -1991,7 +2551,7 @@ start_controller_worker (struct rspamd_worker *worker)
 					rspamd_radix_read, rspamd_radix_fin, (void **)&ctx->secure_map)) {
 				/* Fallback to the plain IP */
 				if (!radix_add_generic_iplist (secure_ip,
-						&ctx->secure_map)) {
+						&ctx->secure_ips)) {
 					msg_warn ("cannot load or parse ip list from '%s'",
 							secure_ip);
 				}
@@ -2031,6 +2591,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			 PATH_HISTORY,
 		rspamd_controller_handle_history);
+	rspamd_http_router_add_path (ctx->http,
+			   PATH_GRAPH,
+		rspamd_controller_handle_graph);
 	rspamd_http_router_add_path (ctx->http,
 		  PATH_LEARN_SPAM,
 		rspamd_controller_handle_learnspam);
@@ -2098,6 +2661,7 @@ start_controller_worker (struct rspamd_worker *worker)
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
+	ctx->resolver->stat = worker->srv->stat;
 
 	rspamd_upstreams_library_init (ctx->resolver->r, ctx->ev_base);
 	rspamd_upstreams_library_config (worker->srv->cfg);
@@ -2108,6 +2672,14 @@ start_controller_worker (struct rspamd_worker *worker)
 
 	event_base_loop (ctx->ev_base, 0);
 
+	/* Learn all queued messages before exit */
+	while (!g_queue_is_empty (ctx->learn_queue)) {
+		rspamd_controller_learn_queue_flush (-1, 0, ctx);
+	}
+
+	evtimer_del (&ctx->learn_ev);
+	g_queue_free (ctx->learn_queue);
+
 	g_mime_shutdown ();
 	rspamd_stat_close ();
 	rspamd_http_router_free (ctx->http);
@@ -109,6 +109,22 @@ rspamd_fuzzy_check_client (struct fuzzy_session *session)
 	return TRUE;
 }
 
+static void
+rspamd_fuzzy_write_replies (struct fuzzy_session *session,
+		struct rspamd_fuzzy_reply *reps, guint nreps)
+{
+	gint r;
+
+	/* All replies for packed commands are sent in a single datagram */
+	while ((r = rspamd_inet_address_sendto (session->fd, reps,
+			sizeof (*reps) * nreps, 0, session->addr)) == -1) {
+		if (errno != EINTR) {
+			msg_err ("error while writing reply: %s", strerror (errno));
+			break;
+		}
+	}
+}
+
 static void
 rspamd_fuzzy_write_reply (struct fuzzy_session *session,
 		struct rspamd_fuzzy_reply *rep)
@@ -149,7 +165,7 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session,
 
 static void
 rspamd_fuzzy_process_command (struct fuzzy_session *session,
-		enum rspamd_fuzzy_epoch epoch)
+		enum rspamd_fuzzy_epoch epoch, struct rspamd_fuzzy_reply *res_rep)
 {
 	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
 	gboolean res = FALSE;
@@ -192,7 +208,14 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session,
 	}
 
 	rep.tag = session->cmd->tag;
-	rspamd_fuzzy_write_reply (session, &rep);
+	memcpy (res_rep, &rep, sizeof (rep));
+}
+
+static gsize
+rspamd_fuzzy_command_len (const struct rspamd_fuzzy_cmd *cmd)
+{
+	return cmd->shingles_count > 0 ? sizeof (struct rspamd_fuzzy_shingle_cmd) :
+			sizeof (struct rspamd_fuzzy_cmd);
 }
 
 
@@ -201,7 +224,16 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 {
 	enum rspamd_fuzzy_epoch ret = RSPAMD_FUZZY_EPOCH_MAX;
 
-	if (cmd->version == RSPAMD_FUZZY_VERSION) {
+	if (cmd->version == RSPAMD_FUZZY_VERSION_MULTI) {
+		/* Packed commands are followed by other commands */
+		if (cmd->shingles_count == 0 ||
+				cmd->shingles_count == RSPAMD_SHINGLE_SIZE) {
+			if (r >= (gint)rspamd_fuzzy_command_len (cmd)) {
+				ret = RSPAMD_FUZZY_EPOCH9;
+			}
+		}
+	}
+	else if (cmd->version == RSPAMD_FUZZY_VERSION) {
 		if (cmd->shingles_count > 0) {
 			if (r == sizeof (struct rspamd_fuzzy_shingle_cmd)) {
 				ret = RSPAMD_FUZZY_EPOCH9;
@@ -230,6 +262,48 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 
 	return ret;
 }
+/*
+ * Process all commands packed in a datagram and send replies in a single
+ * datagram, the whole datagram is rejected if any command is invalid
+ */
+static void
+rspamd_fuzzy_process_multi (struct fuzzy_session *session, guint8 *buf,
+		gint r)
+{
+	struct rspamd_fuzzy_reply reps[RSPAMD_FUZZY_MAX_PACKET /
+			sizeof (struct rspamd_fuzzy_cmd) + 1];
+	struct rspamd_fuzzy_cmd *cmds[G_N_ELEMENTS (reps)];
+	struct rspamd_fuzzy_cmd *cmd;
+	guint ncmds = 0, i;
+	gint remain = r;
+	gsize len;
+
+	while (remain > 0) {
+		cmd = (struct rspamd_fuzzy_cmd *)(buf + (r - remain));
+
+		if ((guint)remain < sizeof (*cmd) ||
+				cmd->version != RSPAMD_FUZZY_VERSION_MULTI ||
+				rspamd_fuzzy_command_valid (cmd, remain) ==
+						RSPAMD_FUZZY_EPOCH_MAX ||
+				ncmds >= G_N_ELEMENTS (cmds)) {
+			msg_debug ("invalid packed fuzzy command at offset %d of %d",
+					r - remain, r);
+			return;
+		}
+
+		len = rspamd_fuzzy_command_len (cmd);
+		cmds[ncmds ++] = cmd;
+		remain -= len;
+	}
+
+	for (i = 0; i < ncmds; i ++) {
+		session->cmd = cmds[i];
+		rspamd_fuzzy_process_command (session, RSPAMD_FUZZY_EPOCH9, &reps[i]);
+	}
+
+	rspamd_fuzzy_write_replies (session, reps, ncmds);
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -238,6 +312,7 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
 	struct fuzzy_session session;
+	struct rspamd_fuzzy_reply rep;
 	gint r;
 	guint8 buf[2048];
 	struct rspamd_fuzzy_cmd *cmd = NULL, lcmd;
@@ -275,6 +350,12 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 			cmd = &lcmd;
 			epoch = RSPAMD_FUZZY_EPOCH6;
 		}
+		else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd) &&
+				((struct rspamd_fuzzy_cmd *)buf)->version ==
+						RSPAMD_FUZZY_VERSION_MULTI) {
+			session.legacy = FALSE;
+			rspamd_fuzzy_process_multi (&session, buf, r);
+		}
 		else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd)) {
 			/* Check shingles count sanity */
 			session.legacy = FALSE;
@@ -292,7 +373,8 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 		}
 		if (cmd != NULL) {
 			session.cmd = cmd;
-			rspamd_fuzzy_process_command (&session, epoch);
+			rspamd_fuzzy_process_command (&session, epoch, &rep);
+			rspamd_fuzzy_write_reply (&session, &rep);
 		}
 
 		rspamd_inet_address_destroy (session.addr);
@@ -7,6 +7,10 @@
 #include "shingles.h"
 
 #define RSPAMD_FUZZY_VERSION 3
+/* Version of commands packed several in a single datagram */
+#define RSPAMD_FUZZY_VERSION_MULTI 4
+/* Maximum size of a datagram with packed commands */
+#define RSPAMD_FUZZY_MAX_PACKET 1400
 
 /* Commands for fuzzy storage */
 #define FUZZY_CHECK 0
@@ -138,6 +138,7 @@ rspamd_cryptobox_init (void)
 	chacha_load ();
 	poly1305_load ();
 	siphash_load ();
+	curve25519_load ();
 }
 
 void
@@ -385,6 +386,14 @@ rspamd_cryptobox_siphash (unsigned char *out, const unsigned char *in,
 	siphash24 (out, in, inlen, k);
 }
 
+void
+rspamd_cryptobox_siphash_multi (guint64 *out, const unsigned char *in,
+		unsigned long long inlen,
+		const rspamd_sipkey_t *keys, guint nkeys)
+{
+	siphash24_multi (out, in, inlen, (const unsigned char *)keys, nkeys);
+}
+
 /*
  * Password-Based Key Derivation Function 2 (PKCS #5 v2.0).
  * Code based on IEEE Std 802.11-2007, Annex H.4.2.
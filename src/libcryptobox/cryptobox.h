@@ -159,6 +159,19 @@ void rspamd_cryptobox_siphash (unsigned char *out, const unsigned char *in,
 		unsigned long long inlen,
 		const rspamd_sipkey_t k);
 
+/**
+ * Calculates siphash-2-4 for a message with several keys at once, it is
+ * faster than calling rspamd_cryptobox_siphash for each key
+ * @param out array of nkeys hashes
+ * @param in
+ * @param inlen
+ * @param keys array of nkeys keys
+ * @param nkeys number of keys
+ */
+void rspamd_cryptobox_siphash_multi (guint64 *out, const unsigned char *in,
+		unsigned long long inlen,
+		const rspamd_sipkey_t *keys, guint nkeys);
+
 /**
  * Derive key from password using PKCS#5 and HMAC-blake2
  * @param pass input password
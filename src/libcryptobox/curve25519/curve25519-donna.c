@@ -891,7 +891,7 @@ static void crecip (limb *out, const limb *z)
 	/* 2^255 - 21 */fmul (out, t1, z11);
 }
 
-int curve25519 (u8 *mypublic, const u8 *secret, const u8 *basepoint)
+int curve25519_donna (u8 *mypublic, const u8 *secret, const u8 *basepoint)
 {
 	limb bp[10], x[10], z[11], zmone[10];
 	int i;
@@ -0,0 +1,115 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "curve25519.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
+
+typedef struct curve25519_impl_s {
+	unsigned long cpu_flags;
+	const char *desc;
+
+	int (*scalarmult) (guchar *mypublic, const guchar *secret,
+			const guchar *basepoint);
+} curve25519_impl_t;
+
+#define CURVE25519_DECLARE(ext) \
+	int curve25519_##ext(guchar *mypublic, const guchar *secret, const guchar *basepoint);
+
+#define CURVE25519_IMPL(cpuflags, desc, ext) \
+	{(cpuflags), desc, curve25519_##ext}
+
+CURVE25519_DECLARE(ref)
+#define CURVE25519_REF CURVE25519_IMPL(0, "ref", ref)
+CURVE25519_DECLARE(donna)
+#define CURVE25519_GENERIC CURVE25519_IMPL(0, "donna", donna)
+#if defined(CURVE25519_DONNA_C64)
+CURVE25519_DECLARE(donna_c64)
+#define CURVE25519_64 CURVE25519_IMPL(0, "donna-c64", donna_c64)
+#endif
+
+/* list implemenations from most optimized to least, with reference as the last entry */
+static const curve25519_impl_t curve25519_list[] = {
+#if defined(CURVE25519_64)
+		CURVE25519_64,
+#endif
+		CURVE25519_GENERIC,
+		CURVE25519_REF,
+};
+
+static const curve25519_impl_t *curve25519_opt =
+		&curve25519_list[G_N_ELEMENTS (curve25519_list) - 1];
+
+/* Test vector from RFC 7748 (clamped private key of Alice) */
+static const guchar curve25519_test_sk[32] = {
+	0x70, 0x07, 0x6d, 0x0a, 0x73, 0x18, 0xa5, 0x7d,
+	0x3c, 0x16, 0xc1, 0x72, 0x51, 0xb2, 0x66, 0x45,
+	0xdf, 0x4c, 0x2f, 0x87, 0xeb, 0xc0, 0x99, 0x2a,
+	0xb1, 0x77, 0xfb, 0xa5, 0x1d, 0xb9, 0x2c, 0x6a
+};
+static const guchar curve25519_test_pk[32] = {
+	0x85, 0x20, 0xf0, 0x09, 0x89, 0x30, 0xa7, 0x54,
+	0x74, 0x8b, 0x7d, 0xdc, 0xb4, 0x3e, 0xf7, 0x5a,
+	0x0d, 0xbf, 0x3a, 0x0d, 0x26, 0x38, 0x1a, 0xf4,
+	0xeb, 0xa4, 0xa9, 0x8e, 0xaa, 0x9b, 0x4e, 0x6a
+};
+
+static gboolean
+curve25519_check (const curve25519_impl_t *impl)
+{
+	guchar out[32];
+
+	impl->scalarmult (out, curve25519_test_sk, curve25519_basepoint);
+
+	return memcmp (out, curve25519_test_pk, sizeof (out)) == 0;
+}
+
+void
+curve25519_load (void)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (curve25519_list); i++) {
+		if ((curve25519_list[i].cpu_flags == 0 ||
+				(curve25519_list[i].cpu_flags & cpu_config)) &&
+				curve25519_check (&curve25519_list[i])) {
+			curve25519_opt = &curve25519_list[i];
+			break;
+		}
+	}
+}
+
+const gchar *
+curve25519_impl_desc (void)
+{
+	return curve25519_opt->desc;
+}
+
+int
+curve25519 (guchar *mypublic, const guchar *secret, const guchar *basepoint)
+{
+	return curve25519_opt->scalarmult (mypublic, secret, basepoint);
+}
@@ -7,4 +7,10 @@ static const guchar curve25519_basepoint[32] = {9};
 
 int curve25519 (guchar *mypublic, const guchar *secret, const guchar *basepoint);
 
+/* Select the fastest implementation that works on this platform */
+void curve25519_load (void);
+
+/* Name of the selected implementation */
+const gchar *curve25519_impl_desc (void);
+
 #endif
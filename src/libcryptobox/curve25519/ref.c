@@ -299,7 +299,7 @@ static void recip (unsigned int out[32], const unsigned int z[32])
 	/* 2^255 - 21 */mult (out, t1, z11);
 }
 
-int curve25519 (unsigned char *q, const unsigned char *n,
+int curve25519_ref (unsigned char *q, const unsigned char *n,
 		const unsigned char *p)
 {
 	unsigned int work[96];
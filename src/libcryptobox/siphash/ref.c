@@ -150,3 +150,117 @@ siphash_ref (const unsigned char k[16], const unsigned char *in, const uint64_t
 	return b;
 #endif
 }
+
+/*
+ * Hash the same message with several keys at once: the state of each key is
+ * kept in a separate lane and every operation is applied to all lanes in a
+ * loop, so the compiler can vectorise rounds using SIMD registers
+ */
+#define SIPHASH_LANES 8
+
+#define SIPROUND_LANES(n)                                              \
+  do {                                                                 \
+    for (j = 0; j < (n); j ++) {                                       \
+      v0[j] += v1[j]; v1[j] = ROTL(v1[j],13); v1[j] ^= v0[j];          \
+      v0[j] = ROTL(v0[j],32);                                          \
+      v2[j] += v3[j]; v3[j] = ROTL(v3[j],16); v3[j] ^= v2[j];          \
+      v0[j] += v3[j]; v3[j] = ROTL(v3[j],21); v3[j] ^= v0[j];          \
+      v2[j] += v1[j]; v1[j] = ROTL(v1[j],17); v1[j] ^= v2[j];          \
+      v2[j] = ROTL(v2[j],32);                                          \
+    }                                                                  \
+  } while(0)
+
+static void
+siphash_ref_lanes (uint64_t *out, const unsigned char *k,
+		const unsigned char *in, const uint64_t inlen, unsigned int n)
+{
+	uint64_t v0[SIPHASH_LANES], v1[SIPHASH_LANES], v2[SIPHASH_LANES],
+		v3[SIPHASH_LANES];
+	uint64_t b, m, k0, k1;
+	unsigned int i, j;
+	const uint8_t *end = in + inlen - (inlen % sizeof(uint64_t));
+	const int left = inlen & 7;
+
+	for (j = 0; j < n; j ++) {
+		k0 = U8TO64_LE(k + j * 16);
+		k1 = U8TO64_LE(k + j * 16 + 8);
+		v0[j] = 0x736f6d6570736575ULL ^ k0;
+		v1[j] = 0x646f72616e646f6dULL ^ k1;
+		v2[j] = 0x6c7967656e657261ULL ^ k0;
+		v3[j] = 0x7465646279746573ULL ^ k1;
+	}
+
+	for (; in != end; in += 8) {
+		m = U8TO64_LE(in);
+
+		for (j = 0; j < n; j ++) {
+			v3[j] ^= m;
+		}
+
+		for (i = 0; i < cROUNDS; ++i) {
+			SIPROUND_LANES(n);
+		}
+
+		for (j = 0; j < n; j ++) {
+			v0[j] ^= m;
+		}
+	}
+
+	b = ((uint64_t) inlen) << 56;
+
+	switch (left) {
+	case 7:
+		b |= ((uint64_t) in[6]) << 48;
+	case 6:
+		b |= ((uint64_t) in[5]) << 40;
+	case 5:
+		b |= ((uint64_t) in[4]) << 32;
+	case 4:
+		b |= ((uint64_t) in[3]) << 24;
+	case 3:
+		b |= ((uint64_t) in[2]) << 16;
+	case 2:
+		b |= ((uint64_t) in[1]) << 8;
+	case 1:
+		b |= ((uint64_t) in[0]);
+		break;
+	case 0:
+		break;
+	}
+
+	for (j = 0; j < n; j ++) {
+		v3[j] ^= b;
+	}
+
+	for (i = 0; i < cROUNDS; ++i) {
+		SIPROUND_LANES(n);
+	}
+
+	for (j = 0; j < n; j ++) {
+		v0[j] ^= b;
+		v2[j] ^= 0xff;
+	}
+
+	for (i = 0; i < dROUNDS; ++i) {
+		SIPROUND_LANES(n);
+	}
+
+	for (j = 0; j < n; j ++) {
+		out[j] = v0[j] ^ v1[j] ^ v2[j] ^ v3[j];
+	}
+}
+
+void
+siphash_ref_multi (uint64_t *out, const unsigned char *keys, unsigned int nkeys,
+		const unsigned char *in, const uint64_t inlen)
+{
+	unsigned int n;
+
+	while (nkeys > 0) {
+		n = nkeys > SIPHASH_LANES ? SIPHASH_LANES : nkeys;
+		siphash_ref_lanes (out, keys, in, inlen, n);
+		out += n;
+		keys += n * 16;
+		nkeys -= n;
+	}
+}
@@ -45,6 +45,8 @@ typedef struct siphash_impl_t
 
 
 SIPHASH_DECLARE(ref)
+void siphash_ref_multi (uint64_t *out, const unsigned char *keys,
+		unsigned int nkeys, const unsigned char *in, const uint64_t inlen);
 #define SIPHASH_GENERIC SIPHASH_IMPL(0, "generic", ref)
 #if defined(HAVE_SSE41) && defined(__i386__)
 SIPHASH_DECLARE(sse41)
@@ -85,6 +87,13 @@ void siphash24 (unsigned char *out, const unsigned char *in,
 	memcpy (out, &r, sizeof (r));
 }
 
+void siphash24_multi (uint64_t *out, const unsigned char *in,
+		unsigned long long inlen, const unsigned char *keys, unsigned int nkeys)
+{
+	/* Single hash assembly is not faster than lanes of the generic version */
+	siphash_ref_multi (out, keys, nkeys, in, inlen);
+}
+
 
 size_t
 siphash24_test (bool generic)
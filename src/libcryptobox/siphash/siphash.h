@@ -24,6 +24,7 @@
 #define SIPHASH_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #if defined(__cplusplus)
 extern "C"
@@ -34,6 +35,11 @@ void siphash24 (unsigned char *out,
 		const unsigned char *in,
 		unsigned long long inlen,
 		const unsigned char *k);
+void siphash24_multi (uint64_t *out,
+		const unsigned char *in,
+		unsigned long long inlen,
+		const unsigned char *keys,
+		unsigned int nkeys);
 #if defined(__cplusplus)
 }
 #endif
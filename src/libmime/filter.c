@@ -228,6 +228,7 @@ G_LOCK_DEFINE (result_mtx);
 static void
 insert_result_common (struct rspamd_task *task,
 	const gchar *symbol,
+	gint id,
 	double flag,
 	GList * opts,
 	gboolean single)
@@ -263,7 +264,12 @@ insert_result_common (struct rspamd_task *task,
 
 	/* Process cache item */
 	if (task->cfg->cache) {
-		rspamd_symbols_cache_inc_frequency (task->cfg->cache, symbol);
+		if (id != -1) {
+			rspamd_symbols_cache_inc_frequency_id (task->cfg->cache, id);
+		}
+		else {
+			rspamd_symbols_cache_inc_frequency (task->cfg->cache, symbol);
+		}
 	}
 
 	if (opts != NULL) {
@@ -284,7 +290,8 @@ rspamd_task_insert_result (struct rspamd_task *task,
 	double flag,
 	GList * opts)
 {
-	insert_result_common (task, symbol, flag, opts, task->cfg->one_shot_mode);
+	insert_result_common (task, symbol, -1, flag, opts,
+			task->cfg->one_shot_mode);
 }
 
 /* Insert result as a single option */
@@ -294,7 +301,28 @@ rspamd_task_insert_result_single (struct rspamd_task *task,
 	double flag,
 	GList * opts)
 {
-	insert_result_common (task, symbol, flag, opts, TRUE);
+	insert_result_common (task, symbol, -1, flag, opts, TRUE);
+}
+
+void
+rspamd_task_insert_result_id (struct rspamd_task *task,
+	gint id,
+	double flag,
+	GList * opts)
+{
+	const gchar *symbol = NULL;
+
+	if (task->cfg->cache) {
+		symbol = rspamd_symbols_cache_symbol_by_id (task->cfg->cache, id);
+	}
+
+	if (symbol == NULL) {
+		msg_err ("cannot insert result for unknown symbol id %d", id);
+		return;
+	}
+
+	insert_result_common (task, symbol, id, flag, opts,
+			task->cfg->one_shot_mode);
 }
 
 gboolean
@@ -108,6 +108,19 @@ void rspamd_task_insert_result_single (struct rspamd_task *task,
 	double flag,
 	GList *opts);
 
+/**
+ * Insert a result to task using symbol id from symbols cache, this avoids
+ * lookup of symbol when counters of symbols cache are updated
+ * @param task worker's task that present message from user
+ * @param id id of symbol returned on its registration
+ * @param flag numeric weight for symbol
+ * @param opts list of symbol's options
+ */
+void rspamd_task_insert_result_id (struct rspamd_task *task,
+	gint id,
+	double flag,
+	GList *opts);
+
 /**
  * Default consolidation function for metric, it get all symbols and multiply symbol
  * weight by some factor that is specified in config. Default factor is 1.
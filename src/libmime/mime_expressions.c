@@ -1655,28 +1655,6 @@ rspamd_is_html_balanced (struct rspamd_task * task, GArray * args, void *unused)
 
 }
 
-struct html_callback_data {
-	struct html_tag *tag;
-	gboolean *res;
-};
-
-static gboolean
-search_html_node_callback (GNode * node, gpointer data)
-{
-	struct html_callback_data *cd = data;
-	struct html_node *nd;
-
-	nd = node->data;
-	if (nd) {
-		if (nd->tag == cd->tag) {
-			*cd->res = TRUE;
-			return TRUE;
-		}
-	}
-
-	return FALSE;
-}
-
 gboolean
 rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 {
@@ -1685,7 +1663,6 @@ rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 	struct expression_argument *arg;
 	struct html_tag *tag;
 	gboolean res = FALSE;
-	struct html_callback_data cd;
 
 	if (args == NULL) {
 		msg_warn ("no parameters to function");
@@ -1706,18 +1683,11 @@ rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 	}
 
 	cur = g_list_first (task->text_parts);
-	cd.res = &res;
-	cd.tag = tag;
 
 	while (cur && res == FALSE) {
 		p = cur->data;
-		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html_nodes) {
-			g_node_traverse (p->html_nodes,
-				G_PRE_ORDER,
-				G_TRAVERSE_ALL,
-				-1,
-				search_html_node_callback,
-				&cd);
+		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html) {
+			res = RSPAMD_HTML_TAG_SEEN (p->html, tag->id) ? TRUE : FALSE;
 		}
 		cur = g_list_next (cur);
 	}
@@ -1737,7 +1707,7 @@ rspamd_has_fake_html (struct rspamd_task * task, GArray * args, void *unused)
 
 	while (cur && res == FALSE) {
 		p = cur->data;
-		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html_nodes == NULL) {
+		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html == NULL) {
 			res = TRUE;
 		}
 		cur = g_list_next (cur);
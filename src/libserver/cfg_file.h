@@ -188,6 +188,8 @@ struct rspamd_config {
 	gchar *log_file;                                /**< path to logfile in case of file logging			*/
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	gboolean log_async;                             /**< write log lines from a separate thread				*/
+	guint32 log_async_size;                         /**< number of slots in the async log ring				*/
 	gchar *debug_ip_map;                            /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
@@ -216,6 +218,7 @@ struct rspamd_config {
 	GHashTable * metrics_symbols;                    /**< hash table of metrics indexed by symbol			*/
 	GHashTable * c_modules;                          /**< hash of c modules indexed by module name			*/
 	GHashTable * composite_symbols;                  /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< composites indexed by symbols they depend on	*/
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -233,6 +236,8 @@ struct rspamd_config {
 	GList *maps;                                    /**< maps active										*/
 	rspamd_mempool_t *map_pool;                     /**< static maps pool									*/
 	gdouble map_timeout;                            /**< maps watch timeout									*/
+	gboolean maps_preloaded;                        /**< maps are compiled by the main process			*/
+	gchar *maps_dir;                                /**< private dir for files of shared maps				*/
 
 	struct symbols_cache *cache;                    /**< symbols cache object								*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
@@ -245,6 +250,11 @@ struct rspamd_config {
 	gchar * rrd_file;                               /**< rrd file to store statistics						*/
 
 	gchar * history_file;                           /**< file to save rolling history						*/
+	guint32 history_rows;                           /**< number of rows in rolling history					*/
+	guint32 keypair_cache_size;                     /**< size of shared cache of encryption keys			*/
+	gboolean prefork_compact;                       /**< compact main memory before forking workers		*/
+	gdouble reload_warmup_time;                     /**< max time to wait for new workers on reload			*/
+	gdouble reload_drain_time;                      /**< max time for old workers to finish their tasks		*/
 
 	gchar * tld_file;								/**< file to load effective tld list from				*/
 
@@ -253,6 +263,7 @@ struct rspamd_config {
 	guint32 dns_throttling_errors;                  /**< maximum errors for starting resolver throttling	*/
 	guint32 dns_throttling_time;                    /**< time in seconds for DNS throttling					*/
 	guint32 dns_io_per_server;                      /**< number of sockets per DNS server					*/
+	guint32 dns_cache_size;                         /**< number of DNS replies cached by each worker		*/
 	GList *nameservers;                             /**< list of nameservers or NULL to parse resolv.conf	*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
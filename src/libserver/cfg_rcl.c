@@ -747,7 +747,7 @@ rspamd_rcl_lua_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 		cur_dir = g_malloc (PATH_MAX);
 		if (getcwd (cur_dir, PATH_MAX) != NULL && chdir (lua_dir) != -1) {
 			/* Load file */
-			if (luaL_loadfile (L, lua_file) != 0) {
+			if (rspamd_lua_load_file (L, cfg, lua_file) != 0) {
 				g_set_error (err,
 					CFG_RCL_ERROR,
 					EINVAL,
@@ -1130,6 +1130,7 @@ rspamd_rcl_composite_handler (rspamd_mempool_t *pool,
 	composite =
 		rspamd_mempool_alloc (cfg->cfg_pool, sizeof (struct rspamd_composite));
 	composite->expr = expr;
+	composite->sym = composite_name;
 	composite->id = g_hash_table_size (cfg->composite_symbols);
 	g_hash_table_insert (cfg->composite_symbols,
 		(gpointer)composite_name,
@@ -1206,6 +1207,16 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 		0);
+	rspamd_rcl_add_default_handler (sub,
+		"log_async",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, log_async),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"log_async_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, log_async_size),
+		RSPAMD_CL_FLAG_INT_32);
 	rspamd_rcl_add_default_handler (sub,
 		"log_urls",
 		rspamd_rcl_parse_struct_boolean,
@@ -1300,6 +1311,11 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, dns_io_per_server),
 		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+		RSPAMD_CL_FLAG_INT_32);
 
 	/* New upstreams configuration */
 	ssub = rspamd_rcl_add_section (&sub->subsections, "upstream", NULL,
@@ -1373,6 +1389,31 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_string,
 		G_STRUCT_OFFSET (struct rspamd_config, history_file),
 		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"history_rows",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, history_rows),
+		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (sub,
+		"keypair_cache_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, keypair_cache_size),
+		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (sub,
+		"prefork_compact",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, prefork_compact),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"reload_warmup_time",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, reload_warmup_time),
+		RSPAMD_CL_FLAG_TIME_FLOAT);
+	rspamd_rcl_add_default_handler (sub,
+		"reload_drain_time",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, reload_drain_time),
+		RSPAMD_CL_FLAG_TIME_FLOAT);
 	rspamd_rcl_add_default_handler (sub,
 		"use_mlock",
 		rspamd_rcl_parse_struct_boolean,
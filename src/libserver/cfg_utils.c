@@ -151,6 +151,7 @@ rspamd_config_defaults (struct rspamd_config *cfg)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	cfg->dns_cache_size = 16384;
 
 	/* 20 Kb */
 	cfg->max_diff = 20480;
@@ -171,6 +172,12 @@ rspamd_config_defaults (struct rspamd_config *cfg)
 
 	cfg->log_level = G_LOG_LEVEL_WARNING;
 	cfg->log_extended = TRUE;
+	cfg->log_async_size = 8192;
+	cfg->history_rows = HISTORY_DEFAULT_ROWS;
+	cfg->keypair_cache_size = 4096;
+	cfg->prefork_compact = TRUE;
+	cfg->reload_warmup_time = 10.0;
+	cfg->reload_drain_time = 60.0;
 
 	cfg->min_word_len = DEFAULT_MIN_WORD;
 }
@@ -31,12 +31,34 @@
 #include "filter.h"
 #include "composites.h"
 
+/*
+ * Inverted index of composites: for each symbol referenced by composites it
+ * contains the list of composites that might be changed by this symbol
+ */
+struct rspamd_composites_index {
+	GHashTable *symbols;
+	/* Composites that might be true when none of their symbols is found */
+	GPtrArray *always;
+	guint nsymbols;
+	guint ncomposites;
+};
+
+struct composite_symbol {
+	guint id;
+	GPtrArray *composites;
+};
+
 struct composites_data {
 	struct rspamd_task *task;
 	struct rspamd_composite *composite;
 	struct metric_result *metric_res;
-	GTree *symbols_to_remove;
+	struct rspamd_composites_index *idx;
+	/* Symbol remove data indexed by composite symbol id */
+	struct symbol_remove_data **symbols_to_remove;
+	guint8 *removed;
 	guint8 *checked;
+	guint8 *pending;
+	GPtrArray *queue;
 };
 
 struct symbol_remove_data {
@@ -92,6 +114,27 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 	return res;
 }
 
+static gint
+rspamd_composite_evaluate (struct composites_data *cd,
+		struct rspamd_composite *comp)
+{
+	struct rspamd_composite *saved = cd->composite;
+	gint rc;
+
+	/* Set checked before processing to avoid cyclic references */
+	setbit (cd->checked, comp->id * 2);
+	cd->composite = comp;
+	rc = rspamd_process_expression (comp->expr, RSPAMD_EXPRESSION_FLAG_NOOPT,
+			cd);
+	cd->composite = saved;
+
+	if (rc) {
+		setbit (cd->checked, comp->id * 2 + 1);
+	}
+
+	return rc;
+}
+
 static gint
 rspamd_composite_process_single_symbol (struct composites_data *cd,
 		const gchar *sym, struct symbol **pms)
@@ -104,18 +147,8 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 		if ((ncomp =
 				g_hash_table_lookup (cd->task->cfg->composite_symbols,
 						sym)) != NULL) {
-			/* Set checked for this symbol to avoid cyclic references */
 			if (isclr (cd->checked, ncomp->id * 2)) {
-				setbit (cd->checked, cd->composite->id * 2);
-				rc = rspamd_process_expression (ncomp->expr,
-						RSPAMD_EXPRESSION_FLAG_NOOPT, cd);
-				clrbit (cd->checked, cd->composite->id * 2);
-
-				if (rc) {
-					setbit (cd->checked, ncomp->id * 2 + 1);
-				}
-				setbit (cd->checked, ncomp->id * 2);
-
+				rc = rspamd_composite_evaluate (cd, ncomp);
 				ms = g_hash_table_lookup (cd->metric_res->symbols, sym);
 			}
 			else {
@@ -140,16 +173,16 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 	struct composites_data *cd = (struct composites_data *)input;
 	const gchar *sym = atom->data;
 	struct symbol_remove_data *rd;
-	struct symbol *ms;
+	struct symbol *ms = NULL;
 	struct rspamd_symbols_group *gr;
 	struct rspamd_symbol_def *sdef;
+	struct composite_symbol *csym;
 	gint rc = 0;
 	gchar t = '\0';
 
-	if (isset (cd->checked, cd->composite->id * 2)) {
-		/* We have already checked this composite, so just return its value */
-		rc = isset (cd->checked, cd->composite->id * 2 + 1);
-		return rc;
+	if (cd == NULL) {
+		/* Evaluate composite assuming that no symbols are found */
+		return 0;
 	}
 
 	if (*sym == '~' || *sym == '-') {
@@ -172,14 +205,15 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 		rc = rspamd_composite_process_single_symbol (cd, sym, &ms);
 	}
 
-	if (rc && ms) {
+	if (rc && ms &&
+			(csym = g_hash_table_lookup (cd->idx->symbols, ms->name)) != NULL) {
 		/*
 		 * At this point we know that we need to do something about this symbol,
 		 * however, we don't know whether we need to delete it unfortunately,
 		 * that depends on the later decisions when the complete expression is
 		 * evaluated.
 		 */
-		if ((rd = g_tree_lookup (cd->symbols_to_remove, ms->name)) == NULL) {
+		if ((rd = cd->symbols_to_remove[csym->id]) == NULL) {
 			rd = rspamd_mempool_alloc (cd->task->task_pool, sizeof (*rd));
 			rd->ms = ms;
 
@@ -197,9 +231,8 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 			}
 
 			rd->comp = g_list_prepend (NULL, cd->composite);
-			g_tree_insert (cd->symbols_to_remove,
-					(gpointer)ms->name,
-					rd);
+			cd->symbols_to_remove[csym->id] = rd;
+			setbit (cd->removed, csym->id);
 		}
 		else {
 			/*
@@ -228,44 +261,174 @@ rspamd_composite_expr_destroy (rspamd_expression_atom_t *atom)
 	/* Composite atoms are destroyed just with the pool */
 }
 
-static gint
-remove_compare_data (gconstpointer a, gconstpointer b)
+static void
+rspamd_composites_index_add_symbol (struct rspamd_composites_index *idx,
+		const gchar *sym, struct rspamd_composite *comp)
 {
-	const gchar *ca = a, *cb = b;
+	struct composite_symbol *csym;
+	guint i;
+
+	if ((csym = g_hash_table_lookup (idx->symbols, sym)) == NULL) {
+		csym = g_slice_alloc (sizeof (*csym));
+		csym->id = idx->nsymbols ++;
+		csym->composites = g_ptr_array_new ();
+		g_hash_table_insert (idx->symbols, g_strdup (sym), csym);
+	}
+
+	for (i = 0; i < csym->composites->len; i ++) {
+		if (g_ptr_array_index (csym->composites, i) == comp) {
+			return;
+		}
+	}
+
+	g_ptr_array_add (csym->composites, comp);
+}
+
+struct composites_index_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composites_index *idx;
+	struct rspamd_composite *comp;
+};
+
+static void
+rspamd_composites_index_atom (rspamd_expression_atom_t *atom, gpointer ud)
+{
+	struct composites_index_cbdata *cbd = ud;
+	const gchar *sym = atom->data;
+	struct rspamd_symbols_group *gr;
+	struct rspamd_symbol_def *sdef;
+
+	if (*sym == '~' || *sym == '-') {
+		sym ++;
+	}
 
-	return strcmp (ca, cb);
+	if (strncmp (sym, "g:", 2) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->symbols_groups, sym + 2);
+
+		if (gr != NULL) {
+			LL_FOREACH (gr->symbols, sdef) {
+				rspamd_composites_index_add_symbol (cbd->idx, sdef->name,
+						cbd->comp);
+			}
+		}
+	}
+	else {
+		rspamd_composites_index_add_symbol (cbd->idx, sym, cbd->comp);
+	}
 }
 
 static void
-composites_foreach_callback (gpointer key, gpointer value, void *data)
+rspamd_composites_index_composite (gpointer key, gpointer value, gpointer ud)
 {
-	struct composites_data *cd = data;
+	struct composites_index_cbdata *cbd = ud;
 	struct rspamd_composite *comp = value;
-	gint rc;
 
-	cd->composite = comp;
+	cbd->comp = comp;
+	/* Redefined composites might have duplicate ids, so assign them here */
+	comp->id = cbd->idx->ncomposites ++;
+	rspamd_expression_atom_foreach (comp->expr, rspamd_composites_index_atom,
+			cbd);
 
-	rc = rspamd_process_expression (comp->expr, RSPAMD_EXPRESSION_FLAG_NOOPT, cd);
+	if (rspamd_process_expression (comp->expr, RSPAMD_EXPRESSION_FLAG_NOOPT,
+			NULL)) {
+		/* Composite like `!A` must be checked for all messages */
+		g_ptr_array_add (cbd->idx->always, comp);
+	}
+}
 
-	/* Checked bit */
-	setbit (cd->checked, comp->id * 2);
+static void
+rspamd_composites_index_symbol_dtor (gpointer p)
+{
+	struct composite_symbol *csym = p;
 
-	/* Result bit */
-	if (rc) {
-		setbit (cd->checked, comp->id * 2 + 1);
-		rspamd_task_insert_result_single (cd->task, key, 1.0, NULL);
+	g_ptr_array_free (csym->composites, TRUE);
+	g_slice_free1 (sizeof (*csym), csym);
+}
+
+static void
+rspamd_composites_index_destroy (gpointer p)
+{
+	struct rspamd_composites_index *idx = p;
+
+	g_hash_table_unref (idx->symbols);
+	g_ptr_array_free (idx->always, TRUE);
+	g_slice_free1 (sizeof (*idx), idx);
+}
+
+static struct rspamd_composites_index *
+rspamd_composites_index_get (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct composites_index_cbdata cbd;
+
+	if (cfg->composites_index != NULL) {
+		return cfg->composites_index;
 	}
-	else {
-		clrbit (cd->checked, comp->id * 2 + 1);
+
+	idx = g_slice_alloc0 (sizeof (*idx));
+	idx->symbols = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, rspamd_composites_index_symbol_dtor);
+	idx->always = g_ptr_array_new ();
+
+	cbd.cfg = cfg;
+	cbd.idx = idx;
+	g_hash_table_foreach (cfg->composite_symbols,
+			rspamd_composites_index_composite, &cbd);
+
+	cfg->composites_index = idx;
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			rspamd_composites_index_destroy, idx);
+
+	return idx;
+}
+
+static void
+composites_enqueue (struct composites_data *cd, struct rspamd_composite *comp)
+{
+	if (isclr (cd->pending, comp->id)) {
+		setbit (cd->pending, comp->id);
+		g_ptr_array_add (cd->queue, comp);
+	}
+}
+
+static void
+composites_enqueue_symbol (struct composites_data *cd, const gchar *sym)
+{
+	struct composite_symbol *csym;
+	guint i;
+
+	if ((csym = g_hash_table_lookup (cd->idx->symbols, sym)) != NULL) {
+		for (i = 0; i < csym->composites->len; i ++) {
+			composites_enqueue (cd, g_ptr_array_index (csym->composites, i));
+		}
 	}
 }
 
+static void
+composites_process_composite (struct composites_data *cd,
+		struct rspamd_composite *comp)
+{
+	gint rc;
+
+	if (isset (cd->checked, comp->id * 2)) {
+		/* Composite has been already checked as a part of another one */
+		rc = isset (cd->checked, comp->id * 2 + 1);
+	}
+	else {
+		rc = rspamd_composite_evaluate (cd, comp);
+	}
+
+	if (rc && g_hash_table_lookup (cd->metric_res->symbols, comp->sym) == NULL) {
+		rspamd_task_insert_result_single (cd->task, comp->sym, 1.0, NULL);
+		/* Composites that depend on this one should be checked now */
+		composites_enqueue_symbol (cd, comp->sym);
+	}
+}
 
-static gboolean
-composites_remove_symbols (gpointer key, gpointer value, gpointer data)
+static void
+composites_remove_symbol (struct composites_data *cd,
+		struct symbol_remove_data *rd)
 {
-	struct composites_data *cd = data;
-	struct symbol_remove_data *rd = value;
 	GList *cur;
 	struct rspamd_composite *comp;
 	gboolean matched = FALSE;
@@ -292,14 +455,12 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 
 	if (matched) {
 		if (rd->remove_symbol) {
-			g_hash_table_remove (cd->metric_res->symbols, key);
+			g_hash_table_remove (cd->metric_res->symbols, rd->ms->name);
 		}
 		if (rd->remove_weight) {
 			cd->metric_res->score -= rd->ms->score;
 		}
 	}
-
-	return FALSE;
 }
 
 static void
@@ -309,23 +470,55 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 	struct composites_data *cd =
 		rspamd_mempool_alloc (task->task_pool, sizeof (struct composites_data));
 	struct metric_result *metric_res = (struct metric_result *)value;
+	struct rspamd_composites_index *idx;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i;
+
+	idx = rspamd_composites_index_get (task->cfg);
+
+	if (idx->ncomposites == 0) {
+		return;
+	}
 
 	cd->task = task;
+	cd->composite = NULL;
+	cd->idx = idx;
 	cd->metric_res = (struct metric_result *)metric_res;
-	cd->symbols_to_remove = g_tree_new (remove_compare_data);
-	cd->checked =
-		rspamd_mempool_alloc0 (task->task_pool,
-			NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
+	cd->checked = rspamd_mempool_alloc0 (task->task_pool,
+			NBYTES (idx->ncomposites * 2));
+	cd->pending = rspamd_mempool_alloc0 (task->task_pool,
+			NBYTES (idx->ncomposites));
+	cd->removed = rspamd_mempool_alloc0 (task->task_pool,
+			NBYTES (idx->nsymbols));
+	cd->symbols_to_remove = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*cd->symbols_to_remove) * idx->nsymbols);
+	cd->queue = g_ptr_array_sized_new (idx->always->len + 16);
+
+	/* Check only composites that depend on the symbols found */
+	for (i = 0; i < idx->always->len; i ++) {
+		composites_enqueue (cd, g_ptr_array_index (idx->always, i));
+	}
 
-	/* Process hash table */
-	g_hash_table_foreach (task->cfg->composite_symbols,
-		composites_foreach_callback,
-		cd);
+	g_hash_table_iter_init (&it, metric_res->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		composites_enqueue_symbol (cd, k);
+	}
+
+	/* Queue might grow when composites are inserted */
+	for (i = 0; i < cd->queue->len; i ++) {
+		composites_process_composite (cd, g_ptr_array_index (cd->queue, i));
+	}
+
+	g_ptr_array_free (cd->queue, TRUE);
 
 	/* Remove symbols that are in composites */
-	g_tree_foreach (cd->symbols_to_remove, composites_remove_symbols, cd);
-	/* Free list */
-	g_tree_destroy (cd->symbols_to_remove);
+	for (i = 0; i < idx->nsymbols; i ++) {
+		if (isset (cd->removed, i)) {
+			composites_remove_symbol (cd, cd->symbols_to_remove[i]);
+		}
+	}
 }
 
 void
@@ -38,6 +38,7 @@ extern const struct rspamd_atom_subr composite_expr_subr;
  */
 struct rspamd_composite {
 	struct rspamd_expression *expr;
+	const gchar *sym;
 	gint id;
 };
 
@@ -27,6 +27,7 @@
 #include "dkim.h"
 #include "dns.h"
 #include "utlist.h"
+#include "hash.h"
 
 /* Parser of dkim params */
 typedef gboolean (*dkim_parse_param_f) (rspamd_dkim_context_t * ctx,
@@ -811,30 +812,12 @@ struct rspamd_dkim_key_cbdata {
 	gpointer ud;
 };
 
+/*
+ * Parse decoded (DER) key data stored in key->keydata
+ */
 static rspamd_dkim_key_t *
-rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
+rspamd_dkim_key_load (rspamd_dkim_key_t *key, GError **err)
 {
-	rspamd_dkim_key_t *key = NULL;
-
-	if (keylen < 3) {
-		msg_err ("DKIM key is too short to be valid");
-		return NULL;
-	}
-	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
-	key->keydata = g_slice_alloc (keylen + 1);
-	rspamd_strlcpy (key->keydata, keydata, keylen + 1);
-	key->keylen = keylen + 1;
-	key->decoded_len = keylen + 1;
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION < 20))
-	gchar *tmp;
-	gsize tmp_len = keylen;
-	tmp = g_base64_decode (key->keydata, &tmp_len);
-	rspamd_strlcpy (key->keydata, tmp, tmp_len + 1);
-	g_free (tmp);
-	key->decoded_len = tmp_len;
-#else
-	g_base64_decode_inplace (key->keydata, &key->decoded_len);
-#endif
 #ifdef HAVE_OPENSSL
 	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
 	if (key->key_bio == NULL) {
@@ -871,6 +854,33 @@ rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
 	return key;
 }
 
+static rspamd_dkim_key_t *
+rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
+{
+	rspamd_dkim_key_t *key = NULL;
+
+	if (keylen < 3) {
+		msg_err ("DKIM key is too short to be valid");
+		return NULL;
+	}
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (keylen + 1);
+	rspamd_strlcpy (key->keydata, keydata, keylen + 1);
+	key->keylen = keylen + 1;
+	key->decoded_len = keylen + 1;
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION < 20))
+	gchar *tmp;
+	gsize tmp_len = keylen;
+	tmp = g_base64_decode (key->keydata, &tmp_len);
+	rspamd_strlcpy (key->keydata, tmp, tmp_len + 1);
+	g_free (tmp);
+	key->decoded_len = tmp_len;
+#else
+	g_base64_decode_inplace (key->keydata, &key->decoded_len);
+#endif
+	return rspamd_dkim_key_load (key, err);
+}
+
 /**
  * Free DKIM key
  * @param key
@@ -893,6 +903,33 @@ rspamd_dkim_key_free (rspamd_dkim_key_t *key)
 	g_slice_free1 (sizeof (rspamd_dkim_key_t), key);
 }
 
+/**
+ * Create DKIM key from the decoded key data (e.g. stored in some cache)
+ */
+rspamd_dkim_key_t *
+rspamd_dkim_key_from_der (const guint8 *der, gsize len, guint ttl,
+	GError **err)
+{
+	rspamd_dkim_key_t *key;
+
+	if (len == 0) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYDECODE,
+			"empty key");
+		return NULL;
+	}
+
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (len);
+	memcpy (key->keydata, der, len);
+	key->keylen = len;
+	key->decoded_len = len;
+	key->ttl = ttl;
+
+	return rspamd_dkim_key_load (key, err);
+}
+
 static rspamd_dkim_key_t *
 rspamd_dkim_parse_key (const gchar *txt, gsize *keylen, GError **err)
 {
@@ -1572,34 +1609,25 @@ rspamd_dkim_canonize_header (rspamd_dkim_context_t *ctx,
 	return FALSE;
 }
 
-/**
- * Check task for dkim context using dkim key
- * @param ctx dkim verify context
- * @param key dkim key (from cache or from dns request)
- * @param task task to check
- * @return
- */
-gint
-rspamd_dkim_check (rspamd_dkim_context_t *ctx,
-	rspamd_dkim_key_t *key,
-	struct rspamd_task *task)
+/* Body of the message is located once per task */
+struct rspamd_dkim_body {
+	const gchar *start;         /**< NULL if there is no body				*/
+	const gchar *end;
+};
+
+static struct rspamd_dkim_body *
+rspamd_dkim_find_body (struct rspamd_task *task)
 {
-	const gchar *p, *headers_end = NULL, *end, *body_end;
+	const gchar *p, *headers_end = NULL, *end;
 	gboolean got_cr = FALSE, got_crlf = FALSE, got_lf = FALSE;
-	gchar *digest;
-	gsize dlen;
-	gint res = DKIM_CONTINUE;
-	guint i;
-	struct rspamd_dkim_header *dh;
-#ifdef HAVE_OPENSSL
-	gint nid;
-#endif
+	struct rspamd_dkim_body *body;
 
-	g_return_val_if_fail (ctx != NULL,		 DKIM_ERROR);
-	g_return_val_if_fail (key != NULL,		 DKIM_ERROR);
-	g_return_val_if_fail (task->msg.len > 0, DKIM_ERROR);
+	body = rspamd_mempool_get_variable (task->task_pool, "dkim_body");
+
+	if (body != NULL) {
+		return body;
+	}
 
-	/* First of all find place of body */
 	p = task->msg.start;
 
 	end = task->msg.start + task->msg.len;
@@ -1666,11 +1694,180 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		p++;
 	}
 
-	/* Start canonization of body part */
-	body_end = end;
-	if (!rspamd_dkim_canonize_body (ctx, headers_end, body_end)) {
+	body = rspamd_mempool_alloc (task->task_pool, sizeof (*body));
+	body->start = headers_end;
+	body->end = end;
+	rspamd_mempool_set_variable (task->task_pool, "dkim_body", body, NULL);
+
+	return body;
+}
+
+/*
+ * Signatures with the same body canonicalization, hash algorithm and body
+ * length have the same body hash, so it is calculated once per task
+ */
+static const guchar *
+rspamd_dkim_body_hash (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task,
+	gsize *dlen)
+{
+	struct rspamd_dkim_body *body;
+	gchar varname[64];
+	guchar *digest;
+
+	rspamd_snprintf (varname, sizeof (varname), "dkim_bh_%d_%d_%z",
+		ctx->body_canon_type, ctx->sig_alg, ctx->len);
+	*dlen = ctx->bhlen;
+	digest = rspamd_mempool_get_variable (task->task_pool, varname);
+
+	if (digest != NULL) {
+		msg_debug ("reuse body hash for %s", varname);
+		return digest;
+	}
+
+	body = rspamd_dkim_find_body (task);
+
+	if (!rspamd_dkim_canonize_body (ctx, body->start, body->end)) {
+		return NULL;
+	}
+
+	digest = rspamd_mempool_alloc (task->task_pool, *dlen);
+	g_checksum_get_digest (ctx->body_hash, digest, dlen);
+	rspamd_mempool_set_variable (task->task_pool, varname, digest, NULL);
+
+	return digest;
+}
+
+#ifdef HAVE_OPENSSL
+#define DKIM_VERIFY_CACHE_SIZE 4096
+#define DKIM_VERIFY_CACHE_MAXAGE 3600
+#define DKIM_VERIFY_CACHE_KEYLEN 32
+
+/* Results of RSA verification indexed by digest of key, signature and data */
+static rspamd_lru_hash_t *dkim_verify_cache = NULL;
+
+static guint
+rspamd_dkim_verify_cache_hash (gconstpointer key)
+{
+	guint h;
+
+	/* Key is a sha256 digest itself */
+	memcpy (&h, key, sizeof (h));
+
+	return h;
+}
+
+static gboolean
+rspamd_dkim_verify_cache_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, DKIM_VERIFY_CACHE_KEYLEN) == 0;
+}
+
+static void
+rspamd_dkim_verify_cache_key_free (gpointer p)
+{
+	g_slice_free1 (DKIM_VERIFY_CACHE_KEYLEN, p);
+}
+
+/*
+ * RSA verification is by far the most expensive part of DKIM check, so its
+ * result is kept for messages that are checked several times (e.g. retried)
+ */
+static gint
+rspamd_dkim_rsa_verify (rspamd_dkim_context_t *ctx,
+	rspamd_dkim_key_t *key,
+	gint nid,
+	const guchar *digest,
+	gsize dlen)
+{
+	GChecksum *ck;
+	guchar *cache_key;
+	gsize klen = DKIM_VERIFY_CACHE_KEYLEN;
+	gpointer cached;
+	gint res = DKIM_CONTINUE;
+	time_t now;
+
+	if (dkim_verify_cache == NULL) {
+		dkim_verify_cache = rspamd_lru_hash_new_full (DKIM_VERIFY_CACHE_SIZE,
+				DKIM_VERIFY_CACHE_MAXAGE,
+				rspamd_dkim_verify_cache_key_free,
+				NULL,
+				rspamd_dkim_verify_cache_hash,
+				rspamd_dkim_verify_cache_equal);
+	}
+
+	ck = g_checksum_new (G_CHECKSUM_SHA256);
+	g_checksum_update (ck, (const guchar *)&nid, sizeof (nid));
+	g_checksum_update (ck, key->keydata, key->decoded_len);
+	g_checksum_update (ck, (const guchar *)ctx->b, ctx->blen);
+	g_checksum_update (ck, digest, dlen);
+	cache_key = g_slice_alloc (DKIM_VERIFY_CACHE_KEYLEN);
+	g_checksum_get_digest (ck, cache_key, &klen);
+	g_checksum_free (ck);
+
+	now = time (NULL);
+	cached = rspamd_lru_hash_lookup (dkim_verify_cache, cache_key, now);
+
+	if (cached != NULL) {
+		rspamd_dkim_verify_cache_key_free (cache_key);
+		msg_debug ("use cached rsa verify result");
+
+		return GPOINTER_TO_INT (cached) - 1;
+	}
+
+	if (RSA_verify (nid, digest, dlen, ctx->b, ctx->blen, key->key_rsa) != 1) {
+		msg_debug ("rsa verify failed");
+		res = DKIM_REJECT;
+	}
+
+	/* Value is shifted by one as NULL means no value */
+	rspamd_lru_hash_insert (dkim_verify_cache, cache_key,
+		GINT_TO_POINTER (res + 1), now, DKIM_VERIFY_CACHE_MAXAGE);
+
+	return res;
+}
+#endif
+
+/**
+ * Check task for dkim context using dkim key
+ * @param ctx dkim verify context
+ * @param key dkim key (from cache or from dns request)
+ * @param task task to check
+ * @return
+ */
+gint
+rspamd_dkim_check (rspamd_dkim_context_t *ctx,
+	rspamd_dkim_key_t *key,
+	struct rspamd_task *task)
+{
+	const guchar *body_digest;
+	gchar *digest;
+	gsize dlen;
+	gint res = DKIM_CONTINUE;
+	guint i;
+	struct rspamd_dkim_header *dh;
+#ifdef HAVE_OPENSSL
+	gint nid;
+#endif
+
+	g_return_val_if_fail (ctx != NULL,		 DKIM_ERROR);
+	g_return_val_if_fail (key != NULL,		 DKIM_ERROR);
+	g_return_val_if_fail (task->msg.len > 0, DKIM_ERROR);
+
+	/* Body hash is shared between signatures, so check it first */
+	body_digest = rspamd_dkim_body_hash (ctx, task, &dlen);
+
+	if (body_digest == NULL) {
 		return DKIM_RECORD_ERROR;
 	}
+
+	/* Check bh field */
+	if (memcmp (ctx->bh, body_digest, dlen) != 0) {
+		msg_debug ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
+				dlen, body_digest);
+		return DKIM_REJECT;
+	}
+
 	/* Now canonize headers */
 	for (i = 0; i < ctx->hlist->len; i++) {
 		dh = g_ptr_array_index (ctx->hlist, i);
@@ -1680,17 +1877,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	/* Canonize dkim signature */
 	rspamd_dkim_canonize_header (ctx, task, DKIM_SIGNHEADER, 1, TRUE);
 
-	dlen = ctx->bhlen;
 	digest = g_alloca (dlen);
-	g_checksum_get_digest (ctx->body_hash, digest, &dlen);
-
-	/* Check bh field */
-	if (memcmp (ctx->bh, digest, dlen) != 0) {
-		msg_debug ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
-				dlen, digest);
-		return DKIM_REJECT;
-	}
-
 	g_checksum_get_digest (ctx->headers_hash, digest, &dlen);
 #ifdef HAVE_OPENSSL
 	/* Check headers signature */
@@ -1706,10 +1893,8 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		nid = NID_sha1;
 	}
 
-	if (RSA_verify (nid, digest, dlen, ctx->b, ctx->blen, key->key_rsa) != 1) {
-		msg_debug ("rsa verify failed");
-		res = DKIM_REJECT;
-	}
+	res = rspamd_dkim_rsa_verify (ctx, key, nid, (const guchar *)digest,
+			dlen);
 #endif
 	return res;
 }
@@ -213,4 +213,17 @@ gint rspamd_dkim_check (rspamd_dkim_context_t *ctx,
  */
 void rspamd_dkim_key_free (rspamd_dkim_key_t *key);
 
+/**
+ * Create DKIM key from the decoded key data, e.g. key->keydata of another key
+ * @param der decoded key data
+ * @param len length of data (key->decoded_len)
+ * @param ttl time to live of the key
+ * @param err pointer to error object
+ * @return new key or NULL
+ */
+rspamd_dkim_key_t * rspamd_dkim_key_from_der (const guint8 *der,
+	gsize len,
+	guint ttl,
+	GError **err);
+
 #endif /* DKIM_H_ */
@@ -28,47 +28,214 @@
 #include "main.h"
 #include "utlist.h"
 #include "uthash.h"
+#include "hash.h"
 #include "rdns_event.h"
 
+/* Replies without records are cached for this time */
+#define RSPAMD_DNS_NEGATIVE_TTL 60
+/* Maximum time to cache any reply */
+#define RSPAMD_DNS_MAX_TTL 86400
+
+struct rspamd_dns_inflight;
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
 	rspamd_mempool_t *pool;
 	struct rdns_request *req;
+	struct rdns_reply *reply;               /**< reply from cache					*/
+	struct rspamd_dns_inflight *inflight;   /**< request we are waiting for			*/
+	struct event ev;
+	struct rspamd_dns_request_ud *prev, *next;
 };
 
-static void
-rspamd_dns_fin_cb (gpointer arg)
+/* Request that is being resolved, all identical requests wait for it */
+struct rspamd_dns_inflight {
+	gchar *key;
+	struct rdns_request *req;
+	struct rspamd_dns_resolver *resolver;
+	struct rspamd_dns_request_ud *waiters;
+};
+
+/* Cached reply is owned by its request */
+struct rspamd_dns_cached_reply {
+	struct rdns_request *req;
+	struct rdns_reply *reply;
+	struct rspamd_dns_resolver *resolver;
+	time_t stored;
+	time_t elapsed;                         /**< time already subtracted from ttl	*/
+};
+
+static gchar *
+rspamd_dns_cache_key (enum rdns_request_type type, const gchar *name)
 {
-	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	gchar *key;
+
+	key = g_strdup_printf ("%s:%s", rdns_strtype (type), name);
+	g_ascii_strdown (key, -1);
 
+	return key;
+}
+
+static void
+rspamd_dns_request_free (struct rspamd_dns_request_ud *reqdata)
+{
 	rdns_request_release (reqdata->req);
+
 	if (reqdata->pool == NULL) {
 		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
 	}
 }
 
 static void
-rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+rspamd_dns_fin_cb (gpointer arg)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+
+	if (reqdata->inflight != NULL) {
+		/* Session is destroyed before the reply has come */
+		DL_DELETE (reqdata->inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+	}
+	else if (reqdata->reply != NULL) {
+		event_del (&reqdata->ev);
+	}
+
+	rspamd_dns_request_free (reqdata);
+}
 
+static void
+rspamd_dns_deliver (struct rspamd_dns_request_ud *reqdata,
+	struct rdns_reply *reply)
+{
 	reqdata->cb (reply, reqdata->ud);
 
 	if (reqdata->session) {
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
-		rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
-	}
-	else if (reqdata->pool == NULL) {
-		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+		rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb,
+				reqdata);
+	}
+	else {
+		rspamd_dns_request_free (reqdata);
 	}
 }
 
+static void
+rspamd_dns_cached_free (gpointer p)
+{
+	struct rspamd_dns_cached_reply *cached = p;
+
+	if (cached->resolver->stat) {
+		cached->resolver->stat->dns_cache_evictions ++;
+	}
+
+	rdns_request_release (cached->req);
+	g_slice_free1 (sizeof (*cached), cached);
+}
+
+/*
+ * Returns TRUE if reply can be cached and sets the time to keep it
+ */
+static gboolean
+rspamd_dns_reply_cacheable (struct rdns_reply *reply, guint *ttl)
+{
+	struct rdns_reply_entry *entry;
+	gint32 min_ttl = RSPAMD_DNS_MAX_TTL;
+
+	if (reply->code == RDNS_RC_NXDOMAIN ||
+			(reply->code == RDNS_RC_NOERROR && reply->entries == NULL)) {
+		*ttl = RSPAMD_DNS_NEGATIVE_TTL;
+		return TRUE;
+	}
+
+	if (reply->code != RDNS_RC_NOERROR) {
+		/* Temporary failures must not be cached */
+		return FALSE;
+	}
+
+	DL_FOREACH (reply->entries, entry) {
+		if (entry->ttl < min_ttl) {
+			min_ttl = entry->ttl;
+		}
+	}
+
+	if (min_ttl <= 0) {
+		return FALSE;
+	}
+
+	*ttl = min_ttl;
+
+	return TRUE;
+}
+
+/* Cached records should have their remaining ttl */
+static void
+rspamd_dns_cached_adjust_ttl (struct rspamd_dns_cached_reply *cached,
+	time_t now)
+{
+	struct rdns_reply_entry *entry;
+	time_t delta;
+
+	delta = now - cached->stored - cached->elapsed;
+
+	if (delta > 0) {
+		DL_FOREACH (cached->reply->entries, entry) {
+			entry->ttl = entry->ttl > delta ? entry->ttl - delta : 0;
+		}
+
+		cached->elapsed += delta;
+	}
+}
+
+static void
+rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_inflight *inflight = ud;
+	struct rspamd_dns_resolver *resolver = inflight->resolver;
+	struct rspamd_dns_cached_reply *cached;
+	struct rspamd_dns_request_ud *reqdata;
+	time_t now;
+	guint ttl;
+
+	/* New identical requests should not wait for this one anymore */
+	g_hash_table_remove (resolver->inflight, inflight->key);
+
+	if (resolver->cache != NULL && rspamd_dns_reply_cacheable (reply, &ttl)) {
+		now = time (NULL);
+		cached = g_slice_alloc0 (sizeof (*cached));
+		cached->req = rdns_request_retain (reply->request);
+		cached->reply = reply;
+		cached->resolver = resolver;
+		cached->stored = now;
+		/* Key is owned by cache now */
+		rspamd_lru_hash_insert (resolver->cache, inflight->key, cached, now,
+				ttl);
+		inflight->key = NULL;
+	}
+
+	/*
+	 * Callbacks can destroy sessions of other waiters, so unlink them one by
+	 * one
+	 */
+	while ((reqdata = inflight->waiters) != NULL) {
+		DL_DELETE (inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+		rspamd_dns_deliver (reqdata, reply);
+	}
+
+	rdns_request_release (inflight->req);
+	g_free (inflight->key);
+	g_slice_free1 (sizeof (*inflight), inflight);
+}
+
+static void
+rspamd_dns_cached_callback (gint fd, short what, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+
+	rspamd_dns_deliver (reqdata, reqdata->reply);
+}
+
 gboolean
 make_dns_request (struct rspamd_dns_resolver *resolver,
 	struct rspamd_async_session *session,
@@ -80,6 +247,11 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 {
 	struct rdns_request *req;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_cached_reply *cached = NULL;
+	struct timeval tv;
+	gchar *key;
+	time_t now = 0;
 
 	g_assert (resolver != NULL);
 
@@ -87,37 +259,91 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 		return FALSE;
 	}
 
+	key = rspamd_dns_cache_key (type, name);
+
+	if (resolver->cache != NULL) {
+		now = time (NULL);
+		cached = rspamd_lru_hash_lookup (resolver->cache, key, now);
+	}
+
+	if (cached == NULL) {
+		inflight = g_hash_table_lookup (resolver->inflight, key);
+
+		if (inflight != NULL) {
+			g_free (key);
+
+			if (resolver->stat) {
+				resolver->stat->dns_coalesced ++;
+			}
+		}
+		else {
+			inflight = g_slice_alloc0 (sizeof (*inflight));
+			inflight->key = key;
+			inflight->resolver = resolver;
+
+			req = rdns_make_request_full (resolver->r, rspamd_dns_callback,
+					inflight, resolver->request_timeout,
+					resolver->max_retransmits, 1, name, type);
+
+			if (req == NULL) {
+				g_free (key);
+				g_slice_free1 (sizeof (*inflight), inflight);
+
+				return FALSE;
+			}
+
+			/* The initial reference is released by rdns after the reply */
+			inflight->req = rdns_request_retain (req);
+			g_hash_table_insert (resolver->inflight, key, inflight);
+
+			if (resolver->stat) {
+				resolver->stat->dns_requests ++;
+			}
+		}
+	}
+	else {
+		g_free (key);
+		rspamd_dns_cached_adjust_ttl (cached, now);
+
+		if (resolver->stat) {
+			resolver->stat->dns_cache_hits ++;
+		}
+	}
+
 	if (pool != NULL) {
 		reqdata =
-			rspamd_mempool_alloc (pool, sizeof (struct rspamd_dns_request_ud));
+			rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_dns_request_ud));
 	}
 	else {
-		reqdata = g_slice_alloc (sizeof (struct rspamd_dns_request_ud));
+		reqdata = g_slice_alloc0 (sizeof (struct rspamd_dns_request_ud));
 	}
 	reqdata->pool = pool;
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
-
-	if (session) {
-		if (req != NULL) {
-			rspamd_session_add_event (session,
-					(event_finalizer_t)rspamd_dns_fin_cb,
-					reqdata,
-					g_quark_from_static_string ("dns resolver"));
-		}
+	if (cached != NULL) {
+		/* Callers expect the reply to come asynchronously */
+		reqdata->req = rdns_request_retain (cached->req);
+		reqdata->reply = cached->reply;
+		event_set (&reqdata->ev, -1, EV_TIMEOUT, rspamd_dns_cached_callback,
+				reqdata);
+		event_base_set (resolver->ev_base, &reqdata->ev);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_add (&reqdata->ev, &tv);
+	}
+	else {
+		reqdata->req = rdns_request_retain (inflight->req);
+		reqdata->inflight = inflight;
+		DL_APPEND (inflight->waiters, reqdata);
 	}
 
-	if (req == NULL) {
-		if (pool == NULL) {
-			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
-		}
-		return FALSE;
+	if (session) {
+		rspamd_session_add_event (session,
+				(event_finalizer_t)rspamd_dns_fin_cb,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
 	}
 
 	return TRUE;
@@ -139,12 +365,22 @@ dns_resolver_init (rspamd_logger_t *logger,
 	if (cfg != NULL) {
 		new->request_timeout = cfg->dns_timeout;
 		new->max_retransmits = cfg->dns_retransmits;
+		new->cache_size = cfg->dns_cache_size;
 	}
 	else {
 		new->request_timeout = 1;
 		new->max_retransmits = 2;
 	}
 
+	new->inflight = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+
+	if (new->cache_size > 0) {
+		new->cache = rspamd_lru_hash_new (new->cache_size,
+				RSPAMD_DNS_MAX_TTL,
+				g_free,
+				rspamd_dns_cached_free);
+	}
+
 	new->r = rdns_resolver_new ();
 	rdns_bind_libevent (new->r, new->ev_base);
 
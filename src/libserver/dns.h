@@ -30,13 +30,20 @@
 #include "mem_pool.h"
 #include "events.h"
 #include "logger.h"
+#include "hash.h"
 #include "rdns.h"
 
+struct rspamd_stat;
+
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct event_base *ev_base;
 	gdouble request_timeout;
 	guint max_retransmits;
+	guint cache_size;
+	GHashTable *inflight;           /**< identical requests share one packet	*/
+	rspamd_lru_hash_t *cache;       /**< cache of replies (can be NULL)			*/
+	struct rspamd_stat *stat;       /**< server statistics (can be NULL)		*/
 };
 
 /* Rspamd DNS API */
@@ -48,7 +55,8 @@ struct rspamd_dns_resolver * dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base, struct rspamd_config *cfg);
 
 /**
- * Make a DNS request
+ * Make a DNS request. Replies are cached according to their TTL and
+ * identical requests that are in flight share the same DNS packet
  * @param resolver resolver object
  * @param session async session to register event
  * @param pool memory pool for storage
@@ -28,8 +28,20 @@
 #include "message.h"
 #include "html.h"
 #include "url.h"
+#include "xxhash.h"
 
-static sig_atomic_t tags_sorted = 0;
+/* Tables are initialized once, possibly from several parsing threads */
+static volatile gsize html_tables_initialized = 0;
+
+/*
+ * Perfect hash for tag names: the seed is selected on initialization so that
+ * no two tags share the same slot. Slots store index + 1 in tag_defs
+ */
+#define HTML_TAGS_HASH_SIZE 2048
+#define HTML_TAG_MAX_LEN 16
+
+static guint8 tags_hash[HTML_TAGS_HASH_SIZE];
+static guint32 tags_hash_seed = 0;
 
 static struct html_tag tag_defs[] = {
 	/* W3C defined elements */
@@ -157,7 +169,6 @@ static struct html_tag tag_defs[] = {
 	{Tag_WBR, "wbr", (CM_INLINE | CM_EMPTY)},
 };
 
-static sig_atomic_t entities_sorted = 0;
 struct _entity;
 typedef struct _entity entity;
 
@@ -441,15 +452,6 @@ static entity entities_defs[] = {
 
 static entity entities_defs_num[ (G_N_ELEMENTS (entities_defs)) ];
 
-static gint
-tag_cmp (const void *m1, const void *m2)
-{
-	const struct html_tag *p1 = m1;
-	const struct html_tag *p2 = m2;
-
-	return g_ascii_strcasecmp (p1->name, p2->name);
-}
-
 static gint
 entity_cmp (const void *m1, const void *m2)
 {
@@ -468,106 +470,91 @@ entity_cmp_num (const void *m1, const void *m2)
 	return p1->code - p2->code;
 }
 
-static GNode *
-construct_html_node (rspamd_mempool_t * pool, gchar *text, gsize tag_len)
+static inline guint
+rspamd_html_tag_hash (const gchar *lc_name, gsize len, guint32 seed)
 {
-	struct html_node *html;
-	GNode *n = NULL;
-	struct html_tag key, *found;
-	gchar t;
+	return XXH32 (lc_name, len, seed) & (HTML_TAGS_HASH_SIZE - 1);
+}
 
-	if (text == NULL || *text == '\0') {
-		return NULL;
-	}
+static void
+rspamd_html_init_tables (void)
+{
+	guint i, h;
+	guint32 seed;
+	gboolean collision;
 
-	html = rspamd_mempool_alloc0 (pool, sizeof (struct html_node));
+	if (g_once_init_enter (&html_tables_initialized)) {
+		qsort (entities_defs, G_N_ELEMENTS (
+				entities_defs), sizeof (entity), entity_cmp);
+		memcpy (entities_defs_num, entities_defs, sizeof (entities_defs));
+		qsort (entities_defs_num, G_N_ELEMENTS (
+				entities_defs), sizeof (entity), entity_cmp_num);
 
-	/* Check whether this tag is fully closed */
-	if (*(text + tag_len - 1) == '/') {
-		html->flags |= FL_CLOSED;
-	}
+		G_STATIC_ASSERT (G_N_ELEMENTS (tag_defs) < G_MAXUINT8);
 
-	/* Check xml tag */
-	if (*text == '?' &&
-		g_ascii_strncasecmp (text + 1, "xml", sizeof ("xml") - 1) == 0) {
-		html->flags |= FL_XML;
-		html->tag = NULL;
-	}
-	else if (*text == '!') {
-		html->flags |= FL_SGML;
-		html->tag = NULL;
-	}
-	else {
-		if (*text == '/') {
-			html->flags |= FL_CLOSING;
-			text++;
-		}
+		for (seed = 0;; seed ++) {
+			memset (tags_hash, 0, sizeof (tags_hash));
+			collision = FALSE;
+
+			for (i = 0; i < G_N_ELEMENTS (tag_defs); i ++) {
+				g_assert (strlen (tag_defs[i].name) < HTML_TAG_MAX_LEN);
+				h = rspamd_html_tag_hash (tag_defs[i].name,
+						strlen (tag_defs[i].name), seed);
 
-		/* Find end of tag name */
-		key.name = text;
-		while (*text && g_ascii_isalnum (*(++text))) ;
+				if (tags_hash[h] != 0) {
+					collision = TRUE;
+					break;
+				}
 
-		t = *text;
-		*text = '\0';
+				tags_hash[h] = i + 1;
+			}
 
-		/* Match tag id by tag name */
-		if ((found =
-			bsearch (&key, tag_defs, G_N_ELEMENTS (tag_defs),
-			sizeof (struct html_tag), tag_cmp)) != NULL) {
-			*text = t;
-			html->tag = found;
-		}
-		else {
-			*text = t;
-			return NULL;
+			if (!collision) {
+				break;
+			}
 		}
-	}
-
-	n = g_node_new (html);
 
-	return n;
+		tags_hash_seed = seed;
+		g_once_init_leave (&html_tables_initialized, 1);
+	}
 }
 
-static gboolean
-check_balance (GNode * node, GNode ** cur_level)
+static struct html_tag *
+rspamd_html_tag_by_name_len (const gchar *name, gsize len)
 {
-	struct html_node *arg = node->data, *tmp;
-	GNode *cur;
-
-	if (arg->flags & FL_CLOSING) {
-		/* First of all check whether this tag is closing tag for parent node */
-		cur = node->parent;
-		while (cur && cur->data) {
-			tmp = cur->data;
-			if ((tmp->tag &&
-				arg->tag) && tmp->tag->id == arg->tag->id &&
-				(tmp->flags & FL_CLOSED) == 0) {
-				tmp->flags |= FL_CLOSED;
-				/* Destroy current node as we find corresponding parent node */
-				g_node_destroy (node);
-				/* Change level */
-				*cur_level = cur->parent;
-				return TRUE;
-			}
-			cur = cur->parent;
-		}
+	gchar lc_name[HTML_TAG_MAX_LEN];
+	struct html_tag *tag;
+	guint i, idx;
+
+	if (len == 0 || len >= sizeof (lc_name)) {
+		return NULL;
 	}
-	else {
-		return TRUE;
+
+	for (i = 0; i < len; i ++) {
+		lc_name[i] = g_ascii_tolower (name[i]);
 	}
 
-	return FALSE;
+	idx = tags_hash[rspamd_html_tag_hash (lc_name, len, tags_hash_seed)];
+
+	if (idx == 0) {
+		return NULL;
+	}
+
+	tag = &tag_defs[idx - 1];
+
+	if (memcmp (tag->name, lc_name, len) == 0 && tag->name[len] == '\0') {
+		return tag;
+	}
+
+	return NULL;
 }
 
 struct html_tag *
 get_tag_by_name (const gchar *name)
 {
-	struct html_tag key;
-
-	key.name = name;
+	rspamd_html_init_tables ();
 
-	return bsearch (&key, tag_defs, G_N_ELEMENTS (tag_defs),
-			   sizeof (struct html_tag), tag_cmp);
+	return rspamd_html_tag_by_name_len (name, strlen (name));
 }
 
 /* Decode HTML entitles in text */
@@ -872,99 +859,415 @@ parse_tag_url (struct rspamd_task *task,
 	}
 }
 
-gboolean
-add_html_node (struct rspamd_task *task,
-	rspamd_mempool_t * pool,
+static void
+rspamd_html_set_tag_seen (struct html_content *hc, tag_id_t id)
+{
+	hc->tags_seen[id / NBBY] |= 1 << (id % NBBY);
+}
+
+/*
+ * Process a single tag: resolve its name, append it to the flat tags array,
+ * check tags balance and extract urls from A and IMG tags.
+ * Returns FALSE if the content after this tag should be skipped
+ */
+static gboolean
+rspamd_html_process_tag (struct rspamd_task *task,
 	struct mime_text_part *part,
+	GArray *stack,
 	gchar *tag_text,
 	gsize tag_len,
 	gsize remain,
-	GNode ** cur_level)
+	guint offset)
 {
-	GNode *new;
-	struct html_node *data;
+	struct html_content *hc = part->html;
+	struct html_tag_event ev;
+	struct html_tag *tag;
+	gchar *p, *name, *end;
+	guint i;
+	gint flags = 0;
+	gboolean need_end;
 
-	if (!tags_sorted) {
-		qsort (tag_defs, G_N_ELEMENTS (
-				tag_defs), sizeof (struct html_tag), tag_cmp);
-		tags_sorted = 1;
+	if (tag_text == NULL || tag_len == 0) {
+		return FALSE;
 	}
-	if (!entities_sorted) {
-		qsort (entities_defs, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp);
-		memcpy (entities_defs_num, entities_defs, sizeof (entities_defs));
-		qsort (entities_defs_num, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp_num);
-		entities_sorted = 1;
+
+	/* Check whether this tag is fully closed */
+	if (tag_text[tag_len - 1] == '/') {
+		flags |= FL_CLOSED;
 	}
 
-	/* First call of this function */
-	if (part->html_nodes == NULL) {
-		/* Insert root node */
-		new = g_node_new (NULL);
-		*cur_level = new;
-		part->html_nodes = new;
-		rspamd_mempool_add_destructor (pool,
-			(rspamd_mempool_destruct_t) g_node_destroy,
-			part->html_nodes);
-		/* Call once again with root node */
-		return add_html_node (task,
-				   pool,
-				   part,
-				   tag_text,
-				   tag_len,
-				   remain,
-				   cur_level);
+	if (*tag_text == '?' &&
+		g_ascii_strncasecmp (tag_text + 1, "xml", sizeof ("xml") - 1) == 0) {
+		/* XML tags are ignored */
+		return TRUE;
 	}
-	else {
-		new = construct_html_node (pool, tag_text, tag_len);
-		if (new == NULL) {
-			debug_task ("cannot construct HTML node for text '%*s'",
-				tag_len,
+	else if (*tag_text == '!') {
+		/* SGML tags are ignored */
+		return TRUE;
+	}
+
+	p = tag_text;
+	end = tag_text + tag_len;
+
+	if (*p == '/') {
+		flags |= FL_CLOSING;
+		p++;
+	}
+
+	/* Find end of tag name */
+	name = p;
+
+	if (p < end) {
+		p++;
+	}
+
+	while (p < end && g_ascii_isalnum (*p)) {
+		p++;
+	}
+
+	tag = rspamd_html_tag_by_name_len (name, p - name);
+
+	if (tag == NULL) {
+		debug_task ("cannot find HTML tag for text '%*s'", (gint)tag_len,
 				tag_text);
-			return FALSE;
-		}
-		data = new->data;
-		if (data->tag &&
-			(data->tag->id == Tag_A ||
-			data->tag->id == Tag_IMG) && ((data->flags & FL_CLOSING) == 0)) {
-			parse_tag_url (task, part, data->tag->id, tag_text, tag_len,
-				remain);
+		return FALSE;
+	}
+
+	ev.id = tag->id;
+	ev.flags = flags;
+	ev.offset = offset;
+	g_array_append_val (hc->tags, ev);
+	rspamd_html_set_tag_seen (hc, tag->id);
+
+	/* Tags without end tag or with optional one are not balanced */
+	need_end = (tag->flags & (CM_EMPTY | CM_OPT)) == 0;
+
+	if (flags & FL_CLOSING) {
+		if (!need_end) {
+			return TRUE;
 		}
 
-		if (data->flags & FL_CLOSING) {
-			if (!*cur_level) {
-				debug_task ("bad parent node");
-				return FALSE;
+		/* Search for the corresponding opening tag */
+		for (i = stack->len; i > 0; i --) {
+			if (g_array_index (stack, guint16, i - 1) == tag->id) {
+				break;
 			}
-			g_node_append (*cur_level, new);
-			if (!check_balance (new, cur_level)) {
+		}
+
+		if (i > 0) {
+			if (i < stack->len) {
 				debug_task (
-					"mark part as unbalanced as it has not pairable closing tags");
-				part->flags &= ~RSPAMD_MIME_PART_FLAG_BALANCED;
+					"mark part as unbalanced as it has not closed tags");
+				hc->flags &= ~RSPAMD_HTML_FLAG_BALANCED;
 			}
+
+			g_array_set_size (stack, i - 1);
+		}
+		else {
+			debug_task (
+				"mark part as unbalanced as it has not pairable closing tags");
+			hc->flags &= ~RSPAMD_HTML_FLAG_BALANCED;
+		}
+	}
+	else {
+		if (tag->id == Tag_A || tag->id == Tag_IMG) {
+			parse_tag_url (task, part, tag->id, tag_text, tag_len, remain);
 		}
-		else if ((data->flags & (FL_XML|FL_SGML)) == 0) {
 
-			g_node_append (*cur_level, new);
-			if ((data->flags & FL_CLOSED) == 0) {
-				*cur_level = new;
+		if (need_end && (flags & FL_CLOSED) == 0) {
+			g_array_append_val (stack, ev.id);
+		}
+
+		/* Skip some tags */
+		if (tag->id == Tag_STYLE ||
+			tag->id == Tag_SCRIPT ||
+			tag->id == Tag_OBJECT ||
+			tag->id == Tag_TITLE) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static struct html_content *
+rspamd_html_content_new (rspamd_mempool_t *pool)
+{
+	struct html_content *hc;
+
+	hc = rspamd_mempool_alloc0 (pool, sizeof (*hc));
+	hc->flags = RSPAMD_HTML_FLAG_BALANCED;
+	hc->tags = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct html_tag_event), 32);
+	rspamd_mempool_add_destructor (pool, rspamd_array_free_hard, hc->tags);
+
+	return hc;
+}
+
+GByteArray *
+rspamd_html_process_part (struct rspamd_task *task,
+	rspamd_mempool_t *pool,
+	struct mime_text_part *part,
+	GByteArray *src)
+{
+	uint8_t *p, *rp, *tbegin = NULL, *end, c, lc, *estart = NULL;
+	gint br, i = 0, depth = 0, in_q = 0;
+	gint state = 0;
+	guint dlen;
+	GByteArray *buf;
+	GArray *stack;
+	gboolean erase = FALSE, html_decode = FALSE;
+
+	rspamd_html_init_tables ();
+
+	buf = g_byte_array_sized_new (src->len);
+	g_byte_array_append (buf, src->data, src->len);
+	stack = g_array_sized_new (FALSE, FALSE, sizeof (guint16), 16);
+
+	c = *src->data;
+	lc = '\0';
+	p = src->data;
+	rp = buf->data;
+	end = src->data + src->len;
+	br = 0;
+
+	while (i < (gint)src->len) {
+		switch (c) {
+		case '\0':
+			break;
+		case '<':
+			if (g_ascii_isspace (*(p + 1))) {
+				goto reg_char;
+			}
+			if (state == 0) {
+				lc = '<';
+				tbegin = p + 1;
+				state = 1;
+			}
+			else if (state == 1) {
+				/* Opening bracket without closing one */
+				p--;
+				while (g_ascii_isspace (*p) && p > src->data) {
+					p--;
+				}
+				p++;
+				goto unbreak_tag;
+			}
+			break;
+
+		case '(':
+			if (state == 2) {
+				if (lc != '"' && lc != '\'') {
+					lc = '(';
+					br++;
+				}
+			}
+			else if (state == 0 && !erase) {
+				*(rp++) = c;
+			}
+			break;
+
+		case ')':
+			if (state == 2) {
+				if (lc != '"' && lc != '\'') {
+					lc = ')';
+					br--;
+				}
+			}
+			else if (state == 0 && !erase) {
+				*(rp++) = c;
+			}
+			break;
+
+		case '>':
+			if (depth) {
+				depth--;
+				break;
+			}
+
+			if (in_q) {
+				break;
+			}
+unbreak_tag:
+			switch (state) {
+			case 1:         /* HTML/XML */
+				lc = '>';
+				in_q = state = 0;
+
+				if (part->html == NULL) {
+					part->html = rspamd_html_content_new (pool);
+				}
+
+				erase = !rspamd_html_process_tag (task,
+						part,
+						stack,
+						tbegin,
+						p - tbegin,
+						end - tbegin,
+						rp - buf->data);
+				break;
+
+			case 2:         /* PHP */
+				if (!br && lc != '\"' && *(p - 1) == '?') {
+					in_q = state = 0;
+				}
+				break;
+
+			case 3:
+				in_q = state = 0;
+				break;
+
+			case 4:         /* JavaScript/CSS/etc... */
+				if (p >= src->data + 2 && *(p - 1) == '-' && *(p - 2) == '-') {
+					in_q = state = 0;
+				}
+				break;
+
+			default:
+				if (!erase) {
+					*(rp++) = c;
+				}
+				break;
+			}
+			break;
+
+		case '"':
+		case '\'':
+			if (state == 2 && *(p - 1) != '\\') {
+				if (lc == c) {
+					lc = '\0';
+				}
+				else if (lc != '\\') {
+					lc = c;
+				}
+			}
+			else if (state == 0 && !erase) {
+				*(rp++) = c;
+			}
+			if (state && p != src->data && *(p - 1) != '\\' &&
+				(!in_q || *p == in_q)) {
+				if (in_q) {
+					in_q = 0;
+				}
+				else {
+					in_q = *p;
+				}
 			}
-			/* Skip some tags */
-			if (data->tag && (data->tag->id == Tag_STYLE ||
-				data->tag->id == Tag_SCRIPT ||
-				data->tag->id == Tag_OBJECT ||
-				data->tag->id == Tag_TITLE)) {
-				return FALSE;
+			break;
+
+		case '!':
+			/* JavaScript & Other HTML scripting languages */
+			if (state == 1 && *(p - 1) == '<') {
+				state = 3;
+				lc = c;
+			}
+			else {
+				if (state == 0 && !erase) {
+					*(rp++) = c;
+				}
 			}
+			break;
+
+		case '-':
+			if (state == 3 && p >= src->data + 2 && *(p - 1) == '-' &&
+				*(p - 2) == '!') {
+				state = 4;
+			}
+			else {
+				goto reg_char;
+			}
+			break;
+
+		case '&':
+			/* Decode entitle */
+			html_decode = TRUE;
+			estart = rp;
+			goto reg_char;
+			break;
+
+		case ';':
+			if (html_decode) {
+				html_decode = FALSE;
+				*rp = ';';
+				if (rp - estart > 0) {
+					dlen = rp - estart + 1;
+					decode_entitles (estart, &dlen);
+					rp = estart + dlen;
+				}
+			}
+			break;
+
+		case '?':
+
+			if (state == 1 && *(p - 1) == '<') {
+				br = 0;
+				state = 2;
+				break;
+			}
+		case 'E':
+		case 'e':
+			/* !DOCTYPE exception */
+			if (state == 3 && p > src->data + 6
+				&& g_ascii_tolower (*(p - 1)) == 'p'
+				&& g_ascii_tolower (*(p - 2)) == 'y'
+				&& g_ascii_tolower (*(p - 3)) == 't' &&
+				g_ascii_tolower (*(p - 4)) == 'c' &&
+				g_ascii_tolower (*(p - 5)) == 'o' &&
+				g_ascii_tolower (*(p - 6)) == 'd') {
+				state = 1;
+				break;
+			}
+		/* fall-through */
+		case 'l':
+
+			/* swm: If we encounter '<?xml' then we shouldn't be in
+			 * state == 2 (PHP). Switch back to HTML.
+			 */
+
+			if (state == 2 && p > src->data + 2 && *(p - 1) == 'm' &&
+				*(p - 2) == 'x') {
+				state = 1;
+				break;
+			}
+
+		/* fall-through */
+		default:
+reg_char:
+			if (state == 0 && !erase) {
+				*(rp++) = c;
+			}
+			break;
+		}
+		i++;
+		if (i < (gint)src->len) {
+			c = *(++p);
+		}
+	}
+	if (rp < buf->data + src->len) {
+		*rp = '\0';
+		g_byte_array_set_size (buf, rp - buf->data);
+	}
+
+	/* Check tag balancing, only tags that require end tags are in stack */
+	if (part->html != NULL) {
+		if (stack->len > 0) {
+			part->html->flags &= ~RSPAMD_HTML_FLAG_BALANCED;
+		}
+
+		if (part->html->flags & RSPAMD_HTML_FLAG_BALANCED) {
+			part->flags |= RSPAMD_MIME_PART_FLAG_BALANCED;
 		}
 		else {
-			/* Destroy ignored nodes */
-			g_node_destroy (new);
+			part->flags &= ~RSPAMD_MIME_PART_FLAG_BALANCED;
 		}
 	}
+	else {
+		part->flags |= RSPAMD_MIME_PART_FLAG_BALANCED;
+	}
 
-	return TRUE;
+	g_array_free (stack, TRUE);
+
+	return buf;
 }
 
 /*
@@ -201,27 +201,41 @@ struct html_tag {
 	gint flags;
 };
 
-struct html_node {
-	struct html_tag *tag;
-	gint flags;
+/* Tag event in the flat tags array */
+struct html_tag_event {
+	guint16 id;                 /**< tag_id_t of the tag						*/
+	guint16 flags;              /**< FL_* flags									*/
+	guint32 offset;             /**< offset of the tag in the stripped text		*/
 };
 
+/* All opening tags have their closing pairs */
+#define RSPAMD_HTML_FLAG_BALANCED (1 << 0)
+
+struct html_content {
+	GArray *tags;               /**< struct html_tag_event in document order	*/
+	guint8 tags_seen[(N_TAGS + NBBY - 1) / NBBY]; /**< bitset of tags found	*/
+	guint flags;
+};
+
+#define RSPAMD_HTML_TAG_SEEN(hc, id) \
+	((hc)->tags_seen[(id) / NBBY] & (1 << ((id) % NBBY)))
+
 /* Forwarded declaration */
 struct rspamd_task;
+struct mime_text_part;
 
 /*
- * Add a single node to the tags tree
+ * Parse HTML part in a single pass: fill part->html with the flat array of
+ * tags, extract urls from tags and return the text with tags stripped and
+ * entities decoded
  */
-gboolean add_html_node (struct rspamd_task *task,
+GByteArray * rspamd_html_process_part (struct rspamd_task *task,
 	rspamd_mempool_t *pool,
 	struct mime_text_part *part,
-	gchar *tag_text,
-	gsize tag_len,
-	gsize remain,
-	GNode **cur_level);
+	GByteArray *src);
 
 /*
- * Get tag structure by its name (binary search is used)
+ * Get tag structure by its name (perfect hash is used)
  */
 struct html_tag * get_tag_by_name (const gchar *name);
 
@@ -1049,6 +1049,7 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
 		rspamd_roll_history_update (task->worker->srv->history, task);
+		rspamd_ts_record_task (task->worker->srv->ts, task);
 	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
@@ -27,45 +27,191 @@
 #include "main.h"
 #include "roll_history.h"
 
-static const gchar rspamd_history_magic[] = {'r', 's', 'h', '1'};
+static const gchar rspamd_history_magic[] = {'r', 's', 'h', '2'};
+
+struct roll_history_header {
+	gchar magic[sizeof (rspamd_history_magic)];
+	guint32 nrows;
+	guint32 row_size;
+	guint32 symbols_len;
+	/* Number of claimed rows */
+	volatile gint cur_row;
+	/* Number of claimed bytes in symbols buffer */
+	volatile gint cur_symbols;
+	guint32 unused;
+};
+
+#define HISTORY_ALIGN(len) (((len) + 7) & ~((gsize)7))
+
+static guint
+rspamd_roll_history_pow2 (guint n)
+{
+	guint res = 1;
+
+	while (res < n && res < G_MAXINT / 2) {
+		res <<= 1;
+	}
+
+	return res;
+}
+
+static gboolean
+rspamd_roll_history_header_valid (struct roll_history *history)
+{
+	struct roll_history_header *hdr = history->hdr;
+
+	return memcmp (hdr->magic, rspamd_history_magic, sizeof (hdr->magic)) == 0 &&
+			hdr->nrows == history->nrows &&
+			hdr->row_size == sizeof (struct roll_history_row) &&
+			hdr->symbols_len == history->symbols_len;
+}
 
 /**
  * Returns new roll history
- * @param pool pool for shared memory
+ * @param pool pool to allocate history structure
+ * @param max_rows number of rows
+ * @param filename file to map history
  * @return new structure
  */
 struct roll_history *
-rspamd_roll_history_new (rspamd_mempool_t *pool)
+rspamd_roll_history_new (rspamd_mempool_t *pool, guint max_rows,
+		const gchar *filename)
 {
 	struct roll_history *new;
+	struct stat st;
+	gpointer map = MAP_FAILED;
+	gsize rows_off, symbols_off;
+	gint fd = -1;
 
 	if (pool == NULL) {
 		return NULL;
 	}
 
-	new = rspamd_mempool_alloc0_shared (pool, sizeof (struct roll_history));
-	new->pool = pool;
-	new->mtx = rspamd_mempool_get_mutex (pool);
+	new = rspamd_mempool_alloc0 (pool, sizeof (struct roll_history));
+	new->nrows = rspamd_roll_history_pow2 (max_rows > 0 ?
+			max_rows : HISTORY_DEFAULT_ROWS);
+	new->symbols_len = rspamd_roll_history_pow2 (
+			new->nrows * HISTORY_SYMBOLS_PER_ROW);
+	rows_off = HISTORY_ALIGN (sizeof (struct roll_history_header));
+	symbols_off = rows_off + sizeof (struct roll_history_row) * new->nrows;
+	new->map_len = symbols_off + new->symbols_len;
+
+	if (filename != NULL) {
+		if ((fd = open (filename, O_RDWR | O_CREAT, 00600)) == -1 ||
+				fstat (fd, &st) == -1) {
+			msg_err ("cannot open history file %s: %s", filename,
+					strerror (errno));
+		}
+		else if ((gsize)st.st_size != new->map_len &&
+				(ftruncate (fd, 0) == -1 ||
+						ftruncate (fd, new->map_len) == -1)) {
+			msg_err ("cannot resize history file %s: %s", filename,
+					strerror (errno));
+		}
+		else {
+			map = mmap (NULL, new->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					fd, 0);
+
+			if (map == MAP_FAILED) {
+				msg_err ("cannot mmap history file %s: %s", filename,
+						strerror (errno));
+			}
+		}
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		new->file_backed = (map != MAP_FAILED);
+	}
+
+	if (map == MAP_FAILED) {
+		map = rspamd_mempool_alloc0_shared (pool, new->map_len);
+	}
+
+	new->hdr = map;
+	new->rows = (struct roll_history_row *)((gchar *)map + rows_off);
+	new->symbols = (gchar *)map + symbols_off;
+
+	if (!rspamd_roll_history_header_valid (new)) {
+		if (new->file_backed) {
+			msg_info ("history file %s is created", filename);
+		}
+
+		memset (map, 0, new->map_len);
+		memcpy (new->hdr->magic, rspamd_history_magic, sizeof (new->hdr->magic));
+		new->hdr->nrows = new->nrows;
+		new->hdr->row_size = sizeof (struct roll_history_row);
+		new->hdr->symbols_len = new->symbols_len;
+	}
 
 	return new;
 }
 
+/* Copy data to the cycled symbols buffer */
+static void
+rspamd_roll_history_write_symbols (struct roll_history *history, guint32 *pos,
+		const gchar *data, guint32 len)
+{
+	guint32 off = *pos & (history->symbols_len - 1), first;
+
+	first = MIN (len, history->symbols_len - off);
+	memcpy (history->symbols + off, data, first);
+
+	if (first < len) {
+		memcpy (history->symbols, data + first, len - first);
+	}
+
+	*pos += len;
+}
+
+/* Returns FALSE if the data has been overwritten while copying */
+static gboolean
+rspamd_roll_history_read_symbols (struct roll_history *history, guint32 pos,
+		gchar *data, guint32 len)
+{
+	guint32 off = pos & (history->symbols_len - 1), first;
+
+	first = MIN (len, history->symbols_len - off);
+	memcpy (data, history->symbols + off, first);
+
+	if (first < len) {
+		memcpy (data + first, history->symbols, len - first);
+	}
+
+	return (guint32)g_atomic_int_get (&history->hdr->cur_symbols) - pos <=
+			history->symbols_len;
+}
+
 struct history_metric_callback_data {
-	gchar *pos;
-	gint remain;
+	struct roll_history *history;
+	guint32 pos;
+	guint32 remain;
 };
 
+static void
+roll_history_symbols_len_callback (gpointer key, gpointer value, void *user_data)
+{
+	struct history_metric_callback_data *cb = user_data;
+	struct symbol *s = value;
+
+	cb->remain += strlen (s->name) + 2;
+}
+
 static void
 roll_history_symbols_callback (gpointer key, gpointer value, void *user_data)
 {
 	struct history_metric_callback_data *cb = user_data;
 	struct symbol *s = value;
-	guint wr;
+	guint32 len;
+
+	len = MIN (strlen (s->name), cb->remain);
+	rspamd_roll_history_write_symbols (cb->history, &cb->pos, s->name, len);
+	cb->remain -= len;
 
-	if (cb->remain > 0) {
-		wr = rspamd_snprintf (cb->pos, cb->remain, "%s, ", s->name);
-		cb->pos += wr;
-		cb->remain -= wr;
+	if (cb->remain >= 2) {
+		rspamd_roll_history_write_symbols (cb->history, &cb->pos, ", ", 2);
+		cb->remain -= 2;
 	}
 }
 
@@ -78,35 +224,16 @@ void
 rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
-	gint row_num;
+	guint row_num;
 	struct roll_history_row *row;
 	struct metric_result *metric_res;
 	struct history_metric_callback_data cbdata;
 
-	if (history->need_lock) {
-		/* Some process is getting history, so wait on a mutex */
-		rspamd_mempool_lock_mutex (history->mtx);
-		history->need_lock = FALSE;
-		rspamd_mempool_unlock_mutex (history->mtx);
-	}
-
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, HISTORY_MAX_ROWS, 0);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
-#else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
-#endif
-
-	if (row_num < HISTORY_MAX_ROWS) {
-		row = &history->rows[row_num];
-		row->completed = FALSE;
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
-		return;
-	}
+	/* First of all claim row number */
+	row_num = (guint)g_atomic_int_add (&history->hdr->cur_row, 1);
+	row = &history->rows[row_num & (history->nrows - 1)];
+	/* Mark row as incomplete */
+	g_atomic_int_set (&row->seq, (row_num << 1) | 1);
 
 	/* Add information from task to roll history */
 	if (task->from_addr) {
@@ -124,125 +251,118 @@ rspamd_roll_history_update (struct roll_history *history,
 	rspamd_strlcpy (row->message_id, task->message_id,
 		sizeof (row->message_id));
 	if (task->user) {
-		rspamd_strlcpy (row->user, task->user, sizeof (row->message_id));
+		rspamd_strlcpy (row->user, task->user, sizeof (row->user));
 	}
 	else {
 		row->user[0] = '\0';
 	}
 
+	row->symbols_pos = 0;
+	row->symbols_len = 0;
+
 	/* Get default metric */
 	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 	if (metric_res == NULL) {
-		row->symbols[0] = '\0';
 		row->action = METRIC_ACTION_NOACTION;
+		row->score = 0.0;
+		row->required_score = 0.0;
 	}
 	else {
 		row->score = metric_res->score;
 		row->action = rspamd_check_action_metric (task, metric_res->score,
 				&row->required_score,
 				metric_res->metric);
-		cbdata.pos = row->symbols;
-		cbdata.remain = sizeof (row->symbols);
+
+		cbdata.history = history;
+		cbdata.remain = 0;
 		g_hash_table_foreach (metric_res->symbols,
-			roll_history_symbols_callback,
+			roll_history_symbols_len_callback,
 			&cbdata);
-		if (cbdata.remain > 0) {
-			/* Remove last whitespace and comma */
-			*cbdata.pos-- = '\0';
-			*cbdata.pos-- = '\0';
-			*cbdata.pos = '\0';
+
+		if (cbdata.remain > 2) {
+			/* Do not write the last comma and space */
+			cbdata.remain = MIN (cbdata.remain - 2, history->symbols_len / 4);
+			row->symbols_len = cbdata.remain;
+			row->symbols_pos = (guint32)g_atomic_int_add (
+					&history->hdr->cur_symbols, cbdata.remain);
+			cbdata.pos = row->symbols_pos;
+			g_hash_table_foreach (metric_res->symbols,
+				roll_history_symbols_callback,
+				&cbdata);
 		}
 	}
 
 	row->scan_time = task->scan_milliseconds;
 	row->len = task->msg.len;
-	row->completed = TRUE;
+	/* Row is completed */
+	g_atomic_int_set (&row->seq, (row_num + 1) << 1);
 }
 
-/**
- * Load previously saved history from file
- * @param history roll history object
- * @param filename filename to load from
- * @return TRUE if history has been loaded
- */
-gboolean
-rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
+guint
+rspamd_roll_history_foreach (struct roll_history *history,
+	rspamd_roll_history_cb cb, gpointer ud)
 {
-	gint fd;
-	struct stat st;
-	gchar magic[sizeof(rspamd_history_magic)];
+	struct roll_history_row row, *cur;
+	guint last, i, nproc = 0;
+	gint seq;
+	GByteArray *buf;
 
-	if (stat (filename, &st) == -1) {
-		msg_info ("cannot load history from %s: %s", filename,
-			strerror (errno));
-		return FALSE;
-	}
+	buf = g_byte_array_new ();
+	last = (guint)g_atomic_int_get (&history->hdr->cur_row);
 
-	if (st.st_size != sizeof (history->rows) + sizeof (rspamd_history_magic)) {
-		msg_info ("cannot load history from %s: size mismatch", filename);
-		return FALSE;
-	}
+	for (i = 0; i < history->nrows; i ++) {
+		cur = &history->rows[(last - i - 1) & (history->nrows - 1)];
+		seq = g_atomic_int_get (&cur->seq);
 
-	if ((fd = open (filename, O_RDONLY)) == -1) {
-		msg_info ("cannot load history from %s: %s", filename,
-			strerror (errno));
-		return FALSE;
-	}
+		if (seq == 0 || (seq & 1)) {
+			/* Unused or incomplete row */
+			continue;
+		}
 
-	if (read (fd, magic, sizeof (magic)) == -1) {
-		close (fd);
-		msg_info ("cannot read history from %s: %s", filename,
-				strerror (errno));
-		return FALSE;
-	}
+		memcpy (&row, cur, sizeof (row));
 
-	if (memcmp (magic, rspamd_history_magic, sizeof (magic)) != 0) {
-		close (fd);
-		msg_info ("cannot read history from %s: bad magic", filename);
-		return FALSE;
-	}
+		if (row.symbols_len > 0) {
+			g_byte_array_set_size (buf, row.symbols_len);
 
-	if (read (fd, history->rows, sizeof (history->rows)) == -1) {
-		close (fd);
-		msg_info ("cannot read history from %s: %s", filename,
-			strerror (errno));
-		return FALSE;
+			if (!rspamd_roll_history_read_symbols (history, row.symbols_pos,
+					buf->data, row.symbols_len)) {
+				continue;
+			}
+		}
+
+		if (g_atomic_int_get (&cur->seq) != seq) {
+			/* Row has been rewritten while we were copying it */
+			continue;
+		}
+
+		nproc ++;
+
+		if (!cb (&row, (const gchar *)buf->data, row.symbols_len, ud)) {
+			break;
+		}
 	}
 
-	close (fd);
+	g_byte_array_free (buf, TRUE);
 
-	return TRUE;
+	return nproc;
 }
 
 /**
  * Save history to file
  * @param history roll history object
- * @param filename filename to load from
  * @return TRUE if history has been saved
  */
 gboolean
-rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
+rspamd_roll_history_save (struct roll_history *history)
 {
-	gint fd;
-
-	if ((fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 00600)) == -1) {
-		msg_info ("cannot save history to %s: %s", filename, strerror (errno));
+	if (history == NULL || !history->file_backed) {
 		return FALSE;
 	}
 
-	if (write (fd, rspamd_history_magic, sizeof (rspamd_history_magic)) == -1) {
-		close (fd);
-		msg_info ("cannot write history to %s: %s", filename, strerror (errno));
+	if (msync (history->hdr, history->map_len, MS_SYNC) == -1) {
+		msg_info ("cannot save history: %s", strerror (errno));
 		return FALSE;
 	}
 
-	if (write (fd, history->rows, sizeof (history->rows)) == -1) {
-		close (fd);
-		msg_info ("cannot write history to %s: %s", filename, strerror (errno));
-		return FALSE;
-	}
-
-	close (fd);
-
 	return TRUE;
 }
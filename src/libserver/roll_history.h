@@ -30,45 +30,70 @@
 
 /*
  * Roll history is a special cycled buffer for checked messages, it is designed for writing history messages
- * and displaying them in webui
+ * and displaying them in webui. It is placed in shared memory (or in a shared
+ * mapping of the history file) and rows are claimed by workers atomically
+ * without locking. Symbols are stored in a separate cycled buffer with
+ * variable length records.
  */
 
 #define HISTORY_MAX_ID 100
-#define HISTORY_MAX_SYMBOLS 200
 #define HISTORY_MAX_USER 20
 #define HISTORY_MAX_ADDR 32
-#define HISTORY_MAX_ROWS 200
+#define HISTORY_DEFAULT_ROWS 200
+/* Average length of symbols record */
+#define HISTORY_SYMBOLS_PER_ROW 256
 
 struct rspamd_task;
 
 struct roll_history_row {
+	/* Odd while the row is being written, 0 for unused rows */
+	volatile gint seq;
+	guint32 symbols_pos;
+	guint32 symbols_len;
+	guint scan_time;
 	struct timeval tv;
 	gchar message_id[HISTORY_MAX_ID];
-	gchar symbols[HISTORY_MAX_SYMBOLS];
 	gchar user[HISTORY_MAX_USER];
 	gchar from_addr[HISTORY_MAX_ADDR];
 	gsize len;
-	guint scan_time;
 	gint action;
 	gdouble score;
 	gdouble required_score;
-	guint8 completed;
 };
 
+struct roll_history_header;
+
 struct roll_history {
-	struct roll_history_row rows[HISTORY_MAX_ROWS];
-	gint cur_row;
-	rspamd_mempool_t *pool;
-	gboolean need_lock;
-	rspamd_mempool_mutex_t *mtx;
+	struct roll_history_header *hdr;
+	struct roll_history_row *rows;
+	gchar *symbols;
+	gsize map_len;
+	guint nrows;
+	guint symbols_len;
+	gboolean file_backed;
 };
 
+/**
+ * Callback for history rows
+ * @param row consistent copy of a row
+ * @param symbols symbols of the row separated by ", " (not zero terminated)
+ * @param symbols_len length of symbols
+ * @param ud opaque data
+ * @return FALSE to stop iteration
+ */
+typedef gboolean (*rspamd_roll_history_cb) (const struct roll_history_row *row,
+		const gchar *symbols, gsize symbols_len, gpointer ud);
+
 /**
  * Returns new roll history
- * @param pool pool for shared memory
+ * @param pool pool to allocate history structure
+ * @param max_rows number of rows (rounded to the next power of two)
+ * @param filename if not NULL, then history is stored in the shared mapping of
+ * this file
  * @return new structure
  */
-struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool);
+struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool,
+	guint max_rows, const gchar *filename);
 
 /**
  * Update roll history with data from task
@@ -79,21 +104,21 @@ void rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task);
 
 /**
- * Load previously saved history from file
+ * Iterate over history rows from the newest to the oldest ones. Rows that are
+ * being written at the moment are skipped.
  * @param history roll history object
- * @param filename filename to load from
- * @return TRUE if history has been loaded
+ * @param cb callback
+ * @param ud opaque data for callback
+ * @return number of rows processed
  */
-gboolean rspamd_roll_history_load (struct roll_history *history,
-	const gchar *filename);
+guint rspamd_roll_history_foreach (struct roll_history *history,
+	rspamd_roll_history_cb cb, gpointer ud);
 
 /**
- * Save history to file
+ * Save history to its file (if any)
  * @param history roll history object
- * @param filename filename to load from
  * @return TRUE if history has been saved
  */
-gboolean rspamd_roll_history_save (struct roll_history *history,
-	const gchar *filename);
+gboolean rspamd_roll_history_save (struct roll_history *history);
 
 #endif /* ROLL_HISTORY_H_ */
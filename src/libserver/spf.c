@@ -29,6 +29,7 @@
 #include "message.h"
 #include "filter.h"
 #include "utlist.h"
+#include "hash.h"
 
 #define SPF_VER1_STR "v=spf1"
 #define SPF_VER2_STR "spf2."
@@ -48,11 +49,19 @@
 /** SPF limits for avoiding abuse **/
 #define SPF_MAX_NESTING 10
 #define SPF_MAX_DNS_REQUESTS 30
+/** Records with less elements are checked without radix index **/
+#define SPF_RADIX_MIN_ELTS 8
+/** Cache of flattened includes shared by all records in a worker **/
+#define SPF_INCLUDES_CACHE_SIZE 1024
+#define SPF_INCLUDES_CACHE_MAXAGE 86400
 
 struct spf_resolved_element {
 	GPtrArray *elts;
 	gchar *cur_domain;
+	guint ttl;
 	gboolean redirected; /* Ingnore level, it's redirected */
+	gboolean cacheable; /* Resolved include that could be cached */
+	gboolean nocache; /* Depends on sender or has failed DNS requests */
 };
 
 struct spf_record {
@@ -62,6 +71,7 @@ struct spf_record {
 
 	guint ttl;
 	GPtrArray *resolved; /* Array of struct spf_resolved_element */
+	GHashTable *domains; /* Domain -> index of resolved element + 1 */
 	const gchar *sender;
 	const gchar *sender_domain;
 	gchar *local_part;
@@ -116,6 +126,8 @@ struct spf_dns_cb {
 static gboolean start_spf_parse (struct spf_record *rec,
 		struct spf_resolved_element *resolved, gchar *begin);
 
+static rspamd_lru_hash_t *spf_includes_cache = NULL;
+
 /* Determine spf mech */
 static spf_mech_t
 check_spf_mech (const gchar *elt, gboolean *need_shift)
@@ -148,6 +160,7 @@ rspamd_spf_new_addr (struct spf_record *rec,
 
 	naddr = g_slice_alloc0 (sizeof (*naddr));
 	naddr->mech = check_spf_mech (elt, &need_shift);
+	naddr->prev = naddr;
 
 	if (need_shift) {
 		naddr->spf_string = g_strdup (elt + 1);
@@ -164,11 +177,13 @@ rspamd_spf_new_addr (struct spf_record *rec,
 static void
 rspamd_spf_free_addr (gpointer a)
 {
-	struct spf_addr *addr = a;
+	struct spf_addr *addr = a, *cur, *tmp;
 
 	if (addr) {
-		g_free (addr->spf_string);
-		g_slice_free1 (sizeof (*addr), addr);
+		DL_FOREACH_SAFE (addr, cur, tmp) {
+			g_free (cur->spf_string);
+			g_slice_free1 (sizeof (*cur), cur);
+		}
 	}
 }
 
@@ -177,13 +192,17 @@ rspamd_spf_new_addr_list (struct spf_record *rec, const gchar *domain)
 {
 	struct spf_resolved_element *resolved;
 
-	resolved = g_slice_alloc (sizeof (*resolved));
-	resolved->redirected = FALSE;
+	resolved = g_slice_alloc0 (sizeof (*resolved));
 	resolved->cur_domain = g_strdup (domain);
 	resolved->elts = g_ptr_array_new_full (8, rspamd_spf_free_addr);
 
 	g_ptr_array_add (rec->resolved, resolved);
 
+	if (g_hash_table_lookup (rec->domains, resolved->cur_domain) == NULL) {
+		g_hash_table_insert (rec->domains, resolved->cur_domain,
+				GUINT_TO_POINTER (rec->resolved->len));
+	}
+
 	return g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 }
 
@@ -198,6 +217,8 @@ spf_record_destructor (gpointer r)
 	guint i;
 
 	if (rec) {
+		g_hash_table_unref (rec->domains);
+
 		for (i = 0; i < rec->resolved->len; i ++) {
 			elt = g_ptr_array_index (rec->resolved, i);
 			g_ptr_array_free (elt->elts, TRUE);
@@ -222,17 +243,41 @@ rspamd_flatten_record_dtor (struct spf_resolved *r)
 
 	g_free (r->domain);
 	g_array_free (r->elts, TRUE);
+	radix_destroy_compressed (r->radix);
 	g_slice_free1 (sizeof (*r), r);
 }
 
+static struct spf_resolved *
+rspamd_spf_new_resolved (const gchar *domain, guint ttl, guint nelts)
+{
+	struct spf_resolved *res;
+
+	res = g_slice_alloc0 (sizeof (*res));
+	res->elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr),
+			nelts);
+	res->domain = g_strdup (domain);
+	res->ttl = ttl;
+	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
+
+	return res;
+}
+
 static void
 rspamd_spf_process_reference (struct spf_resolved *target,
-		struct spf_addr *addr, struct spf_record *rec, gboolean top)
+		struct spf_addr *addr, struct spf_record *rec, gboolean top,
+		guint depth)
 {
 	struct spf_resolved_element *elt;
-	struct spf_addr *cur = NULL, taddr;
+	struct spf_addr *cur = NULL, *chain, taddr;
 	guint i;
 
+	if (depth > SPF_MAX_NESTING) {
+		/* Includes and redirects are shared, so they can form loops */
+		msg_info ("spf recursion limit %d is reached, domain: %s",
+				SPF_MAX_NESTING, rec->sender_domain);
+		return;
+	}
+
 	if (addr) {
 		g_assert (addr->m.idx < rec->resolved->len);
 
@@ -261,6 +306,13 @@ rspamd_spf_process_reference (struct spf_resolved *target,
 
 		g_assert (cur->flags & RSPAMD_SPF_FLAG_REFRENCE);
 		g_assert (cur->m.idx < rec->resolved->len);
+
+		if (++depth > SPF_MAX_NESTING) {
+			msg_info ("spf recursion limit %d is reached, domain: %s",
+					SPF_MAX_NESTING, rec->sender_domain);
+			return;
+		}
+
 		elt = g_ptr_array_index (rec->resolved, cur->m.idx);
 	}
 
@@ -273,7 +325,7 @@ rspamd_spf_process_reference (struct spf_resolved *target,
 		}
 		else if (cur->flags & RSPAMD_SPF_FLAG_REFRENCE) {
 			/* Process reference */
-			rspamd_spf_process_reference (target, cur, rec, FALSE);
+			rspamd_spf_process_reference (target, cur, rec, FALSE, depth + 1);
 		}
 		else {
 			if ((cur->flags & RSPAMD_SPF_FLAG_ANY) && !top) {
@@ -281,14 +333,133 @@ rspamd_spf_process_reference (struct spf_resolved *target,
 				continue;
 			}
 
-			memcpy (&taddr, cur, sizeof (taddr));
-			/* Steal element */
-			cur->spf_string = NULL;
-			g_array_append_val (target->elts, taddr);
+			/* Element can be referenced several times, so copy strings */
+			DL_FOREACH (cur, chain) {
+				memcpy (&taddr, chain, sizeof (taddr));
+				taddr.spf_string = g_strdup (chain->spf_string);
+				taddr.prev = NULL;
+				taddr.next = NULL;
+				g_array_append_val (target->elts, taddr);
+			}
 		}
 	}
 }
 
+static gboolean
+rspamd_spf_prefix_match (const guchar *net, const guchar *addr, guint mask)
+{
+	guint bytes = mask / NBBY, bits = mask % NBBY;
+	guchar bmask;
+
+	if (memcmp (net, addr, bytes) != 0) {
+		return FALSE;
+	}
+
+	if (bits > 0) {
+		bmask = (0xff << (NBBY - bits)) & 0xff;
+
+		return (net[bytes] & bmask) == (addr[bytes] & bmask);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Radix key is the family tag followed by an address padded to ipv6 length,
+ * so both families live in the same tree without overlapping
+ */
+#define SPF_RADIX_KEYLEN (sizeof (guint32) + sizeof (struct in6_addr))
+
+static void
+rspamd_spf_radix_key (guint8 *key, gint af, const guchar *addr)
+{
+	memset (key, 0, SPF_RADIX_KEYLEN);
+	key[3] = af == AF_INET ? 4 : 6;
+	memcpy (key + sizeof (guint32), addr, af == AF_INET ?
+			sizeof (struct in_addr) : sizeof (struct in6_addr));
+}
+
+/*
+ * Returns the network of element for the specified family or NULL
+ */
+static const guchar *
+rspamd_spf_elt_prefix (struct spf_addr *elt, gint af, guint *mask)
+{
+	guint flag = af == AF_INET ? RSPAMD_SPF_FLAG_IPV4 : RSPAMD_SPF_FLAG_IPV6;
+
+	if (elt->flags & flag) {
+		*mask = af == AF_INET ? elt->m.dual.mask_v4 : elt->m.dual.mask_v6;
+
+		return af == AF_INET ? elt->addr4 : elt->addr6;
+	}
+	else if (!(elt->flags & (RSPAMD_SPF_FLAG_IPV4|RSPAMD_SPF_FLAG_IPV6)) &&
+			(elt->flags & RSPAMD_SPF_FLAG_ANY)) {
+		*mask = 0;
+
+		return elt->addr6;
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_spf_index_family (struct spf_resolved *rec, gint af)
+{
+	struct spf_addr *cur, *prev;
+	const guchar *caddr, *paddr;
+	guint i, j, cmask = 0, pmask = 0, max;
+	guint8 key[SPF_RADIX_KEYLEN];
+	gboolean covered;
+
+	max = af == AF_INET ? 32 : 128;
+
+	/*
+	 * SPF uses the first matching element whilst radix returns the longest
+	 * prefix. These are the same if we skip elements covered by some previous
+	 * element, as any more specific previous element wins in radix anyway.
+	 */
+	for (i = 0; i < rec->elts->len; i ++) {
+		cur = &g_array_index (rec->elts, struct spf_addr, i);
+		caddr = rspamd_spf_elt_prefix (cur, af, &cmask);
+
+		if (caddr == NULL || cmask > max) {
+			continue;
+		}
+
+		covered = FALSE;
+
+		for (j = 0; j < i && !covered; j ++) {
+			prev = &g_array_index (rec->elts, struct spf_addr, j);
+			paddr = rspamd_spf_elt_prefix (prev, af, &pmask);
+
+			if (paddr != NULL && pmask <= cmask &&
+					rspamd_spf_prefix_match (paddr, caddr, pmask)) {
+				covered = TRUE;
+			}
+		}
+
+		if (!covered) {
+			rspamd_spf_radix_key (key, af, caddr);
+			/* Radix expects the number of bits to ignore */
+			radix_insert_compressed (rec->radix, key, sizeof (key),
+					(max - cmask) + (af == AF_INET ? 96 : 0), i);
+		}
+	}
+}
+
+static void
+rspamd_spf_index_record (struct spf_resolved *rec)
+{
+	if (rec->elts->len < SPF_RADIX_MIN_ELTS) {
+		/* Linear scan is faster */
+		return;
+	}
+
+	rec->radix = radix_create_compressed ();
+	rspamd_spf_index_family (rec, AF_INET);
+	rspamd_spf_index_family (rec, AF_INET6);
+}
+
 /*
  * Parse record and flatten it to a simple structure
  */
@@ -299,26 +470,83 @@ rspamd_spf_record_flatten (struct spf_record *rec)
 
 	g_assert (rec != NULL);
 
-	res = g_slice_alloc (sizeof (*res));
-	res->elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr),
+	res = rspamd_spf_new_resolved (rec->sender_domain, rec->ttl,
 			rec->resolved->len);
-	res->domain = g_strdup (rec->sender_domain);
-	res->ttl = rec->ttl;
-	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
 
 	if (rec->resolved->len > 0) {
-		rspamd_spf_process_reference (res, NULL, rec, TRUE);
+		rspamd_spf_process_reference (res, NULL, rec, TRUE, 0);
 	}
 
+	rspamd_spf_index_record (res);
+
 	return res;
 }
 
+static gboolean
+rspamd_spf_element_nocache (struct spf_record *rec,
+		struct spf_resolved_element *elt, guint depth)
+{
+	struct spf_addr *cur;
+	guint i;
+
+	if (elt->nocache || depth > SPF_MAX_NESTING) {
+		return TRUE;
+	}
+
+	for (i = 0; i < elt->elts->len; i ++) {
+		cur = g_ptr_array_index (elt->elts, i);
+
+		if ((cur->flags & RSPAMD_SPF_FLAG_REFRENCE) &&
+				(cur->flags & RSPAMD_SPF_FLAG_PARSED) &&
+				rspamd_spf_element_nocache (rec,
+						g_ptr_array_index (rec->resolved, cur->m.idx),
+						depth + 1)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Save flattened includes to reuse them for other records
+ */
+static void
+rspamd_spf_cache_includes (struct spf_record *rec)
+{
+	struct spf_resolved_element *elt;
+	struct spf_resolved *res;
+	struct spf_addr ref;
+	time_t now = rec->task->tv.tv_sec;
+	guint i;
+
+	for (i = 1; i < rec->resolved->len; i ++) {
+		elt = g_ptr_array_index (rec->resolved, i);
+
+		if (!elt->cacheable || elt->ttl == 0 ||
+				rspamd_spf_element_nocache (rec, elt, 0) ||
+				rspamd_lru_hash_lookup (spf_includes_cache, elt->cur_domain,
+						now) != NULL) {
+			continue;
+		}
+
+		res = rspamd_spf_new_resolved (elt->cur_domain, elt->ttl,
+				elt->elts->len);
+		memset (&ref, 0, sizeof (ref));
+		ref.m.idx = i;
+		rspamd_spf_process_reference (res, &ref, rec, FALSE, 0);
+		rspamd_lru_hash_insert (spf_includes_cache, res->domain, res,
+				now, elt->ttl);
+	}
+}
+
 static void
 rspamd_spf_maybe_return (struct spf_record *rec)
 {
 	struct spf_resolved *flat;
 
 	if (rec->requests_inflight == 0 && !rec->done) {
+		rspamd_spf_cache_includes (rec);
 		flat = rspamd_spf_record_flatten (rec);
 		rec->callback (flat, rec->task);
 		REF_RELEASE (flat);
@@ -387,6 +615,32 @@ spf_check_ptr_host (struct spf_dns_cb *cb, const char *name)
 static void
 spf_record_process_addr (struct spf_addr *addr, struct rdns_reply_entry *reply)
 {
+	struct spf_addr *cur, *naddr;
+	guint flag;
+
+	flag = reply->type == RDNS_REQUEST_AAAA ? RSPAMD_SPF_FLAG_IPV6 :
+			RSPAMD_SPF_FLAG_IPV4;
+
+	/* Mechanism can resolve to many addresses, so keep them in a chain */
+	DL_FOREACH (addr, cur) {
+		if (!(cur->flags & flag)) {
+			break;
+		}
+	}
+
+	if (cur == NULL) {
+		naddr = g_slice_alloc0 (sizeof (*naddr));
+		naddr->mech = addr->mech;
+		naddr->m = addr->m;
+		naddr->flags = addr->flags &
+				~(RSPAMD_SPF_FLAG_IPV4|RSPAMD_SPF_FLAG_IPV6);
+		naddr->spf_string = g_strdup (addr->spf_string);
+		DL_APPEND (addr, naddr);
+		cur = naddr;
+	}
+
+	addr = cur;
+
 	if (reply->type == RDNS_REQUEST_AAAA) {
 		memcpy (addr->addr6, &reply->content.aaa.addr, sizeof (addr->addr6));
 		addr->flags |= RSPAMD_SPF_FLAG_IPV6;
@@ -523,6 +777,8 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
 
 					if (ret) {
 						cb->addr->flags |= RSPAMD_SPF_FLAG_PARSED;
+						cb->resolved->cacheable = TRUE;
+						cb->resolved->ttl = elt_data->ttl;
 					}
 					else {
 						cb->addr->flags &= ~RSPAMD_SPF_FLAG_PARSED;
@@ -597,6 +853,10 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
 			break;
 		}
 	}
+	else {
+		/* Temporary failure, this result must not be reused */
+		cb->resolved->nocache = TRUE;
+	}
 
 	rspamd_spf_maybe_return (cb->rec);
 }
@@ -609,10 +869,10 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
  * dual-cidr-length = [ ip4-cidr-length ] [ "/" ip6-cidr-length ]
  */
 static const gchar *
-parse_spf_domain_mask (struct spf_record *rec, struct spf_addr *addr,
+parse_spf_domain_mask (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr,
 		gboolean allow_mask)
 {
-	struct spf_resolved_element *resolved;
 	struct rspamd_task *task = rec->task;
 	enum {
 		parse_spf_elt = 0,
@@ -629,7 +889,6 @@ parse_spf_domain_mask (struct spf_record *rec, struct spf_addr *addr,
 	gchar t;
 	guint16 cur_mask = 0;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	host = resolved->cur_domain;
 	c = p;
 
@@ -735,17 +994,19 @@ parse_spf_domain_mask (struct spf_record *rec, struct spf_addr *addr,
 }
 
 static gboolean
-parse_spf_a (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_a (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host = NULL;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	CHECK_REC (rec);
 
-	host = parse_spf_domain_mask (rec, addr, TRUE);
+	/* Exact addresses unless mask is specified */
+	addr->m.dual.mask_v4 = 32;
+	addr->m.dual.mask_v6 = 128;
+	host = parse_spf_domain_mask (rec, resolved, addr, TRUE);
 
 	if (host == NULL) {
 		return FALSE;
@@ -771,18 +1032,21 @@ parse_spf_a (struct spf_record *rec, struct spf_addr *addr)
 }
 
 static gboolean
-parse_spf_ptr (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_ptr (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host;
 	gchar *ptr;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	CHECK_REC (rec);
 
-	host = parse_spf_domain_mask (rec, addr, FALSE);
+	addr->m.dual.mask_v4 = 32;
+	addr->m.dual.mask_v6 = 128;
+	/* Result depends on the sender's address */
+	resolved->nocache = TRUE;
+	host = parse_spf_domain_mask (rec, resolved, addr, FALSE);
 
 	rec->dns_requests++;
 	cb = rspamd_mempool_alloc (task->task_pool, sizeof (struct spf_dns_cb));
@@ -813,18 +1077,18 @@ parse_spf_ptr (struct spf_record *rec, struct spf_addr *addr)
 }
 
 static gboolean
-parse_spf_mx (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_mx (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
-
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 
 	CHECK_REC (rec);
 
-	host = parse_spf_domain_mask (rec, addr, TRUE);
+	addr->m.dual.mask_v4 = 32;
+	addr->m.dual.mask_v6 = 128;
+	host = parse_spf_domain_mask (rec, resolved, addr, TRUE);
 
 	if (host == NULL) {
 		return FALSE;
@@ -961,6 +1225,52 @@ parse_spf_ip6 (struct spf_record *rec, struct spf_addr *addr)
 }
 
 
+/*
+ * Make a reference to the domain that has been already requested for this
+ * record or, for includes, to the flattened include from the cache
+ */
+static gboolean
+spf_record_reuse_domain (struct spf_record *rec, struct spf_addr *addr,
+		const gchar *domain, gboolean is_include)
+{
+	struct spf_resolved *cached;
+	struct spf_resolved_element *resolved;
+	struct spf_addr *cur, *naddr;
+	guint idx, i;
+
+	idx = GPOINTER_TO_UINT (g_hash_table_lookup (rec->domains, domain));
+
+	if (idx != 0) {
+		msg_debug ("reuse %s for %s", domain, rec->sender_domain);
+		addr->m.idx = idx - 1;
+		addr->flags |= RSPAMD_SPF_FLAG_REFRENCE;
+
+		return TRUE;
+	}
+
+	if (!is_include || (cached = rspamd_lru_hash_lookup (spf_includes_cache,
+			domain, rec->task->tv.tv_sec)) == NULL) {
+		return FALSE;
+	}
+
+	msg_debug ("use cached include %s for %s", domain, rec->sender_domain);
+	addr->m.idx = rec->resolved->len;
+	addr->flags |= RSPAMD_SPF_FLAG_REFRENCE;
+	resolved = rspamd_spf_new_addr_list (rec, domain);
+
+	for (i = 0; i < cached->elts->len; i ++) {
+		cur = &g_array_index (cached->elts, struct spf_addr, i);
+		naddr = g_slice_alloc (sizeof (*naddr));
+		memcpy (naddr, cur, sizeof (*naddr));
+		naddr->spf_string = g_strdup (cur->spf_string);
+		naddr->prev = naddr;
+		naddr->next = NULL;
+		g_ptr_array_add (resolved->elts, naddr);
+	}
+
+	return TRUE;
+}
+
 static gboolean
 parse_spf_include (struct spf_record *rec, struct spf_addr *addr)
 {
@@ -977,6 +1287,10 @@ parse_spf_include (struct spf_record *rec, struct spf_addr *addr)
 
 	domain++;
 
+	if (spf_record_reuse_domain (rec, addr, domain, TRUE)) {
+		return TRUE;
+	}
+
 	rec->dns_requests++;
 
 	cb = rspamd_mempool_alloc (task->task_pool, sizeof (struct spf_dns_cb));
@@ -1030,7 +1344,6 @@ parse_spf_redirect (struct spf_record *rec,
 
 	domain++;
 
-	rec->dns_requests++;
 	resolved->redirected = TRUE;
 
 	/* Now clear all elements but this one */
@@ -1042,6 +1355,11 @@ parse_spf_redirect (struct spf_record *rec,
 		}
 	}
 
+	if (spf_record_reuse_domain (rec, addr, domain, FALSE)) {
+		return TRUE;
+	}
+
+	rec->dns_requests++;
 	cb = rspamd_mempool_alloc (task->task_pool, sizeof (struct spf_dns_cb));
 	/* Set reference */
 	addr->flags |= RSPAMD_SPF_FLAG_REFRENCE;
@@ -1065,14 +1383,13 @@ parse_spf_redirect (struct spf_record *rec,
 }
 
 static gboolean
-parse_spf_exists (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_exists (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	CHECK_REC (rec);
 
 	host = strchr (addr->spf_string, ':');
@@ -1083,6 +1400,8 @@ parse_spf_exists (struct spf_record *rec, struct spf_addr *addr)
 
 	host ++;
 	rec->dns_requests++;
+	/* Usually exists is used with macros */
+	resolved->nocache = TRUE;
 
 	cb = rspamd_mempool_alloc (task->task_pool, sizeof (struct spf_dns_cb));
 	cb->rec = rec;
@@ -1135,7 +1454,7 @@ reverse_spf_ip (gchar *ip, gint len)
 
 static const gchar *
 expand_spf_macro (struct spf_record *rec,
-	const gchar *begin)
+	struct spf_resolved_element *resolved, const gchar *begin)
 {
 	const gchar *p;
 	gchar *c, *new, *tmp;
@@ -1143,13 +1462,11 @@ expand_spf_macro (struct spf_record *rec,
 	gchar ip_buf[INET6_ADDRSTRLEN];
 	gboolean need_expand = FALSE;
 	struct rspamd_task *task;
-	struct spf_resolved_element *resolved;
 
 	g_assert (rec != NULL);
 	g_assert (begin != NULL);
 
 	task = rec->task;
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	p = begin;
 	/* Calculate length */
 	while (*p) {
@@ -1413,7 +1730,13 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 	}
 
 	task = rec->task;
-	begin = expand_spf_macro (rec, elt);
+	begin = expand_spf_macro (rec, resolved, elt);
+
+	if (begin != elt) {
+		/* Macro depends on sender */
+		resolved->nocache = TRUE;
+	}
+
 	addr = rspamd_spf_new_addr (rec, resolved, begin);
 	g_assert (addr != NULL);
 	t = g_ascii_tolower (addr->spf_string[0]);
@@ -1429,7 +1752,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 		}
 		else if (g_ascii_strncasecmp (begin, SPF_A,
 				sizeof (SPF_A) - 1) == 0) {
-			res = parse_spf_a (rec, addr);
+			res = parse_spf_a (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1458,7 +1781,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 	case 'm':
 		/* mx */
 		if (g_ascii_strncasecmp (begin, SPF_MX, sizeof (SPF_MX) - 1) == 0) {
-			res = parse_spf_mx (rec, addr);
+			res = parse_spf_mx (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1469,7 +1792,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 		/* ptr */
 		if (g_ascii_strncasecmp (begin, SPF_PTR,
 				sizeof (SPF_PTR) - 1) == 0) {
-			res = parse_spf_ptr (rec, addr);
+			res = parse_spf_ptr (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1484,7 +1807,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 		}
 		else if (g_ascii_strncasecmp (begin, SPF_EXISTS,
 				sizeof (SPF_EXISTS) - 1) == 0) {
-			res = parse_spf_exists (rec, addr);
+			res = parse_spf_exists (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1669,6 +1992,13 @@ resolve_spf (struct rspamd_task *task, spf_cb_t callback)
 	rec->callback = callback;
 
 	rec->resolved = g_ptr_array_sized_new (8);
+	rec->domains = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+
+	if (spf_includes_cache == NULL) {
+		spf_includes_cache = rspamd_lru_hash_new (SPF_INCLUDES_CACHE_SIZE,
+				SPF_INCLUDES_CACHE_MAXAGE, NULL,
+				(GDestroyNotify)spf_record_unref);
+	}
 
 	/* Add destructor */
 	rspamd_mempool_add_destructor (task->task_pool,
@@ -1705,6 +2035,75 @@ resolve_spf (struct rspamd_task *task, spf_cb_t callback)
 	return FALSE;
 }
 
+static gboolean
+spf_addr_match (struct spf_addr *addr, rspamd_inet_addr_t *from, gint af)
+{
+	const guint8 *s, *d;
+	guint mask, addrlen;
+
+	if (((addr->flags & RSPAMD_SPF_FLAG_IPV6) && af == AF_INET6) ||
+		((addr->flags & RSPAMD_SPF_FLAG_IPV4) && af == AF_INET)) {
+		d = rspamd_inet_address_get_radix_key (from, &addrlen);
+
+		if (af == AF_INET6) {
+			s = (const guint8 *)addr->addr6;
+			mask = addr->m.dual.mask_v6;
+		}
+		else {
+			s = (const guint8 *)addr->addr4;
+			mask = addr->m.dual.mask_v4;
+		}
+
+		if (mask > addrlen * NBBY) {
+			msg_info ("bad mask length: %d", mask);
+			return FALSE;
+		}
+
+		return rspamd_spf_prefix_match (s, d, mask);
+	}
+
+	return (addr->flags & RSPAMD_SPF_FLAG_ANY) ? TRUE : FALSE;
+}
+
+struct spf_addr *
+spf_record_match (struct spf_resolved *rec, rspamd_inet_addr_t *addr)
+{
+	struct spf_addr *cur;
+	guint8 key[SPF_RADIX_KEYLEN];
+	const guchar *d;
+	guint i, addrlen;
+	uintptr_t idx;
+	gint af;
+
+	if (addr == NULL) {
+		return NULL;
+	}
+
+	af = rspamd_inet_address_get_af (addr);
+
+	if (rec->radix != NULL && (af == AF_INET || af == AF_INET6)) {
+		d = rspamd_inet_address_get_radix_key (addr, &addrlen);
+		rspamd_spf_radix_key (key, af, d);
+		idx = radix_find_compressed (rec->radix, key, sizeof (key));
+
+		if (idx != RADIX_NO_VALUE) {
+			return &g_array_index (rec->elts, struct spf_addr, idx);
+		}
+
+		return NULL;
+	}
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		cur = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (spf_addr_match (cur, addr, af)) {
+			return cur;
+		}
+	}
+
+	return NULL;
+}
+
 struct spf_resolved *
 spf_record_ref (struct spf_resolved *rec)
 {
@@ -1717,3 +2116,106 @@ spf_record_unref (struct spf_resolved *rec)
 {
 	REF_RELEASE (rec);
 }
+
+/* Serialized element: addr6, addr4, m, flags, mech, strlen, string */
+#define SPF_SERIALIZED_ELT_LEN (sizeof (struct in6_addr) + \
+	sizeof (struct in_addr) + sizeof (guint32) * 4)
+
+GByteArray *
+spf_record_serialize (struct spf_resolved *rec)
+{
+	GByteArray *ar;
+	struct spf_addr *addr;
+	guint32 hdr[3], fields[4];
+	gsize dlen;
+	guint i;
+
+	dlen = strlen (rec->domain);
+	ar = g_byte_array_sized_new (sizeof (hdr) + dlen +
+			rec->elts->len * (SPF_SERIALIZED_ELT_LEN + 16));
+	hdr[0] = rec->ttl;
+	hdr[1] = rec->elts->len;
+	hdr[2] = dlen;
+	g_byte_array_append (ar, (const guint8 *)hdr, sizeof (hdr));
+	g_byte_array_append (ar, (const guint8 *)rec->domain, dlen);
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		g_byte_array_append (ar, addr->addr6, sizeof (addr->addr6));
+		g_byte_array_append (ar, addr->addr4, sizeof (addr->addr4));
+		memcpy (&fields[0], &addr->m, sizeof (fields[0]));
+		fields[1] = addr->flags;
+		fields[2] = addr->mech;
+		fields[3] = addr->spf_string ? strlen (addr->spf_string) + 1 : 0;
+		g_byte_array_append (ar, (const guint8 *)fields, sizeof (fields));
+
+		if (fields[3] > 0) {
+			g_byte_array_append (ar, (const guint8 *)addr->spf_string,
+					fields[3] - 1);
+		}
+	}
+
+	return ar;
+}
+
+struct spf_resolved *
+spf_record_deserialize (const guchar *data, gsize len)
+{
+	struct spf_resolved *res;
+	struct spf_addr addr;
+	guint32 hdr[3], fields[4];
+	const guchar *p = data, *end = data + len;
+	guint i;
+
+	if (len < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	if (hdr[2] > (gsize)(end - p) ||
+			hdr[1] > (gsize)(end - p) / SPF_SERIALIZED_ELT_LEN) {
+		return NULL;
+	}
+
+	res = rspamd_spf_new_resolved (NULL, hdr[0], hdr[1]);
+	res->domain = g_malloc (hdr[2] + 1);
+	rspamd_strlcpy (res->domain, (const gchar *)p, hdr[2] + 1);
+	p += hdr[2];
+
+	for (i = 0; i < hdr[1]; i ++) {
+		if ((gsize)(end - p) < SPF_SERIALIZED_ELT_LEN) {
+			REF_RELEASE (res);
+			return NULL;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		memcpy (addr.addr6, p, sizeof (addr.addr6));
+		p += sizeof (addr.addr6);
+		memcpy (addr.addr4, p, sizeof (addr.addr4));
+		p += sizeof (addr.addr4);
+		memcpy (fields, p, sizeof (fields));
+		p += sizeof (fields);
+		memcpy (&addr.m, &fields[0], sizeof (addr.m));
+		addr.flags = fields[1];
+		addr.mech = fields[2];
+
+		if (fields[3] > 0) {
+			if (fields[3] - 1 > (gsize)(end - p)) {
+				REF_RELEASE (res);
+				return NULL;
+			}
+
+			addr.spf_string = g_malloc (fields[3]);
+			rspamd_strlcpy (addr.spf_string, (const gchar *)p, fields[3]);
+			p += fields[3] - 1;
+		}
+
+		g_array_append_val (res->elts, addr);
+	}
+
+	rspamd_spf_index_record (res);
+
+	return res;
+}
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "ref.h"
+#include "radix.h"
 
 struct rspamd_task;
 struct spf_resolved;
@@ -47,12 +48,14 @@ struct spf_addr {
 	guint flags;
 	spf_mech_t mech;
 	gchar *spf_string;
+	struct spf_addr *prev, *next; /* Additional addresses of the same mech */
 };
 
 struct spf_resolved {
 	gchar *domain;
 	guint ttl;
 	GArray *elts; /* Flat list of struct spf_addr */
+	radix_compressed_t *radix; /* Index of elts for large records */
 	ref_entry_t ref; /* Refcounting */
 };
 
@@ -68,6 +71,13 @@ gboolean resolve_spf (struct rspamd_task *task, spf_cb_t callback);
 const gchar * get_spf_domain (struct rspamd_task *task);
 
 
+/*
+ * Find the first element of flattened record that matches the specified
+ * address, returns NULL if no elements match
+ */
+struct spf_addr * spf_record_match (struct spf_resolved *rec,
+		rspamd_inet_addr_t *addr);
+
 /*
  * Increase refcount
  */
@@ -78,4 +88,15 @@ struct spf_resolved * spf_record_ref (struct spf_resolved *rec);
  */
 void spf_record_unref (struct spf_resolved *rec);
 
+/*
+ * Serialize flattened record to a plain buffer, e.g. to store it in some cache
+ */
+GByteArray * spf_record_serialize (struct spf_resolved *rec);
+
+/*
+ * Restore flattened record from a buffer produced by spf_record_serialize,
+ * returns NULL if the buffer is corrupted
+ */
+struct spf_resolved * spf_record_deserialize (const guchar *data, gsize len);
+
 #endif
@@ -38,6 +38,30 @@ struct rspamd_symbols_cache_header {
 	guchar unused[128];
 };
 
+/* Per process counters of a symbol, written by the owner process only */
+struct counter_data {
+	gdouble value;
+	guint32 number;
+	guint32 frequency;
+};
+
+/*
+ * Slabs of counters indexed by symbol id are allocated in shared memory for
+ * each worker. Each slab starts at cache line boundary with the header, so
+ * workers never write to the same cache lines, and counters of all slabs are
+ * summed lazily on resort and when statistics are requested.
+ */
+#define COUNTERS_ALIGN 64
+/* Slabs for workers respawned before their predecessors are reaped */
+#define COUNTERS_SPARE_SLABS 4
+
+struct counters_slab_hdr {
+	gint pid;
+};
+
+#define COUNTERS_SLAB_DATA(slab) \
+	((struct counter_data *)((guchar *)(slab) + COUNTERS_ALIGN))
+
 struct symbols_cache {
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
@@ -48,14 +72,19 @@ struct symbols_cache {
 	guint used_items;
 	guint64 total_freq;
 	struct rspamd_config *cfg;
-	rspamd_mempool_mutex_t *mtx;
 	gdouble reload_time;
 	struct event resort_ev;
-};
-
-struct counter_data {
-	gdouble value;
-	gint number;
+	/* Shared slabs of counters */
+	guchar *slabs;
+	guint nslabs;
+	gsize slab_size;
+	guint slab_items;
+	/* Counters of this process: a shared slab or a private array */
+	struct counter_data *counters;
+	guint counters_items;
+	gboolean private_counters;
+	/* Process that has allocated private counters */
+	pid_t counters_pid;
 };
 
 struct cache_item {
@@ -65,8 +94,11 @@ struct cache_item {
 	guint32 frequency;
 	guint32 avg_counter;
 
-	/* Per process counter */
-	struct counter_data *cd;
+	/* Values loaded from the cache file, counters of workers are added */
+	gdouble saved_time;
+	guint32 saved_frequency;
+	guint32 saved_counter;
+
 	gchar *symbol;
 	enum rspamd_symbol_type type;
 
@@ -164,25 +196,210 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	return 0;
 }
 
+/*
+ * Returns counters of the current process, private counters are used if there
+ * are no shared slabs or the process has not claimed one
+ */
+static inline struct counter_data *
+rspamd_symbols_cache_get_counters (struct symbols_cache *cache)
+{
+	if (G_UNLIKELY (cache->counters == NULL)) {
+		cache->counters_items = cache->used_items;
+		cache->counters = g_malloc0 (sizeof (struct counter_data) *
+				MAX (cache->counters_items, 1));
+		cache->private_counters = TRUE;
+		cache->counters_pid = getpid ();
+	}
+
+	return cache->counters;
+}
+
 /**
  * Set counter for a symbol
  */
 static double
-rspamd_set_counter (struct cache_item *item, guint32 value)
+rspamd_set_counter (struct symbols_cache *cache, struct cache_item *item,
+		guint32 value)
 {
 	struct counter_data *cd;
-	cd = item->cd;
 
-	/* Cumulative moving average using per-process counter data */
-	if (cd->number == 0) {
-		cd->value = 0;
+	cd = rspamd_symbols_cache_get_counters (cache);
+
+	if (G_UNLIKELY (item->id >= (gint)cache->counters_items)) {
+		/* Symbol is registered after counters are allocated */
+		return 0;
 	}
 
+	cd += item->id;
+	/* Cumulative moving average using per-process counter data */
 	cd->value = cd->value + (value - cd->value) / (++cd->number);
 
 	return cd->value;
 }
 
+/*
+ * Allocate slabs for all workers defined in config, must be called before
+ * workers are forked
+ */
+static void
+rspamd_symbols_cache_alloc_slabs (struct symbols_cache *cache)
+{
+	GList *cur;
+	struct rspamd_worker_conf *cf;
+	guint nworkers = 0;
+	guchar *p;
+
+	if (cache->slabs != NULL || cache->used_items == 0) {
+		return;
+	}
+
+	for (cur = cache->cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+
+		if (cf->worker != NULL && (cf->worker->unique || cf->worker->threaded)) {
+			nworkers ++;
+		}
+		else {
+			nworkers += cf->count;
+		}
+	}
+
+	cache->nslabs = nworkers + COUNTERS_SPARE_SLABS;
+	cache->slab_size = COUNTERS_ALIGN + sizeof (struct counter_data) *
+			cache->used_items;
+	cache->slab_size = (cache->slab_size + COUNTERS_ALIGN - 1) &
+			~(COUNTERS_ALIGN - 1);
+	cache->slab_items = (cache->slab_size - COUNTERS_ALIGN) /
+			sizeof (struct counter_data);
+	p = rspamd_mempool_alloc0_shared (cache->static_pool,
+			cache->slab_size * cache->nslabs + COUNTERS_ALIGN);
+	cache->slabs = (guchar *)(((guintptr)p + COUNTERS_ALIGN - 1) &
+			~((guintptr)COUNTERS_ALIGN - 1));
+}
+
+/*
+ * Add private counters to the counters of a slab
+ */
+static void
+rspamd_symbols_cache_merge_counters (struct counter_data *dst, guint nitems,
+		const struct counter_data *src)
+{
+	guint i, total;
+
+	for (i = 0; i < nitems; i ++) {
+		total = dst[i].number + src[i].number;
+
+		if (total > 0) {
+			dst[i].value = (dst[i].value * dst[i].number +
+					src[i].value * src[i].number) / total;
+		}
+
+		dst[i].number = total;
+		dst[i].frequency += src[i].frequency;
+	}
+}
+
+/*
+ * Take a slab that is free or owned by a dead process
+ */
+static void
+rspamd_symbols_cache_claim_slab (struct symbols_cache *cache)
+{
+	struct counters_slab_hdr *hdr;
+	gint pid, owner;
+	guint i;
+
+	if (cache->slabs == NULL || (cache->counters && !cache->private_counters)) {
+		return;
+	}
+
+	pid = getpid ();
+
+	for (i = 0; i < cache->nslabs; i ++) {
+		hdr = (struct counters_slab_hdr *)(cache->slabs + i * cache->slab_size);
+		owner = g_atomic_int_get (&hdr->pid);
+
+		if (owner == 0 || (kill (owner, 0) == -1 && errno == ESRCH)) {
+			if (g_atomic_int_compare_and_exchange (&hdr->pid, owner, pid)) {
+				if (cache->private_counters) {
+					/*
+					 * Keep values counted before the slab was claimed, but
+					 * not those inherited from the parent process
+					 */
+					if (cache->counters_pid == pid) {
+						rspamd_symbols_cache_merge_counters (
+								COUNTERS_SLAB_DATA (hdr),
+								MIN (cache->slab_items, cache->counters_items),
+								cache->counters);
+					}
+
+					g_free (cache->counters);
+					cache->private_counters = FALSE;
+				}
+
+				cache->counters = COUNTERS_SLAB_DATA (hdr);
+				cache->counters_items = cache->slab_items;
+				return;
+			}
+		}
+	}
+
+	msg_warn ("no free slab of symbols counters for process %P, its "
+			"statistics are not shared", pid);
+}
+
+/*
+ * Sum saved values and counters of all processes
+ */
+static void
+rspamd_symbols_cache_aggregate (struct symbols_cache *cache)
+{
+	struct cache_item *item, *parent;
+	struct counter_data *cd;
+	guint i, j;
+	guint64 freq, cnt;
+	gdouble tm;
+
+	cache->total_freq = 1;
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+		freq = item->saved_frequency;
+		cnt = item->saved_counter;
+		tm = item->saved_time * cnt;
+
+		for (j = 0; j < cache->nslabs && i < cache->slab_items; j ++) {
+			cd = &COUNTERS_SLAB_DATA (cache->slabs + j * cache->slab_size)[i];
+			freq += cd->frequency;
+			cnt += cd->number;
+			tm += cd->value * cd->number;
+		}
+
+		if (cache->private_counters && i < cache->counters_items) {
+			cd = &cache->counters[i];
+			freq += cd->frequency;
+			cnt += cd->number;
+			tm += cd->value * cd->number;
+		}
+
+		item->frequency = freq;
+		item->avg_counter = cnt;
+		item->avg_time = cnt > 0 ? tm / cnt : 0;
+		cache->total_freq += freq;
+	}
+
+	/* Sync virtual symbols */
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->parent != -1) {
+			parent = g_ptr_array_index (cache->items_by_id, item->parent);
+			item->avg_time = parent->avg_time;
+			item->avg_counter = parent->avg_counter;
+		}
+	}
+}
+
 /* Sort items in logical order */
 static void
 post_cache_init (struct symbols_cache *cache)
@@ -234,6 +451,7 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 	struct cache_item *item, *parent;
 	const guchar *p;
 	gint fd;
+	guint i;
 	gpointer map;
 	double w;
 
@@ -358,6 +576,13 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 	ucl_object_iterate_free (it);
 	ucl_object_unref (top);
 
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+		item->saved_time = item->avg_time;
+		item->saved_counter = item->avg_counter;
+		item->saved_frequency = item->frequency;
+	}
+
 	return TRUE;
 }
 
@@ -393,6 +618,7 @@ rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 		return FALSE;
 	}
 
+	rspamd_symbols_cache_aggregate (cache);
 	top = ucl_object_typed_new (UCL_OBJECT);
 	g_hash_table_iter_init (&it, cache->items_by_symbol);
 
@@ -450,12 +676,6 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 
 	item = rspamd_mempool_alloc0_shared (cache->static_pool,
 			sizeof (struct cache_item));
-	/*
-	 * We do not share cd to skip locking, instead we'll just calculate it on
-	 * save or accumulate
-	 */
-	item->cd = rspamd_mempool_alloc0 (cache->static_pool,
-			sizeof (struct counter_data));
 
 	if (name != NULL) {
 		item->symbol = rspamd_mempool_strdup (cache->static_pool, name);
@@ -476,7 +696,6 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 	item->parent = parent;
 	cache->used_items ++;
 	msg_debug ("used items: %d, added symbol: %s", cache->used_items, name);
-	rspamd_set_counter (item, 0);
 	g_ptr_array_add (cache->items_by_id, item);
 	g_ptr_array_add (cache->items_by_order, item);
 	item->deps = g_ptr_array_new ();
@@ -571,6 +790,10 @@ rspamd_symbols_cache_destroy (struct symbols_cache *cache)
 			}
 		}
 
+		if (cache->private_counters) {
+			g_free (cache->counters);
+		}
+
 		g_hash_table_destroy (cache->items_by_symbol);
 		rspamd_mempool_delete (cache->static_pool);
 		g_ptr_array_free (cache->items_by_id, TRUE);
@@ -591,7 +814,6 @@ rspamd_symbols_cache_new (void)
 			rspamd_str_equal);
 	cache->items_by_order = g_ptr_array_new ();
 	cache->items_by_id = g_ptr_array_new ();
-	cache->mtx = rspamd_mempool_get_mutex (cache->static_pool);
 	cache->reload_time = CACHE_RELOAD_TIME;
 	cache->total_freq = 1;
 	cache->max_weight = 1.0;
@@ -611,11 +833,13 @@ rspamd_symbols_cache_init (struct symbols_cache* cache,
 	/* Just in-memory cache */
 	if (cfg->cache_filename == NULL) {
 		post_cache_init (cache);
+		rspamd_symbols_cache_alloc_slabs (cache);
 		return TRUE;
 	}
 
 	/* Copy saved cache entries */
 	res = rspamd_symbols_cache_load_items (cache, cfg->cache_filename);
+	rspamd_symbols_cache_alloc_slabs (cache);
 
 	return res;
 }
@@ -928,7 +1152,7 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 
 		t2 = rspamd_get_ticks ();
 		diff = (t2 - t1) * 1000000;
-		rspamd_set_counter (item, diff);
+		rspamd_set_counter (cache, item, diff);
 		rspamd_session_watch_stop (task->s);
 		pending_after = rspamd_session_events_pending (task->s);
 
@@ -1139,6 +1363,7 @@ rspamd_symbols_cache_counters (struct symbols_cache * cache)
 	struct counters_cbdata cbd;
 
 	g_assert (cache != NULL);
+	rspamd_symbols_cache_aggregate (cache);
 	top = ucl_object_typed_new (UCL_ARRAY);
 	cbd.top = top;
 	cbd.cache = cache;
@@ -1154,8 +1379,6 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 	struct timeval tv;
 	gdouble tm;
 	struct symbols_cache *cache = ud;
-	struct cache_item *item, *parent;
-	guint i;
 
 	/* Plan new event */
 	tm = rspamd_time_jitter (cache->reload_time, 0);
@@ -1165,34 +1388,8 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 	double_to_tv (tm, &tv);
 	event_add (&cache->resort_ev, &tv);
 
-	rspamd_mempool_lock_mutex (cache->mtx);
-
-	/* Gather stats from shared execution times */
-	for (i = 0; i < cache->items_by_order->len; i ++) {
-		item = g_ptr_array_index (cache->items_by_order, i);
-
-		if (item->type == SYMBOL_TYPE_CALLBACK ||
-				item->type == SYMBOL_TYPE_NORMAL) {
-			if (item->cd->number > 0) {
-				item->avg_counter += item->cd->number + 1;
-				item->avg_time = item->avg_time +
-						(item->cd->value - item->avg_time) /
-						item->avg_counter;
-				item->cd->value = item->avg_time;
-				item->cd->number = item->avg_counter;
-			}
-		}
-	}
-	/* Sync virtual symbols */
-	for (i = 0; i < cache->items_by_id->len; i ++) {
-		if (item->parent != -1) {
-			parent = g_ptr_array_index (cache->items_by_id, item->parent);
-			item->avg_time = parent->avg_time;
-			item->avg_counter = parent->avg_counter;
-		}
-	}
-
-	rspamd_mempool_unlock_mutex (cache->mtx);
+	/* Gather stats from counters of all workers */
+	rspamd_symbols_cache_aggregate (cache);
 
 	g_ptr_array_sort_with_data (cache->items_by_order, cache_logic_cmp, cache);
 }
@@ -1206,33 +1403,68 @@ rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 
 	tm = rspamd_time_jitter (cache->reload_time, 0);
 	g_assert (cache != NULL);
+	rspamd_symbols_cache_claim_slab (cache);
 	evtimer_set (&cache->resort_ev, rspamd_symbols_cache_resort_cb, cache);
 	event_base_set (ev_base, &cache->resort_ev);
 	double_to_tv (tm, &tv);
 	event_add (&cache->resort_ev, &tv);
 }
 
+void
+rspamd_symbols_cache_inc_frequency_id (struct symbols_cache *cache, gint id)
+{
+	struct cache_item *item;
+	struct counter_data *cd;
+
+	g_assert (cache != NULL);
+
+	if (id < 0 || id >= (gint)cache->items_by_id->len) {
+		return;
+	}
+
+	cd = rspamd_symbols_cache_get_counters (cache);
+
+	if (id < (gint)cache->counters_items) {
+		/* Only this process writes to its counters */
+		cd[id].frequency ++;
+		item = g_ptr_array_index (cache->items_by_id, id);
+
+		/* For virtual symbols we also increase counter for parent */
+		if (item->parent != -1 && item->parent < (gint)cache->counters_items) {
+			cd[item->parent].frequency ++;
+		}
+	}
+}
+
 void
 rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 		const gchar *symbol)
 {
-	struct cache_item *item, *parent;
+	struct cache_item *item;
 
 	g_assert (cache != NULL);
 
 	item = g_hash_table_lookup (cache->items_by_symbol, symbol);
 
 	if (item != NULL) {
-		/* We assume ++ as atomic op */
-		item->frequency ++;
-		cache->total_freq ++;
+		rspamd_symbols_cache_inc_frequency_id (cache, item->id);
+	}
+}
 
-		/* For virtual symbols we also increase counter for parent */
-		if (item->parent != -1) {
-			parent = g_ptr_array_index (cache->items_by_id, item->parent);
-			parent->frequency ++;
-		}
+const gchar *
+rspamd_symbols_cache_symbol_by_id (struct symbols_cache *cache, gint id)
+{
+	struct cache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (id < 0 || id >= (gint)cache->items_by_id->len) {
+		return NULL;
 	}
+
+	item = g_ptr_array_index (cache->items_by_id, id);
+
+	return item->symbol;
 }
 
 void
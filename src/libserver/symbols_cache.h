@@ -172,6 +172,24 @@ void rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 void rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 		const gchar *symbol);
 
+/**
+ * Increases counter for a symbol specified by its id, this function does not
+ * look up symbol by name and writes only counters owned by the current process
+ * @param cache
+ * @param id id of symbol returned on its registration
+ */
+void rspamd_symbols_cache_inc_frequency_id (struct symbols_cache *cache,
+		gint id);
+
+/**
+ * Returns name of symbol by its id
+ * @param cache
+ * @param id
+ * @return symbol name or NULL if there is no such symbol or it is a callback
+ */
+const gchar * rspamd_symbols_cache_symbol_by_id (struct symbols_cache *cache,
+		gint id);
+
 /**
  * Add dependency relation between two symbols identified by id (source) and
  * a symbolic name (destination). Destination could be virtual or real symbol.
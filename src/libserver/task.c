@@ -316,6 +316,68 @@ rspamd_task_select_processing_stage (struct rspamd_task *task, guint stages)
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+/*
+ * Message parsing could be offloaded to a CPU thread: the task waits for it
+ * as for any other async event and the stage is marked as done when the thread
+ * finishes its job. Lines logged while parsing are written by the event loop
+ * when the job is finished
+ */
+struct rspamd_task_offload {
+	struct rspamd_task *task;
+	struct rspamd_thread_pool_job *job;
+	gboolean res;
+};
+
+static void
+rspamd_task_offload_parse (gpointer ud)
+{
+	struct rspamd_task_offload *off = ud;
+
+	off->res = rspamd_message_parse (off->task);
+}
+
+static void
+rspamd_task_offload_event_fin (gpointer ud)
+{
+	struct rspamd_task_offload *off = ud;
+
+	if (off->job != NULL) {
+		/* Session is destroyed while a thread still uses the task */
+		rspamd_thread_pool_job_wait (off->task->cpu_pool, off->job);
+		off->job = NULL;
+	}
+}
+
+static void
+rspamd_task_offload_fin (gpointer ud)
+{
+	struct rspamd_task_offload *off = ud;
+	struct rspamd_task *task = off->task;
+
+	off->job = NULL;
+	task->processed_stages |= RSPAMD_TASK_STAGE_READ_MESSAGE;
+
+	if (!off->res) {
+		/* Reply with an error */
+		task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
+	}
+
+	rspamd_session_remove_event (task->s, rspamd_task_offload_event_fin, off);
+}
+
+static void
+rspamd_task_offload_message_parse (struct rspamd_task *task)
+{
+	struct rspamd_task_offload *off;
+
+	off = rspamd_mempool_alloc0 (task->task_pool, sizeof (*off));
+	off->task = task;
+	rspamd_session_add_event (task->s, rspamd_task_offload_event_fin, off,
+			g_quark_from_static_string ("task"));
+	off->job = rspamd_thread_pool_push (task->cpu_pool,
+			rspamd_task_offload_parse, rspamd_task_offload_fin, off);
+}
+
 static gboolean
 rspamd_process_filters (struct rspamd_task *task)
 {
@@ -345,7 +407,10 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 
 	switch (st) {
 	case RSPAMD_TASK_STAGE_READ_MESSAGE:
-		if (!rspamd_message_parse (task)) {
+		if (task->cpu_pool != NULL && task->s != NULL) {
+			rspamd_task_offload_message_parse (task);
+		}
+		else if (!rspamd_message_parse (task)) {
 			ret = FALSE;
 		}
 		break;
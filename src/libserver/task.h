@@ -29,6 +29,7 @@
 #include "util.h"
 #include "mem_pool.h"
 #include "dns.h"
+#include "thread_pool.h"
 
 enum rspamd_command {
 	CMD_CHECK,
@@ -168,6 +169,7 @@ struct rspamd_task {
 
 	struct rspamd_dns_resolver *resolver;                       /**< DNS resolver									*/
 	struct event_base *ev_base;                                 /**< Event base										*/
+	struct rspamd_thread_pool *cpu_pool;                        /**< Threads for CPU bound stages (if any)			*/
 
 	gpointer checkpoint;										/**< Opaque checkpoint data						*/
 
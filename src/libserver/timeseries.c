@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "timeseries.h"
+#include "filter.h"
+#include "cfg_file.h"
+
+struct rspamd_ts_level {
+	guint step;
+	guint nslots;
+};
+
+/* 10 seconds for an hour, a minute for a day and 15 minutes for a week */
+static const struct rspamd_ts_level ts_levels[] = {
+	{10, 360},
+	{60, 1440},
+	{900, 672}
+};
+
+#define RSPAMD_TS_LEVELS G_N_ELEMENTS (ts_levels)
+/* Symbols are not stored with the finest resolution to save memory */
+#define RSPAMD_TS_LEVELS_ALL ((1 << RSPAMD_TS_LEVELS) - 1)
+#define RSPAMD_TS_LEVELS_COARSE (RSPAMD_TS_LEVELS_ALL & ~1)
+#define RSPAMD_TS_BACKEND_LEN 48
+#define RSPAMD_TS_LATENCY_PREFIX "latency:"
+/* The first bucket is for latencies less than 2^RSPAMD_TS_BUCKET_SHIFT usec */
+#define RSPAMD_TS_BUCKET_SHIFT 8
+
+struct rspamd_ts_backend {
+	/* 0 - free, 1 - being initialized, 2 - ready */
+	volatile gint state;
+	gchar name[RSPAMD_TS_BACKEND_LEN];
+};
+
+struct rspamd_ts_series {
+	gchar *name;
+	enum rspamd_ts_series_type type;
+	guint ncols;
+	guint levels;
+	/* Columns of values: data[level][col * nslots + slot] */
+	volatile guint32 *data[RSPAMD_TS_LEVELS];
+};
+
+struct rspamd_ts_store {
+	GPtrArray *series;
+	GHashTable *by_name;
+	struct rspamd_ts_series *actions[METRIC_ACTION_MAX];
+	struct rspamd_ts_series *scan_time;
+	struct rspamd_ts_series *backends[RSPAMD_TS_MAX_BACKENDS];
+	struct rspamd_ts_backend *backend_names;
+	/* Interval number stored in each slot of a level */
+	volatile guint32 *epochs[RSPAMD_TS_LEVELS];
+};
+
+static struct rspamd_ts_series *
+rspamd_ts_series_new (struct rspamd_ts_store *store, gchar *name,
+		enum rspamd_ts_series_type type, guint levels, gsize *len)
+{
+	struct rspamd_ts_series *s;
+	guint i;
+
+	s = g_slice_alloc0 (sizeof (*s));
+	s->name = name;
+	s->type = type;
+	s->ncols = type == RSPAMD_TS_HISTOGRAM ? RSPAMD_TS_BUCKETS : 1;
+	s->levels = levels;
+
+	/* Offsets are converted to pointers when shared memory is allocated */
+	for (i = 0; i < RSPAMD_TS_LEVELS; i ++) {
+		if (levels & (1 << i)) {
+			s->data[i] = (volatile guint32 *)(guintptr)*len;
+			*len += sizeof (guint32) * s->ncols * ts_levels[i].nslots;
+		}
+	}
+
+	g_ptr_array_add (store->series, s);
+
+	if (name != NULL) {
+		g_hash_table_insert (store->by_name, name, s);
+	}
+
+	return s;
+}
+
+static void
+rspamd_ts_store_dtor (gpointer p)
+{
+	struct rspamd_ts_store *store = p;
+	struct rspamd_ts_series *s;
+	guint i;
+
+	for (i = 0; i < store->series->len; i ++) {
+		s = g_ptr_array_index (store->series, i);
+		g_free (s->name);
+		g_slice_free1 (sizeof (*s), s);
+	}
+
+	g_ptr_array_free (store->series, TRUE);
+	g_hash_table_unref (store->by_name);
+}
+
+struct rspamd_ts_new_cbdata {
+	struct rspamd_ts_store *store;
+	gsize *len;
+};
+
+static void
+rspamd_ts_add_symbol_series (gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_ts_new_cbdata *cbd = ud;
+
+	rspamd_ts_series_new (cbd->store, g_strconcat ("symbol:", key, NULL),
+			RSPAMD_TS_COUNTER, RSPAMD_TS_LEVELS_COARSE, cbd->len);
+}
+
+struct rspamd_ts_store *
+rspamd_ts_store_new (rspamd_mempool_t *pool, struct rspamd_config *cfg)
+{
+	struct rspamd_ts_store *store;
+	struct rspamd_ts_series *s;
+	struct rspamd_ts_new_cbdata cbd;
+	gsize len = 0, epochs_len = 0;
+	guchar *map;
+	guint i, j;
+
+	store = rspamd_mempool_alloc0 (pool, sizeof (*store));
+	store->series = g_ptr_array_new ();
+	store->by_name = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+
+	for (i = 0; i < RSPAMD_TS_LEVELS; i ++) {
+		epochs_len += sizeof (guint32) * ts_levels[i].nslots;
+	}
+
+	len = epochs_len + sizeof (struct rspamd_ts_backend) * RSPAMD_TS_MAX_BACKENDS;
+
+	for (i = 0; i < METRIC_ACTION_MAX; i ++) {
+		store->actions[i] = rspamd_ts_series_new (store,
+				g_strconcat ("action:", rspamd_action_to_str (i), NULL),
+				RSPAMD_TS_COUNTER, RSPAMD_TS_LEVELS_ALL, &len);
+	}
+
+	store->scan_time = rspamd_ts_series_new (store, g_strdup ("scan_time"),
+			RSPAMD_TS_HISTOGRAM, RSPAMD_TS_LEVELS_ALL, &len);
+
+	for (i = 0; i < RSPAMD_TS_MAX_BACKENDS; i ++) {
+		/* Names are assigned in shared memory when backends are used */
+		store->backends[i] = rspamd_ts_series_new (store, NULL,
+				RSPAMD_TS_HISTOGRAM, RSPAMD_TS_LEVELS_ALL, &len);
+	}
+
+	if (cfg != NULL) {
+		cbd.store = store;
+		cbd.len = &len;
+		g_hash_table_foreach (cfg->metrics_symbols, rspamd_ts_add_symbol_series,
+				&cbd);
+	}
+
+	map = rspamd_mempool_alloc0_shared (pool, len);
+
+	for (i = 0, len = 0; i < RSPAMD_TS_LEVELS; i ++) {
+		store->epochs[i] = (volatile guint32 *)(map + len);
+		len += sizeof (guint32) * ts_levels[i].nslots;
+	}
+
+	store->backend_names = (struct rspamd_ts_backend *)(map + len);
+
+	for (i = 0; i < store->series->len; i ++) {
+		s = g_ptr_array_index (store->series, i);
+
+		for (j = 0; j < RSPAMD_TS_LEVELS; j ++) {
+			if (s->levels & (1 << j)) {
+				s->data[j] = (volatile guint32 *)(map + (guintptr)s->data[j]);
+			}
+		}
+	}
+
+	rspamd_mempool_add_destructor (pool, rspamd_ts_store_dtor, store);
+
+	return store;
+}
+
+/*
+ * Returns slot for the specified time in a level, if the slot contains an
+ * older interval, then it is reset for all series
+ */
+static gint
+rspamd_ts_slot (struct rspamd_ts_store *store, guint level, time_t t)
+{
+	guint32 epoch, old;
+	guint slot, i, j, nslots = ts_levels[level].nslots;
+	struct rspamd_ts_series *s;
+
+	epoch = t / ts_levels[level].step;
+	slot = epoch % nslots;
+	old = g_atomic_int_get ((volatile gint *)&store->epochs[level][slot]);
+
+	if (old == epoch) {
+		return slot;
+	}
+	else if (old > epoch) {
+		/* Too old time */
+		return -1;
+	}
+
+	if (g_atomic_int_compare_and_exchange (
+			(volatile gint *)&store->epochs[level][slot], old, epoch)) {
+		/*
+		 * We are the first to use this slot for a new interval. Values added
+		 * by other workers before we reset them are lost, which is tolerable
+		 * for statistics.
+		 */
+		for (i = 0; i < store->series->len; i ++) {
+			s = g_ptr_array_index (store->series, i);
+
+			if (s->data[level] != NULL) {
+				for (j = 0; j < s->ncols; j ++) {
+					s->data[level][j * nslots + slot] = 0;
+				}
+			}
+		}
+	}
+
+	return slot;
+}
+
+static void
+rspamd_ts_series_add (struct rspamd_ts_series *s, const gint *slots,
+		guint col, guint value)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_TS_LEVELS; i ++) {
+		if (s->data[i] != NULL && slots[i] != -1) {
+			g_atomic_int_add ((volatile gint *)&s->data[i][col *
+					ts_levels[i].nslots + slots[i]], value);
+		}
+	}
+}
+
+static void
+rspamd_ts_get_slots (struct rspamd_ts_store *store, time_t t, gint *slots)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_TS_LEVELS; i ++) {
+		slots[i] = rspamd_ts_slot (store, i, t);
+	}
+}
+
+static guint
+rspamd_ts_bucket (gdouble latency)
+{
+	guint64 usec;
+	guint bucket = 0;
+
+	usec = latency > 0 ? latency * 1e6 : 0;
+	usec >>= RSPAMD_TS_BUCKET_SHIFT;
+
+	while (usec > 0 && bucket < RSPAMD_TS_BUCKETS - 1) {
+		usec >>= 1;
+		bucket ++;
+	}
+
+	return bucket;
+}
+
+void
+rspamd_ts_record_task (struct rspamd_ts_store *store, struct rspamd_task *task)
+{
+	struct metric_result *metric_res;
+	struct rspamd_ts_series *s;
+	GHashTableIter it;
+	gpointer k, v;
+	gint slots[RSPAMD_TS_LEVELS], action = METRIC_ACTION_NOACTION;
+	gchar namebuf[128];
+
+	if (store == NULL) {
+		return;
+	}
+
+	rspamd_ts_get_slots (store, time (NULL), slots);
+	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	if (metric_res != NULL) {
+		action = rspamd_check_action_metric (task, metric_res->score, NULL,
+				metric_res->metric);
+		g_hash_table_iter_init (&it, metric_res->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			rspamd_snprintf (namebuf, sizeof (namebuf), "symbol:%s", k);
+
+			if ((s = g_hash_table_lookup (store->by_name, namebuf)) != NULL) {
+				rspamd_ts_series_add (s, slots, 0, 1);
+			}
+		}
+	}
+
+	if (action >= 0 && action < METRIC_ACTION_MAX) {
+		rspamd_ts_series_add (store->actions[action], slots, 0, 1);
+	}
+
+	rspamd_ts_series_add (store->scan_time, slots,
+			rspamd_ts_bucket (rspamd_get_ticks () - task->time_real), 1);
+}
+
+gboolean
+rspamd_ts_add_counter (struct rspamd_ts_store *store, const gchar *name,
+		guint value)
+{
+	struct rspamd_ts_series *s;
+	gint slots[RSPAMD_TS_LEVELS];
+
+	if (store == NULL ||
+			(s = g_hash_table_lookup (store->by_name, name)) == NULL ||
+			s->type != RSPAMD_TS_COUNTER) {
+		return FALSE;
+	}
+
+	rspamd_ts_get_slots (store, time (NULL), slots);
+	rspamd_ts_series_add (s, slots, 0, value);
+
+	return TRUE;
+}
+
+static struct rspamd_ts_series *
+rspamd_ts_find_backend (struct rspamd_ts_store *store, const gchar *name,
+		gboolean create)
+{
+	struct rspamd_ts_backend *b;
+	guint i;
+
+	for (i = 0; i < RSPAMD_TS_MAX_BACKENDS; i ++) {
+		b = &store->backend_names[i];
+
+		if (g_atomic_int_get (&b->state) == 2) {
+			if (strcmp (b->name, name) == 0) {
+				return store->backends[i];
+			}
+		}
+		else if (create && g_atomic_int_compare_and_exchange (&b->state, 0, 1)) {
+			rspamd_strlcpy (b->name, name, sizeof (b->name));
+			g_atomic_int_set (&b->state, 2);
+
+			return store->backends[i];
+		}
+	}
+
+	return NULL;
+}
+
+void
+rspamd_ts_add_latency (struct rspamd_ts_store *store, const gchar *backend,
+		gdouble latency)
+{
+	struct rspamd_ts_series *s;
+	gint slots[RSPAMD_TS_LEVELS];
+	gchar name[RSPAMD_TS_BACKEND_LEN];
+
+	if (store == NULL) {
+		return;
+	}
+
+	rspamd_snprintf (name, sizeof (name), RSPAMD_TS_LATENCY_PREFIX "%s",
+			backend);
+
+	if ((s = rspamd_ts_find_backend (store, name, TRUE)) != NULL) {
+		rspamd_ts_get_slots (store, time (NULL), slots);
+		rspamd_ts_series_add (s, slots, rspamd_ts_bucket (latency), 1);
+	}
+}
+
+gboolean
+rspamd_ts_query (struct rspamd_ts_store *store, const gchar *name,
+		time_t from, time_t to, guint *step, enum rspamd_ts_series_type *type,
+		rspamd_ts_query_cb cb, gpointer ud)
+{
+	struct rspamd_ts_series *s;
+	guint32 values[RSPAMD_TS_BUCKETS], epoch, first, last;
+	guint level, slot, i, nslots;
+	time_t now = time (NULL);
+
+	if ((s = g_hash_table_lookup (store->by_name, name)) == NULL &&
+			(s = rspamd_ts_find_backend (store, name, FALSE)) == NULL) {
+		return FALSE;
+	}
+
+	if (to > now || to <= 0) {
+		to = now;
+	}
+
+	/* Select the finest level that covers the range */
+	for (level = 0; level < RSPAMD_TS_LEVELS; level ++) {
+		if (s->data[level] != NULL &&
+				now - from < (time_t)(ts_levels[level].step *
+						ts_levels[level].nslots)) {
+			break;
+		}
+	}
+
+	if (level == RSPAMD_TS_LEVELS) {
+		/* Use the coarsest level */
+		level = RSPAMD_TS_LEVELS - 1;
+	}
+
+	nslots = ts_levels[level].nslots;
+	*step = ts_levels[level].step;
+	*type = s->type;
+	last = to / *step;
+	first = from > 0 ? from / *step : 0;
+
+	if (first > last) {
+		return TRUE;
+	}
+
+	if (last - first >= nslots) {
+		first = last - nslots + 1;
+	}
+
+	for (epoch = first; epoch <= last; epoch ++) {
+		slot = epoch % nslots;
+
+		if (g_atomic_int_get ((volatile gint *)&store->epochs[level][slot]) !=
+				(gint)epoch) {
+			/* No data for this interval */
+			continue;
+		}
+
+		for (i = 0; i < s->ncols; i ++) {
+			values[i] = s->data[level][i * nslots + slot];
+		}
+
+		cb ((time_t)epoch * *step, values, s->ncols, ud);
+	}
+
+	return TRUE;
+}
+
+GList *
+rspamd_ts_series_names (struct rspamd_ts_store *store)
+{
+	GList *res = NULL;
+	struct rspamd_ts_series *s;
+	guint i;
+
+	for (i = 0; i < store->series->len; i ++) {
+		s = g_ptr_array_index (store->series, i);
+
+		if (s->name != NULL) {
+			res = g_list_prepend (res, s->name);
+		}
+	}
+
+	for (i = 0; i < RSPAMD_TS_MAX_BACKENDS; i ++) {
+		if (g_atomic_int_get (&store->backend_names[i].state) == 2) {
+			res = g_list_prepend (res, store->backend_names[i].name);
+		}
+	}
+
+	return g_list_reverse (res);
+}
+
+gdouble
+rspamd_ts_percentile (const guint32 *buckets, gdouble p)
+{
+	guint64 total = 0, cur = 0, target;
+	guint i;
+	gdouble lo, hi;
+
+	for (i = 0; i < RSPAMD_TS_BUCKETS; i ++) {
+		total += buckets[i];
+	}
+
+	if (total == 0) {
+		return 0.0;
+	}
+
+	target = MAX (1, (guint64)(p * total + 0.5));
+	target = MIN (target, total);
+
+	for (i = 0; i < RSPAMD_TS_BUCKETS; i ++) {
+		if (cur + buckets[i] >= target) {
+			break;
+		}
+
+		cur += buckets[i];
+	}
+
+	if (i == RSPAMD_TS_BUCKETS) {
+		i = RSPAMD_TS_BUCKETS - 1;
+	}
+
+	/* Interpolate inside bucket, bounds are in microseconds */
+	lo = i == 0 ? 0.0 : (gdouble)(1ULL << (RSPAMD_TS_BUCKET_SHIFT + i - 1));
+	hi = (gdouble)(1ULL << (RSPAMD_TS_BUCKET_SHIFT + i));
+
+	return (lo + (hi - lo) * (gdouble)(target - cur) / buckets[i]) / 1000.0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SRC_LIBSERVER_TIMESERIES_H_
+#define SRC_LIBSERVER_TIMESERIES_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Time series store keeps counters for fixed time intervals in shared memory.
+ * Each series is stored with several resolutions (levels), each level is a
+ * ring of intervals and values of a series are stored in columns (one column
+ * per counter), so range queries read contiguous memory. Timestamps are not
+ * stored but derived from interval numbers that are shared by all series of
+ * a level. Workers update counters atomically without locking.
+ */
+
+/* Number of logarithmic latency buckets in histogram series */
+#define RSPAMD_TS_BUCKETS 16
+/* Maximum number of backends with latency series */
+#define RSPAMD_TS_MAX_BACKENDS 8
+
+enum rspamd_ts_series_type {
+	RSPAMD_TS_COUNTER = 0,
+	RSPAMD_TS_HISTOGRAM
+};
+
+struct rspamd_ts_store;
+struct rspamd_task;
+struct rspamd_config;
+
+/**
+ * Callback for a range query
+ * @param ts start of interval
+ * @param values counters for this interval (1 value for counters and
+ * RSPAMD_TS_BUCKETS values for histograms)
+ * @param nvalues number of values
+ * @param ud opaque data
+ */
+typedef void (*rspamd_ts_query_cb) (time_t ts, const guint32 *values,
+		guint nvalues, gpointer ud);
+
+/**
+ * Create new time series store in shared memory with series for actions,
+ * scan time, symbols defined in config and backends latencies
+ * @param pool pool for shared memory
+ * @param cfg config
+ * @return new store
+ */
+struct rspamd_ts_store * rspamd_ts_store_new (rspamd_mempool_t *pool,
+		struct rspamd_config *cfg);
+
+/**
+ * Record the results of a task: action, scan time and symbols
+ * @param store store
+ * @param task task
+ */
+void rspamd_ts_record_task (struct rspamd_ts_store *store,
+		struct rspamd_task *task);
+
+/**
+ * Add a value to a counter series
+ * @param store store
+ * @param name name of series
+ * @param value value to add
+ * @return FALSE if there is no such series
+ */
+gboolean rspamd_ts_add_counter (struct rspamd_ts_store *store,
+		const gchar *name, guint value);
+
+/**
+ * Add latency of a backend, series for a backend is created on the first use
+ * @param store store
+ * @param backend name of backend
+ * @param latency latency in seconds
+ */
+void rspamd_ts_add_latency (struct rspamd_ts_store *store,
+		const gchar *backend, gdouble latency);
+
+/**
+ * Query series for the specified time range. The finest resolution that
+ * covers the range is used.
+ * @param store store
+ * @param name name of series
+ * @param from start of range
+ * @param to end of range
+ * @param step output for the resolution used
+ * @param type output for the type of series
+ * @param cb callback for each interval with data
+ * @param ud opaque data for callback
+ * @return FALSE if there is no such series
+ */
+gboolean rspamd_ts_query (struct rspamd_ts_store *store, const gchar *name,
+		time_t from, time_t to, guint *step, enum rspamd_ts_series_type *type,
+		rspamd_ts_query_cb cb, gpointer ud);
+
+/**
+ * Returns names of all series
+ * @param store store
+ * @return list of names that should be freed by g_list_free
+ */
+GList * rspamd_ts_series_names (struct rspamd_ts_store *store);
+
+/**
+ * Estimate percentile from histogram buckets
+ * @param buckets RSPAMD_TS_BUCKETS values
+ * @param p percentile (0.0 - 1.0)
+ * @return latency in milliseconds
+ */
+gdouble rspamd_ts_percentile (const guint32 *buckets, gdouble p);
+
+#endif /* SRC_LIBSERVER_TIMESERIES_H_ */
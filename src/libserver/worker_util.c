@@ -49,8 +49,32 @@ rspamd_get_worker_by_type (GQuark type)
 
 sig_atomic_t wanna_die = 0;
 
+static struct event drain_ev;
+
 /*
- * Config reload is designed by sending sigusr2 to active workers and pending shutdown of them
+ * Check whether all connections are finished after stopping accepting
+ */
+static void
+rspamd_worker_drain_cb (gint fd, short what, void *arg)
+{
+	struct rspamd_worker_signal_handler *sigh =
+		(struct rspamd_worker_signal_handler *)arg;
+	struct timeval tv;
+
+	if (sigh->worker->nconns == 0) {
+		msg_info ("all connections are finished, terminating");
+		event_base_loopexit (sigh->base, NULL);
+	}
+	else {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		event_add (&drain_ev, &tv);
+	}
+}
+
+/*
+ * Config reload is designed by sending sigusr2 to active workers and pending shutdown of them,
+ * it is sent when workers with new config are ready to accept
  */
 static void
 rspamd_worker_usr2_handler (gint fd, short what, void *arg)
@@ -61,15 +85,29 @@ rspamd_worker_usr2_handler (gint fd, short what, void *arg)
 	struct timeval tv;
 
 	if (!wanna_die) {
-		tv.tv_sec = SOFT_SHUTDOWN_TIME;
-		tv.tv_usec = 0;
+		double_to_tv (sigh->worker->srv->cfg->reload_drain_time, &tv);
 		wanna_die = 1;
-		msg_info ("worker's shutdown is pending in %d sec", SOFT_SHUTDOWN_TIME);
+		/* Connections that are not finished till this time are terminated */
 		event_base_loopexit (sigh->base, &tv);
 		if (sigh->post_handler) {
 			sigh->post_handler (sigh->handler_data);
 		}
 		rspamd_worker_stop_accept (sigh->worker);
+
+		if (sigh->worker->cf->worker->counts_conns) {
+			msg_info ("worker's shutdown is pending, %ud connections in "
+					"progress, waiting for them at most %.1f sec",
+					sigh->worker->nconns,
+					sigh->worker->srv->cfg->reload_drain_time);
+			evtimer_set (&drain_ev, rspamd_worker_drain_cb, sigh);
+			event_base_set (sigh->base, &drain_ev);
+			rspamd_worker_drain_cb (-1, EV_TIMEOUT, sigh);
+		}
+		else {
+			/* Nothing to check, just wait for the drain time */
+			msg_info ("worker's shutdown is pending in %.1f sec",
+					sigh->worker->srv->cfg->reload_drain_time);
+		}
 	}
 }
 
@@ -180,6 +218,57 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 	sigprocmask (SIG_UNBLOCK, &signals.sa_mask, NULL);
 }
 
+/* Interval of memory usage sampling (seconds) */
+#define MEMORY_STAT_INTERVAL 10
+
+static struct event memory_ev;
+
+void
+rspamd_update_process_memory_stat (struct rspamd_main *rspamd_main)
+{
+	struct rspamd_stat *stat = rspamd_main->stat;
+	pid_t pid = getpid ();
+	gsize priv, shared;
+	guint i;
+
+	for (i = 0; i < RSPAMD_MAX_PROCESSES_STAT; i ++) {
+		if (stat->processes[i].pid == pid) {
+			if (rspamd_get_process_memory (pid, &priv, &shared)) {
+				stat->processes[i].private_mem = priv;
+				stat->processes[i].shared_mem = shared;
+			}
+
+			return;
+		}
+	}
+}
+
+static void
+rspamd_worker_memory_stat_cb (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = arg;
+	struct timeval tv;
+
+	rspamd_update_process_memory_stat (worker->srv);
+
+	tv.tv_sec = MEMORY_STAT_INTERVAL;
+	tv.tv_usec = 0;
+	event_add (&memory_ev, &tv);
+}
+
+/*
+ * Called when the event loop of a worker is started, so it is ready to accept
+ */
+static void
+rspamd_worker_ready_cb (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = arg;
+
+	g_atomic_int_inc (&worker->srv->stat->workers_ready);
+	/* Main process waits for that on reload to stop old workers */
+	kill (getppid (), SIGUSR2);
+}
+
 struct event_base *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	void (*accept_handler)(int, short, void *))
@@ -188,6 +277,8 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	struct event *accept_event;
 	GList *cur;
 	gint listen_socket;
+	static struct event ready_ev;
+	struct timeval tv;
 
 #ifdef WITH_PROFILER
 	extern void _start (void), etext (void);
@@ -220,6 +311,18 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 		cur = g_list_next (cur);
 	}
 
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	evtimer_set (&ready_ev, rspamd_worker_ready_cb, worker);
+	event_base_set (ev_base, &ready_ev);
+	event_add (&ready_ev, &tv);
+
+	/* Main process registers the worker after fork, so give it a second */
+	tv.tv_sec = 1;
+	evtimer_set (&memory_ev, rspamd_worker_memory_stat_cb, worker);
+	event_base_set (ev_base, &memory_ev);
+	event_add (&memory_ev, &tv);
+
 	return ev_base;
 }
 
@@ -41,6 +41,7 @@ typedef void (*rspamd_sig_handler_t) (gint, siginfo_t *, void *);
 #endif
 
 struct rspamd_worker;
+struct rspamd_main;
 
 /**
  * Prepare worker's startup
@@ -54,6 +55,14 @@ struct event_base *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	void (*accept_handler)(int, short, void *));
 
+/**
+ * Store memory usage of the current process in its slot of the shared
+ * statistics. Workers are not dumpable after dropping privileges, so nobody
+ * else can read their smaps.
+ * @param rspamd_main main structure
+ */
+void rspamd_update_process_memory_stat (struct rspamd_main *rspamd_main);
+
 /**
  * Stop accepting new connections for a worker
  * @param worker
@@ -58,6 +58,7 @@ struct rspamd_stat_backend {
 	gulong (*dec_learns)(struct rspamd_task *task,
 			gpointer runtime, gpointer ctx);
 	ucl_object_t* (*get_stat)(gpointer runtime, gpointer ctx);
+	void (*finish_batch)(gpointer ctx);
 	void (*close)(gpointer ctx);
 	gpointer ctx;
 };
@@ -92,6 +93,7 @@ struct rspamd_stat_backend {
 				gpointer ctx); \
 		ucl_object_t * rspamd_##name##_get_stat (gpointer runtime, \
 				gpointer ctx); \
+		void rspamd_##name##_finish_batch (gpointer ctx); \
 		void rspamd_##name##_close (gpointer ctx)
 
 RSPAMD_STAT_BACKEND_DEF(mmaped_file);
@@ -1089,3 +1089,26 @@ rspamd_mmaped_file_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		msync (mf->map, mf->len, MS_INVALIDATE | MS_ASYNC);
 	}
 }
+
+void
+rspamd_mmaped_file_finish_batch (gpointer p)
+{
+	rspamd_mmaped_file_ctx *ctx = (rspamd_mmaped_file_ctx *)p;
+	GHashTableIter it;
+	gpointer k, v;
+	rspamd_mmaped_file_t *mf;
+
+	rspamd_mempool_lock_mutex (ctx->lock);
+	g_hash_table_iter_init (&it, ctx->files);
+
+	/* Sync files once per batch instead of syncing them after each learn */
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		mf = v;
+
+		if (mf->map != NULL) {
+			msync (mf->map, mf->len, MS_INVALIDATE | MS_ASYNC);
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (ctx->lock);
+}
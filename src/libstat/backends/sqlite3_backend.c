@@ -596,6 +596,27 @@ rspamd_sqlite3_finalize_learn (struct rspamd_task *task, gpointer runtime,
 	return;
 }
 
+void
+rspamd_sqlite3_finish_batch (gpointer p)
+{
+	struct rspamd_stat_sqlite3_ctx *ctx = p;
+	struct rspamd_stat_sqlite3_db *bk;
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, ctx->files);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		bk = v;
+
+		/* All learns of a batch are written in a single transaction */
+		if (bk->sqlite && bk->in_transaction) {
+			rspamd_sqlite3_run_prstmt (bk, RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
+			bk->in_transaction = FALSE;
+		}
+	}
+}
+
 gulong
 rspamd_sqlite3_total_learns (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
@@ -83,6 +83,17 @@ rspamd_stat_result_t rspamd_stat_learn (struct rspamd_task *task,
 ucl_object_t * rspamd_stat_statistics (struct rspamd_config *cfg,
 		guint64 *total_learns);
 
+/**
+ * Start a batch of learns: backends that support batching do not commit
+ * learned tokens until the batch is finished
+ */
+void rspamd_stat_learn_batch_start (void);
+
+/**
+ * Finish a batch of learns and commit all changes made in it
+ */
+void rspamd_stat_learn_batch_finish (void);
+
 void rspamd_stat_unload (void);
 
 #endif /* STAT_API_H_ */
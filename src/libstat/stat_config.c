@@ -66,6 +66,7 @@ static struct rspamd_stat_tokenizer stat_tokenizers[] = {
 		.inc_learns = rspamd_##eltn##_inc_learns, \
 		.dec_learns = rspamd_##eltn##_dec_learns, \
 		.get_stat = rspamd_##eltn##_get_stat, \
+		.finish_batch = rspamd_##eltn##_finish_batch, \
 		.close = rspamd_##eltn##_close \
 	}
 
@@ -91,6 +91,7 @@ struct rspamd_stat_ctx {
 	guint caches_count;
 
 	guint statfiles;
+	gboolean in_batch;
 };
 
 typedef enum rspamd_learn_cache_result {
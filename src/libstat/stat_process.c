@@ -610,9 +610,13 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 								st_run->st->symbol, nrev);
 						}
 
-						st_run->backend->finalize_learn (task,
-														st_run->backend_runtime,
-														st_run->backend->ctx);
+						/* Batches are committed at once when finished */
+						if (!st_ctx->in_batch ||
+								st_run->backend->finish_batch == NULL) {
+							st_run->backend->finalize_learn (task,
+									st_run->backend_runtime,
+									st_run->backend->ctx);
+						}
 
 						curst = g_list_next (curst);
 					}
@@ -630,6 +634,42 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 	return ret;
 }
 
+void
+rspamd_stat_learn_batch_start (void)
+{
+	struct rspamd_stat_ctx *st_ctx;
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+
+	st_ctx->in_batch = TRUE;
+}
+
+void
+rspamd_stat_learn_batch_finish (void)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_stat_backend *bk;
+	guint i;
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+
+	if (!st_ctx->in_batch) {
+		return;
+	}
+
+	for (i = 0; i < st_ctx->backends_count; i ++) {
+		bk = &st_ctx->backends[i];
+
+		if (bk->finish_batch != NULL && bk->ctx != NULL) {
+			bk->finish_batch (bk->ctx);
+		}
+	}
+
+	st_ctx->in_batch = FALSE;
+}
+
 ucl_object_t *
 rspamd_stat_statistics (struct rspamd_config *cfg, guint64 *total_learns)
 {
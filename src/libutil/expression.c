@@ -31,11 +31,13 @@
 #include "ottery.h"
 
 #define RSPAMD_EXPR_FLAG_NEGATE (1 << 0)
-#define RSPAMD_EXPR_FLAG_PROCESSED (1 << 1)
 
 #define MIN_RESORT_EVALS 50
 #define MAX_RESORT_EVALS 150
 
+/* Stack depth that is evaluated without heap allocations */
+#define RSPAMD_EXPR_STACK_SIZE 32
+
 enum rspamd_expression_op {
 	OP_INVALID = 0,
 	OP_PLUS, /* || or + */
@@ -66,16 +68,49 @@ struct rspamd_expression_elt {
 			gint op_idx;
 		} lim;
 	} p;
-	gint flags;
-	gint value;
 	gint priority;
 };
 
+/*
+ * Expression is evaluated from a flat postfix code compiled from AST:
+ * - ATOM pushes the result of an atom
+ * - CONST pushes `arg`
+ * - FIRST replaces the top of stack with the initial accumulator of `op`
+ * - NEXT pops an operand and applies `op` to it and the accumulator
+ * - JUMP moves to `target` (the end of operator) if `op` cannot be changed
+ * by the rest of operands
+ */
+enum rspamd_expression_opcode {
+	EXPR_INSN_ATOM = 0,
+	EXPR_INSN_CONST,
+	EXPR_INSN_FIRST,
+	EXPR_INSN_NEXT,
+	EXPR_INSN_JUMP
+};
+
+struct rspamd_expression_insn {
+	enum rspamd_expression_opcode opcode;
+	enum rspamd_expression_op op;
+	gint arg;
+	union {
+		rspamd_expression_atom_t *atom;
+		guint target;
+	} p;
+};
+
+struct rspamd_expression_code {
+	struct rspamd_expression_insn *insns;
+	guint ninsns;
+	guint max_stack;
+	guint version;
+};
+
 struct rspamd_expression {
 	const struct rspamd_atom_subr *subr;
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	struct rspamd_expression_code *code;
 	guint next_resort;
 	guint evals;
 };
@@ -340,6 +375,15 @@ rspamd_expr_str_to_op (const gchar *a, const gchar *end, const gchar **next)
 	return op;
 }
 
+static void
+rspamd_expression_code_free (struct rspamd_expression_code *code)
+{
+	g_free (code->insns);
+	g_slice_free1 (sizeof (*code), code);
+}
+
+static void rspamd_expression_compile (struct rspamd_expression *expr);
+
 static void
 rspamd_expression_destroy (struct rspamd_expression *expr)
 {
@@ -362,7 +406,13 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 
 		g_array_free (expr->expressions, TRUE);
 		g_ptr_array_free (expr->expression_stack, TRUE);
-		g_node_destroy (expr->ast);
+
+		if (expr->ast) {
+			g_node_destroy (expr->ast);
+		}
+		if (expr->code) {
+			rspamd_expression_code_free (expr->code);
+		}
 	}
 }
 
@@ -560,6 +610,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 			sizeof (struct rspamd_expression_elt));
 	operand_stack = g_ptr_array_sized_new (32);
 	e->ast = NULL;
+	e->code = NULL;
 	e->expression_stack = g_ptr_array_sized_new (32);
 	e->subr = subr;
 	e->evals = 0;
@@ -785,6 +836,8 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 			rspamd_ast_resort_traverse, NULL);
 
+	rspamd_expression_compile (e);
+
 	if (target) {
 		*target = e;
 		rspamd_mempool_add_destructor (pool,
@@ -800,59 +853,37 @@ err:
 	return FALSE;
 }
 
-static gboolean
-rspamd_ast_node_done (struct rspamd_expression_elt *elt,
-		struct rspamd_expression_elt *parelt, gint acc, gint lim)
+/*
+ * Initial value of an operator accumulator from its first operand
+ */
+static inline gint
+rspamd_expr_op_first (enum rspamd_expression_op op, gint val, gint lim)
 {
-	gboolean ret = FALSE;
-
-	g_assert (elt->type == ELT_OP);
+	gint ret = val;
 
-	switch (elt->p.op) {
+	switch (op) {
 	case OP_NOT:
-		ret = TRUE;
+		ret = !val;
 		break;
 	case OP_PLUS:
-		if (parelt && lim > 0) {
-			g_assert (parelt->type == ELT_OP);
-
-			switch (parelt->p.op) {
-			case OP_GE:
-				ret = acc >= lim;
-				break;
-			case OP_GT:
-				ret = acc > lim;
-				break;
-			case OP_LE:
-				ret = acc <= lim;
-				break;
-			case OP_LT:
-				ret = acc < lim;
-				break;
-			default:
-				ret = FALSE;
-				break;
-			}
-		}
+		ret = val;
 		break;
 	case OP_GE:
-		ret = acc >= lim;
+		ret = val >= lim;
 		break;
 	case OP_GT:
-		ret = acc > lim;
+		ret = val > lim;
 		break;
 	case OP_LE:
-		ret = acc <= lim;
+		ret = val <= lim;
 		break;
 	case OP_LT:
-		ret = acc < lim;
+		ret = val < lim;
 		break;
 	case OP_MULT:
 	case OP_AND:
-		ret = !acc;
-		break;
 	case OP_OR:
-		ret = !!acc;
+		ret = !!val;
 		break;
 	default:
 		g_assert (0);
@@ -862,14 +893,12 @@ rspamd_ast_node_done (struct rspamd_expression_elt *elt,
 	return ret;
 }
 
-static gint
-rspamd_ast_do_op (struct rspamd_expression_elt *elt, gint val, gint acc, gint lim)
+static inline gint
+rspamd_expr_op_next (enum rspamd_expression_op op, gint val, gint acc, gint lim)
 {
 	gint ret = val;
 
-	g_assert (elt->type == ELT_OP);
-
-	switch (elt->p.op) {
+	switch (op) {
 	case OP_NOT:
 		ret = !val;
 		break;
@@ -903,142 +932,380 @@ rspamd_ast_do_op (struct rspamd_expression_elt *elt, gint val, gint acc, gint li
 	return ret;
 }
 
+/*
+ * Returns TRUE if the accumulated value of an operator cannot be changed by
+ * the rest of its operands
+ */
+static inline gboolean
+rspamd_expr_op_done (enum rspamd_expression_op op, gint acc, gint lim)
+{
+	gboolean ret = FALSE;
+
+	switch (op) {
+	case OP_GE:
+		ret = acc >= lim;
+		break;
+	case OP_GT:
+		ret = acc > lim;
+		break;
+	case OP_MULT:
+	case OP_AND:
+		ret = !acc;
+		break;
+	case OP_OR:
+		ret = !!acc;
+		break;
+	default:
+		break;
+	}
+
+	return ret;
+}
+
 static gint
-rspamd_ast_process_node (struct rspamd_expression *expr, gint flags, GNode *node,
-		gpointer data)
+rspamd_expr_node_priority (struct rspamd_expression *expr, GNode *node)
 {
-	struct rspamd_expression_elt *elt, *celt, *parelt = NULL;
-	GNode *cld;
-	gint acc = G_MININT, lim = G_MININT, val;
-	gdouble t1, t2;
-	gboolean calc_ticks = FALSE;
+	struct rspamd_expression_elt *elt = node->data;
+	GNode *cur;
+	gint cnt = 0;
+
+	if (elt->type == ELT_LIMIT) {
+		return 0;
+	}
+	else if (elt->type == ELT_ATOM) {
+		cnt = RSPAMD_EXPRESSION_MAX_PRIORITY;
 
-	elt = node->data;
+		if (expr->subr->priority != NULL) {
+			cnt -= expr->subr->priority (elt->p.atom);
+		}
 
-	switch (elt->type) {
-	case ELT_ATOM:
-		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
+		return cnt;
+	}
 
-			/*
-			 * Sometimes get ticks for this expression. 'Sometimes' here means
-			 * that we get lowest 5 bits of the counter `evals` and 5 bits
-			 * of some shifted address to provide some sort of jittering for
-			 * ticks evaluation
-			 */
-			if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (node) >> 4 & 0x1F)) {
-				calc_ticks = TRUE;
-				t1 = rspamd_get_ticks ();
-			}
+	for (cur = node->children; cur != NULL; cur = cur->next) {
+		cnt += rspamd_expr_node_priority (expr, cur);
+	}
 
-			elt->value = expr->subr->process (data, elt->p.atom);
+	return cnt;
+}
 
-			if (elt->value) {
-				elt->p.atom->hits ++;
-			}
+struct rspamd_expr_operand {
+	GNode *node;
+	gint priority;
+};
 
-			if (calc_ticks) {
-				t2 = rspamd_get_ticks ();
-				elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
-						(expr->evals);
-			}
+static gint
+rspamd_expr_operand_cmp (gconstpointer a, gconstpointer b, gpointer unused)
+{
+	const struct rspamd_expr_operand *oa = a, *ob = b;
+	struct rspamd_expression_elt *ea = oa->node->data, *eb = ob->node->data;
+	gdouble w1, w2;
+
+	if (oa->priority != ob->priority) {
+		return oa->priority - ob->priority;
+	}
+
+	/* Prefer atoms that are rarely triggered and cheap */
+	if (ea->type == ELT_ATOM && eb->type == ELT_ATOM) {
+		w1 = ATOM_PRIORITY (ea);
+		w2 = ATOM_PRIORITY (eb);
 
-			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
+		if (w1 < w2) {
+			return -1;
+		}
+		else if (w1 > w2) {
+			return 1;
 		}
+	}
 
-		return elt->value;
-		break;
-	case ELT_LIMIT:
+	return 0;
+}
 
-		return elt->p.lim.val;
-		break;
-	case ELT_OP:
-		g_assert (node->children != NULL);
-		cld = node->children;
+static inline void
+rspamd_expr_emit (GArray *code, guint opcode, enum rspamd_expression_op op,
+		gint arg, rspamd_expression_atom_t *atom)
+{
+	struct rspamd_expression_insn insn;
 
-		/* Try to find limit at the parent node */
-		if (node->parent) {
-			parelt = node->parent->data;
-			celt = node->parent->children->data;
+	insn.opcode = opcode;
+	insn.op = op;
+	insn.arg = arg;
 
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim.val;
-			}
+	if (opcode == EXPR_INSN_JUMP) {
+		/* Resolved when the whole operator is emitted */
+		insn.p.target = 0;
+	}
+	else {
+		insn.p.atom = atom;
+	}
+
+	g_array_append_val (code, insn);
+}
+
+/*
+ * Emits postfix code for a node. Operands of an operator are evaluated in the
+ * order of their priorities and, unless the remaining operands might change
+ * the accumulated value, a jump to the end of the operator is inserted after
+ * each operand.
+ */
+static void
+rspamd_expr_compile_node (struct rspamd_expression *expr, GNode *node,
+		GArray *code, enum rspamd_expression_op done_op, gint done_lim,
+		guint depth, guint *max_depth)
+{
+	struct rspamd_expression_elt *elt = node->data, *celt;
+	struct rspamd_expr_operand *operands;
+	enum rspamd_expression_op child_done_op = OP_INVALID;
+	gboolean is_cmp = FALSE;
+	gint lim = G_MININT;
+	guint nops = 0, i, j, first_jump;
+	struct rspamd_expression_insn *insn;
+	GNode *cur;
+
+	if (elt->type == ELT_ATOM || elt->type == ELT_LIMIT) {
+		if (elt->type == ELT_ATOM) {
+			rspamd_expr_emit (code, EXPR_INSN_ATOM, OP_INVALID, 0,
+					elt->p.atom);
+		}
+		else {
+			rspamd_expr_emit (code, EXPR_INSN_CONST, OP_INVALID,
+					elt->p.lim.val, NULL);
 		}
 
-		DL_FOREACH (node->children, cld) {
-			celt = cld->data;
+		*max_depth = MAX (*max_depth, depth + 1);
 
-			/* Save limit if we've found it */
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim.val;
-				continue;
-			}
+		return;
+	}
+
+	switch (elt->p.op) {
+	case OP_GE:
+	case OP_GT:
+	case OP_LE:
+	case OP_LT:
+		is_cmp = TRUE;
+		done_op = OP_INVALID;
+		break;
+	case OP_MULT:
+	case OP_AND:
+	case OP_OR:
+		done_op = elt->p.op;
+		break;
+	case OP_PLUS:
+		/* Sum can be finished earlier if it is compared using `>` or `>=` */
+		break;
+	default:
+		done_op = OP_INVALID;
+		break;
+	}
 
-			val = rspamd_ast_process_node (expr, flags, cld, data);
+	operands = g_alloca (sizeof (*operands) * g_node_n_children (node));
 
-			if (acc == G_MININT) {
-				acc = val;
-			}
+	for (cur = node->children; cur != NULL; cur = cur->next) {
+		celt = cur->data;
 
-			acc = rspamd_ast_do_op (elt, val, acc, lim);
+		/* The first number of a comparison is its limit */
+		if (is_cmp && celt->type == ELT_LIMIT && lim == G_MININT) {
+			lim = celt->p.lim.val;
+			continue;
+		}
 
-			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT)) {
-				if (rspamd_ast_node_done (elt, parelt, acc, lim)) {
-					return acc;
-				}
-			}
+		operands[nops].node = cur;
+		operands[nops].priority = rspamd_expr_node_priority (expr, cur);
+		nops ++;
+	}
+
+	if (is_cmp && (elt->p.op == OP_GE || elt->p.op == OP_GT) &&
+			lim != G_MININT) {
+		child_done_op = elt->p.op;
+	}
+
+	if (nops == 0) {
+		rspamd_expr_emit (code, EXPR_INSN_CONST, OP_INVALID, G_MININT, NULL);
+		*max_depth = MAX (*max_depth, depth + 1);
+
+		return;
+	}
+
+	g_qsort_with_data (operands, nops, sizeof (*operands),
+			rspamd_expr_operand_cmp, NULL);
+	first_jump = code->len;
+
+	for (i = 0; i < nops; i ++) {
+		celt = operands[i].node->data;
+		rspamd_expr_compile_node (expr, operands[i].node, code,
+				(celt->type == ELT_OP && celt->p.op == OP_PLUS) ?
+						child_done_op : OP_INVALID,
+				lim,
+				i == 0 ? depth : depth + 1,
+				max_depth);
+
+		rspamd_expr_emit (code, i == 0 ? EXPR_INSN_FIRST : EXPR_INSN_NEXT,
+				elt->p.op, lim, NULL);
+
+		if (i != nops - 1 && done_op != OP_INVALID) {
+			rspamd_expr_emit (code, EXPR_INSN_JUMP, done_op,
+					elt->p.op == OP_PLUS ? done_lim : 0, NULL);
 		}
-		break;
 	}
 
-	return acc;
+	/* Resolve jumps to the end of this operator */
+	for (j = first_jump; j < code->len; j ++) {
+		insn = &g_array_index (code, struct rspamd_expression_insn, j);
+
+		if (insn->opcode == EXPR_INSN_JUMP && insn->p.target == 0) {
+			insn->p.target = code->len;
+		}
+	}
 }
 
-static gboolean
-rspamd_ast_cleanup_traverse (GNode *n, gpointer d)
+/*
+ * Compiles the AST to a new version of code, the previous version is released
+ */
+static void
+rspamd_expression_compile (struct rspamd_expression *expr)
 {
-	struct rspamd_expression_elt *elt = n->data;
+	struct rspamd_expression_code *code;
+	struct rspamd_expression_insn *insn;
+	GArray *insns;
+	guint max_depth = 0, i;
+
+	insns = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_expression_insn),
+			expr->expressions->len * 2);
+	rspamd_expr_compile_node (expr, expr->ast, insns, OP_INVALID, 0, 0,
+			&max_depth);
+
+	code = g_slice_alloc (sizeof (*code));
+	code->ninsns = insns->len;
+	code->max_stack = max_depth;
+	code->insns = (struct rspamd_expression_insn *)g_array_free (insns, FALSE);
+
+	/* Statistics are collected for the new version of code */
+	for (i = 0; i < code->ninsns; i ++) {
+		insn = &code->insns[i];
+
+		if (insn->opcode == EXPR_INSN_ATOM) {
+			insn->p.atom->hits = 0;
+			insn->p.atom->avg_ticks = 0.0;
+		}
+	}
 
-	elt->value = 0;
-	elt->flags = 0;
+	if (expr->code) {
+		code->version = expr->code->version + 1;
+		rspamd_expression_code_free (expr->code);
+	}
+	else {
+		code->version = 0;
+	}
 
-	return FALSE;
+	expr->code = code;
 }
 
 gint
 rspamd_process_expression (struct rspamd_expression *expr, gint flags,
 		gpointer data)
 {
-	gint ret = 0;
+	struct rspamd_expression_code *code;
+	struct rspamd_expression_insn *insn;
+	gint stackbuf[RSPAMD_EXPR_STACK_SIZE], *stack = stackbuf, ret = 0, val;
+	guint pc, sp = 0;
+	gdouble t1, t2;
 
 	g_assert (expr != NULL);
-	/* Ensure that stack is empty at this point */
-	g_assert (expr->expression_stack->len == 0);
+	code = expr->code;
 
-	ret = rspamd_ast_process_node (expr, flags, expr->ast, data);
+	if (code->max_stack > G_N_ELEMENTS (stackbuf)) {
+		stack = g_malloc (code->max_stack * sizeof (*stack));
+	}
+
+	for (pc = 0; pc < code->ninsns; pc ++) {
+		insn = &code->insns[pc];
+
+		switch (insn->opcode) {
+		case EXPR_INSN_ATOM:
+			/*
+			 * Sometimes get ticks for this atom. 'Sometimes' here means
+			 * that we compare the lowest 5 bits of the counter `evals` with
+			 * 5 bits of the instruction offset to provide some sort of
+			 * jittering for ticks evaluation
+			 */
+			if ((expr->evals & 0x1F) == (pc & 0x1F)) {
+				t1 = rspamd_get_ticks ();
+				val = expr->subr->process (data, insn->p.atom);
+				t2 = rspamd_get_ticks ();
+				insn->p.atom->avg_ticks += ((t2 - t1) -
+						insn->p.atom->avg_ticks) / (expr->evals + 1);
+			}
+			else {
+				val = expr->subr->process (data, insn->p.atom);
+			}
 
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+			if (val) {
+				insn->p.atom->hits ++;
+			}
+
+			stack[sp ++] = val;
+			break;
+		case EXPR_INSN_CONST:
+			stack[sp ++] = insn->arg;
+			break;
+		case EXPR_INSN_FIRST:
+			stack[sp - 1] = rspamd_expr_op_first (insn->op, stack[sp - 1],
+					insn->arg);
+			break;
+		case EXPR_INSN_NEXT:
+			sp --;
+			stack[sp - 1] = rspamd_expr_op_next (insn->op, stack[sp],
+					stack[sp - 1], insn->arg);
+			break;
+		case EXPR_INSN_JUMP:
+			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+					rspamd_expr_op_done (insn->op, stack[sp - 1], insn->arg)) {
+				/* Skip the rest of operands */
+				pc = insn->p.target - 1;
+			}
+			break;
+		}
+	}
+
+	if (sp > 0) {
+		ret = stack[sp - 1];
+	}
+
+	if (stack != stackbuf) {
+		g_free (stack);
+	}
 
 	expr->evals ++;
 
 	/* Check if we need to resort */
 	if (expr->evals == expr->next_resort) {
-		expr->next_resort = ottery_rand_range (MAX_RESORT_EVALS) +
+		expr->next_resort = expr->evals + ottery_rand_range (MAX_RESORT_EVALS) +
 				MIN_RESORT_EVALS;
-		/* Set priorities for branches */
-		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
-				rspamd_ast_priority_traverse, expr);
-
-		/* Now set less expensive branches to be evaluated first */
-		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
-				rspamd_ast_resort_traverse, NULL);
+		rspamd_expression_compile (expr);
 	}
 
 	return ret;
 }
 
+void
+rspamd_expression_atom_foreach (struct rspamd_expression *expr,
+		rspamd_expression_atom_foreach_cb cb, gpointer ud)
+{
+	struct rspamd_expression_elt *elt;
+	guint i;
+
+	g_assert (expr != NULL);
+
+	for (i = 0; i < expr->expressions->len; i ++) {
+		elt = &g_array_index (expr->expressions, struct rspamd_expression_elt, i);
+
+		if (elt->type == ELT_ATOM) {
+			cb (elt->p.atom, ud);
+		}
+	}
+}
+
 static gboolean
 rspamd_ast_string_traverse (GNode *n, gpointer d)
 {
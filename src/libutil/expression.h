@@ -86,6 +86,18 @@ gboolean rspamd_parse_expression (const gchar *line, gsize len,
 gint rspamd_process_expression (struct rspamd_expression *expr, gint flags,
 		gpointer data);
 
+typedef void (*rspamd_expression_atom_foreach_cb) (rspamd_expression_atom_t *atom,
+		gpointer ud);
+
+/**
+ * Calls the specified callback for each atom of an expression
+ * @param expr expression
+ * @param cb callback
+ * @param ud opaque data for the callback
+ */
+void rspamd_expression_atom_foreach (struct rspamd_expression *expr,
+		rspamd_expression_atom_foreach_cb cb, gpointer ud);
+
 /**
  * Shows string representation of an expression
  * @param expr expression to show
@@ -29,6 +29,11 @@
 #include "keypair_private.h"
 #include "hash.h"
 #include "xxhash.h"
+#include "blake2.h"
+#include "mem_pool.h"
+
+/* Number of slots probed in the shared table */
+#define RSPAMD_KEYPAIR_SHARED_PROBES 4
 
 struct rspamd_keypair_elt {
 	guchar nm[rspamd_cryptobox_NMBYTES];
@@ -39,6 +44,31 @@ struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
 };
 
+/*
+ * Shared elements are protected by a sequence counter: odd values mean that
+ * an element is being written. Secret keys are not stored in shared memory,
+ * elements are identified by a hash of both keys instead.
+ */
+struct rspamd_keypair_shared_elt {
+	volatile gint seq;
+	guchar id[16];
+	guchar nm[rspamd_cryptobox_NMBYTES];
+};
+
+struct rspamd_keypair_shared_cache {
+	volatile gint hits;
+	volatile gint misses;
+	guint nelts;
+	struct rspamd_keypair_shared_elt elts[];
+};
+
+static struct rspamd_keypair_shared_cache *shared_cache = NULL;
+/* Used when there is no shared cache */
+static struct {
+	gint hits;
+	gint misses;
+} local_stat;
+
 static void
 rspamd_keypair_destroy (gpointer ptr)
 {
@@ -79,6 +109,119 @@ rspamd_keypair_cache_new (guint max_items)
 	return c;
 }
 
+void
+rspamd_keypair_cache_init_shared (rspamd_mempool_t *pool, guint nelts)
+{
+	g_assert (pool != NULL);
+
+	if (nelts == 0) {
+		shared_cache = NULL;
+		return;
+	}
+
+	shared_cache = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*shared_cache) +
+			sizeof (struct rspamd_keypair_shared_elt) * nelts);
+	shared_cache->nelts = nelts;
+}
+
+static gboolean
+rspamd_keypair_shared_lookup (const guchar *id, guchar *nm)
+{
+	struct rspamd_keypair_shared_elt *elt;
+	guint64 h;
+	guint i;
+	gint seq;
+	guchar elt_id[sizeof (elt->id)];
+
+	memcpy (&h, id, sizeof (h));
+
+	for (i = 0; i < RSPAMD_KEYPAIR_SHARED_PROBES; i++) {
+		elt = &shared_cache->elts[(h + i) % shared_cache->nelts];
+		seq = g_atomic_int_get (&elt->seq);
+
+		if (seq == 0 || (seq & 1)) {
+			continue;
+		}
+
+		memcpy (elt_id, elt->id, sizeof (elt_id));
+		memcpy (nm, elt->nm, rspamd_cryptobox_NMBYTES);
+
+		if (g_atomic_int_get (&elt->seq) == seq &&
+				memcmp (elt_id, id, sizeof (elt_id)) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_keypair_shared_insert (const guchar *id, const guchar *nm)
+{
+	struct rspamd_keypair_shared_elt *elt, *victim = NULL;
+	guint64 h;
+	guint i;
+	gint seq;
+
+	memcpy (&h, id, sizeof (h));
+
+	/* Prefer an empty slot, otherwise replace the first one */
+	for (i = 0; i < RSPAMD_KEYPAIR_SHARED_PROBES; i++) {
+		elt = &shared_cache->elts[(h + i) % shared_cache->nelts];
+
+		if (g_atomic_int_get (&elt->seq) == 0) {
+			victim = elt;
+			break;
+		}
+	}
+
+	if (victim == NULL) {
+		victim = &shared_cache->elts[h % shared_cache->nelts];
+	}
+
+	seq = g_atomic_int_get (&victim->seq);
+
+	if ((seq & 1) ||
+			!g_atomic_int_compare_and_exchange (&victim->seq, seq, seq + 1)) {
+		/* Another process is writing this element, skip it */
+		return;
+	}
+
+	memcpy (victim->id, id, sizeof (victim->id));
+	memcpy (victim->nm, nm, sizeof (victim->nm));
+	g_atomic_int_set (&victim->seq, seq + 2);
+}
+
+static inline void
+rspamd_keypair_cache_account (gboolean hit)
+{
+	if (shared_cache != NULL) {
+		g_atomic_int_inc (hit ? &shared_cache->hits : &shared_cache->misses);
+	}
+	else {
+		if (hit) {
+			local_stat.hits ++;
+		}
+		else {
+			local_stat.misses ++;
+		}
+	}
+}
+
+void
+rspamd_keypair_cache_stat (guint64 *hits, guint64 *misses)
+{
+	if (shared_cache != NULL) {
+		*hits = (guint)g_atomic_int_get (&shared_cache->hits);
+		*misses = (guint)g_atomic_int_get (&shared_cache->misses);
+	}
+	else {
+		*hits = (guint)local_stat.hits;
+		*misses = (guint)local_stat.misses;
+	}
+}
+
 void
 rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		gpointer lk, gpointer rk)
@@ -86,6 +229,8 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	struct rspamd_http_keypair *kp_local = (struct rspamd_http_keypair *)lk,
 			*kp_remote = (struct rspamd_http_keypair *)rk;
 	struct rspamd_keypair_elt search, *new;
+	guchar id[16];
+	gboolean found = FALSE;
 
 	g_assert (kp_local != NULL);
 	g_assert (kp_remote != NULL);
@@ -97,12 +242,30 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 
 	if (new == NULL) {
 		new = g_slice_alloc (sizeof (*new));
-		memcpy (new->pair, kp_remote->pk, rspamd_cryptobox_PKBYTES);
-		memcpy (&new->pair[rspamd_cryptobox_PKBYTES], kp_local->sk,
-				rspamd_cryptobox_SKBYTES);
-		rspamd_cryptobox_nm (new->nm, kp_remote->pk, kp_local->sk);
+		memcpy (new->pair, search.pair, sizeof (new->pair));
+
+		if (shared_cache != NULL) {
+			/* Another worker might have already computed this value */
+			blake2b (id, new->pair, NULL, sizeof (id), sizeof (new->pair), 0);
+			found = rspamd_keypair_shared_lookup (id, new->nm);
+		}
+
+		if (!found) {
+			rspamd_cryptobox_nm (new->nm, kp_remote->pk, kp_local->sk);
+
+			if (shared_cache != NULL) {
+				rspamd_keypair_shared_insert (id, new->nm);
+			}
+		}
+
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
 	}
+	else {
+		found = TRUE;
+	}
+
+	rspamd_keypair_cache_account (found);
+	rspamd_explicit_memzero (search.pair, sizeof (search.pair));
 
 	g_assert (new != NULL);
 
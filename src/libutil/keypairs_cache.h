@@ -26,6 +26,7 @@
 #define KEYPAIRS_CACHE_H_
 
 #include "config.h"
+#include "mem_pool.h"
 
 struct rspamd_keypair_cache;
 
@@ -36,6 +37,22 @@ struct rspamd_keypair_cache;
  */
 struct rspamd_keypair_cache * rspamd_keypair_cache_new (guint max_items);
 
+/**
+ * Create a second level cache of shared secrets in shared memory. It should be
+ * called before workers are forked, so that all caches in all workers use it.
+ * Secret keys are not stored in this cache.
+ * @param pool pool for shared memory
+ * @param nelts number of elements (0 disables shared cache)
+ */
+void rspamd_keypair_cache_init_shared (rspamd_mempool_t *pool, guint nelts);
+
+/**
+ * Get statistics of keypair caches: hits include values found in both local
+ * and shared caches
+ * @param hits output for the number of hits
+ * @param misses output for the number of computed values
+ */
+void rspamd_keypair_cache_stat (guint64 *hits, guint64 *misses);
 
 /**
  * Process local and remote keypair setting beforenm value as appropriate
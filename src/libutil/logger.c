@@ -34,6 +34,37 @@
 #define REPEATS_MIN 3
 #define REPEATS_MAX 300
 #define RSPAMD_LOGBUF_SIZE 8192
+/* Size of a slot in the async log ring */
+#define RSPAMD_LOG_SLOT_SIZE 256
+#define RSPAMD_LOG_SLOT_DATA (RSPAMD_LOG_SLOT_SIZE - sizeof (guint32))
+/* Maximum slots written by a single writev */
+#define RSPAMD_LOG_IOV_MAX 64
+
+/*
+ * Slot of the async log ring: a line occupies one or more consecutive slots,
+ * the first of them stores the length of the whole line
+ */
+struct rspamd_log_slot {
+	guint32 len;
+	gchar data[RSPAMD_LOG_SLOT_DATA];
+};
+
+/*
+ * Single producer, single consumer ring: the producer is the logging process
+ * (serialized by the logger mutex) and the consumer is the writer thread
+ */
+struct rspamd_log_ring {
+	struct rspamd_log_slot *slots;
+	guint nslots;               /**< power of two							*/
+	volatile guint head;        /**< next slot to fill (producer)			*/
+	volatile guint tail;        /**< next slot to write (writer)			*/
+	volatile guint dropped;     /**< lines dropped due to overflow			*/
+	volatile gint stop;
+	volatile gint sleeping;
+	gint wakeup[2];
+	GThread *writer;
+	pid_t owner;                /**< process that has started the writer	*/
+};
 
 /**
  * Static structure that store logging parameters
@@ -64,12 +95,56 @@ struct rspamd_logger_s {
 	gchar *saved_function;
 	rspamd_mempool_t *pool;
 	rspamd_mempool_mutex_t *mtx;
+	gboolean is_async;
+	struct rspamd_log_ring *ring;
+	struct rspamd_stat *stat;
 };
 
 static const gchar lf_chr = '\n';
 
 static rspamd_logger_t *default_logger = NULL;
 
+/* Maximum number of lines that are deferred by a single thread */
+#define RSPAMD_LOG_DEFERRED_MAX 256
+
+/*
+ * Log lines of a CPU thread, they are written from the event loop thread
+ */
+struct rspamd_log_deferred_line {
+	rspamd_logger_t *logger;
+	GLogLevelFlags log_level;
+	gboolean forced;
+	gchar *log_domain;
+	gchar *function;
+	gchar *message;
+};
+
+struct rspamd_log_deferred {
+	GArray *lines;
+	guint dropped;
+};
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+static GPrivate log_deferred_key = G_PRIVATE_INIT (NULL);
+#define RSPAMD_LOG_DEFERRED_KEY (&log_deferred_key)
+#else
+static GPrivate *log_deferred_key = NULL;
+
+static GPrivate *
+rspamd_log_deferred_key (void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		log_deferred_key = g_private_new (NULL);
+		g_once_init_leave (&initialized, 1);
+	}
+
+	return log_deferred_key;
+}
+#define RSPAMD_LOG_DEFERRED_KEY (rspamd_log_deferred_key ())
+#endif
+
 
 static void
 syslog_log_function (const gchar * log_domain, const gchar *function,
@@ -141,6 +216,272 @@ direct_write_log_line (rspamd_logger_t *rspamd_log,
 	}
 }
 
+/*
+ * Write all lines pushed to the ring, returns number of slots written
+ */
+static guint
+rspamd_log_ring_drain (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+	struct iovec iov[RSPAMD_LOG_IOV_MAX];
+	struct rspamd_log_slot *slot;
+	guint head, cur, n, mask, niov = 0, total = 0, dropped;
+	gsize len;
+
+	head = g_atomic_int_get (&ring->head);
+	cur = ring->tail;
+	mask = ring->nslots - 1;
+
+	while (cur != head) {
+		len = ring->slots[cur & mask].len;
+		n = MAX (1, (len + RSPAMD_LOG_SLOT_DATA - 1) / RSPAMD_LOG_SLOT_DATA);
+
+		if (niov + n > G_N_ELEMENTS (iov)) {
+			direct_write_log_line (rspamd_log, iov, niov, TRUE);
+			g_atomic_int_set (&ring->tail, cur);
+			niov = 0;
+		}
+
+		while (n > 0) {
+			slot = &ring->slots[cur & mask];
+			iov[niov].iov_base = slot->data;
+			iov[niov].iov_len = MIN (len, RSPAMD_LOG_SLOT_DATA);
+			len -= iov[niov].iov_len;
+			niov ++;
+			cur ++;
+			total ++;
+			n --;
+		}
+	}
+
+	if (niov > 0) {
+		direct_write_log_line (rspamd_log, iov, niov, TRUE);
+		g_atomic_int_set (&ring->tail, cur);
+	}
+
+	dropped = g_atomic_int_get (&ring->dropped);
+
+	if (dropped > 0) {
+		g_atomic_int_add (&ring->dropped, -(gint)dropped);
+
+		if (rspamd_log->stat) {
+			/* Statistics are shared between all processes */
+			__sync_fetch_and_add (&rspamd_log->stat->log_dropped,
+					(guint64)dropped);
+		}
+	}
+
+	return total;
+}
+
+static gpointer
+rspamd_log_writer_thread (gpointer ud)
+{
+	rspamd_logger_t *rspamd_log = ud;
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+	struct pollfd pfd;
+	gchar buf[64];
+
+	pfd.fd = ring->wakeup[0];
+	pfd.events = POLLIN;
+
+	while (!g_atomic_int_get (&ring->stop)) {
+		if (rspamd_log_ring_drain (rspamd_log) == 0) {
+			g_atomic_int_set (&ring->sleeping, 1);
+
+			/* Recheck the ring as the producer could miss our sleep */
+			if (g_atomic_int_get (&ring->head) == ring->tail &&
+					poll (&pfd, 1, 1000) > 0) {
+				while (read (ring->wakeup[0], buf, sizeof (buf)) > 0);
+			}
+
+			g_atomic_int_set (&ring->sleeping, 0);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_log_ring_wakeup (struct rspamd_log_ring *ring)
+{
+	if (write (ring->wakeup[1], "", 1) == -1) {
+		/* Pipe is full, so the writer is going to be woken up anyway */
+	}
+}
+
+/*
+ * Forget the writer and lines pending after fork: they belong to the parent
+ * that is going to write them itself
+ */
+static void
+rspamd_log_ring_reset (struct rspamd_log_ring *ring)
+{
+	if (ring->wakeup[0] != -1) {
+		close (ring->wakeup[0]);
+		close (ring->wakeup[1]);
+		ring->wakeup[0] = -1;
+		ring->wakeup[1] = -1;
+	}
+
+	ring->writer = NULL;
+	ring->owner = 0;
+	ring->tail = ring->head;
+	ring->dropped = 0;
+}
+
+/*
+ * Start writer thread for the current process
+ */
+static gboolean
+rspamd_log_ring_start (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+	GError *err = NULL;
+
+	if (ring->owner == getpid ()) {
+		return ring->writer != NULL;
+	}
+
+	if (ring->owner != 0) {
+		/* Forked without rspamd_log_update_pid */
+		rspamd_log_ring_reset (ring);
+	}
+
+	ring->owner = getpid ();
+	ring->stop = 0;
+	ring->sleeping = 0;
+	ring->writer = NULL;
+
+	if (pipe (ring->wakeup) == -1) {
+		fprintf (stderr, "cannot create log wakeup pipe: %s\n",
+				strerror (errno));
+		ring->wakeup[0] = -1;
+		ring->wakeup[1] = -1;
+
+		return FALSE;
+	}
+
+	rspamd_socket_nonblocking (ring->wakeup[0]);
+	rspamd_socket_nonblocking (ring->wakeup[1]);
+	ring->writer = rspamd_create_thread ("logger", rspamd_log_writer_thread,
+			rspamd_log, &err);
+
+	if (ring->writer == NULL) {
+		fprintf (stderr, "cannot start log writer thread: %s\n",
+				err ? err->message : "unknown error");
+		if (err) {
+			g_error_free (err);
+		}
+		close (ring->wakeup[0]);
+		close (ring->wakeup[1]);
+		ring->wakeup[0] = -1;
+		ring->wakeup[1] = -1;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Stop writer thread of this process and write the remaining lines
+ */
+static void
+rspamd_log_ring_stop (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+
+	if (ring->owner != getpid ()) {
+		return;
+	}
+
+	if (ring->writer != NULL) {
+		g_atomic_int_set (&ring->stop, 1);
+		rspamd_log_ring_wakeup (ring);
+		g_thread_join (ring->writer);
+		ring->writer = NULL;
+		close (ring->wakeup[0]);
+		close (ring->wakeup[1]);
+		ring->wakeup[0] = -1;
+		ring->wakeup[1] = -1;
+	}
+
+	ring->owner = 0;
+	rspamd_log_ring_drain (rspamd_log);
+}
+
+/*
+ * Copy a line to the ring without blocking, returns FALSE if the line cannot
+ * be written asynchronously
+ */
+static gboolean
+rspamd_log_ring_push (rspamd_logger_t *rspamd_log,
+	const struct iovec *iov,
+	gint iovcnt)
+{
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+	struct rspamd_log_slot *slot;
+	guint head, tail, n, mask, off = 0;
+	gsize len = 0, remain, chunk, cp;
+	const gchar *p;
+	gint i;
+
+	if (!rspamd_log_ring_start (rspamd_log)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	/* Huge lines are truncated to what the writer can output at once */
+	len = MIN (len, RSPAMD_LOG_IOV_MAX * RSPAMD_LOG_SLOT_DATA);
+	n = MAX (1, (len + RSPAMD_LOG_SLOT_DATA - 1) / RSPAMD_LOG_SLOT_DATA);
+	head = ring->head;
+	tail = g_atomic_int_get (&ring->tail);
+	mask = ring->nslots - 1;
+
+	if (head - tail + n > ring->nslots) {
+		/* Never block the caller */
+		g_atomic_int_inc (&ring->dropped);
+		return TRUE;
+	}
+
+	slot = &ring->slots[head & mask];
+	slot->len = len;
+	remain = len;
+
+	for (i = 0; i < iovcnt && remain > 0; i++) {
+		p = iov[i].iov_base;
+		chunk = MIN (iov[i].iov_len, remain);
+		remain -= chunk;
+
+		while (chunk > 0) {
+			if (off == RSPAMD_LOG_SLOT_DATA) {
+				head ++;
+				slot = &ring->slots[head & mask];
+				off = 0;
+			}
+
+			cp = MIN (chunk, RSPAMD_LOG_SLOT_DATA - off);
+			memcpy (slot->data + off, p, cp);
+			off += cp;
+			p += cp;
+			chunk -= cp;
+		}
+	}
+
+	/* Publish the whole line */
+	g_atomic_int_set (&ring->head, head + 1);
+
+	if (g_atomic_int_get (&ring->sleeping)) {
+		rspamd_log_ring_wakeup (ring);
+	}
+
+	return TRUE;
+}
+
 static void
 rspamd_escape_log_string (gchar *str)
 {
@@ -316,6 +657,21 @@ rspamd_set_logger (struct rspamd_config *cfg,
 	}
 
 	rspamd->logger->cfg = cfg;
+	rspamd->logger->stat = rspamd->stat;
+	/* Set up asynchronous writing */
+	rspamd->logger->is_async = cfg->log_async &&
+		cfg->log_type != RSPAMD_LOG_SYSLOG;
+	if (rspamd->logger->is_async && rspamd->logger->ring == NULL) {
+		rspamd->logger->ring = g_malloc0 (sizeof (struct rspamd_log_ring));
+		rspamd->logger->ring->nslots = 64;
+		while (rspamd->logger->ring->nslots < cfg->log_async_size) {
+			rspamd->logger->ring->nslots <<= 1;
+		}
+		rspamd->logger->ring->slots = g_malloc (
+			rspamd->logger->ring->nslots * sizeof (struct rspamd_log_slot));
+		rspamd->logger->ring->wakeup[0] = -1;
+		rspamd->logger->ring->wakeup[1] = -1;
+	}
 	/* Set up buffer */
 	if (rspamd->cfg->log_buffered) {
 		if (rspamd->cfg->log_buf_size != 0) {
@@ -358,6 +714,11 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 {
 	rspamd_log->pid = getpid ();
 	rspamd_log->process_type = ptype;
+
+	if (rspamd_log->ring) {
+		/* Writer thread is not inherited */
+		rspamd_log_ring_reset (rspamd_log->ring);
+	}
 }
 
 /**
@@ -366,6 +727,10 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 void
 rspamd_log_flush (rspamd_logger_t *rspamd_log)
 {
+	if (rspamd_log->ring) {
+		rspamd_log_ring_stop (rspamd_log);
+	}
+
 	if (rspamd_log->is_buffered &&
 		(rspamd_log->type == RSPAMD_LOG_CONSOLE || rspamd_log->type ==
 		RSPAMD_LOG_FILE)) {
@@ -378,6 +743,122 @@ rspamd_log_flush (rspamd_logger_t *rspamd_log)
 }
 
 
+static inline struct rspamd_log_deferred *
+rspamd_log_deferred_get (void)
+{
+	return g_private_get (RSPAMD_LOG_DEFERRED_KEY);
+}
+
+static void
+rspamd_log_deferred_add (struct rspamd_log_deferred *deferred,
+	rspamd_logger_t *rspamd_log,
+	const gchar *log_domain,
+	const gchar *function,
+	GLogLevelFlags log_level,
+	gboolean forced,
+	const gchar *message)
+{
+	struct rspamd_log_deferred_line line;
+
+	if (deferred->lines->len >= RSPAMD_LOG_DEFERRED_MAX) {
+		deferred->dropped ++;
+		return;
+	}
+
+	line.logger = rspamd_log;
+	line.log_level = log_level;
+	line.forced = forced;
+	line.log_domain = g_strdup (log_domain);
+	line.function = g_strdup (function);
+	line.message = g_strdup (message);
+	g_array_append_val (deferred->lines, line);
+}
+
+static void
+rspamd_log_deferred_addv (struct rspamd_log_deferred *deferred,
+	rspamd_logger_t *rspamd_log,
+	const gchar *function,
+	GLogLevelFlags log_level,
+	gboolean forced,
+	const gchar *fmt,
+	va_list args)
+{
+	GString *msg;
+
+	msg = g_string_sized_new (128);
+	rspamd_vprintf_gstring (msg, fmt, args);
+	rspamd_escape_log_string (msg->str);
+	rspamd_log_deferred_add (deferred, rspamd_log, NULL, function, log_level,
+			forced, msg->str);
+	g_string_free (msg, TRUE);
+}
+
+void
+rspamd_log_defer_start (void)
+{
+	struct rspamd_log_deferred *deferred;
+
+	g_assert (rspamd_log_deferred_get () == NULL);
+
+	deferred = g_slice_alloc0 (sizeof (*deferred));
+	deferred->lines = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_log_deferred_line));
+	g_private_set (RSPAMD_LOG_DEFERRED_KEY, deferred);
+}
+
+struct rspamd_log_deferred *
+rspamd_log_defer_stop (void)
+{
+	struct rspamd_log_deferred *deferred;
+
+	deferred = rspamd_log_deferred_get ();
+	g_private_set (RSPAMD_LOG_DEFERRED_KEY, NULL);
+
+	if (deferred != NULL && deferred->lines->len == 0 &&
+			deferred->dropped == 0) {
+		g_array_free (deferred->lines, TRUE);
+		g_slice_free1 (sizeof (*deferred), deferred);
+		deferred = NULL;
+	}
+
+	return deferred;
+}
+
+void
+rspamd_log_deferred_flush (struct rspamd_log_deferred *deferred)
+{
+	struct rspamd_log_deferred_line *line;
+	guint i;
+
+	if (deferred == NULL) {
+		return;
+	}
+
+	for (i = 0; i < deferred->lines->len; i ++) {
+		line = &g_array_index (deferred->lines, struct rspamd_log_deferred_line,
+				i);
+		rspamd_mempool_lock_mutex (line->logger->mtx);
+		line->logger->log_func (line->log_domain,
+			line->function,
+			line->log_level,
+			line->message,
+			line->forced,
+			line->logger);
+		rspamd_mempool_unlock_mutex (line->logger->mtx);
+		g_free (line->log_domain);
+		g_free (line->function);
+		g_free (line->message);
+	}
+
+	if (deferred->dropped > 0) {
+		msg_info ("%ud log lines of a thread have been dropped",
+				deferred->dropped);
+	}
+
+	g_array_free (deferred->lines, TRUE);
+	g_slice_free1 (sizeof (*deferred), deferred);
+}
+
 void
 rspamd_common_logv (rspamd_logger_t *rspamd_log,
 	GLogLevelFlags log_level,
@@ -386,6 +867,7 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log,
 	va_list args)
 {
 	static gchar logbuf[RSPAMD_LOGBUF_SIZE];
+	struct rspamd_log_deferred *deferred;
 	u_char *end;
 
 	if (rspamd_log == NULL) {
@@ -402,6 +884,12 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log,
 		}
 	}
 	else if (log_level <= rspamd_log->cfg->log_level) {
+		if ((deferred = rspamd_log_deferred_get ()) != NULL) {
+			rspamd_log_deferred_addv (deferred, rspamd_log, function,
+					log_level, FALSE, fmt, args);
+			return;
+		}
+
 		rspamd_mempool_lock_mutex (rspamd_log->mtx);
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, args);
 		*end = '\0';
@@ -481,6 +969,11 @@ file_log_helper (rspamd_logger_t *rspamd_log,
 	size_t len = 0;
 	gint i;
 
+	if (rspamd_log->is_async &&
+		rspamd_log_ring_push (rspamd_log, iov, iovcnt)) {
+		return;
+	}
+
 	if (!rspamd_log->is_buffered) {
 		/* Write string directly */
 		direct_write_log_line (rspamd_log, (void *)iov, iovcnt, TRUE);
@@ -774,6 +1267,7 @@ rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 	rspamd_inet_addr_t *addr, const gchar *function, const gchar *fmt, ...)
 {
 	static gchar logbuf[BUFSIZ];
+	struct rspamd_log_deferred *deferred;
 	va_list vp;
 	u_char *end;
 
@@ -785,8 +1279,16 @@ rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 				return;
 			}
 		}
-		rspamd_mempool_lock_mutex (rspamd_log->mtx);
 		va_start (vp, fmt);
+
+		if ((deferred = rspamd_log_deferred_get ()) != NULL) {
+			rspamd_log_deferred_addv (deferred, rspamd_log, function,
+					G_LOG_LEVEL_DEBUG, TRUE, fmt, vp);
+			va_end (vp);
+			return;
+		}
+
+		rspamd_mempool_lock_mutex (rspamd_log->mtx);
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
 		rspamd_escape_log_string (logbuf);
@@ -810,8 +1312,15 @@ rspamd_glib_log_function (const gchar *log_domain,
 	gpointer arg)
 {
 	rspamd_logger_t *rspamd_log = arg;
+	struct rspamd_log_deferred *deferred;
 
 	if (rspamd_log->enabled) {
+		if ((deferred = rspamd_log_deferred_get ()) != NULL) {
+			rspamd_log_deferred_add (deferred, rspamd_log, log_domain, NULL,
+					log_level, FALSE, message);
+			return;
+		}
+
 		rspamd_mempool_lock_mutex (rspamd_log->mtx);
 		rspamd_log->log_func (log_domain,
 			NULL,
@@ -72,6 +72,26 @@ void rspamd_common_logv (rspamd_logger_t *logger,
 	const gchar *fmt,
 	va_list args);
 
+struct rspamd_log_deferred;
+
+/**
+ * Start collecting log lines of the current thread instead of writing them,
+ * it is used for threads that cannot use logger directly
+ */
+void rspamd_log_defer_start (void);
+
+/**
+ * Stop collecting log lines of the current thread
+ * @return lines collected or NULL if nothing has been logged
+ */
+struct rspamd_log_deferred * rspamd_log_defer_stop (void);
+
+/**
+ * Write and free lines collected, must be called from the main thread
+ * @param deferred lines returned by `rspamd_log_defer_stop`
+ */
+void rspamd_log_deferred_flush (struct rspamd_log_deferred *deferred);
+
 /**
  * Conditional debug function
  */
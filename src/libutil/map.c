@@ -31,6 +31,8 @@
 #include "main.h"
 #include "util.h"
 #include "mem_pool.h"
+#include "xxhash.h"
+#include "ottery.h"
 
 static const gchar *hash_fill = "1";
 
@@ -74,6 +76,510 @@ struct http_callback_data {
 #define HTTP_CONNECT_TIMEOUT 2
 #define HTTP_READ_TIMEOUT 10
 
+#define RSPAMD_MAP_HASH_MAGIC "rmaphsh\1"
+
+struct rspamd_map_hash_hdr {
+	gchar magic[8];
+	guint64 seed;
+	guint32 nelts;
+	guint32 nbuckets;           /**< power of two							*/
+	guint32 strings_len;
+	guint32 unused;
+	/* Buckets, entries sorted by keys and strings follow */
+};
+
+struct rspamd_map_hash_entry {
+	guint32 key;                /**< offsets of strings						*/
+	guint32 value;
+};
+
+struct rspamd_map_hash {
+	const guchar *data;
+	gsize len;
+	gboolean mapped;
+};
+
+/**
+ * State of a compiled map shared between processes
+ */
+struct rspamd_map_shared {
+	volatile gint generation;   /**< last published version					*/
+	pid_t owner;                /**< process that has created the map		*/
+	time_t mtime;               /**< mtime of the published file map		*/
+};
+
+static guint64
+rspamd_map_hash_key (const gchar *key, gsize len, guint64 seed)
+{
+	XXH64_state_t st;
+	gchar buf[64];
+	gsize i, n;
+
+	XXH64_reset (&st, seed);
+
+	while (len > 0) {
+		n = MIN (len, sizeof (buf));
+
+		for (i = 0; i < n; i ++) {
+			buf[i] = g_ascii_tolower (key[i]);
+		}
+
+		XXH64_update (&st, buf, n);
+		key += n;
+		len -= n;
+	}
+
+	return XXH64_digest (&st);
+}
+
+static gint
+rspamd_map_hash_key_cmp (gconstpointer a, gconstpointer b)
+{
+	return g_ascii_strcasecmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+/*
+ * Compile hash table of strings to the sorted table of strings with an open
+ * addressing index
+ */
+static guchar *
+rspamd_map_hash_compile (GHashTable *tbl, gsize *len)
+{
+	struct rspamd_map_hash_hdr *hdr;
+	struct rspamd_map_hash_entry *entries;
+	GHashTableIter it;
+	GPtrArray *keys;
+	gpointer k, v;
+	guint32 *buckets, nbuckets = 1, i, b, strings_len = 0;
+	const gchar *key, *value;
+	gchar *strings;
+	gsize klen, vlen;
+	guchar *res;
+
+	keys = g_ptr_array_sized_new (g_hash_table_size (tbl));
+	g_hash_table_iter_init (&it, tbl);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_ptr_array_add (keys, k);
+		strings_len += strlen (k) + strlen (v) + 2;
+	}
+
+	g_ptr_array_sort (keys, rspamd_map_hash_key_cmp);
+
+	/* Keep load factor below 0.5 */
+	while (nbuckets < keys->len * 2) {
+		nbuckets <<= 1;
+	}
+
+	*len = sizeof (*hdr) + nbuckets * sizeof (*buckets) +
+			keys->len * sizeof (*entries) + strings_len;
+	res = g_malloc0 (*len);
+	hdr = (struct rspamd_map_hash_hdr *)res;
+	memcpy (hdr->magic, RSPAMD_MAP_HASH_MAGIC, sizeof (hdr->magic));
+	hdr->seed = ottery_rand_uint64 ();
+	hdr->nelts = keys->len;
+	hdr->nbuckets = nbuckets;
+	hdr->strings_len = strings_len;
+	buckets = (guint32 *)(res + sizeof (*hdr));
+	entries = (struct rspamd_map_hash_entry *)(buckets + nbuckets);
+	strings = (gchar *)(entries + keys->len);
+	strings_len = 0;
+
+	for (i = 0; i < keys->len; i ++) {
+		key = g_ptr_array_index (keys, i);
+		value = g_hash_table_lookup (tbl, key);
+		klen = strlen (key);
+		vlen = strlen (value);
+
+		entries[i].key = strings_len;
+		memcpy (strings + strings_len, key, klen + 1);
+		strings_len += klen + 1;
+		entries[i].value = strings_len;
+		memcpy (strings + strings_len, value, vlen + 1);
+		strings_len += vlen + 1;
+
+		b = rspamd_map_hash_key (key, klen, hdr->seed) & (nbuckets - 1);
+
+		while (buckets[b] != 0) {
+			b = (b + 1) & (nbuckets - 1);
+		}
+
+		buckets[b] = i + 1;
+	}
+
+	g_ptr_array_free (keys, TRUE);
+
+	return res;
+}
+
+static struct rspamd_map_hash *
+rspamd_map_hash_new (const guchar *data, gsize len, gboolean mapped)
+{
+	const struct rspamd_map_hash_hdr *hdr;
+	const struct rspamd_map_hash_entry *entries;
+	const guint32 *buckets;
+	const gchar *strings;
+	struct rspamd_map_hash *h;
+	guint32 i;
+
+	/* Check data as it can be read from a file */
+	if (len < sizeof (*hdr)) {
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_map_hash_hdr *)data;
+
+	if (memcmp (hdr->magic, RSPAMD_MAP_HASH_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->nbuckets == 0 || (hdr->nbuckets & (hdr->nbuckets - 1)) != 0 ||
+			hdr->nelts > hdr->nbuckets ||
+			len != sizeof (*hdr) + (gsize)hdr->nbuckets * sizeof (*buckets) +
+			(gsize)hdr->nelts * sizeof (*entries) + hdr->strings_len) {
+		return NULL;
+	}
+
+	buckets = (const guint32 *)(data + sizeof (*hdr));
+	entries = (const struct rspamd_map_hash_entry *)(buckets + hdr->nbuckets);
+	strings = (const gchar *)(entries + hdr->nelts);
+
+	if (hdr->strings_len > 0 && strings[hdr->strings_len - 1] != '\0') {
+		return NULL;
+	}
+
+	for (i = 0; i < hdr->nbuckets; i ++) {
+		if (buckets[i] > hdr->nelts) {
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < hdr->nelts; i ++) {
+		if (entries[i].key >= hdr->strings_len ||
+				entries[i].value >= hdr->strings_len) {
+			return NULL;
+		}
+	}
+
+	h = g_slice_alloc (sizeof (*h));
+	h->data = data;
+	h->len = len;
+	h->mapped = mapped;
+
+	return h;
+}
+
+const gchar *
+rspamd_map_hash_lookup (struct rspamd_map_hash *h, const gchar *key)
+{
+	const struct rspamd_map_hash_hdr *hdr;
+	const struct rspamd_map_hash_entry *entry;
+	const guint32 *buckets;
+	const gchar *strings;
+	guint32 i, b, idx, mask;
+
+	if (h == NULL || key == NULL) {
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_map_hash_hdr *)h->data;
+
+	if (hdr->nelts == 0) {
+		return NULL;
+	}
+
+	buckets = (const guint32 *)(h->data + sizeof (*hdr));
+	entry = (const struct rspamd_map_hash_entry *)(buckets + hdr->nbuckets);
+	strings = (const gchar *)(entry + hdr->nelts);
+	mask = hdr->nbuckets - 1;
+	b = rspamd_map_hash_key (key, strlen (key), hdr->seed) & mask;
+
+	for (i = 0; i < hdr->nbuckets; i ++) {
+		idx = buckets[b];
+
+		if (idx == 0) {
+			break;
+		}
+
+		if (g_ascii_strcasecmp (strings + entry[idx - 1].key, key) == 0) {
+			return strings + entry[idx - 1].value;
+		}
+
+		b = (b + 1) & mask;
+	}
+
+	return NULL;
+}
+
+gsize
+rspamd_map_hash_size (struct rspamd_map_hash *h)
+{
+	if (h == NULL) {
+		return 0;
+	}
+
+	return ((const struct rspamd_map_hash_hdr *)h->data)->nelts;
+}
+
+void
+rspamd_map_hash_destroy (struct rspamd_map_hash *h)
+{
+	if (h) {
+		if (h->mapped) {
+			munmap ((gpointer)h->data, h->len);
+		}
+		else {
+			g_free ((gpointer)h->data);
+		}
+
+		g_slice_free1 (sizeof (*h), h);
+	}
+}
+
+/*
+ * Create object of the map type from compiled data, data is released on
+ * failure
+ */
+static gpointer
+rspamd_map_compiled_new (struct rspamd_map *map, const guchar *data, gsize len,
+	gboolean mapped)
+{
+	gpointer res = NULL;
+
+	if (map->ctype == RSPAMD_MAP_HASH) {
+		res = rspamd_map_hash_new (data, len, mapped);
+	}
+	else if (map->ctype == RSPAMD_MAP_RADIX) {
+		res = radix_create_flat (data, len, mapped);
+	}
+
+	if (res == NULL) {
+		msg_err ("invalid compiled data for map %s", map->uri);
+
+		if (mapped) {
+			munmap ((gpointer)data, len);
+		}
+		else {
+			g_free ((gpointer)data);
+		}
+	}
+
+	return res;
+}
+
+static void
+rspamd_map_compiled_destroy (struct rspamd_map *map, gpointer obj)
+{
+	if (map->ctype == RSPAMD_MAP_HASH) {
+		rspamd_map_hash_destroy (obj);
+	}
+	else if (map->ctype == RSPAMD_MAP_RADIX) {
+		radix_destroy_compressed (obj);
+	}
+}
+
+static gchar *
+rspamd_map_shared_path (struct rspamd_map *map, gint generation)
+{
+	return g_strdup_printf ("%s/%u.%d", map->cfg->maps_dir, map->id,
+			generation);
+}
+
+/*
+ * Create a private directory for the files of shared maps. It is owned by
+ * workers, as they publish new versions of maps after fork.
+ */
+static gchar *
+rspamd_map_create_dir (struct rspamd_config *cfg)
+{
+	gchar *dir;
+
+	dir = g_strdup_printf ("%s/rspamd-maps-XXXXXX",
+			cfg->temp_dir ? cfg->temp_dir : "/tmp");
+
+	if (mkdtemp (dir) == NULL) {
+		msg_warn ("cannot create directory for shared maps %s: %s, maps are "
+				"not shared", dir, strerror (errno));
+		g_free (dir);
+
+		return NULL;
+	}
+
+	if (geteuid () == 0 && rspamd_main != NULL &&
+			rspamd_main->workers_uid != (uid_t)-1 &&
+			chown (dir, rspamd_main->workers_uid,
+					rspamd_main->workers_gid) == -1) {
+		msg_warn ("cannot chown %s: %s, maps are not shared", dir,
+				strerror (errno));
+		rmdir (dir);
+		g_free (dir);
+
+		return NULL;
+	}
+
+	return dir;
+}
+
+/*
+ * Write compiled data to a new generation of the shared map and return the
+ * mapping of that file. If the map is not shared or the file cannot be written
+ * then data is returned as is.
+ */
+static const guchar *
+rspamd_map_publish (struct rspamd_map *map, guchar *blob, gsize len,
+	gboolean *mapped)
+{
+	gchar *path, *tmp_path;
+	gint fd, generation;
+	gpointer res = MAP_FAILED;
+	gssize r;
+	gsize written = 0;
+
+	*mapped = FALSE;
+
+	if (map->shared == NULL || map->cfg->maps_dir == NULL) {
+		return blob;
+	}
+
+	generation = g_atomic_int_get (&map->shared->generation) + 1;
+	path = rspamd_map_shared_path (map, generation);
+	/* Created with mode 0600 and O_EXCL */
+	tmp_path = g_strdup_printf ("%s/.new-XXXXXX", map->cfg->maps_dir);
+	fd = mkstemp (tmp_path);
+
+	if (fd == -1) {
+		msg_warn ("cannot create %s: %s, map %s is not shared", tmp_path,
+				strerror (errno), map->uri);
+		g_free (tmp_path);
+		g_free (path);
+
+		return blob;
+	}
+
+	while (written < len) {
+		r = write (fd, blob + written, len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		written += r;
+	}
+
+	if (written == len) {
+		res = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	}
+
+	close (fd);
+
+	if (res == MAP_FAILED || rename (tmp_path, path) == -1) {
+		msg_warn ("cannot publish %s: %s, map %s is not shared", path,
+				strerror (errno), map->uri);
+
+		if (res != MAP_FAILED) {
+			munmap (res, len);
+		}
+
+		unlink (tmp_path);
+		g_free (tmp_path);
+		g_free (path);
+
+		return blob;
+	}
+
+	g_free (tmp_path);
+	g_free (path);
+
+	/* Processes that use the previous generation have it mapped */
+	if (generation > 1) {
+		path = rspamd_map_shared_path (map, generation - 1);
+		unlink (path);
+		g_free (path);
+	}
+
+	g_atomic_int_set (&map->shared->generation, generation);
+	map->generation = generation;
+	g_free (blob);
+	*mapped = TRUE;
+
+	return res;
+}
+
+/*
+ * Switch to the last published generation of the map
+ */
+static void
+rspamd_map_attach (struct rspamd_map *map)
+{
+	gchar *path;
+	gint fd, generation;
+	struct stat st;
+	gpointer data, obj;
+
+	generation = g_atomic_int_get (&map->shared->generation);
+	path = rspamd_map_shared_path (map, generation);
+
+	if ((fd = open (path, O_RDONLY | O_NOFOLLOW)) == -1) {
+		/* Likely a newer generation is published, try again later */
+		msg_info ("cannot open %s: %s", path, strerror (errno));
+		g_free (path);
+		return;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		msg_err ("cannot stat %s: %s", path, strerror (errno));
+		close (fd);
+		g_free (path);
+		return;
+	}
+
+	/* Files are written by this user or by root before workers are spawned */
+	if (!S_ISREG (st.st_mode) || (st.st_uid != geteuid () && st.st_uid != 0) ||
+			(st.st_mode & (S_IWGRP | S_IWOTH))) {
+		msg_err ("refuse to use %s: it is not a regular file owned by us "
+				"or it is writable by others", path);
+		close (fd);
+		map->generation = generation;
+		g_free (path);
+		return;
+	}
+
+	if (st.st_size == 0 ||
+			(data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+			== MAP_FAILED) {
+		msg_err ("cannot map %s: %s", path, strerror (errno));
+		close (fd);
+		g_free (path);
+		return;
+	}
+
+	close (fd);
+	obj = rspamd_map_compiled_new (map, data, st.st_size, TRUE);
+
+	if (obj != NULL) {
+		msg_info ("use version %d of map %s", generation, map->uri);
+		rspamd_map_compiled_destroy (map, *map->user_data);
+		*map->user_data = obj;
+	}
+
+	/* Do not retry broken data */
+	map->generation = generation;
+	g_free (path);
+}
+
+/*
+ * Strings of compiled maps are copied, so the temporary pool can be cleaned
+ */
+static void
+rspamd_map_compiled_done (struct rspamd_map *map)
+{
+	if (map->ctype != RSPAMD_MAP_CUSTOM) {
+		rspamd_mempool_delete (map->pool);
+		map->pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	}
+}
+
 /**
  * Helper for HTTP connection establishment
  */
@@ -165,6 +671,7 @@ http_map_finish (struct rspamd_http_connection *conn,
 
 		map->fin_callback (map->pool, &cbd->cbdata);
 		*map->user_data = cbd->cbdata.cur_data;
+		rspamd_map_compiled_done (map);
 		cbd->data->last_checked = msg->date;
 		msg_info ("read map data from %s", cbd->data->host);
 	}
@@ -274,6 +781,7 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data)
 	if (tlen > 0) {
 		map->fin_callback (map->pool, &cbdata);
 		*map->user_data = cbdata.cur_data;
+		rspamd_map_compiled_done (map);
 	}
 }
 
@@ -300,6 +808,15 @@ file_callback (gint fd, short what, void *ud)
 	struct rspamd_map *map = ud;
 	struct file_map_data *data = map->map_data;
 	struct stat st;
+	time_t mtime;
+
+	if (map->shared != NULL &&
+			g_atomic_int_get (&map->shared->generation) != map->generation) {
+		/* Map has been recompiled by another process */
+		rspamd_map_attach (map);
+		jitter_timeout_event (map, FALSE, FALSE);
+		return;
+	}
 
 	if (g_atomic_int_get (map->locked)) {
 		msg_info (
@@ -310,11 +827,16 @@ file_callback (gint fd, short what, void *ud)
 
 	g_atomic_int_inc (map->locked);
 	jitter_timeout_event (map, FALSE, FALSE);
+	/* Shared maps are checked against the version published */
+	mtime = map->shared ? map->shared->mtime : data->st.st_mtime;
 	if (stat (data->filename,
 		&st) != -1 &&
-		(st.st_mtime > data->st.st_mtime || data->st.st_mtime == -1)) {
+		(st.st_mtime > mtime || mtime == -1)) {
 		/* File was modified since last check */
 		memcpy (&data->st, &st, sizeof (struct stat));
+		if (map->shared) {
+			map->shared->mtime = st.st_mtime;
+		}
 	}
 	else {
 		g_atomic_int_set (map->locked, 0);
@@ -393,7 +915,21 @@ rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 			evtimer_set (&map->ev, file_callback, map);
 			/* Read initial data */
 			fdata = map->map_data;
-			if (fdata->st.st_mtime != -1) {
+			if (map->shared != NULL) {
+				if (g_atomic_int_get (&map->shared->generation) > 0) {
+					/* Usually it has been inherited from the main process */
+					if (map->generation !=
+						g_atomic_int_get (&map->shared->generation)) {
+						rspamd_map_attach (map);
+					}
+				}
+				else if (fdata->st.st_mtime != -1 &&
+					g_atomic_int_compare_and_exchange (map->locked, 0, 1)) {
+					read_map_file (map, map->map_data);
+					g_atomic_int_set (map->locked, 0);
+				}
+			}
+			else if (fdata->st.st_mtime != -1) {
 				/* Do not try to read non-existent file */
 				read_map_file (map, map->map_data);
 			}
@@ -408,9 +944,67 @@ rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 	}
 }
 
+void
+rspamd_map_preload (struct rspamd_config *cfg)
+{
+	GList *cur = cfg->maps;
+	struct rspamd_map *map;
+	struct file_map_data *fdata;
+
+	while (cur) {
+		map = cur->data;
+		if (map->shared != NULL) {
+			if (cfg->maps_dir == NULL) {
+				cfg->maps_dir = rspamd_map_create_dir (cfg);
+			}
+
+			fdata = map->map_data;
+			if (fdata->st.st_mtime != -1) {
+				read_map_file (map, fdata);
+			}
+			map->shared->mtime = fdata->st.st_mtime;
+		}
+		cur = g_list_next (cur);
+	}
+
+	cfg->maps_preloaded = TRUE;
+}
+
 void
 rspamd_map_remove_all (struct rspamd_config *cfg)
 {
+	GList *cur = cfg->maps;
+	struct rspamd_map *map;
+	gchar *path;
+	gint generation;
+	gboolean owner = FALSE;
+
+	/* Remove files of the maps published */
+	while (cur) {
+		map = cur->data;
+		if (map->shared != NULL && map->shared->owner == getpid ()) {
+			owner = TRUE;
+
+			if (cfg->maps_dir != NULL &&
+				(generation = g_atomic_int_get (&map->shared->generation)) > 0) {
+				path = rspamd_map_shared_path (map, generation);
+				unlink (path);
+				g_free (path);
+			}
+		}
+		cur = g_list_next (cur);
+	}
+
+	if (cfg->maps_dir != NULL) {
+		/* Old workers could still publish maps there, so it may be kept */
+		if (owner && rmdir (cfg->maps_dir) == -1) {
+			msg_info ("cannot remove %s: %s", cfg->maps_dir, strerror (errno));
+		}
+
+		g_free (cfg->maps_dir);
+		cfg->maps_dir = NULL;
+	}
+
 	g_list_free (cfg->maps);
 	cfg->maps = NULL;
 	if (cfg->map_pool != NULL) {
@@ -483,6 +1077,14 @@ rspamd_map_add (struct rspamd_config *cfg,
 	new_map->locked =
 		rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (gint));
 
+	if (read_callback == rspamd_hosts_read ||
+		read_callback == rspamd_kv_list_read) {
+		new_map->ctype = RSPAMD_MAP_HASH;
+	}
+	else if (read_callback == rspamd_radix_read) {
+		new_map->ctype = RSPAMD_MAP_RADIX;
+	}
+
 	if (proto == MAP_PROTO_FILE) {
 		new_map->uri = rspamd_mempool_strdup (cfg->cfg_pool, def);
 		def = new_map->uri;
@@ -517,6 +1119,17 @@ rspamd_map_add (struct rspamd_config *cfg,
 		}
 		fdata->filename = rspamd_mempool_strdup (cfg->map_pool, def);
 		new_map->map_data = fdata;
+
+		/*
+		 * Maps added by workers after fork are private: nobody else can
+		 * attach them and their files would never be removed
+		 */
+		if (new_map->ctype != RSPAMD_MAP_CUSTOM && !cfg->maps_preloaded) {
+			new_map->shared = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+					sizeof (struct rspamd_map_shared));
+			new_map->shared->owner = getpid ();
+			new_map->shared->mtime = fdata->st.st_mtime;
+		}
 	}
 	else if (proto == MAP_PROTO_HTTP) {
 		hdata =
@@ -815,17 +1428,37 @@ rspamd_hosts_read (rspamd_mempool_t * pool,
 			   (insert_func) g_hash_table_insert);
 }
 
-void
-rspamd_hosts_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
+/*
+ * Compile hash table of a hosts or kv list and publish it
+ */
+static void
+rspamd_map_hash_fin (struct map_cb_data *data)
 {
+	GHashTable *tbl = data->cur_data;
+	guchar *blob;
+	const guchar *res;
+	gsize len;
+	gboolean mapped;
+
 	if (data->prev_data) {
-		g_hash_table_destroy (data->prev_data);
+		rspamd_map_hash_destroy (data->prev_data);
 	}
-	if (data->cur_data) {
-		msg_info ("read hash of %z elements", g_hash_table_size (data->cur_data));
+	if (tbl) {
+		blob = rspamd_map_hash_compile (tbl, &len);
+		g_hash_table_destroy (tbl);
+		res = rspamd_map_publish (data->map, blob, len, &mapped);
+		data->cur_data = rspamd_map_compiled_new (data->map, res, len, mapped);
+		msg_info ("read hash of %z elements",
+				rspamd_map_hash_size (data->cur_data));
 	}
 }
 
+void
+rspamd_hosts_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
+{
+	rspamd_map_hash_fin (data);
+}
+
 gchar *
 rspamd_kv_list_read (rspamd_mempool_t * pool,
 	gchar * chunk,
@@ -846,12 +1479,7 @@ rspamd_kv_list_read (rspamd_mempool_t * pool,
 void
 rspamd_kv_list_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
-	if (data->prev_data) {
-		g_hash_table_destroy (data->prev_data);
-	}
-	if (data->cur_data) {
-		msg_info ("read hash of %z elements", g_hash_table_size (data->cur_data));
-	}
+	rspamd_map_hash_fin (data);
 }
 
 gchar *
@@ -861,7 +1489,7 @@ rspamd_radix_read (rspamd_mempool_t * pool,
 	struct map_cb_data *data)
 {
 	if (data->cur_data == NULL) {
-		data->cur_data = radix_create_compressed ();
+		data->cur_data = radix_create_compressed_flattenable ();
 	}
 	return rspamd_parse_abstract_list (pool,
 			   chunk,
@@ -873,10 +1501,21 @@ rspamd_radix_read (rspamd_mempool_t * pool,
 void
 rspamd_radix_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
+	radix_compressed_t *tree = data->cur_data;
+	guchar *blob;
+	const guchar *res;
+	gsize len;
+	gboolean mapped;
+
 	if (data->prev_data) {
 		radix_destroy_compressed (data->prev_data);
 	}
-	if (data->cur_data) {
-		msg_info ("read radix trie of %z elements", radix_get_size (data->cur_data));
+	if (tree) {
+		blob = radix_flatten_compressed (tree, &len);
+		radix_destroy_compressed (tree);
+		res = rspamd_map_publish (data->map, blob, len, &mapped);
+		data->cur_data = rspamd_map_compiled_new (data->map, res, len, mapped);
+		msg_info ("read radix trie of %z elements",
+				radix_get_size (data->cur_data));
 	}
 }
@@ -15,7 +15,19 @@ enum fetch_proto {
 	MAP_PROTO_FILE,
 	MAP_PROTO_HTTP,
 };
+
+/**
+ * Maps read by the common callbacks are compiled to immutable structures, file
+ * maps are compiled once and shared between all processes
+ */
+enum rspamd_map_compiled_type {
+	RSPAMD_MAP_CUSTOM = 0,
+	RSPAMD_MAP_HASH,
+	RSPAMD_MAP_RADIX
+};
+
 struct map_cb_data;
+struct rspamd_map_shared;
 
 /**
  * Callback types
@@ -45,6 +57,11 @@ struct rspamd_map {
 	guint32 checksum;
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	gint *locked;
+	enum rspamd_map_compiled_type ctype;
+	/* Published version of a compiled map (NULL if not shared) */
+	struct rspamd_map_shared *shared;
+	/* Version used by this process */
+	gint generation;
 };
 
 /**
@@ -77,6 +94,12 @@ gboolean rspamd_map_add (struct rspamd_config *cfg,
  */
 void rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base);
 
+/**
+ * Compile shared maps before spawning workers, so workers inherit them
+ * without reading
+ */
+void rspamd_map_preload (struct rspamd_config *cfg);
+
 /**
  * Remove all maps watched (remove events)
  */
@@ -98,6 +121,30 @@ gchar * rspamd_radix_read (rspamd_mempool_t *pool,
 	struct map_cb_data *data);
 void rspamd_radix_fin (rspamd_mempool_t *pool, struct map_cb_data *data);
 
+/**
+ * Immutable case insensitive hash produced by hosts and kv lists
+ */
+struct rspamd_map_hash;
+
+/**
+ * Find value of the key in the hash
+ * @param h hash (can be NULL)
+ * @param key key to find
+ * @return value or NULL if key has not been found
+ */
+const gchar * rspamd_map_hash_lookup (struct rspamd_map_hash *h,
+	const gchar *key);
+
+/**
+ * Returns number of elements in the hash
+ */
+gsize rspamd_map_hash_size (struct rspamd_map_hash *h);
+
+/**
+ * Destroy hash
+ */
+void rspamd_map_hash_destroy (struct rspamd_map_hash *h);
+
 /**
  * Host list is an ordinal list of hosts or domains
  */
@@ -45,29 +45,101 @@ struct radix_compressed_node {
 };
 
 
+/*
+ * Prefix inserted to the trie, used to build multibit tables
+ */
+struct radix_prefix {
+	guint8 key[16];
+	guint8 keylen;
+	guint8 plen;
+	uintptr_t value;
+	struct radix_prefix *next;
+};
+
 struct radix_tree_compressed {
 	struct radix_compressed_node *root;
 	rspamd_mempool_t *pool;
 	size_t size;
+	struct radix_prefix *prefixes;
+	struct radix_prefix *prefixes_tail;
+	gboolean keep_prefixes;
+	gboolean pop_unsupported;
+	/* Flat trees are immutable and have no pool */
+	const guchar *flat;
+	gsize flat_len;
+	gboolean flat_mapped;
+	/* Multibit tables for IPv4 and IPv6 keys (can be NULL) */
+	const guchar *pop[2];
+};
+
+#define RADIX_FLAT_MAGIC "rradix\0\2"
+#define RADIX_FLAT_NONE G_MAXUINT32
+
+struct radix_flat_hdr {
+	gchar magic[8];
+	guint64 size;
+	guint32 nnodes;
+	guint32 keys_len;
+	guint32 pop_len;            /**< length of multibit tables or 0			*/
+	guint32 unused;
+};
+
+/*
+ * Multibit tables (poptrie): each node covers RADIX_POP_STRIDE bits of a key,
+ * `vector` marks slots that have child nodes and `leafvec` marks slots where
+ * the leaf value changes, so children and leaves are stored in contiguous
+ * arrays indexed by popcount of these bitmaps
+ */
+#define RADIX_POP_STRIDE 6
+#define RADIX_POP_SLOTS (1U << RADIX_POP_STRIDE)
+#define RADIX_POP_ALIGN(len) (((len) + 7) & ~((gsize)7))
+
+struct radix_pop_hdr {
+	guint32 nnodes;
+	guint32 nleaves;
+};
+
+struct radix_pop_node {
+	guint64 vector;
+	guint64 leafvec;
+	guint32 base0;              /**< index of the first leaf				*/
+	guint32 base1;              /**< index of the first child				*/
+};
+
+struct radix_pop_build_node {
+	struct radix_pop_build_node *child[2];
+	uintptr_t value;
+};
+
+/*
+ * Node of a flat trie: children are indexes of nodes, compressed leaves
+ * store offset and length of their key in the keys area instead
+ */
+struct radix_flat_node {
+	guint64 value;
+	guint32 left;
+	guint32 right;
+	guint32 level;
+	guint32 skipped;
 };
 
 static gboolean
-radix_compare_compressed (struct radix_compressed_node *node,
+radix_compare_key (const guint8 *nkey, guint nkeylen, guint level,
 		guint8 *key, guint keylen, guint cur_level)
 {
-	guint8 *nk;
+	const guint8 *nk;
 	guint8 *k;
 	guint8 bit;
 	guint shift, rbits, skip;
 
-	if (node->d.s.keylen > keylen) {
+	if (nkeylen > keylen) {
 		/* Obvious case */
 		return FALSE;
 	}
 
 
 	/* Compare byte aligned levels of a compressed node */
-	shift = node->d.s.level / NBBY;
+	shift = level / NBBY;
 	/*
 	 * We know that at least of cur_level bits are the same,
 	 * se we can optimize search slightly
@@ -75,15 +147,15 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	if (shift > 0) {
 		skip = cur_level / NBBY;
 		if (shift > skip &&
-				memcmp (node->d.s.key + skip, key + skip, shift - skip) != 0) {
+				memcmp (nkey + skip, key + skip, shift - skip) != 0) {
 			return FALSE;
 		}
 	}
 
-	rbits = node->d.s.level % NBBY;
+	rbits = level % NBBY;
 	if (rbits > 0) {
 		/* Precisely compare remaining bits */
-		nk = node->d.s.key + shift;
+		nk = nkey + shift;
 		k = key + shift;
 
 		bit = 1U << 7;
@@ -100,6 +172,136 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	return TRUE;
 }
 
+static inline gboolean
+radix_compare_compressed (struct radix_compressed_node *node,
+		guint8 *key, guint keylen, guint cur_level)
+{
+	return radix_compare_key (node->d.s.key, node->d.s.keylen, node->d.s.level,
+			key, keylen, cur_level);
+}
+
+static inline guint
+radix_popcount (guint64 v)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll (v);
+#else
+	v = v - ((v >> 1) & G_GUINT64_CONSTANT (0x5555555555555555));
+	v = (v & G_GUINT64_CONSTANT (0x3333333333333333)) +
+			((v >> 2) & G_GUINT64_CONSTANT (0x3333333333333333));
+	v = (v + (v >> 4)) & G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f);
+
+	return (v * G_GUINT64_CONSTANT (0x0101010101010101)) >> 56;
+#endif
+}
+
+/*
+ * Get RADIX_POP_STRIDE bits of a key starting from the specified bit, key is
+ * padded with zeroes
+ */
+static inline guint
+radix_pop_chunk (const guint8 *key, guint keylen, guint off)
+{
+	guint byte = off / NBBY, shift = off % NBBY;
+	guint w;
+
+	w = (byte < keylen ? key[byte] : 0) << NBBY;
+	w |= byte + 1 < keylen ? key[byte + 1] : 0;
+
+	return (w >> (2 * NBBY - RADIX_POP_STRIDE - shift)) & (RADIX_POP_SLOTS - 1);
+}
+
+static uintptr_t
+radix_find_pop (const guchar *pop, const guint8 *key, guint keylen)
+{
+	const struct radix_pop_hdr *hdr = (const struct radix_pop_hdr *)pop;
+	const struct radix_pop_node *nodes, *node;
+	const guint64 *leaves;
+	guint off = 0, v;
+	guint64 bmask;
+
+	nodes = (const struct radix_pop_node *)(pop + sizeof (*hdr));
+	leaves = (const guint64 *)(nodes + hdr->nnodes);
+	node = &nodes[0];
+	v = radix_pop_chunk (key, keylen, 0);
+
+	while (node->vector & (G_GUINT64_CONSTANT (1) << v)) {
+		bmask = (G_GUINT64_CONSTANT (2) << v) - 1;
+		node = &nodes[node->base1 + radix_popcount (node->vector & bmask) - 1];
+		off += RADIX_POP_STRIDE;
+		v = radix_pop_chunk (key, keylen, off);
+	}
+
+	bmask = (G_GUINT64_CONSTANT (2) << v) - 1;
+
+	return (uintptr_t)leaves[node->base0 +
+			radix_popcount (node->leafvec & bmask) - 1];
+}
+
+static uintptr_t
+radix_find_flat (radix_compressed_t * tree, guint8 *key, gsize keylen)
+{
+	const struct radix_flat_hdr *hdr;
+	const struct radix_flat_node *nodes, *node;
+	const guint8 *keys;
+	guint32 bit, idx;
+	gsize kremain = keylen / sizeof (guint32);
+	uintptr_t value;
+	guint32 *k = (guint32 *)key;
+	guint32 kv = ntohl (*k);
+	guint cur_level = 0;
+
+	if (keylen == 4 && tree->pop[0] != NULL) {
+		return radix_find_pop (tree->pop[0], key, keylen);
+	}
+	else if (keylen == 16 && tree->pop[1] != NULL) {
+		return radix_find_pop (tree->pop[1], key, keylen);
+	}
+
+	hdr = (const struct radix_flat_hdr *)tree->flat;
+	nodes = (const struct radix_flat_node *)(tree->flat + sizeof (*hdr));
+	keys = (const guint8 *)(nodes + hdr->nnodes);
+
+	bit = 1U << 31;
+	value = RADIX_NO_VALUE;
+	idx = hdr->nnodes > 0 ? 0 : RADIX_FLAT_NONE;
+
+	while (idx != RADIX_FLAT_NONE && kremain) {
+		node = &nodes[idx];
+
+		if (node->skipped) {
+			if (radix_compare_key (keys + node->left, node->right, node->level,
+					key, keylen, cur_level)) {
+				return (uintptr_t)node->value;
+			}
+			else {
+				return value;
+			}
+		}
+		if ((uintptr_t)node->value != RADIX_NO_VALUE) {
+			value = node->value;
+		}
+
+		if (kv & bit) {
+			idx = node->right;
+		}
+		else {
+			idx = node->left;
+		}
+
+		bit >>= 1;
+		if (bit == 0) {
+			k ++;
+			bit = 1U << 31;
+			kv = ntohl (*k);
+			kremain --;
+		}
+		cur_level ++;
+	}
+
+	return value;
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 {
@@ -111,6 +313,10 @@ radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 	guint32 kv = ntohl (*k);
 	guint cur_level = 0;
 
+	if (tree->flat != NULL) {
+		return radix_find_flat (tree, key, keylen);
+	}
+
 	bit = 1U << 31;
 	value = RADIX_NO_VALUE;
 	node = tree->root;
@@ -394,6 +600,41 @@ radix_uncompress_node (radix_compressed_t *tree,
 }
 
 
+/*
+ * Save prefix to build multibit tables on flattening
+ */
+static void
+radix_add_prefix (radix_compressed_t *tree, const guint8 *key, gsize keylen,
+		guint plen, uintptr_t value)
+{
+	struct radix_prefix *pfx;
+
+	if (!tree->keep_prefixes) {
+		/* Most of tries are never flattened */
+		return;
+	}
+
+	if (keylen != 4 && keylen != 16) {
+		tree->pop_unsupported = TRUE;
+		return;
+	}
+
+	pfx = rspamd_mempool_alloc0 (tree->pool, sizeof (*pfx));
+	memcpy (pfx->key, key, keylen);
+	pfx->keylen = keylen;
+	pfx->plen = plen;
+	pfx->value = value;
+
+	if (tree->prefixes_tail) {
+		tree->prefixes_tail->next = pfx;
+	}
+	else {
+		tree->prefixes = pfx;
+	}
+
+	tree->prefixes_tail = pfx;
+}
+
 uintptr_t
 radix_insert_compressed (radix_compressed_t * tree,
 	guint8 *key, gsize keylen,
@@ -408,12 +649,16 @@ radix_insert_compressed (radix_compressed_t * tree,
 	gsize kremain = keylen;
 	uintptr_t oldval = RADIX_NO_VALUE;
 
+	g_return_val_if_fail (tree->flat == NULL, RADIX_NO_VALUE);
+
 	bit = 1U << 7;
 	node = tree->root;
 
 	g_assert (keybits >= masklen);
 	msg_debug ("want insert value %p with mask %z", value, masklen);
 
+	radix_add_prefix (tree, key, keylen, target_level, value);
+
 	node = tree->root;
 	next = node;
 	prev = &tree->root;
@@ -522,7 +767,7 @@ radix_create_compressed (void)
 {
 	radix_compressed_t *tree;
 
-	tree = g_slice_alloc (sizeof (*tree));
+	tree = g_slice_alloc0 (sizeof (*tree));
 	if (tree == NULL) {
 		return NULL;
 	}
@@ -534,15 +779,393 @@ radix_create_compressed (void)
 	return tree;
 }
 
+radix_compressed_t *
+radix_create_compressed_flattenable (void)
+{
+	radix_compressed_t *tree;
+
+	tree = radix_create_compressed ();
+	if (tree != NULL) {
+		tree->keep_prefixes = TRUE;
+	}
+
+	return tree;
+}
+
 void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
 	if (tree) {
-		rspamd_mempool_delete (tree->pool);
+		if (tree->flat != NULL) {
+			if (tree->flat_mapped) {
+				munmap ((gpointer)tree->flat, tree->flat_len);
+			}
+			else {
+				g_free ((gpointer)tree->flat);
+			}
+		}
+		else {
+			rspamd_mempool_delete (tree->pool);
+		}
+
 		g_slice_free1 (sizeof (*tree), tree);
 	}
 }
 
+static void
+radix_pop_insert (rspamd_mempool_t *pool, struct radix_pop_build_node *root,
+		struct radix_prefix *pfx)
+{
+	struct radix_pop_build_node *cur = root, **next;
+	guint i, bit;
+
+	for (i = 0; i < pfx->plen; i ++) {
+		bit = (pfx->key[i / NBBY] >> (NBBY - 1 - i % NBBY)) & 1;
+		next = &cur->child[bit];
+
+		if (*next == NULL) {
+			*next = rspamd_mempool_alloc0 (pool, sizeof (**next));
+			(*next)->value = RADIX_NO_VALUE;
+		}
+
+		cur = *next;
+	}
+
+	cur->value = pfx->value;
+}
+
+/*
+ * Fill node `idx` from a binary trie node, `def` is the value of the longest
+ * prefix matched above this node
+ */
+static void
+radix_pop_fill (struct radix_pop_build_node *bn, uintptr_t def, guint32 idx,
+		GArray *nodes, GArray *leaves)
+{
+	struct radix_pop_node pn;
+	struct radix_pop_build_node *cur, *children[RADIX_POP_SLOTS];
+	uintptr_t val, defs[RADIX_POP_SLOTS], last = RADIX_NO_VALUE;
+	guint64 leaf;
+	guint v, i, nchildren = 0;
+	gboolean have_leaf = FALSE;
+
+	memset (&pn, 0, sizeof (pn));
+	pn.base0 = leaves->len;
+
+	if (bn->value != RADIX_NO_VALUE) {
+		def = bn->value;
+	}
+
+	for (v = 0; v < RADIX_POP_SLOTS; v ++) {
+		cur = bn;
+		val = def;
+
+		for (i = 0; i < RADIX_POP_STRIDE && cur != NULL; i ++) {
+			cur = cur->child[(v >> (RADIX_POP_STRIDE - 1 - i)) & 1];
+
+			if (cur != NULL && cur->value != RADIX_NO_VALUE) {
+				val = cur->value;
+			}
+		}
+
+		if (cur != NULL && (cur->child[0] != NULL || cur->child[1] != NULL)) {
+			pn.vector |= G_GUINT64_CONSTANT (1) << v;
+			children[nchildren] = cur;
+			defs[nchildren ++] = val;
+		}
+		else if (!have_leaf || val != last) {
+			pn.leafvec |= G_GUINT64_CONSTANT (1) << v;
+			leaf = val;
+			g_array_append_val (leaves, leaf);
+			last = val;
+			have_leaf = TRUE;
+		}
+	}
+
+	/* Children of a node are contiguous and follow it */
+	pn.base1 = nodes->len;
+	g_array_set_size (nodes, nodes->len + nchildren);
+	g_array_index (nodes, struct radix_pop_node, idx) = pn;
+
+	for (i = 0; i < nchildren; i ++) {
+		radix_pop_fill (children[i], defs[i], pn.base1 + i, nodes, leaves);
+	}
+}
+
+/*
+ * Build multibit tables for keys of the specified length and append them to
+ * the output
+ */
+static void
+radix_pop_build (radix_compressed_t *tree, guint keylen, GByteArray *out)
+{
+	struct radix_pop_build_node *root;
+	struct radix_prefix *pfx;
+	struct radix_pop_hdr hdr;
+	rspamd_mempool_t *pool;
+	GArray *nodes, *leaves;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	root = rspamd_mempool_alloc0 (pool, sizeof (*root));
+	root->value = RADIX_NO_VALUE;
+
+	for (pfx = tree->prefixes; pfx != NULL; pfx = pfx->next) {
+		if (pfx->keylen == keylen) {
+			radix_pop_insert (pool, root, pfx);
+		}
+	}
+
+	nodes = g_array_new (FALSE, TRUE, sizeof (struct radix_pop_node));
+	leaves = g_array_new (FALSE, FALSE, sizeof (guint64));
+	g_array_set_size (nodes, 1);
+	radix_pop_fill (root, RADIX_NO_VALUE, 0, nodes, leaves);
+
+	hdr.nnodes = nodes->len;
+	hdr.nleaves = leaves->len;
+	g_byte_array_append (out, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (out, (const guint8 *)nodes->data,
+			nodes->len * sizeof (struct radix_pop_node));
+	g_byte_array_append (out, (const guint8 *)leaves->data,
+			leaves->len * sizeof (guint64));
+
+	g_array_free (nodes, TRUE);
+	g_array_free (leaves, TRUE);
+	rspamd_mempool_delete (pool);
+}
+
+/*
+ * Check multibit tables read from untrusted data, returns length of the
+ * tables or 0 if they are invalid
+ */
+static gsize
+radix_pop_check (const guchar *pop, gsize len)
+{
+	const struct radix_pop_hdr *hdr;
+	const struct radix_pop_node *nodes, *node;
+	gsize total;
+	guint32 i;
+
+	if (len < sizeof (*hdr)) {
+		return 0;
+	}
+
+	hdr = (const struct radix_pop_hdr *)pop;
+	total = sizeof (*hdr) + (gsize)hdr->nnodes * sizeof (*nodes) +
+			(gsize)hdr->nleaves * sizeof (guint64);
+
+	if (hdr->nnodes == 0 || total > len) {
+		return 0;
+	}
+
+	nodes = (const struct radix_pop_node *)(pop + sizeof (*hdr));
+
+	for (i = 0; i < hdr->nnodes; i ++) {
+		node = &nodes[i];
+
+		/* Children must follow parents to guarantee termination */
+		if ((node->leafvec & node->vector) != 0 ||
+				(node->vector != 0 && (node->base1 <= i ||
+				node->base1 + radix_popcount (node->vector) > hdr->nnodes)) ||
+				node->base0 + radix_popcount (node->leafvec) > hdr->nleaves) {
+			return 0;
+		}
+
+		/* The first leaf slot must start a run of leaves */
+		if (~node->vector != 0 &&
+				(node->leafvec & (~node->vector & (node->vector + 1))) == 0) {
+			return 0;
+		}
+	}
+
+	return total;
+}
+
+static void
+radix_count_nodes (struct radix_compressed_node *node, guint32 *nnodes,
+		guint32 *keys_len)
+{
+	if (node == NULL) {
+		return;
+	}
+
+	(*nnodes) ++;
+
+	if (node->skipped) {
+		*keys_len += node->d.s.keylen;
+	}
+	else {
+		radix_count_nodes (node->d.n.left, nnodes, keys_len);
+		radix_count_nodes (node->d.n.right, nnodes, keys_len);
+	}
+}
+
+static guint32
+radix_flatten_node (struct radix_compressed_node *node,
+		struct radix_flat_node *nodes, guint8 *keys,
+		guint32 *cur_node, guint32 *cur_key)
+{
+	struct radix_flat_node *fn;
+	guint32 idx, child;
+
+	if (node == NULL) {
+		return RADIX_FLAT_NONE;
+	}
+
+	idx = (*cur_node) ++;
+	fn = &nodes[idx];
+	fn->value = node->value;
+	fn->skipped = node->skipped;
+
+	if (node->skipped) {
+		fn->left = *cur_key;
+		fn->right = node->d.s.keylen;
+		fn->level = node->d.s.level;
+		memcpy (keys + *cur_key, node->d.s.key, node->d.s.keylen);
+		*cur_key += node->d.s.keylen;
+	}
+	else {
+		fn->level = 0;
+		/* Pointer to fn can be used as nodes array is preallocated */
+		child = radix_flatten_node (node->d.n.left, nodes, keys, cur_node,
+				cur_key);
+		fn->left = child;
+		child = radix_flatten_node (node->d.n.right, nodes, keys, cur_node,
+				cur_key);
+		fn->right = child;
+	}
+
+	return idx;
+}
+
+guchar *
+radix_flatten_compressed (radix_compressed_t *tree, gsize *len)
+{
+	struct radix_flat_hdr *hdr;
+	struct radix_flat_node *nodes;
+	guint32 nnodes = 0, keys_len = 0, cur_node = 0, cur_key = 0;
+	GByteArray *pop = NULL;
+	gsize pop_off;
+	guchar *res;
+
+	g_assert (tree != NULL);
+
+	if (tree->flat != NULL) {
+		*len = tree->flat_len;
+
+		return g_memdup (tree->flat, tree->flat_len);
+	}
+
+	radix_count_nodes (tree->root, &nnodes, &keys_len);
+	*len = sizeof (*hdr) + nnodes * sizeof (*nodes) + keys_len;
+	/* Multibit tables are aligned after keys */
+	pop_off = RADIX_POP_ALIGN (*len);
+
+	if (tree->prefixes != NULL && !tree->pop_unsupported) {
+		pop = g_byte_array_new ();
+		radix_pop_build (tree, 4, pop);
+		radix_pop_build (tree, 16, pop);
+		*len = pop_off + pop->len;
+	}
+
+	res = g_malloc0 (*len);
+	hdr = (struct radix_flat_hdr *)res;
+	memcpy (hdr->magic, RADIX_FLAT_MAGIC, sizeof (hdr->magic));
+	hdr->size = tree->size;
+	hdr->nnodes = nnodes;
+	hdr->keys_len = keys_len;
+	nodes = (struct radix_flat_node *)(res + sizeof (*hdr));
+
+	if (pop != NULL) {
+		hdr->pop_len = pop->len;
+		memcpy (res + pop_off, pop->data, pop->len);
+		g_byte_array_free (pop, TRUE);
+	}
+
+	/* Root is always the first node */
+	radix_flatten_node (tree->root, nodes, (guint8 *)(nodes + nnodes),
+			&cur_node, &cur_key);
+
+	return res;
+}
+
+radix_compressed_t *
+radix_create_flat (const guchar *data, gsize len, gboolean mapped)
+{
+	radix_compressed_t *tree;
+	const struct radix_flat_hdr *hdr;
+	const struct radix_flat_node *nodes, *node;
+	const guchar *pop[2] = {NULL, NULL};
+	gsize base, pop_len;
+	guint32 i;
+
+	/* Check data as it can be read from a file */
+	if (len < sizeof (*hdr)) {
+		return NULL;
+	}
+
+	hdr = (const struct radix_flat_hdr *)data;
+	base = sizeof (*hdr) + (gsize)hdr->nnodes * sizeof (*nodes) +
+			hdr->keys_len;
+
+	if (memcmp (hdr->magic, RADIX_FLAT_MAGIC, sizeof (hdr->magic)) != 0) {
+		return NULL;
+	}
+
+	if (hdr->pop_len == 0) {
+		if (len != base) {
+			return NULL;
+		}
+	}
+	else {
+		base = RADIX_POP_ALIGN (base);
+
+		if (len != base + hdr->pop_len) {
+			return NULL;
+		}
+
+		pop[0] = data + base;
+
+		if ((pop_len = radix_pop_check (pop[0], hdr->pop_len)) == 0) {
+			return NULL;
+		}
+
+		pop[1] = pop[0] + pop_len;
+
+		if (radix_pop_check (pop[1], hdr->pop_len - pop_len) !=
+				hdr->pop_len - pop_len) {
+			return NULL;
+		}
+	}
+
+	nodes = (const struct radix_flat_node *)(data + sizeof (*hdr));
+
+	for (i = 0; i < hdr->nnodes; i ++) {
+		node = &nodes[i];
+
+		if (node->skipped) {
+			if (node->left > hdr->keys_len ||
+					node->right > hdr->keys_len - node->left ||
+					node->level > node->right * NBBY) {
+				return NULL;
+			}
+		}
+		else if ((node->left != RADIX_FLAT_NONE && node->left >= hdr->nnodes) ||
+				(node->right != RADIX_FLAT_NONE && node->right >= hdr->nnodes)) {
+			return NULL;
+		}
+	}
+
+	tree = g_slice_alloc0 (sizeof (*tree));
+	tree->flat = data;
+	tree->flat_len = len;
+	tree->flat_mapped = mapped;
+	tree->size = hdr->size;
+	tree->pop[0] = pop[0];
+	tree->pop[1] = pop[1];
+
+	return tree;
+}
+
 uintptr_t
 radix_find_compressed_addr (radix_compressed_t *tree, rspamd_inet_addr_t *addr)
 {
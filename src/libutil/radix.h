@@ -80,6 +80,38 @@ void radix_destroy_compressed (radix_compressed_t *tree);
  */
 radix_compressed_t *radix_create_compressed (void);
 
+/**
+ * Create new radix trie that is going to be flattened: inserted prefixes are
+ * saved to build multibit tables by @see radix_flatten_compressed
+ * @return
+ */
+radix_compressed_t *radix_create_compressed_flattenable (void);
+
+/**
+ * Serialize radix trie to a flat position independent form. If the trie has
+ * been created by @see radix_create_compressed_flattenable and all keys are
+ * IPv4 or IPv6 addresses then they are also compiled to multibit tables that
+ * are used for lookups of 4 and 16 bytes keys (IPv4 prefixes do not match
+ * IPv6 keys and vice versa in this case).
+ * @param tree radix trie
+ * @param len output length of the result
+ * @return data that must be freed by g_free
+ */
+guchar * radix_flatten_compressed (radix_compressed_t *tree, gsize *len);
+
+/**
+ * Create immutable radix trie that uses data produced by
+ * @see radix_flatten_compressed (e.g. mapped from a file). Such a trie does
+ * not allow insertions.
+ * @param data flat data
+ * @param len length of data
+ * @param mapped if TRUE then data is unmapped on destruction, otherwise it is
+ * freed by g_free
+ * @return new radix trie or NULL if data is invalid
+ */
+radix_compressed_t * radix_create_flat (const guchar *data, gsize len,
+		gboolean mapped);
+
 /**
  * Insert list of ip addresses and masks to the radix tree
  * @param list string line of addresses
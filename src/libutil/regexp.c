@@ -43,8 +43,8 @@ struct rspamd_regexp_s {
 	pcre *re;
 	pcre_extra *extra;
 #ifdef HAVE_PCRE_JIT
-	pcre_jit_stack *jstack;
-	pcre_jit_stack *raw_jstack;
+	gboolean jit;
+	gboolean raw_jit;
 #endif
 	pcre *raw_re;
 	pcre_extra *raw_extra;
@@ -60,6 +60,14 @@ struct rspamd_regexp_cache {
 
 static struct rspamd_regexp_cache *global_re_cache = NULL;
 static gboolean can_jit = FALSE;
+#ifdef HAVE_PCRE_JIT
+/*
+ * All jitted regexps of a process share the same stack that is allocated on
+ * the first match: compiled regexps are not modified when matching, so their
+ * pages stay shared between workers forked from the main process
+ */
+static pcre_jit_stack *process_jstack = NULL;
+#endif
 
 static GQuark
 rspamd_regexp_quark (void)
@@ -67,6 +75,18 @@ rspamd_regexp_quark (void)
 	return g_quark_from_static_string ("rspamd-regexp");
 }
 
+#ifdef HAVE_PCRE_JIT
+static pcre_jit_stack *
+rspamd_regexp_jit_stack (void *unused)
+{
+	if (process_jstack == NULL) {
+		process_jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
+	}
+
+	return process_jstack;
+}
+#endif
+
 static void
 rspamd_regexp_generate_id (const gchar *pattern, const gchar *flags,
 		regexp_id_t out)
@@ -93,9 +113,6 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 			if (re->raw_extra) {
 				pcre_free_study (re->raw_extra);
 			}
-			if (re->raw_jstack) {
-				pcre_jit_stack_free (re->raw_jstack);
-			}
 #else
 			pcre_free (re->raw_extra);
 #endif
@@ -106,9 +123,6 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 			if (re->extra) {
 				pcre_free_study (re->extra);
 			}
-			if (re->jstack) {
-				pcre_jit_stack_free (re->jstack);
-			}
 #else
 			pcre_free (re->extra);
 #endif
@@ -275,11 +289,12 @@ fin:
 
 					if (n != 0 || jit != 1) {
 						msg_debug ("jit compilation of %s is not supported", pattern);
-						res->jstack = NULL;
+						res->jit = FALSE;
 					}
 					else {
-						res->jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
-						pcre_assign_jit_stack (res->extra, NULL, res->jstack);
+						res->jit = TRUE;
+						pcre_assign_jit_stack (res->extra, rspamd_regexp_jit_stack,
+								NULL);
 					}
 				}
 #endif
@@ -305,13 +320,12 @@ fin:
 						if (n != 0 || jit != 1) {
 							msg_debug ("jit compilation of %s is not supported",
 									pattern);
-							res->raw_jstack = NULL;
+							res->raw_jit = FALSE;
 						}
 						else {
-							res->raw_jstack = pcre_jit_stack_alloc (32 * 1024,
-									512 * 1024);
-							pcre_assign_jit_stack (res->raw_extra, NULL,
-									res->raw_jstack);
+							res->raw_jit = TRUE;
+							pcre_assign_jit_stack (res->raw_extra,
+									rspamd_regexp_jit_stack, NULL);
 						}
 					}
 #endif
@@ -325,7 +339,7 @@ fin:
 #ifdef HAVE_PCRE_JIT
 				/* Just alias pointers */
 				res->raw_extra = res->extra;
-				res->raw_jstack = res->jstack;
+				res->raw_jit = res->jit;
 #endif
 			}
 		}
@@ -378,15 +392,17 @@ rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
 		r = re->raw_re;
 		ext = re->raw_extra;
 #if defined(HAVE_PCRE_JIT) && defined(HAVE_PCRE_JIT_FAST)
-		st = re->raw_jstack;
+		if (re->raw_jit) {
+			st = rspamd_regexp_jit_stack (NULL);
+		}
 #endif
 	}
 	else {
 		r = re->re;
 		ext = re->extra;
 #if defined(HAVE_PCRE_JIT) && defined(HAVE_PCRE_JIT_FAST)
-		if (g_utf8_validate (mt, remain, NULL)) {
-			st = re->jstack;
+		if (re->jit && g_utf8_validate (mt, remain, NULL)) {
+			st = rspamd_regexp_jit_stack (NULL);
 		}
 #endif
 	}
@@ -27,6 +27,58 @@
 #include "blake2.h"
 
 #define SHINGLES_WINDOW 3
+/* Number of keys with cached derived siphash keys */
+#define SHINGLES_KEYS_CACHE 4
+
+struct rspamd_shingles_keys {
+	guchar key[16];
+	gboolean valid;
+	rspamd_sipkey_t keys[RSPAMD_SHINGLE_SIZE];
+};
+
+static struct rspamd_shingles_keys keys_cache[SHINGLES_KEYS_CACHE];
+static guint keys_cache_pos = 0;
+
+static const rspamd_sipkey_t *
+rspamd_shingles_get_keys (const guchar key[16])
+{
+	struct rspamd_shingles_keys *elt;
+	guchar shabuf[BLAKE2B_OUTBYTES];
+	const guchar *cur_key;
+	blake2b_state bs;
+	guint i;
+
+	for (i = 0; i < SHINGLES_KEYS_CACHE; i ++) {
+		elt = &keys_cache[i];
+
+		if (elt->valid && memcmp (elt->key, key, sizeof (elt->key)) == 0) {
+			return elt->keys;
+		}
+	}
+
+	/* Replace entries in round robin order */
+	elt = &keys_cache[keys_cache_pos];
+	keys_cache_pos = (keys_cache_pos + 1) % SHINGLES_KEYS_CACHE;
+	memcpy (elt->key, key, sizeof (elt->key));
+	cur_key = key;
+
+	/*
+	 * To generate a set of hashes we just apply blake2b to the
+	 * initial key as many times as many hashes are required and
+	 * take the first 16 bytes of the result as a SIP key.
+	 */
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		blake2b_init (&bs, BLAKE2B_OUTBYTES);
+		blake2b_update (&bs, cur_key, 16);
+		blake2b_final (&bs, shabuf, sizeof (shabuf));
+		memcpy (elt->keys[i], shabuf, sizeof (elt->keys[i]));
+		cur_key = elt->keys[i];
+	}
+
+	elt->valid = TRUE;
+
+	return elt->keys;
+}
 
 struct rspamd_shingle*
 rspamd_shingles_generate (GArray *input,
@@ -36,16 +88,13 @@ rspamd_shingles_generate (GArray *input,
 		gpointer filterd)
 {
 	struct rspamd_shingle *res;
-	GArray *hashes[RSPAMD_SHINGLE_SIZE];
-	rspamd_sipkey_t keys[RSPAMD_SHINGLE_SIZE];
-	guchar shabuf[BLAKE2B_OUTBYTES], *out_key;
-	const guchar *cur_key;
-	GString *row;
+	const rspamd_sipkey_t *keys;
+	guint64 *hashes = NULL, vals[RSPAMD_SHINGLE_SIZE];
+	guchar rowbuf[256], *row = rowbuf;
 	rspamd_fstring_t *word;
-	blake2b_state bs;
-	guint64 val;
+	gsize rowlen, rowsize = sizeof (rowbuf), nwindows, windows_max;
 	gint i, j, beg = 0;
-	guint8 shalen;
+	gboolean streaming;
 
 	if (pool != NULL) {
 		res = rspamd_mempool_alloc (pool, sizeof (*res));
@@ -54,59 +103,86 @@ rspamd_shingles_generate (GArray *input,
 		res = g_malloc (sizeof (*res));
 	}
 
-	blake2b_init (&bs, BLAKE2B_OUTBYTES);
-	row = g_string_sized_new (256);
-	cur_key = key;
-	out_key = (guchar *)&keys[0];
+	keys = rspamd_shingles_get_keys (key);
 
-	/* Init hashes pipes and keys */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		hashes[i] = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
-				input->len + SHINGLES_WINDOW);
-		/*
-		 * To generate a set of hashes we just apply sha256 to the
-		 * initial key as many times as many hashes are required and
-		 * xor left and right parts of sha256 to get a single 16 bytes SIP key.
-		 */
-		shalen = sizeof (shabuf);
-		blake2b_update (&bs, cur_key, 16);
-		blake2b_final (&bs, shabuf, shalen);
+	/*
+	 * Default filter selects minimal hashes, so we can keep just running
+	 * minima instead of all hashes of all windows
+	 */
+	streaming = (filter == rspamd_shingles_default_filter);
+	windows_max = input->len + 1;
+	nwindows = 0;
 
-		for (j = 0; j < 16; j ++) {
-			out_key[j] = shabuf[j];
+	if (streaming) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = G_MAXUINT64;
 		}
-		blake2b_init (&bs, BLAKE2B_OUTBYTES);
-		cur_key = out_key;
-		out_key += 16;
+	}
+	else {
+		hashes = g_malloc (sizeof (guint64) * RSPAMD_SHINGLE_SIZE * windows_max);
 	}
 
 	/* Now parse input words into a vector of hashes using rolling window */
 	for (i = 0; i <= (gint)input->len; i ++) {
 		if (i - beg >= SHINGLES_WINDOW || i == (gint)input->len) {
+			rowlen = 0;
+
 			for (j = beg; j < i; j ++) {
 				word = &g_array_index (input, rspamd_fstring_t, j);
-				g_string_append_len (row, word->begin, word->len);
+				rowlen += word->len;
+			}
+
+			if (rowlen > rowsize) {
+				if (row != rowbuf) {
+					g_free (row);
+				}
+
+				rowsize = MAX (rowlen, rowsize * 2);
+				row = g_malloc (rowsize);
+			}
+
+			for (j = beg, rowlen = 0; j < i; j ++) {
+				word = &g_array_index (input, rspamd_fstring_t, j);
+				memcpy (row + rowlen, word->begin, word->len);
+				rowlen += word->len;
 			}
+
 			beg++;
 
-			/* Now we need to create a new row here */
-			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
-				rspamd_cryptobox_siphash ((guchar *)&val, row->str, row->len,
-						keys[j]);
-				g_array_append_val (hashes[j], val);
+			/* All hashes of a row are calculated at once */
+			rspamd_cryptobox_siphash_multi (vals, row, rowlen, keys,
+					RSPAMD_SHINGLE_SIZE);
+
+			if (streaming) {
+				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+					if (vals[j] < res->hashes[j]) {
+						res->hashes[j] = vals[j];
+					}
+				}
+			}
+			else {
+				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+					hashes[j * windows_max + nwindows] = vals[j];
+				}
 			}
-			g_string_assign (row, "");
+
+			nwindows ++;
 		}
 	}
 
-	/* Now we need to filter all hashes and make a shingles result */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		res->hashes[i] = filter ((guint64 *)hashes[i]->data, hashes[i]->len,
-				i, key, filterd);
-		g_array_free (hashes[i], TRUE);
+	if (!streaming) {
+		/* Now we need to filter all hashes and make a shingles result */
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = filter (hashes + i * windows_max, nwindows,
+					i, key, filterd);
+		}
+
+		g_free (hashes);
 	}
 
-	g_string_free (row, TRUE);
+	if (row != rowbuf) {
+		g_free (row);
+	}
 
 	return res;
 }
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "shm_cache.h"
+#include "util.h"
+#include "logger.h"
+#include "xxhash.h"
+#include "ottery.h"
+
+#define RSPAMD_SHM_CACHE_MAGIC "rshmc\0\0\1"
+#define RSPAMD_SHM_CACHE_WAYS 4
+#define RSPAMD_SHM_CACHE_ALIGN 64
+
+struct rspamd_shm_cache_hdr {
+	gchar magic[8];
+	guint64 seed;
+	guint32 nbuckets;
+	guint32 slot_size;
+	guint32 max_value;
+	guchar pad[RSPAMD_SHM_CACHE_ALIGN - 28];
+};
+
+struct rspamd_shm_cache_slot {
+	volatile gint seq;          /**< odd while a writer owns the slot		*/
+	guint32 atime;              /**< last access time, updated racy		*/
+	guint64 hash;
+	guint64 expire;
+	guint16 keylen;             /**< zero for empty slots					*/
+	guint16 unused;
+	guint32 vlen;
+	/* Key and value follow */
+};
+
+struct rspamd_shm_cache {
+	struct rspamd_shm_cache_hdr *hdr;
+	guchar *slots;
+	gsize size;
+	guint nelts;
+	gchar *path;
+};
+
+static GQuark
+rspamd_shm_cache_quark (void)
+{
+	return g_quark_from_static_string ("shm-cache");
+}
+
+static inline struct rspamd_shm_cache_slot *
+rspamd_shm_cache_slot (struct rspamd_shm_cache *c, guint idx)
+{
+	return (struct rspamd_shm_cache_slot *)(c->slots +
+			(gsize)idx * c->hdr->slot_size);
+}
+
+static gboolean
+rspamd_shm_cache_hdr_valid (struct rspamd_shm_cache_hdr *hdr, guint nbuckets,
+		guint slot_size, gsize max_value)
+{
+	return memcmp (hdr->magic, RSPAMD_SHM_CACHE_MAGIC, sizeof (hdr->magic)) == 0 &&
+			hdr->nbuckets == nbuckets &&
+			hdr->slot_size == slot_size &&
+			hdr->max_value == max_value;
+}
+
+struct rspamd_shm_cache *
+rspamd_shm_cache_new (guint nelts,
+		gsize max_value,
+		const gchar *path,
+		GError **err)
+{
+	struct rspamd_shm_cache *c;
+	guint nbuckets, slot_size;
+	gsize size;
+	gpointer map;
+	gboolean reused = FALSE;
+	struct stat st;
+	gint fd;
+
+	g_assert (nelts > 0);
+
+	nbuckets = (nelts + RSPAMD_SHM_CACHE_WAYS - 1) / RSPAMD_SHM_CACHE_WAYS;
+	slot_size = sizeof (struct rspamd_shm_cache_slot) +
+			RSPAMD_SHM_CACHE_MAX_KEY + max_value;
+	slot_size = (slot_size + RSPAMD_SHM_CACHE_ALIGN - 1) &
+			~(RSPAMD_SHM_CACHE_ALIGN - 1);
+	size = sizeof (struct rspamd_shm_cache_hdr) +
+			(gsize)nbuckets * RSPAMD_SHM_CACHE_WAYS * slot_size;
+
+	if (path != NULL) {
+		fd = open (path, O_RDWR);
+
+		if (fd != -1) {
+			if (fstat (fd, &st) != -1 && (gsize)st.st_size == size) {
+				map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+						fd, 0);
+
+				if (map != MAP_FAILED) {
+					reused = rspamd_shm_cache_hdr_valid (map, nbuckets,
+							slot_size, max_value);
+
+					if (!reused) {
+						munmap (map, size);
+					}
+				}
+			}
+
+			close (fd);
+		}
+
+		if (!reused) {
+			/*
+			 * Workers of the previous configuration may still map the old
+			 * file, so it must not be resized or wiped in place: replace it
+			 * with a new inode instead
+			 */
+			if (unlink (path) == -1 && errno != ENOENT) {
+				g_set_error (err, rspamd_shm_cache_quark (), errno,
+						"cannot unlink %s: %s", path, strerror (errno));
+				return NULL;
+			}
+
+			fd = open (path, O_RDWR | O_CREAT | O_EXCL, 00600);
+
+			if (fd == -1) {
+				g_set_error (err, rspamd_shm_cache_quark (), errno,
+						"cannot open %s: %s", path, strerror (errno));
+				return NULL;
+			}
+
+			if (ftruncate (fd, size) == -1) {
+				g_set_error (err, rspamd_shm_cache_quark (), errno,
+						"cannot resize %s: %s", path, strerror (errno));
+				close (fd);
+				unlink (path);
+				return NULL;
+			}
+
+			map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close (fd);
+		}
+	}
+	else {
+#if defined(HAVE_MMAP_ANON)
+		map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+				-1, 0);
+#else
+		fd = open ("/dev/zero", O_RDWR);
+
+		if (fd == -1) {
+			g_set_error (err, rspamd_shm_cache_quark (), errno,
+					"cannot open /dev/zero: %s", strerror (errno));
+			return NULL;
+		}
+
+		map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close (fd);
+#endif
+	}
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_shm_cache_quark (), errno,
+				"cannot map %z bytes: %s", size, strerror (errno));
+		return NULL;
+	}
+
+	c = g_slice_alloc0 (sizeof (*c));
+	c->hdr = map;
+	c->slots = (guchar *)map + sizeof (struct rspamd_shm_cache_hdr);
+	c->size = size;
+	c->nelts = nelts;
+	c->path = g_strdup (path);
+
+	if (reused) {
+		/*
+		 * Workers of the previous configuration may be writing to this file
+		 * right now, so slots with odd sequence are left as is: a slot left
+		 * locked by a crashed writer is just never used again
+		 */
+		msg_info ("reused shared cache from %s", path);
+	}
+	else {
+		/* Fresh mapping is zero filled */
+		memcpy (c->hdr->magic, RSPAMD_SHM_CACHE_MAGIC, sizeof (c->hdr->magic));
+		c->hdr->seed = ottery_rand_uint64 ();
+		c->hdr->nbuckets = nbuckets;
+		c->hdr->slot_size = slot_size;
+		c->hdr->max_value = max_value;
+	}
+
+	return c;
+}
+
+struct rspamd_shm_cache *
+rspamd_shm_cache_reuse (struct rspamd_shm_cache *old,
+		guint nelts,
+		gsize max_value,
+		const gchar *path,
+		GError **err)
+{
+	if (old != NULL) {
+		if (old->nelts == nelts && old->hdr->max_value == max_value &&
+				g_strcmp0 (old->path, path) == 0) {
+			return old;
+		}
+
+		rspamd_shm_cache_destroy (old);
+	}
+
+	if (nelts == 0) {
+		return NULL;
+	}
+
+	return rspamd_shm_cache_new (nelts, max_value, path, err);
+}
+
+gpointer
+rspamd_shm_cache_lookup (struct rspamd_shm_cache *c,
+		gconstpointer key,
+		gsize keylen,
+		time_t now,
+		gsize *vlen,
+		guint *ttl)
+{
+	struct rspamd_shm_cache_slot *slot;
+	guint64 h, expire;
+	guint i, bucket;
+	gint seq;
+	gsize len;
+	guchar *data, *res;
+
+	g_assert (c != NULL);
+
+	if (keylen == 0 || keylen > RSPAMD_SHM_CACHE_MAX_KEY) {
+		return NULL;
+	}
+
+	h = XXH64 (key, keylen, c->hdr->seed);
+	bucket = h % c->hdr->nbuckets;
+
+	for (i = 0; i < RSPAMD_SHM_CACHE_WAYS; i ++) {
+		slot = rspamd_shm_cache_slot (c, bucket * RSPAMD_SHM_CACHE_WAYS + i);
+		seq = g_atomic_int_get (&slot->seq);
+
+		if ((seq & 1) || slot->hash != h || slot->keylen != keylen) {
+			continue;
+		}
+
+		expire = slot->expire;
+		len = slot->vlen;
+		data = (guchar *)slot + sizeof (*slot);
+
+		/* Everything read here is validated by the second check of seq */
+		if (expire <= (guint64)now || len > c->hdr->max_value ||
+				memcmp (data, key, keylen) != 0) {
+			continue;
+		}
+
+		res = g_malloc (MAX (len, 1));
+		memcpy (res, data + keylen, len);
+
+		if (g_atomic_int_get (&slot->seq) != seq) {
+			/* Concurrent update, treat as miss */
+			g_free (res);
+			return NULL;
+		}
+
+		slot->atime = now;
+		*vlen = len;
+
+		if (ttl) {
+			*ttl = expire - now;
+		}
+
+		return res;
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_shm_cache_insert (struct rspamd_shm_cache *c,
+		gconstpointer key,
+		gsize keylen,
+		gconstpointer value,
+		gsize vlen,
+		time_t now,
+		guint ttl)
+{
+	struct rspamd_shm_cache_slot *slot, *sel = NULL, *empty = NULL,
+			*oldest = NULL;
+	guint64 h;
+	guint i, bucket;
+	gint seq;
+	guchar *data;
+
+	g_assert (c != NULL);
+
+	if (keylen == 0 || keylen > RSPAMD_SHM_CACHE_MAX_KEY ||
+			vlen > c->hdr->max_value || ttl == 0) {
+		return FALSE;
+	}
+
+	h = XXH64 (key, keylen, c->hdr->seed);
+	bucket = h % c->hdr->nbuckets;
+
+	/* Prefer the same key, then a free or expired slot, then the oldest one */
+	for (i = 0; i < RSPAMD_SHM_CACHE_WAYS; i ++) {
+		slot = rspamd_shm_cache_slot (c, bucket * RSPAMD_SHM_CACHE_WAYS + i);
+
+		if (slot->hash == h && slot->keylen == keylen) {
+			sel = slot;
+			break;
+		}
+
+		if (slot->keylen == 0 || slot->expire <= (guint64)now) {
+			if (empty == NULL) {
+				empty = slot;
+			}
+		}
+		else if (oldest == NULL || slot->atime < oldest->atime) {
+			oldest = slot;
+		}
+	}
+
+	if (sel == NULL) {
+		sel = empty != NULL ? empty : oldest;
+	}
+
+	seq = g_atomic_int_get (&sel->seq);
+
+	if ((seq & 1) ||
+			!g_atomic_int_compare_and_exchange (&sel->seq, seq, seq + 1)) {
+		/* Somebody else is writing this slot */
+		return FALSE;
+	}
+
+	data = (guchar *)sel + sizeof (*sel);
+	sel->hash = h;
+	sel->keylen = keylen;
+	sel->vlen = vlen;
+	sel->expire = (guint64)now + ttl;
+	sel->atime = now;
+	memcpy (data, key, keylen);
+	memcpy (data + keylen, value, vlen);
+
+	/* Full barrier, makes the slot even again */
+	g_atomic_int_inc (&sel->seq);
+
+	return TRUE;
+}
+
+void
+rspamd_shm_cache_destroy (struct rspamd_shm_cache *c)
+{
+	if (c) {
+		munmap (c->hdr, c->size);
+		g_free (c->path);
+		g_slice_free1 (sizeof (*c), c);
+	}
+}
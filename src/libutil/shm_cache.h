@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SHM_CACHE_H_
+#define SHM_CACHE_H_
+
+#include "config.h"
+
+/*
+ * Fixed size cache of opaque values that lives in shared memory and is
+ * inherited by all workers forked after its creation. The cache is set
+ * associative and each slot is protected by a sequence lock, so readers never
+ * block and concurrent writers to the same slot simply skip insertion.
+ * Eviction is approximate LRU within a bucket.
+ */
+struct rspamd_shm_cache;
+
+/* Maximum length of a key */
+#define RSPAMD_SHM_CACHE_MAX_KEY 255
+
+/**
+ * Create new shared cache
+ * @param nelts number of elements in the cache
+ * @param max_value maximum length of a value
+ * @param path if not NULL, the cache is mapped from this file and its content
+ * survives restarts; a file with different geometry is replaced by a new one,
+ * so processes that still map the old file are not affected
+ * @param err error pointer
+ * @return new cache or NULL
+ */
+struct rspamd_shm_cache * rspamd_shm_cache_new (guint nelts,
+		gsize max_value,
+		const gchar *path,
+		GError **err);
+
+/**
+ * Return `old` cache if it has the same geometry and backing file, otherwise
+ * destroy it and create a new one. If `nelts` is zero, then NULL is returned
+ * and no error is set
+ * @param old old cache (can be NULL)
+ * @param nelts number of elements in the cache
+ * @param max_value maximum length of a value
+ * @param path backing file or NULL
+ * @param err error pointer
+ * @return cache to use or NULL
+ */
+struct rspamd_shm_cache * rspamd_shm_cache_reuse (struct rspamd_shm_cache *old,
+		guint nelts,
+		gsize max_value,
+		const gchar *path,
+		GError **err);
+
+/**
+ * Find value in the cache
+ * @param c cache object
+ * @param key key to find
+ * @param keylen length of key
+ * @param now current time
+ * @param vlen output length of the value
+ * @param ttl if not NULL, then the remaining time to live is stored here
+ * @return copy of the value that must be freed by g_free or NULL
+ */
+gpointer rspamd_shm_cache_lookup (struct rspamd_shm_cache *c,
+		gconstpointer key,
+		gsize keylen,
+		time_t now,
+		gsize *vlen,
+		guint *ttl);
+
+/**
+ * Insert value to the cache replacing the old value for the same key
+ * @param c cache object
+ * @param key key to insert
+ * @param keylen length of key
+ * @param value value to insert
+ * @param vlen length of value
+ * @param now current time
+ * @param ttl time to live for the value
+ * @return TRUE if the value has been inserted
+ */
+gboolean rspamd_shm_cache_insert (struct rspamd_shm_cache *c,
+		gconstpointer key,
+		gsize keylen,
+		gconstpointer value,
+		gsize vlen,
+		time_t now,
+		guint ttl);
+
+/**
+ * Unmap the cache in the current process
+ * @param c cache object (can be NULL)
+ */
+void rspamd_shm_cache_destroy (struct rspamd_shm_cache *c);
+
+#endif /* SHM_CACHE_H_ */
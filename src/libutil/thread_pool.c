@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "thread_pool.h"
+#include "util.h"
+#include "logger.h"
+
+struct rspamd_thread_pool_job {
+	rspamd_thread_pool_func_t func;
+	rspamd_thread_pool_fin_t fin;
+	gpointer ud;
+	struct rspamd_log_deferred *logs;
+	gboolean done;
+	gboolean cancelled;
+};
+
+struct rspamd_thread_pool {
+	GThreadPool *threads;
+	rspamd_mutex_t *mtx;
+	GCond *cond;
+	GQueue *finished;
+	gint notify[2];
+	struct event ev;
+	struct event_base *ev_base;
+};
+
+static void
+rspamd_thread_pool_thread (gpointer data, gpointer ud)
+{
+	struct rspamd_thread_pool_job *job = data;
+	struct rspamd_thread_pool *pool = ud;
+	gint r;
+
+	/* Logger is not thread safe, so lines are written by the event loop */
+	rspamd_log_defer_start ();
+	job->func (job->ud);
+	job->logs = rspamd_log_defer_stop ();
+
+	rspamd_mutex_lock (pool->mtx);
+	job->done = TRUE;
+	g_queue_push_tail (pool->finished, job);
+	g_cond_broadcast (pool->cond);
+	rspamd_mutex_unlock (pool->mtx);
+
+	/* Wake up event loop, EAGAIN means that a wakeup is already pending */
+	do {
+		r = write (pool->notify[1], "", 1);
+	} while (r == -1 && errno == EINTR);
+}
+
+static void
+rspamd_thread_pool_drain (struct rspamd_thread_pool *pool, gboolean call_fin)
+{
+	struct rspamd_thread_pool_job *job;
+	GQueue finished = G_QUEUE_INIT;
+
+	rspamd_mutex_lock (pool->mtx);
+	finished = *pool->finished;
+	g_queue_init (pool->finished);
+	rspamd_mutex_unlock (pool->mtx);
+
+	while ((job = g_queue_pop_head (&finished)) != NULL) {
+		rspamd_log_deferred_flush (job->logs);
+
+		if (call_fin && !job->cancelled) {
+			job->fin (job->ud);
+		}
+
+		g_slice_free1 (sizeof (*job), job);
+	}
+}
+
+static void
+rspamd_thread_pool_notify (gint fd, short what, gpointer ud)
+{
+	struct rspamd_thread_pool *pool = ud;
+	gchar buf[64];
+
+	while (read (fd, buf, sizeof (buf)) > 0);
+
+	rspamd_thread_pool_drain (pool, TRUE);
+}
+
+struct rspamd_thread_pool *
+rspamd_thread_pool_new (guint nthreads,
+		struct event_base *ev_base,
+		GError **err)
+{
+	struct rspamd_thread_pool *pool;
+
+	g_assert (nthreads > 0);
+	g_assert (ev_base != NULL);
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+
+	if (pipe (pool->notify) == -1) {
+		g_set_error (err, g_quark_from_static_string ("thread-pool"), errno,
+				"cannot create notify pipe: %s", strerror (errno));
+		g_slice_free1 (sizeof (*pool), pool);
+
+		return NULL;
+	}
+
+	rspamd_socket_nonblocking (pool->notify[0]);
+	rspamd_socket_nonblocking (pool->notify[1]);
+
+	pool->threads = g_thread_pool_new (rspamd_thread_pool_thread, pool,
+			nthreads, TRUE, err);
+
+	if (pool->threads == NULL) {
+		close (pool->notify[0]);
+		close (pool->notify[1]);
+		g_slice_free1 (sizeof (*pool), pool);
+
+		return NULL;
+	}
+
+	pool->mtx = rspamd_mutex_new ();
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	pool->cond = g_malloc0 (sizeof (GCond));
+	g_cond_init (pool->cond);
+#else
+	pool->cond = g_cond_new ();
+#endif
+	pool->finished = g_queue_new ();
+	pool->ev_base = ev_base;
+
+	event_set (&pool->ev, pool->notify[0], EV_READ | EV_PERSIST,
+			rspamd_thread_pool_notify, pool);
+	event_base_set (ev_base, &pool->ev);
+	event_add (&pool->ev, NULL);
+
+	return pool;
+}
+
+struct rspamd_thread_pool_job *
+rspamd_thread_pool_push (struct rspamd_thread_pool *pool,
+		rspamd_thread_pool_func_t func,
+		rspamd_thread_pool_fin_t fin,
+		gpointer ud)
+{
+	struct rspamd_thread_pool_job *job;
+
+	g_assert (pool != NULL);
+	g_assert (func != NULL && fin != NULL);
+
+	job = g_slice_alloc0 (sizeof (*job));
+	job->func = func;
+	job->fin = fin;
+	job->ud = ud;
+
+	g_thread_pool_push (pool->threads, job, NULL);
+
+	return job;
+}
+
+void
+rspamd_thread_pool_job_wait (struct rspamd_thread_pool *pool,
+		struct rspamd_thread_pool_job *job)
+{
+	g_assert (pool != NULL && job != NULL);
+
+	rspamd_mutex_lock (pool->mtx);
+	job->cancelled = TRUE;
+
+	while (!job->done) {
+		rspamd_cond_wait (pool->cond, pool->mtx);
+	}
+
+	rspamd_mutex_unlock (pool->mtx);
+}
+
+void
+rspamd_thread_pool_destroy (struct rspamd_thread_pool *pool)
+{
+	if (pool) {
+		g_thread_pool_free (pool->threads, FALSE, TRUE);
+		event_del (&pool->ev);
+		rspamd_thread_pool_drain (pool, FALSE);
+
+		close (pool->notify[0]);
+		close (pool->notify[1]);
+		g_queue_free (pool->finished);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+		g_cond_clear (pool->cond);
+		g_free (pool->cond);
+#else
+		g_cond_free (pool->cond);
+#endif
+		rspamd_mutex_free (pool->mtx);
+		g_slice_free1 (sizeof (*pool), pool);
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include "config.h"
+
+struct rspamd_thread_pool;
+struct rspamd_thread_pool_job;
+
+/**
+ * Job function, called from a pool thread. Lines logged by it are written
+ * from the event loop thread before the finalizer is called
+ */
+typedef void (*rspamd_thread_pool_func_t) (gpointer ud);
+
+/**
+ * Finalizer, called from the event loop thread when a job is done
+ */
+typedef void (*rspamd_thread_pool_fin_t) (gpointer ud);
+
+/**
+ * Create new pool of CPU threads bound to the specified event loop
+ * @param nthreads number of threads
+ * @param ev_base event base where finalizers are called
+ * @param err error pointer
+ * @return new pool or NULL
+ */
+struct rspamd_thread_pool * rspamd_thread_pool_new (guint nthreads,
+		struct event_base *ev_base,
+		GError **err);
+
+/**
+ * Push new job to the pool. `func` is called from some pool thread and
+ * `fin` is called afterwards from the event loop
+ * @param pool pool object
+ * @param func job function
+ * @param fin finalizer function
+ * @param ud opaque data for both callbacks
+ * @return job handle that is valid until `fin` is called
+ */
+struct rspamd_thread_pool_job * rspamd_thread_pool_push (
+		struct rspamd_thread_pool *pool,
+		rspamd_thread_pool_func_t func,
+		rspamd_thread_pool_fin_t fin,
+		gpointer ud);
+
+/**
+ * Block until the specified job is done. Finalizer of the job is NOT called
+ * after this function, so it should be used merely for cancellation
+ * @param pool pool object
+ * @param job job handle
+ */
+void rspamd_thread_pool_job_wait (struct rspamd_thread_pool *pool,
+		struct rspamd_thread_pool_job *job);
+
+/**
+ * Wait for all jobs and destroy the pool
+ * @param pool pool object
+ */
+void rspamd_thread_pool_destroy (struct rspamd_thread_pool *pool);
+
+#endif /* THREAD_POOL_H_ */
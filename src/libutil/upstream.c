@@ -55,6 +55,10 @@ struct upstream {
 	struct upstream_inet_addr_entry *new_addrs;
 	rspamd_mutex_t *lock;
 
+	/* Updated atomically for latency based rotation */
+	volatile gint inflight;
+	volatile gint latency;                  /* EWMA of latency in microseconds */
+
 	ref_entry_t ref;
 };
 
@@ -75,6 +79,10 @@ static gdouble default_revive_jitter = 0.4;
 static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
+/* Latency assumed for a failed request (microseconds) */
+static gint default_fail_latency = 1000000;
+/* Weight of a new sample in EWMA latency, 1 / (1 << shift) */
+#define UPSTREAM_LATENCY_SHIFT 3
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg)
@@ -282,6 +290,49 @@ rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *up)
 	rspamd_mutex_unlock (ls->lock);
 }
 
+static void
+rspamd_upstream_update_latency (struct upstream *up, gint sample)
+{
+	gint old, nval;
+
+	do {
+		old = g_atomic_int_get (&up->latency);
+
+		if (old == 0) {
+			/* The first measurement */
+			nval = sample;
+		}
+		else {
+			nval = old + ((sample - old) >> UPSTREAM_LATENCY_SHIFT);
+		}
+
+		nval = MAX (nval, 1);
+	} while (!g_atomic_int_compare_and_exchange (&up->latency, old, nval));
+}
+
+void
+rspamd_upstream_release (struct upstream *up)
+{
+	gint old;
+
+	do {
+		old = g_atomic_int_get (&up->inflight);
+
+		if (old <= 0) {
+			return;
+		}
+	} while (!g_atomic_int_compare_and_exchange (&up->inflight, old, old - 1));
+}
+
+void
+rspamd_upstream_latency (struct upstream *up, gdouble latency)
+{
+	gdouble usec = latency * 1e6;
+
+	rspamd_upstream_update_latency (up,
+			usec > default_fail_latency ? default_fail_latency : (gint)usec);
+}
+
 void
 rspamd_upstream_fail (struct upstream *up)
 {
@@ -289,6 +340,7 @@ rspamd_upstream_fail (struct upstream *up)
 	gdouble error_rate, max_error_rate;
 	gint msec_last, msec_cur;
 
+	rspamd_upstream_update_latency (up, default_fail_latency);
 	gettimeofday (&tv, NULL);
 
 	rspamd_mutex_lock (up->lock);
@@ -323,6 +375,11 @@ rspamd_upstream_fail (struct upstream *up)
 void
 rspamd_upstream_ok (struct upstream *up)
 {
+	if (g_atomic_int_get ((gint *)&up->errors) == 0) {
+		/* Nothing to reset, avoid locking */
+		return;
+	}
+
 	rspamd_mutex_lock (up->lock);
 	if (up->errors > 0 && up->active_idx != -1) {
 		/* We touch upstream if and only if it is active */
@@ -637,6 +694,78 @@ rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint
 	return g_ptr_array_index (ups->alive, idx);
 }
 
+static inline guint64
+rspamd_upstream_latency_cost (struct upstream *up)
+{
+	/* Unmeasured upstreams are the cheapest ones to get measured */
+	return ((guint64)g_atomic_int_get (&up->latency) + 1) *
+			((guint64)g_atomic_int_get (&up->inflight) + 1);
+}
+
+/*
+ * Power of two choices: select two random upstreams and use the one with the
+ * lower latency multiplied by the number of requests in flight. The list of
+ * all upstreams is not modified after configuration, so no locking is needed.
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups)
+{
+	struct upstream *up1 = NULL, *up2 = NULL, *up, *selected;
+	guint nups = ups->ups->len, i, idx, first = 0;
+
+	if (nups == 0) {
+		return NULL;
+	}
+
+	/* The first choice: random alive upstream */
+	idx = ottery_rand_range (nups - 1);
+
+	for (i = 0; i < nups; i ++) {
+		up = g_ptr_array_index (ups->ups, (idx + i) % nups);
+
+		if (up->active_idx != -1) {
+			up1 = up;
+			first = (idx + i) % nups;
+			break;
+		}
+	}
+
+	/* The second choice: random alive upstream distinct from the first one */
+	if (up1 != NULL && nups > 1) {
+		idx = first + 1 + ottery_rand_range (nups - 2);
+
+		for (i = 0; i < nups; i ++) {
+			if ((idx + i) % nups == first) {
+				continue;
+			}
+
+			up = g_ptr_array_index (ups->ups, (idx + i) % nups);
+
+			if (up->active_idx != -1) {
+				up2 = up;
+				break;
+			}
+		}
+	}
+
+	if (up1 == NULL) {
+		return NULL;
+	}
+
+	if (up2 == NULL ||
+			rspamd_upstream_latency_cost (up1) <=
+			rspamd_upstream_latency_cost (up2)) {
+		selected = up1;
+	}
+	else {
+		selected = up2;
+	}
+
+	g_atomic_int_inc (&selected->inflight);
+
+	return selected;
+}
+
 struct upstream*
 rspamd_upstream_get (struct upstream_list *ups,
 		enum rspamd_upstream_rotation type, ...)
@@ -644,6 +773,13 @@ rspamd_upstream_get (struct upstream_list *ups,
 	va_list ap;
 	const guint8 *key;
 	guint keylen;
+	struct upstream *up;
+
+	if (type == RSPAMD_UPSTREAM_LATENCY) {
+		if ((up = rspamd_upstream_get_latency (ups)) != NULL) {
+			return up;
+		}
+	}
 
 	rspamd_mutex_lock (ups->lock);
 	if (ups->alive->len == 0) {
@@ -672,6 +808,12 @@ rspamd_upstream_get (struct upstream_list *ups,
 		}
 
 		return g_ptr_array_index (ups->alive, ups->cur_elt ++);
+	case RSPAMD_UPSTREAM_LATENCY:
+		/* No alive upstream has been sampled, select any of alive ones */
+		up = rspamd_upstream_get_random (ups);
+		g_atomic_int_inc (&up->inflight);
+
+		return up;
 	}
 
 	/* Silent stupid compilers */
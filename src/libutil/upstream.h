@@ -11,7 +11,8 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_HASHED,
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
-	RSPAMD_UPSTREAM_SEQUENTIAL
+	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY
 };
 
 
@@ -51,6 +52,23 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Account latency of a request to an upstream, it is used by
+ * `RSPAMD_UPSTREAM_LATENCY` rotation that prefers upstreams with lower latency
+ * and less requests in flight.
+ * @param up upstream
+ * @param latency latency in seconds
+ */
+void rspamd_upstream_latency (struct upstream *up, gdouble latency);
+
+/**
+ * Finish a request to an upstream selected by `RSPAMD_UPSTREAM_LATENCY`
+ * rotation: each such request must be released exactly once after
+ * `rspamd_upstream_ok` or `rspamd_upstream_fail`
+ * @param up upstream
+ */
+void rspamd_upstream_release (struct upstream *up);
+
 /**
  * Create new list of upstreams
  * @return
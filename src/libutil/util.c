@@ -2627,3 +2627,51 @@ rspamd_time_jitter (gdouble in, gdouble jitter)
 
 	return in + jitter * res;
 }
+
+gboolean
+rspamd_get_process_memory (pid_t pid, gsize *private_mem, gsize *shared_mem)
+{
+#ifdef __linux__
+	FILE *f;
+	gchar path[PATH_MAX], line[256];
+	gulong val;
+	gsize priv = 0, shared = 0;
+
+	/* Kernels since 4.14 provide already summed values */
+	rspamd_snprintf (path, sizeof (path), "/proc/%P/smaps_rollup", pid);
+	f = fopen (path, "r");
+
+	if (f == NULL) {
+		rspamd_snprintf (path, sizeof (path), "/proc/%P/smaps", pid);
+		f = fopen (path, "r");
+
+		if (f == NULL) {
+			return FALSE;
+		}
+	}
+
+	while (fgets (line, sizeof (line), f) != NULL) {
+		if (line[0] == 'P' && sscanf (line, "Private_%*[a-zA-Z]: %lu kB",
+				&val) == 1) {
+			priv += val;
+		}
+		else if (line[0] == 'S' && sscanf (line, "Shared_%*[a-zA-Z]: %lu kB",
+				&val) == 1) {
+			shared += val;
+		}
+	}
+
+	fclose (f);
+
+	if (private_mem) {
+		*private_mem = priv * 1024;
+	}
+	if (shared_mem) {
+		*shared_mem = shared * 1024;
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
@@ -485,4 +485,15 @@ guint64 rspamd_hash_seed (void);
  */
 gdouble rspamd_time_jitter (gdouble in, gdouble jitter);
 
+/**
+ * Get memory used by a process split into private pages and pages shared with
+ * other processes (e.g. copy-on-write pages inherited from the main process)
+ * @param pid process id
+ * @param private_mem output for private memory in bytes
+ * @param shared_mem output for shared memory in bytes
+ * @return FALSE if memory information is not available for this process or OS
+ */
+gboolean rspamd_get_process_memory (pid_t pid, gsize *private_mem,
+		gsize *shared_mem);
+
 #endif
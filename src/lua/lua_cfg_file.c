@@ -142,7 +142,8 @@ rspamd_lua_post_load_config (struct rspamd_config *cfg)
 	lua_State *L = cfg->lua_state;
 	const gchar *name, *val;
 	gchar *sym;
-	struct rspamd_expression *expr, *old_expr;
+	struct rspamd_expression *expr;
+	struct rspamd_composite *composite;
 	ucl_object_t *obj;
 	gsize keylen;
 	GError *err = NULL;
@@ -204,15 +205,18 @@ rspamd_lua_post_load_config (struct rspamd_config *cfg)
 					err = NULL;
 					continue;
 				}
+				composite = rspamd_mempool_alloc (cfg->cfg_pool,
+						sizeof (struct rspamd_composite));
+				composite->expr = expr;
+				composite->sym = sym;
+				composite->id = g_hash_table_size (cfg->composite_symbols);
 				/* Now check hash table for this composite */
-				if ((old_expr =
-					g_hash_table_lookup (cfg->composite_symbols,
-					name)) != NULL) {
+				if (g_hash_table_lookup (cfg->composite_symbols, name) != NULL) {
 					msg_info ("replacing composite symbol %s", name);
-					g_hash_table_replace (cfg->composite_symbols, sym, expr);
+					g_hash_table_replace (cfg->composite_symbols, sym, composite);
 				}
 				else {
-					g_hash_table_insert (cfg->composite_symbols, sym, expr);
+					g_hash_table_insert (cfg->composite_symbols, sym, composite);
 					rspamd_symbols_cache_add_symbol (cfg->cache, sym,
 							1, 0, NULL, NULL, SYMBOL_TYPE_COMPOSITE, -1);
 				}
@@ -23,9 +23,14 @@
  */
 
 #include "lua_common.h"
+#include "blake2.h"
+#include <sys/mman.h>
+#include <dirent.h>
 
 /* Lua module init function */
 #define MODULE_INIT_FUNC "module_init"
+/* Default directory for compiled lua chunks */
+#define LUA_CACHE_DEFAULT_DIR RSPAMD_DBDIR "/lua_cache"
 
 const luaL_reg null_reg[] = {
 	{"__tostring", rspamd_lua_class_tostring},
@@ -237,6 +242,7 @@ rspamd_lua_init (struct rspamd_config *cfg)
 	luaopen_text (L);
 	luaopen_util (L);
 	luaopen_tcp (L);
+	luaopen_ffi (L);
 
 	rspamd_lua_add_preload (L, "ucl", luaopen_ucl);
 
@@ -274,6 +280,304 @@ rspamd_free_lua_locked (struct lua_locked_state *st)
 	g_slice_free1 (sizeof (struct lua_locked_state), st);
 }
 
+/*
+ * Cache of compiled lua chunks: files are named by a hash of the file path
+ * followed by a hash of the source and of the version of lua interpreter, so
+ * changed files and interpreters never use stale bytecode. Bytecode includes
+ * the name of its file, hence the path is a part of the name. When a file is
+ * recompiled, older entries with the same path hash are removed.
+ */
+static const gchar *
+rspamd_lua_cache_dir (struct rspamd_config *cfg)
+{
+	const ucl_object_t *opts;
+
+	if (cfg != NULL && cfg->rcl_obj != NULL) {
+		opts = ucl_object_find_key (cfg->rcl_obj, "options");
+
+		if (opts != NULL) {
+			opts = ucl_object_find_key (opts, "lua_cache_dir");
+
+			if (opts != NULL) {
+				if (ucl_object_type (opts) == UCL_STRING) {
+					return ucl_object_tostring (opts);
+				}
+
+				/* `lua_cache_dir = false` disables cache */
+				return NULL;
+			}
+		}
+	}
+
+	return LUA_CACHE_DEFAULT_DIR;
+}
+
+/*
+ * Main process loads cached bytecode as root, so cache files and their
+ * directory must be owned by the current user and writable by nobody else
+ */
+static gboolean
+rspamd_lua_cache_check_owner (const struct stat *st, const gchar *path)
+{
+	if (st->st_uid != geteuid () || (st->st_mode & (S_IWGRP | S_IWOTH))) {
+		msg_warn ("lua cache %s is not owned by uid %d or is writable by "
+				"others, do not use it", path, (gint)geteuid ());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_lua_cache_dir_secure (const gchar *dir)
+{
+	struct stat st;
+
+	if (stat (dir, &st) == -1) {
+		/* Directory is created on the first store */
+		return errno == ENOENT;
+	}
+
+	if (!S_ISDIR (st.st_mode)) {
+		msg_warn ("lua cache %s is not a directory, do not use it", dir);
+		return FALSE;
+	}
+
+	return rspamd_lua_cache_check_owner (&st, dir);
+}
+
+static gchar *
+rspamd_lua_cache_path (lua_State *L, const gchar *dir, const gchar *path,
+		const guchar *src, gsize srclen)
+{
+	blake2b_state st;
+	guchar digest[20];
+	const gchar *version;
+	gchar *path_b32, *src_b32, *res;
+	guint ptrsize = sizeof (gpointer);
+
+	blake2b_init (&st, sizeof (digest));
+	blake2b_update (&st, (const guint8 *)path, strlen (path));
+	blake2b_final (&st, digest, sizeof (digest));
+	path_b32 = rspamd_encode_base32 (digest, sizeof (digest));
+
+	/* Bytecode depends on interpreter, prefer LuaJIT version if any */
+	lua_getglobal (L, "jit");
+
+	if (lua_istable (L, -1)) {
+		lua_getfield (L, -1, "version");
+	}
+	else {
+		lua_getglobal (L, "_VERSION");
+	}
+
+	version = lua_tostring (L, -1);
+	blake2b_init (&st, sizeof (digest));
+
+	if (version != NULL) {
+		blake2b_update (&st, (const guint8 *)version, strlen (version));
+	}
+
+	lua_pop (L, 2);
+	blake2b_update (&st, (const guint8 *)&ptrsize, sizeof (ptrsize));
+	blake2b_update (&st, src, srclen);
+	blake2b_final (&st, digest, sizeof (digest));
+	src_b32 = rspamd_encode_base32 (digest, sizeof (digest));
+
+	res = g_strdup_printf ("%s/%s-%s.luac", dir, path_b32, src_b32);
+	g_free (path_b32);
+	g_free (src_b32);
+
+	return res;
+}
+
+/*
+ * Remove entries of the same file that have been compiled from other sources
+ */
+static void
+rspamd_lua_cache_prune (const gchar *dir, const gchar *path)
+{
+	DIR *d;
+	struct dirent *de;
+	const gchar *name, *sep;
+	gchar *stale;
+	gsize prefix_len;
+
+	name = strrchr (path, '/');
+	name = name ? name + 1 : path;
+	sep = strchr (name, '-');
+
+	if (sep == NULL || (d = opendir (dir)) == NULL) {
+		return;
+	}
+
+	prefix_len = sep - name + 1;
+
+	while ((de = readdir (d)) != NULL) {
+		if (strncmp (de->d_name, name, prefix_len) == 0 &&
+				strcmp (de->d_name, name) != 0 &&
+				g_str_has_suffix (de->d_name, ".luac")) {
+			stale = g_strconcat (dir, "/", de->d_name, NULL);
+
+			if (unlink (stale) == 0) {
+				msg_debug ("removed stale compiled lua chunk %s", stale);
+			}
+
+			g_free (stale);
+		}
+	}
+
+	closedir (d);
+}
+
+static gint
+rspamd_lua_cache_writer (lua_State *L, const void *p, size_t sz, void *ud)
+{
+	GByteArray *ar = ud;
+
+	g_byte_array_append (ar, p, sz);
+
+	return 0;
+}
+
+static void
+rspamd_lua_cache_store (lua_State *L, const gchar *dir, const gchar *path)
+{
+	GByteArray *ar;
+	gchar *tmp;
+	gint fd;
+
+	if (mkdir (dir, 0700) == -1 && errno != EEXIST) {
+		msg_debug ("cannot create lua cache dir %s: %s", dir, strerror (errno));
+		return;
+	}
+
+	if (!rspamd_lua_cache_dir_secure (dir)) {
+		return;
+	}
+
+	/* Compiled function is on the top of the stack */
+	ar = g_byte_array_new ();
+
+	if (lua_dump (L, rspamd_lua_cache_writer, ar) != 0 || ar->len == 0) {
+		g_byte_array_free (ar, TRUE);
+		return;
+	}
+
+	tmp = g_strdup_printf ("%s.%d.tmp", path, (gint)getpid ());
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+
+	if (fd == -1) {
+		msg_debug ("cannot create %s: %s", tmp, strerror (errno));
+	}
+	else {
+		if (write (fd, ar->data, ar->len) == (gssize)ar->len &&
+				rename (tmp, path) == 0) {
+			msg_debug ("stored compiled lua chunk in %s", path);
+			rspamd_lua_cache_prune (dir, path);
+		}
+		else {
+			msg_info ("cannot store compiled lua chunk in %s: %s", path,
+					strerror (errno));
+			unlink (tmp);
+		}
+
+		close (fd);
+	}
+
+	g_free (tmp);
+	g_byte_array_free (ar, TRUE);
+}
+
+static gboolean
+rspamd_lua_cache_load (lua_State *L, const gchar *path, const gchar *chunkname)
+{
+	struct stat st;
+	gpointer map;
+	gint fd, ret;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode) || st.st_size == 0 ||
+			!rspamd_lua_cache_check_owner (&st, path) ||
+			(map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+			== MAP_FAILED) {
+		close (fd);
+		return FALSE;
+	}
+
+	close (fd);
+	ret = luaL_loadbuffer (L, map, st.st_size, chunkname);
+	munmap (map, st.st_size);
+
+	if (ret != 0) {
+		msg_info ("cannot load compiled lua chunk %s: %s", path,
+				lua_tostring (L, -1));
+		lua_pop (L, 1);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gint
+rspamd_lua_load_file (lua_State *L, struct rspamd_config *cfg,
+		const gchar *path)
+{
+	struct stat st;
+	const gchar *dir;
+	gchar *chunkname, *cache_path = NULL;
+	gpointer map;
+	gint fd, ret;
+
+	dir = rspamd_lua_cache_dir (cfg);
+
+	if (dir == NULL || !rspamd_lua_cache_dir_secure (dir) ||
+			(fd = open (path, O_RDONLY)) == -1) {
+		return luaL_loadfile (L, path);
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size == 0 ||
+			(map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+			== MAP_FAILED) {
+		close (fd);
+		return luaL_loadfile (L, path);
+	}
+
+	close (fd);
+
+	if (*(const gchar *)map == '#') {
+		/* Only luaL_loadfile skips the first line like `#!/usr/bin/lua` */
+		munmap (map, st.st_size);
+		return luaL_loadfile (L, path);
+	}
+
+	chunkname = g_strconcat ("@", path, NULL);
+	cache_path = rspamd_lua_cache_path (L, dir, path, map, st.st_size);
+
+	if (rspamd_lua_cache_load (L, cache_path, chunkname)) {
+		ret = 0;
+	}
+	else {
+		ret = luaL_loadbuffer (L, map, st.st_size, chunkname);
+
+		if (ret == 0) {
+			rspamd_lua_cache_store (L, dir, cache_path);
+		}
+	}
+
+	munmap (map, st.st_size);
+	g_free (chunkname);
+	g_free (cache_path);
+
+	return ret;
+}
+
 gboolean
 rspamd_init_lua_filters (struct rspamd_config *cfg)
 {
@@ -288,7 +592,7 @@ rspamd_init_lua_filters (struct rspamd_config *cfg)
 	while (cur) {
 		module = cur->data;
 		if (module->path) {
-			if (luaL_loadfile (L, module->path) != 0) {
+			if (rspamd_lua_load_file (L, cfg, module->path) != 0) {
 				msg_info ("load of %s failed: %s", module->path,
 					lua_tostring (L, -1));
 				cur = g_list_next (cur);
@@ -152,6 +152,12 @@ struct rspamd_lua_ip * lua_check_ip (lua_State * L, gint pos);
 
 struct rspamd_lua_text * lua_check_text (lua_State * L, gint pos);
 
+/**
+ * Push new text object to lua, if `own` is FALSE, text is not freed with object
+ */
+struct rspamd_lua_text * lua_new_text (lua_State *L, const gchar *start,
+	gsize len, gboolean own);
+
 /**
  * Push specific header to lua
  */
@@ -214,6 +220,7 @@ void luaopen_logger (lua_State * L);
 void luaopen_text (lua_State *L);
 void luaopen_util (lua_State * L);
 void luaopen_tcp (lua_State * L);
+void luaopen_ffi (lua_State * L);
 
 gint rspamd_lua_call_filter (const gchar *function, struct rspamd_task *task);
 gint rspamd_lua_call_chain_filter (const gchar *function,
@@ -256,9 +263,62 @@ void rspamd_lua_dumpstack (lua_State *L);
 /* Set lua path according to the configuration */
 void rspamd_lua_set_path (lua_State *L, struct rspamd_config *cfg);
 
+/**
+ * Load lua file like `luaL_loadfile` using cache of compiled chunks stored in
+ * `lua_cache_dir` directory
+ * @param L lua state
+ * @param cfg config (may be NULL)
+ * @param path path to a file
+ * @return the same values as `luaL_loadfile`
+ */
+gint rspamd_lua_load_file (lua_State *L, struct rspamd_config *cfg,
+	const gchar *path);
+
 struct memory_pool_s * rspamd_lua_check_mempool (lua_State * L, gint pos);
 struct rspamd_config * lua_check_config (lua_State * L, gint pos);
 
+/*
+ * Functions for LuaJIT FFI (`rspamd_ffi` module). They are called directly
+ * from lua with userdata objects as `ud` arguments, so no type checks are
+ * performed.
+ */
+struct rspamd_ffi_str {
+	const gchar *start;
+	gsize len;
+};
+
+/**
+ * Returns string representation of the sender's IP address or NULL
+ */
+const gchar * rspamd_ffi_task_get_from_ip (void *ud);
+
+/**
+ * Get score of a metric (default metric if `metric` is NULL)
+ * @return 1 if a metric has been found and `score` is set
+ */
+gint rspamd_ffi_task_get_score (void *ud, const gchar *metric, gdouble *score);
+
+/**
+ * Get value of the `idx`-th header with the specified name without copying
+ * @return pointer to the value (its length is stored in `len`) or NULL
+ */
+const gchar * rspamd_ffi_task_get_header (void *ud, const gchar *name,
+	gint strong, gint raw, guint idx, gsize *len);
+
+/**
+ * Store at most `max` urls of a task to `urls` array
+ * @return total number of urls in a task
+ */
+guint rspamd_ffi_task_get_urls (void *ud, struct rspamd_ffi_str *urls,
+	guint max);
+
+/**
+ * Match regexp object against the text
+ * @return 1 if regexp matches
+ */
+gint rspamd_ffi_regexp_match (void *ud, const gchar *text, gsize len,
+	gint raw);
+
 
 #endif /* WITH_LUA */
 #endif /* RSPAMD_LUA_H */
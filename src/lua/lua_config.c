@@ -370,12 +370,12 @@ lua_check_radix (lua_State * L)
 	return ud ? **((radix_compressed_t ***)ud) : NULL;
 }
 
-static GHashTable *
+static struct rspamd_map_hash *
 lua_check_hash_table (lua_State * L)
 {
 	void *ud = luaL_checkudata (L, 1, "rspamd{hash_table}");
 	luaL_argcheck (L, ud != NULL, 1, "'hash_table' expected");
-	return ud ? **((GHashTable ***)ud) : NULL;
+	return ud ? **((struct rspamd_map_hash ***)ud) : NULL;
 }
 
 /*** Config functions ***/
@@ -746,29 +746,37 @@ lua_config_radix_from_config (lua_State *L)
 	}
 }
 
+static void
+lua_config_hash_map_dtor (gpointer p)
+{
+	struct rspamd_map_hash **r = p;
+
+	/* Map replaces hash on reload, so destroy the current one */
+	rspamd_map_hash_destroy (*r);
+}
+
 static gint
 lua_config_add_hash_map (lua_State *L)
 {
 	struct rspamd_config *cfg = lua_check_config (L, 1);
 	const gchar *map_line, *description;
-	GHashTable **r, ***ud;
+	struct rspamd_map_hash **r, ***ud;
 
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 		description = lua_tostring (L, 3);
-		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (GHashTable *));
-		*r = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+		r = rspamd_mempool_alloc0 (cfg->cfg_pool,
+				sizeof (struct rspamd_map_hash *));
 		if (!rspamd_map_add (cfg, map_line, description, rspamd_hosts_read, rspamd_hosts_fin,
 			(void **)r)) {
 			msg_warn ("invalid hash map %s", map_line);
-			g_hash_table_destroy (*r);
 			lua_pushnil (L);
 			return 1;
 		}
 		rspamd_mempool_add_destructor (cfg->cfg_pool,
-			(rspamd_mempool_destruct_t)g_hash_table_destroy,
-			*r);
-		ud = lua_newuserdata (L, sizeof (GHashTable *));
+			lua_config_hash_map_dtor,
+			r);
+		ud = lua_newuserdata (L, sizeof (struct rspamd_map_hash *));
 		*ud = r;
 		rspamd_lua_setclass (L, "rspamd{hash_table}", -1);
 
@@ -785,24 +793,23 @@ lua_config_add_kv_map (lua_State *L)
 {
 	struct rspamd_config *cfg = lua_check_config (L, 1);
 	const gchar *map_line, *description;
-	GHashTable **r, ***ud;
+	struct rspamd_map_hash **r, ***ud;
 
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 		description = lua_tostring (L, 3);
-		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (GHashTable *));
-		*r = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+		r = rspamd_mempool_alloc0 (cfg->cfg_pool,
+				sizeof (struct rspamd_map_hash *));
 		if (!rspamd_map_add (cfg, map_line, description, rspamd_kv_list_read, rspamd_kv_list_fin,
 			(void **)r)) {
 			msg_warn ("invalid hash map %s", map_line);
-			g_hash_table_destroy (*r);
 			lua_pushnil (L);
 			return 1;
 		}
 		rspamd_mempool_add_destructor (cfg->cfg_pool,
-			(rspamd_mempool_destruct_t)g_hash_table_destroy,
-			*r);
-		ud = lua_newuserdata (L, sizeof (GHashTable *));
+			lua_config_hash_map_dtor,
+			r);
+		ud = lua_newuserdata (L, sizeof (struct rspamd_map_hash *));
 		*ud = r;
 		rspamd_lua_setclass (L, "rspamd{hash_table}", -1);
 
@@ -1248,6 +1255,7 @@ lua_config_add_composite (lua_State * L)
 				composite = rspamd_mempool_alloc (cfg->cfg_pool,
 						sizeof (struct rspamd_composite));
 				composite->expr = expr;
+				composite->sym = name;
 				composite->id = g_hash_table_size (cfg->composite_symbols);
 				g_hash_table_insert (cfg->composite_symbols,
 						(gpointer)name,
@@ -1530,13 +1538,13 @@ lua_radix_get_key (lua_State * L)
 static gint
 lua_hash_table_get_key (lua_State * L)
 {
-	GHashTable *tbl = lua_check_hash_table (L);
+	struct rspamd_map_hash *tbl = lua_check_hash_table (L);
 	const gchar *key, *value;
 
 	if (tbl) {
 		key = luaL_checkstring (L, 2);
 
-		if ((value = g_hash_table_lookup (tbl, key)) != NULL) {
+		if ((value = rspamd_map_hash_lookup (tbl, key)) != NULL) {
 			lua_pushstring (L, value);
 			return 1;
 		}
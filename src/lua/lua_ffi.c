@@ -0,0 +1,145 @@
+/* Copyright (c) 2010-2011, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lua_common.h"
+
+/***
+ * @module rspamd_ffi
+ * This module provides fast access to the hot task accessors using LuaJIT FFI.
+ * Calls of these functions are compiled by LuaJIT and values such as headers
+ * are not copied to lua strings unless requested. If rspamd is built without
+ * LuaJIT, then `require "rspamd_ffi"` returns `nil`, so rules should fall back
+ * to the methods of `rspamd_task`.
+ *
+ * Arguments are not checked, so passing wrong objects leads to crashes.
+ * @example
+local rspamd_ffi = require "rspamd_ffi"
+local rspamd_regexp = require "rspamd_regexp"
+local re = rspamd_regexp.create_cached('/viagra/i')
+
+rspamd_config.SUBJ_VIAGRA = function(task)
+	if rspamd_ffi then
+		return rspamd_ffi.header_match(task, 'Subject', re)
+	end
+
+	local subj = task:get_header('Subject')
+	return subj and re:match(subj)
+end
+ */
+
+static const gchar lua_ffi_module[] =
+	"local ok, ffi = pcall(require, 'ffi')\n"
+	"if not ok then return nil end\n"
+	"ffi.cdef[[\n"
+	"struct rspamd_ffi_str { const char *start; size_t len; };\n"
+	"const char * rspamd_ffi_task_get_from_ip (void *ud);\n"
+	"int rspamd_ffi_task_get_score (void *ud, const char *metric, double *score);\n"
+	"const char * rspamd_ffi_task_get_header (void *ud, const char *name,\n"
+	"  int strong, int raw, unsigned idx, size_t *len);\n"
+	"unsigned rspamd_ffi_task_get_urls (void *ud, struct rspamd_ffi_str *urls,\n"
+	"  unsigned max);\n"
+	"int rspamd_ffi_regexp_match (void *ud, const char *text, size_t len, int raw);\n"
+	"]]\n"
+	"local C = ffi.C\n"
+	"local len_buf = ffi.new('size_t[1]')\n"
+	"local score_buf = ffi.new('double[1]')\n"
+	"local exports = {}\n"
+	/* from_ip(task) -> string or nil */
+	"function exports.from_ip(task)\n"
+	"  local s = C.rspamd_ffi_task_get_from_ip(task)\n"
+	"  if s ~= nil then return ffi.string(s) end\n"
+	"  return nil\n"
+	"end\n"
+	/* score(task[, metric]) -> number or nil */
+	"function exports.score(task, metric)\n"
+	"  if C.rspamd_ffi_task_get_score(task, metric, score_buf) ~= 0 then\n"
+	"    return tonumber(score_buf[0])\n"
+	"  end\n"
+	"  return nil\n"
+	"end\n"
+	/* header_ptr(task, name[, strong[, raw[, idx]]]) -> cdata, len or nil */
+	"function exports.header_ptr(task, name, strong, raw, idx)\n"
+	"  local p = C.rspamd_ffi_task_get_header(task, name, strong and 1 or 0,\n"
+	"    raw and 1 or 0, (idx or 1) - 1, len_buf)\n"
+	"  if p ~= nil then return p, tonumber(len_buf[0]) end\n"
+	"  return nil\n"
+	"end\n"
+	/* header(task, name[, strong[, raw[, idx]]]) -> string or nil */
+	"function exports.header(task, name, strong, raw, idx)\n"
+	"  local p = C.rspamd_ffi_task_get_header(task, name, strong and 1 or 0,\n"
+	"    raw and 1 or 0, (idx or 1) - 1, len_buf)\n"
+	"  if p ~= nil then return ffi.string(p, len_buf[0]) end\n"
+	"  return nil\n"
+	"end\n"
+	/* header_match(task, name, re[, strong[, raw]]) -> boolean */
+	"function exports.header_match(task, name, re, strong, raw)\n"
+	"  local s, r, i = strong and 1 or 0, raw and 1 or 0, 0\n"
+	"  while true do\n"
+	"    local p = C.rspamd_ffi_task_get_header(task, name, s, r, i, len_buf)\n"
+	"    if p == nil then return false end\n"
+	"    if C.rspamd_ffi_regexp_match(re, p, len_buf[0], r) ~= 0 then\n"
+	"      return true\n"
+	"    end\n"
+	"    i = i + 1\n"
+	"  end\n"
+	"end\n"
+	/* urls(task) -> iterator of cdata, len */
+	"function exports.urls(task)\n"
+	"  local n = C.rspamd_ffi_task_get_urls(task, nil, 0)\n"
+	"  local buf = ffi.new('struct rspamd_ffi_str[?]', n)\n"
+	"  C.rspamd_ffi_task_get_urls(task, buf, n)\n"
+	"  local i = -1\n"
+	"  return function()\n"
+	"    i = i + 1\n"
+	"    if i < n then return buf[i].start, tonumber(buf[i].len) end\n"
+	"  end\n"
+	"end\n"
+	/* regexp_match(re, text[, len[, raw]]) -> boolean, text is string or cdata */
+	"function exports.regexp_match(re, text, len, raw)\n"
+	"  return C.rspamd_ffi_regexp_match(re, text, len or #text,\n"
+	"    raw and 1 or 0) ~= 0\n"
+	"end\n"
+	"return exports\n";
+
+static gint
+lua_load_ffi (lua_State * L)
+{
+	if (luaL_loadbuffer (L, lua_ffi_module, sizeof (lua_ffi_module) - 1,
+			"rspamd_ffi") != 0) {
+		msg_err ("cannot load rspamd_ffi module: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	lua_call (L, 0, 1);
+
+	return 1;
+}
+
+void
+luaopen_ffi (lua_State * L)
+{
+	rspamd_lua_add_preload (L, "rspamd_ffi", lua_load_ffi);
+}
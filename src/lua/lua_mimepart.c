@@ -113,6 +113,14 @@ LUA_FUNCTION_DEF (textpart, get_mimepart);
  * @return {integer} commodity percentage (e.g. the same strings give `100`, different give `0` and unrelated give `-1`)
  */
 LUA_FUNCTION_DEF (textpart, compare_distance);
+/***
+ * @method text_part:get_words([normalized])
+ * Get words of the part as `rspamd_text` objects that refer to the part's
+ * memory without copying
+ * @param {boolean} normalized return lowercased and stemmed words
+ * @return {table rspamd_text} list of words
+ */
+LUA_FUNCTION_DEF (textpart, get_words);
 
 static const struct luaL_reg textpartlib_m[] = {
 	LUA_INTERFACE_DEF (textpart, is_utf),
@@ -125,6 +133,7 @@ static const struct luaL_reg textpartlib_m[] = {
 	LUA_INTERFACE_DEF (textpart, get_language),
 	LUA_INTERFACE_DEF (textpart, get_mimepart),
 	LUA_INTERFACE_DEF (textpart, compare_distance),
+	LUA_INTERFACE_DEF (textpart, get_words),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -283,6 +292,37 @@ lua_textpart_get_content (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_textpart_get_words (lua_State * L)
+{
+	struct mime_text_part *part = lua_check_textpart (L);
+	GArray *words;
+	rspamd_fstring_t *w;
+	guint i;
+
+	if (part == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	words = lua_toboolean (L, 2) ? part->normalized_words : part->words;
+
+	if (words == NULL) {
+		lua_newtable (L);
+		return 1;
+	}
+
+	lua_createtable (L, words->len, 0);
+
+	for (i = 0; i < words->len; i ++) {
+		w = &g_array_index (words, rspamd_fstring_t, i);
+		lua_new_text (L, w->begin, w->len, FALSE);
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	return 1;
+}
+
 static gint
 lua_textpart_get_length (lua_State * L)
 {
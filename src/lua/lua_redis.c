@@ -31,6 +31,13 @@
 #endif
 
 #define REDIS_DEFAULT_TIMEOUT 1.0
+/* Idle connections are closed after this time */
+#define REDIS_IDLE_TIMEOUT 10.0
+/* Maximum number of idle connections per server */
+#define REDIS_MAX_IDLE 16
+/* Server is not used for REDIS_REVIVE_TIME seconds after this number of errors */
+#define REDIS_MAX_ERRORS 3
+#define REDIS_REVIVE_TIME 10
 
 /***
  * @module rspamd_redis
@@ -53,47 +60,269 @@ local function symbol_callback(task)
 	-- or in table form:
 	-- rspamd_redis.make_request({task=task, host="127.0.0.1:6379,
 	--	callback=redis_cb, timeout=2.0, cmd='GET', args={redis_key}})
+	-- several commands can be sent at once:
+	-- rspamd_redis.make_pipeline({task=task, host=addr, callback=redis_cb,
+	--	commands={{'GET', redis_key}, {'INCR', 'counter'}}})
 end
  */
 
 LUA_FUNCTION_DEF (redis, make_request);
+LUA_FUNCTION_DEF (redis, make_pipeline);
 
 static const struct luaL_reg redislib_m[] = {
 	LUA_INTERFACE_DEF (redis, make_request),
+	LUA_INTERFACE_DEF (redis, make_pipeline),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
 
 #ifdef WITH_HIREDIS
+/**
+ * Pool of connections to a single server
+ */
+struct lua_redis_pool_elt {
+	gchar *key;
+	GQueue *idle;
+	guint errors;
+	time_t last_error;
+};
+
+/**
+ * Connection that is either used by a request or is idle in a pool
+ */
+struct lua_redis_conn {
+	redisAsyncContext *ctx;
+	struct lua_redis_pool_elt *elt;
+	struct event_base *ev_base;
+	struct event idle_timeout;
+	GList *entry;
+};
+
+struct lua_redis_command {
+	gchar **args;
+	guint nargs;
+};
+
 /**
  * Struct for userdata representation
  */
 struct lua_redis_userdata {
-	redisAsyncContext *ctx;
+	struct lua_redis_conn *conn;
 	lua_State *L;
 	struct rspamd_task *task;
 	struct event timeout;
-	gchar *server;
-	gchar *reqline;
-	gchar **args;
+	struct lua_redis_command *cmds;
+	const gchar *err;
 	gint cbref;
-	guint nargs;
-	guint16 port;
+	gint resref;
+	guint ncmds;
+	guint nreplies;
+	guint16 pipeline;
 	guint16 terminated;
+	guint16 reusable;
 };
 
+/* Per worker connections pools indexed by server address */
+static GHashTable *lua_redis_pools = NULL;
+
+static void lua_redis_conn_close (struct lua_redis_conn *conn);
+
 static void
 lua_redis_free_args (struct lua_redis_userdata *ud)
 {
-	guint i;
+	guint i, j;
+
+	for (i = 0; i < ud->ncmds; i ++) {
+		if (ud->cmds[i].args) {
+			for (j = 0; j < ud->cmds[i].nargs; j ++) {
+				g_free (ud->cmds[i].args[j]);
+			}
 
-	if (ud->args) {
-		for (i = 0; i < ud->nargs; i ++) {
-			g_free (ud->args[i]);
+			g_free (ud->cmds[i].args);
+			ud->cmds[i].args = NULL;
 		}
+	}
+}
+
+static struct lua_redis_pool_elt *
+lua_redis_pool_get (const gchar *key)
+{
+	struct lua_redis_pool_elt *elt;
+
+	if (lua_redis_pools == NULL) {
+		lua_redis_pools = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	}
+
+	elt = g_hash_table_lookup (lua_redis_pools, key);
 
-		g_free (ud->args);
+	if (elt == NULL) {
+		elt = g_slice_alloc0 (sizeof (*elt));
+		elt->key = g_strdup (key);
+		elt->idle = g_queue_new ();
+		g_hash_table_insert (lua_redis_pools, elt->key, elt);
 	}
+
+	return elt;
+}
+
+static void
+lua_redis_pool_fail (struct lua_redis_pool_elt *elt)
+{
+	elt->errors ++;
+	elt->last_error = time (NULL);
+}
+
+static gboolean
+lua_redis_pool_alive (struct lua_redis_pool_elt *elt)
+{
+	if (elt->errors >= REDIS_MAX_ERRORS) {
+		if (time (NULL) - elt->last_error < REDIS_REVIVE_TIME) {
+			return FALSE;
+		}
+
+		/* Give the server another chance */
+		elt->errors = REDIS_MAX_ERRORS - 1;
+	}
+
+	return TRUE;
+}
+
+static void
+lua_redis_idle_timeout (gint fd, short what, gpointer d)
+{
+	struct lua_redis_conn *conn = d;
+
+	lua_redis_conn_close (conn);
+}
+
+static void
+lua_redis_disconnect_cb (const struct redisAsyncContext *c, int status)
+{
+	struct lua_redis_conn *conn = c->data;
+
+	if (conn == NULL) {
+		/* Connection is closed by us */
+		return;
+	}
+
+	/* Context is freed by hiredis after this callback */
+	conn->ctx = NULL;
+
+	if (conn->entry != NULL) {
+		/* Idle connection has been closed by server */
+		lua_redis_conn_close (conn);
+	}
+}
+
+/**
+ * Close connection and remove it from pool
+ */
+static void
+lua_redis_conn_close (struct lua_redis_conn *conn)
+{
+	redisAsyncContext *ctx = conn->ctx;
+
+	if (conn->entry != NULL) {
+		event_del (&conn->idle_timeout);
+		g_queue_delete_link (conn->elt->idle, conn->entry);
+		conn->entry = NULL;
+	}
+
+	if (ctx != NULL) {
+		conn->ctx = NULL;
+		ctx->data = NULL;
+		redisAsyncFree (ctx);
+	}
+
+	g_slice_free1 (sizeof (*conn), conn);
+}
+
+/**
+ * Return connection to pool or close it if there are too many idle connections
+ */
+static void
+lua_redis_conn_release (struct lua_redis_conn *conn)
+{
+	struct timeval tv;
+
+	if (conn->ctx == NULL || conn->ctx->err != 0 ||
+			g_queue_get_length (conn->elt->idle) >= REDIS_MAX_IDLE) {
+		lua_redis_conn_close (conn);
+		return;
+	}
+
+	conn->elt->errors = 0;
+	g_queue_push_head (conn->elt->idle, conn);
+	conn->entry = conn->elt->idle->head;
+
+	double_to_tv (REDIS_IDLE_TIMEOUT, &tv);
+	evtimer_set (&conn->idle_timeout, lua_redis_idle_timeout, conn);
+	event_base_set (conn->ev_base, &conn->idle_timeout);
+	evtimer_add (&conn->idle_timeout, &tv);
+}
+
+static void
+lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
+{
+	/*
+	 * Workaround to prevent double close:
+	 * https://groups.google.com/forum/#!topic/redis-db/mQm46XkIPOY
+	 */
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR == 0 && HIREDIS_MINOR <= 11
+	struct redisAsyncContext *nc = (struct redisAsyncContext *)c;
+	if (status == REDIS_ERR) {
+		nc->c.fd = -1;
+	}
+#endif
+}
+
+/**
+ * Get idle connection from pool or establish a new one
+ */
+static struct lua_redis_conn *
+lua_redis_conn_get (struct lua_redis_pool_elt *elt, rspamd_inet_addr_t *addr,
+		struct event_base *ev_base)
+{
+	struct lua_redis_conn *conn;
+	GList *cur;
+
+	for (cur = elt->idle->head; cur != NULL; cur = g_list_next (cur)) {
+		conn = cur->data;
+
+		if (conn->ev_base == ev_base) {
+			event_del (&conn->idle_timeout);
+			g_queue_delete_link (elt->idle, cur);
+			conn->entry = NULL;
+
+			return conn;
+		}
+	}
+
+	conn = g_slice_alloc0 (sizeof (*conn));
+	conn->elt = elt;
+	conn->ev_base = ev_base;
+	conn->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (conn->ctx == NULL || conn->ctx->err) {
+		if (conn->ctx) {
+			msg_info ("cannot connect to redis server %s: %s", elt->key,
+					conn->ctx->errstr);
+			redisAsyncFree (conn->ctx);
+		}
+
+		lua_redis_pool_fail (elt);
+		g_slice_free1 (sizeof (*conn), conn);
+
+		return NULL;
+	}
+
+	conn->ctx->data = conn;
+	redisAsyncSetConnectCallback (conn->ctx, lua_redis_connect_cb);
+	redisAsyncSetDisconnectCallback (conn->ctx, lua_redis_disconnect_cb);
+	redisLibeventAttach (conn->ctx, ev_base);
+
+	return conn;
 }
 
 static void
@@ -101,12 +330,25 @@ lua_redis_fin (void *arg)
 {
 	struct lua_redis_userdata *ud = arg;
 
-	if (ud->ctx) {
+	if (ud->conn) {
 		ud->terminated = 1;
-		redisAsyncFree (ud->ctx);
+
+		if (ud->reusable) {
+			lua_redis_conn_release (ud->conn);
+		}
+		else {
+			/* There might be pending replies, so we cannot reuse connection */
+			lua_redis_conn_close (ud->conn);
+		}
+
+		ud->conn = NULL;
 		lua_redis_free_args (ud);
 		event_del (&ud->timeout);
 		luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+
+		if (ud->resref != -1) {
+			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->resref);
+		}
 	}
 }
 
@@ -156,6 +398,7 @@ lua_redis_push_reply (lua_State *L, const redisReply *r)
 		break;
 	case REDIS_REPLY_STRING:
 	case REDIS_REPLY_STATUS:
+	case REDIS_REPLY_ERROR:
 		lua_pushlstring (L, r->str, r->len);
 		break;
 	case REDIS_REPLY_ARRAY:
@@ -187,10 +430,25 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_userdata *ud)
 	rspamd_lua_setclass (ud->L, "rspamd{task}", -1);
 
 	*ptask = ud->task;
-	/* Error is nil */
-	lua_pushnil (ud->L);
-	/* Data */
-	lua_redis_push_reply (ud->L, r);
+
+	if (ud->pipeline) {
+		/* Error of the first failed command if any */
+		if (ud->err) {
+			lua_pushstring (ud->L, ud->err);
+		}
+		else {
+			lua_pushnil (ud->L);
+		}
+
+		/* Table of all replies */
+		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->resref);
+	}
+	else {
+		/* Error is nil */
+		lua_pushnil (ud->L);
+		/* Data */
+		lua_redis_push_reply (ud->L, r);
+	}
 
 	if (lua_pcall (ud->L, 3, 0, 0) != 0) {
 		msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
@@ -218,10 +476,31 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	if (c->err == 0) {
 		if (r != NULL) {
-			if (reply->type != REDIS_REPLY_ERROR) {
+			ud->nreplies ++;
+
+			if (ud->pipeline) {
+				/* Collect replies until the last one is received */
+				lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->resref);
+				lua_redis_push_reply (ud->L, reply);
+				lua_rawseti (ud->L, -2, ud->nreplies);
+				lua_pop (ud->L, 1);
+
+				if (reply->type == REDIS_REPLY_ERROR && ud->err == NULL) {
+					ud->err = rspamd_mempool_strdup (ud->task->task_pool,
+							reply->str);
+				}
+
+				if (ud->nreplies == ud->ncmds) {
+					ud->reusable = 1;
+					lua_redis_push_data (reply, ud);
+				}
+			}
+			else if (reply->type != REDIS_REPLY_ERROR) {
+				ud->reusable = 1;
 				lua_redis_push_data (reply, ud);
 			}
 			else {
+				ud->reusable = 1;
 				lua_redis_push_error (reply->str, ud, TRUE);
 			}
 		}
@@ -230,6 +509,8 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 		}
 	}
 	else {
+		lua_redis_pool_fail (ud->conn->elt);
+
 		if (c->err == REDIS_ERR_IO) {
 			lua_redis_push_error (strerror (errno), ud, TRUE);
 		}
@@ -245,41 +526,37 @@ lua_redis_timeout (int fd, short what, gpointer u)
 	struct lua_redis_userdata *ud = u;
 
 	msg_info ("timeout while querying redis server");
+	lua_redis_pool_fail (ud->conn->elt);
 	lua_redis_push_error ("timeout while connecting the server", ud, TRUE);
 }
 
 
+/**
+ * Fill command from cmd and elements of the array at idx starting from first
+ */
 static void
-lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
-		struct lua_redis_userdata *ud)
+lua_redis_parse_args (lua_State *L, gint idx, gint first, const gchar *cmd,
+		struct lua_redis_command *rcmd)
 {
 	gchar **args = NULL;
-	gint top;
+	gint top, i, len;
 
 	if (idx != 0 && lua_type (L, idx) == LUA_TTABLE) {
 		/* Get all arguments */
-		lua_pushvalue (L, 5);
-		lua_pushnil (L);
-		top = 0;
+		len = lua_objlen (L, idx);
+		args = g_malloc ((len + 1) * sizeof (gchar *));
+		args[0] = g_strdup (cmd);
+		top = 1;
+
+		for (i = first; i <= len; i ++) {
+			lua_rawgeti (L, idx, i);
 
-		while (lua_next (L, -2) != 0) {
 			if (lua_isstring (L, -1)) {
-				top ++;
+				args[top++] = g_strdup (lua_tostring (L, -1));
 			}
-			lua_pop (L, 1);
-		}
-
-		args = g_malloc ((top + 1) * sizeof (gchar *));
-		lua_pushnil (L);
-		args[0] = g_strdup (cmd);
-		top = 1;
 
-		while (lua_next (L, -2) != 0) {
-			args[top++] = g_strdup (lua_tostring (L, -1));
 			lua_pop (L, 1);
 		}
-
-		lua_pop (L, 1);
 	}
 	else {
 		/* Use merely cmd */
@@ -288,23 +565,104 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 		top = 1;
 	}
 
-	ud->nargs = top;
-	ud->args = args;
+	rcmd->nargs = top;
+	rcmd->args = args;
 }
 
-static void
-lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
+/**
+ * Send all commands of a request in a single write and register it in session
+ */
+static gboolean
+lua_redis_send (struct lua_redis_userdata *ud, rspamd_inet_addr_t *addr,
+		gdouble timeout)
 {
-	/*
-	 * Workaround to prevent double close:
-	 * https://groups.google.com/forum/#!topic/redis-db/mQm46XkIPOY
-	 */
-#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR == 0 && HIREDIS_MINOR <= 11
-	struct redisAsyncContext *nc = (struct redisAsyncContext *)c;
-	if (status == REDIS_ERR) {
-		nc->c.fd = -1;
+	struct lua_redis_pool_elt *elt;
+	struct timeval tv;
+	guint i;
+	gint ret = REDIS_OK;
+	gchar key[128];
+
+	rspamd_snprintf (key, sizeof (key), "%s:%d",
+			rspamd_inet_address_to_string (addr),
+			(gint)rspamd_inet_address_get_port (addr));
+	elt = lua_redis_pool_get (key);
+
+	if (!lua_redis_pool_alive (elt)) {
+		msg_info ("redis server %s is marked as failed", elt->key);
+		ud->conn = NULL;
 	}
-#endif
+	else {
+		ud->conn = lua_redis_conn_get (elt, addr, ud->task->ev_base);
+	}
+
+	if (ud->conn == NULL) {
+		ud->terminated = 1;
+		lua_redis_free_args (ud);
+		luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+
+		if (ud->resref != -1) {
+			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->resref);
+		}
+
+		return FALSE;
+	}
+
+	/* Commands are buffered by hiredis and are written in one go */
+	for (i = 0; i < ud->ncmds && ret == REDIS_OK; i ++) {
+		ret = redisAsyncCommandArgv (ud->conn->ctx,
+				lua_redis_callback,
+				ud,
+				ud->cmds[i].nargs,
+				(const gchar **)ud->cmds[i].args,
+				NULL);
+	}
+
+	if (ret == REDIS_OK) {
+		rspamd_session_add_event (ud->task->s,
+				lua_redis_fin,
+				ud,
+				g_quark_from_static_string ("lua redis"));
+
+		double_to_tv (timeout, &tv);
+		event_set (&ud->timeout, -1, EV_TIMEOUT, lua_redis_timeout, ud);
+		event_base_set (ud->task->ev_base, &ud->timeout);
+		event_add (&ud->timeout, &tv);
+	}
+	else {
+		msg_info ("call to redis failed: %s", ud->conn->ctx->errstr);
+		ud->terminated = 1;
+		lua_redis_free_args (ud);
+		lua_redis_conn_close (ud->conn);
+		ud->conn = NULL;
+		luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+
+		if (ud->resref != -1) {
+			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->resref);
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static struct lua_redis_userdata *
+lua_redis_userdata_new (lua_State *L, struct rspamd_task *task, gint cbref,
+		guint ncmds)
+{
+	struct lua_redis_userdata *ud;
+
+	ud = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct lua_redis_userdata));
+	ud->task = task;
+	ud->L = L;
+	ud->cbref = cbref;
+	ud->resref = -1;
+	ud->ncmds = ncmds;
+	ud->cmds = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct lua_redis_command) * ncmds);
+
+	return ud;
 }
 
 /***
@@ -321,12 +679,11 @@ lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
 static int
 lua_redis_make_request (lua_State *L)
 {
-	struct lua_redis_userdata *ud;
+	struct lua_redis_userdata *ud = NULL;
 	struct rspamd_lua_ip *addr = NULL;
 	struct rspamd_task *task = NULL;
 	const gchar *cmd = NULL;
 	gint top, cbref = -1;
-	struct timeval tv;
 	gboolean ret = FALSE;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 
@@ -364,18 +721,18 @@ lua_redis_make_request (lua_State *L)
 
 		lua_pushstring (L, "timeout");
 		lua_gettable (L, -2);
-		timeout = lua_tonumber (L, -1);
+		if (lua_isnumber (L, -1)) {
+			timeout = lua_tonumber (L, -1);
+		}
 		lua_pop (L, 1);
 
-		if (task != NULL && addr != NULL && cbref != -1 && cmd != NULL) {
-			ud =
-					rspamd_mempool_alloc (task->task_pool,
-							sizeof (struct lua_redis_userdata));
-			ud->task = task;
-			ud->L = L;
-			ud->cbref = cbref;
+		if (task != NULL && addr != NULL && addr->addr && cbref != -1 &&
+				cmd != NULL) {
+			ud = lua_redis_userdata_new (L, task, cbref, 1);
 			lua_pushstring (L, "args");
-			lua_redis_parse_args (L, -1, cmd, ud);
+			lua_gettable (L, 1);
+			lua_redis_parse_args (L, lua_gettop (L), 1, cmd, &ud->cmds[0]);
+			lua_pop (L, 1);
 			ret = TRUE;
 		}
 		else {
@@ -391,24 +748,19 @@ lua_redis_make_request (lua_State *L)
 		top = lua_gettop (L);
 		/* Now get callback */
 		if (lua_isfunction (L, 3) && addr != NULL && addr->addr && top >= 4) {
-			/* Create userdata */
-			ud =
-				rspamd_mempool_alloc (task->task_pool,
-					sizeof (struct lua_redis_userdata));
-			ud->task = task;
-			ud->L = L;
-
 			/* Pop other arguments */
 			lua_pushvalue (L, 3);
 			/* Get a reference */
-			ud->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+			/* Create userdata */
+			ud = lua_redis_userdata_new (L, task, cbref, 1);
 
 			cmd = luaL_checkstring (L, 4);
 			if (top > 4) {
-				lua_redis_parse_args (L, 5, cmd, ud);
+				lua_redis_parse_args (L, 5, 1, cmd, &ud->cmds[0]);
 			}
 			else {
-				lua_redis_parse_args (L, 0, cmd, ud);
+				lua_redis_parse_args (L, 0, 1, cmd, &ud->cmds[0]);
 			}
 
 			ret = TRUE;
@@ -419,47 +771,132 @@ lua_redis_make_request (lua_State *L)
 	}
 
 	if (ret) {
-		ud->terminated = 0;
-		ud->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
-		redisAsyncSetConnectCallback (ud->ctx, lua_redis_connect_cb);
-
-		if (ud->ctx == NULL || ud->ctx->err) {
-			ud->terminated = 1;
-			redisAsyncFree (ud->ctx);
-			lua_redis_free_args (ud);
-			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
-			lua_pushboolean (L, FALSE);
+		ret = lua_redis_send (ud, addr->addr, timeout);
+	}
+
+	lua_pushboolean (L, ret);
+
+	return 1;
+}
+
+/***
+ * @function rspamd_redis.make_pipeline({params})
+ * Send several commands to redis server in a single write and get all replies
+ * in a single callback. Connections to servers are reused between requests.
+ * @param {task} task worker task object
+ * @param {ip} host server address
+ * @param {function} callback callback to be called in form `function (task, err, data)`,
+ * where `data` is a numeric array of replies in order of commands and `err` is
+ * the error of the first failed command if any
+ * @param {table} commands array of commands, each command is an array of strings,
+ * e.g. `{{'GET', 'key1'}, {'INCR', 'key2'}}`
+ * @param {number} timeout timeout in seconds for all commands (1.0 by default)
+ * @return {boolean} `true` if commands have been scheduled
+ */
+static int
+lua_redis_make_pipeline (lua_State *L)
+{
+	struct lua_redis_userdata *ud = NULL;
+	struct rspamd_lua_ip *addr = NULL;
+	struct rspamd_task *task = NULL;
+	const gchar *cmd;
+	gint cbref = -1, cmds_idx, ncmds = 0, i, cmd_idx;
+	gboolean ret = FALSE;
+	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
+
+	if (!lua_istable (L, 1)) {
+		msg_err ("incorrect function invocation");
+		lua_pushboolean (L, FALSE);
+
+		return 1;
+	}
+
+	lua_pushstring (L, "task");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TUSERDATA) {
+		task = lua_check_task (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "host");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TUSERDATA) {
+		addr = lua_check_ip (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "timeout");
+	lua_gettable (L, 1);
+	if (lua_isnumber (L, -1)) {
+		timeout = lua_tonumber (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "commands");
+	lua_gettable (L, 1);
+	cmds_idx = lua_gettop (L);
+
+	if (lua_type (L, cmds_idx) == LUA_TTABLE) {
+		ncmds = lua_objlen (L, cmds_idx);
+	}
+
+	lua_pushstring (L, "callback");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TFUNCTION) {
+		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	else {
+		lua_pop (L, 1);
+	}
+
+	if (task != NULL && addr != NULL && addr->addr && cbref != -1 &&
+			ncmds > 0) {
+		ud = lua_redis_userdata_new (L, task, cbref, ncmds);
+		ud->pipeline = 1;
+		ret = TRUE;
+
+		for (i = 0; i < ncmds; i ++) {
+			lua_rawgeti (L, cmds_idx, i + 1);
+			cmd_idx = lua_gettop (L);
+			cmd = NULL;
+
+			if (lua_type (L, cmd_idx) == LUA_TTABLE) {
+				lua_rawgeti (L, cmd_idx, 1);
+				cmd = lua_tostring (L, -1);
+				lua_pop (L, 1);
+			}
+
+			if (cmd == NULL) {
+				ret = FALSE;
+				lua_pop (L, 1);
+				break;
+			}
 
-			return 1;
+			/* Command name is the first element of a command table */
+			lua_redis_parse_args (L, cmd_idx, 2, cmd, &ud->cmds[i]);
+			lua_pop (L, 1);
 		}
-		redisLibeventAttach (ud->ctx, ud->task->ev_base);
-		ret = redisAsyncCommandArgv (ud->ctx,
-					lua_redis_callback,
-					ud,
-					ud->nargs,
-					(const gchar **)ud->args,
-					NULL);
-		if (ret == REDIS_OK) {
-			rspamd_session_add_event (ud->task->s,
-					lua_redis_fin,
-					ud,
-					g_quark_from_static_string ("lua redis"));
-
-			double_to_tv (timeout, &tv);
-			event_set (&ud->timeout, -1, EV_TIMEOUT, lua_redis_timeout, ud);
-			event_base_set (ud->task->ev_base, &ud->timeout);
-			event_add (&ud->timeout, &tv);
+
+		if (ret) {
+			lua_createtable (L, ncmds, 0);
+			ud->resref = luaL_ref (L, LUA_REGISTRYINDEX);
+			ret = lua_redis_send (ud, addr->addr, timeout);
 		}
 		else {
-			msg_info ("call to redis failed: %s", ud->ctx->errstr);
-			ud->terminated = 1;
+			msg_err ("bad command in redis pipeline");
 			lua_redis_free_args (ud);
-			redisAsyncFree (ud->ctx);
-			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+			luaL_unref (L, LUA_REGISTRYINDEX, cbref);
+		}
+	}
+	else {
+		if (cbref != -1) {
+			luaL_unref (L, LUA_REGISTRYINDEX, cbref);
 		}
+
+		msg_err ("incorrect function invocation");
 	}
 
+	lua_pop (L, 1);
 	lua_pushboolean (L, ret);
 
 	return 1;
@@ -474,6 +911,16 @@ lua_redis_make_request (lua_State *L)
 
 	return 1;
 }
+
+static int
+lua_redis_make_pipeline (lua_State *L)
+{
+	msg_warn ("rspamd is compiled with no redis support");
+
+	lua_pushboolean (L, FALSE);
+
+	return 1;
+}
 #endif
 
 static gint
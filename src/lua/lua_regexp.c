@@ -587,6 +587,23 @@ lua_load_regexp (lua_State * L)
 	return 1;
 }
 
+/* FFI accessors */
+gint
+rspamd_ffi_regexp_match (void *ud, const gchar *text, gsize len, gint raw)
+{
+	struct rspamd_lua_regexp *re = *(struct rspamd_lua_regexp **)ud;
+
+	if (re == NULL || IS_DESTROYED (re) || text == NULL) {
+		return 0;
+	}
+
+	if (re->match_limit > 0) {
+		len = MIN (len, re->match_limit);
+	}
+
+	return rspamd_regexp_search (re->re, text, len, NULL, NULL, raw) ? 1 : 0;
+}
+
 void
 luaopen_regexp (lua_State * L)
 {
@@ -104,7 +104,7 @@ LUA_FUNCTION_DEF (task, get_ev_base);
  * @method task:insert_result(symbol, weigth[, option1, ...])
  * Insert specific symbol to the tasks scanning results assigning the initial
  * weight to it.
- * @param {string} symbol symbol to insert
+ * @param {string|number} symbol symbol to insert or its id returned by `rspamd_config:register_symbol`, ids are faster as symbol is not looked up by its name
  * @param {number} weight initial weight (this weight is multiplied by the metric weight)
  * @param {string} options list of optional options attached to a symbol inserted
 @example
@@ -140,6 +140,7 @@ LUA_FUNCTION_DEF (task, set_pre_result);
 /***
  * @method task:get_urls()
  * Get all URLs found in a message.
+ * The returned table is cached for a task and must not be modified.
  * @return {table rspamd_url} list of all urls found
 @example
 local function phishing_cb(task)
@@ -165,18 +166,21 @@ LUA_FUNCTION_DEF (task, get_content);
 /***
  * @method task:get_emails()
  * Get all email addresses found in a message.
+ * The returned table is cached for a task and must not be modified.
  * @return {table rspamd_url} list of all email addresses found
  */
 LUA_FUNCTION_DEF (task, get_emails);
 /***
  * @method task:get_text_parts()
  * Get all text (and HTML) parts found in a message
+ * The returned table is cached for a task and must not be modified.
  * @return {table rspamd_text_part} list of text parts
  */
 LUA_FUNCTION_DEF (task, get_text_parts);
 /***
  * @method task:get_parts()
  * Get all mime parts found in a message
+ * The returned table is cached for a task and must not be modified.
  * @return {table rspamd_mime_part} list of mime parts
  */
 LUA_FUNCTION_DEF (task, get_parts);
@@ -213,6 +217,15 @@ LUA_FUNCTION_DEF (task, get_header);
  * @return {string} raw value of a header
  */
 LUA_FUNCTION_DEF (task, get_header_raw);
+/***
+ * @method task:get_header_text(name[, case_sensitive])
+ * Get decoded value of a header like `task:get_header` but as `rspamd_text`
+ * object that refers to the task's memory without copying.
+ * @param {string} name name of header to get
+ * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @return {rspamd_text} decoded value of a header
+ */
+LUA_FUNCTION_DEF (task, get_header_text);
 /***
  * @method task:get_header_full(name[, case_sensitive])
  * Get raw value of a header specified with optional case_sensitive flag.
@@ -226,7 +239,8 @@ LUA_FUNCTION_DEF (task, get_header_raw);
  * - `empty_separator` - `true` if there are no separator between a header and a value
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
- * @return {list of tables} all values of a header as specified above
+ * @return {list of tables} all values of a header as specified above, the list
+ * is cached for a task and must not be modified
 @example
 function check_header_delimiter_tab(task, header_name)
 	for _,rh in ipairs(task:get_header_full(header_name)) do
@@ -491,6 +505,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, set_request_header),
 	LUA_INTERFACE_DEF (task, get_header),
 	LUA_INTERFACE_DEF (task, get_header_raw),
+	LUA_INTERFACE_DEF (task, get_header_text),
 	LUA_INTERFACE_DEF (task, get_header_full),
 	LUA_INTERFACE_DEF (task, get_raw_headers),
 	LUA_INTERFACE_DEF (task, get_received_headers),
@@ -583,6 +598,97 @@ lua_check_text (lua_State * L, gint pos)
 	return ud ? (struct rspamd_lua_text *)ud : NULL;
 }
 
+struct rspamd_lua_text *
+lua_new_text (lua_State *L, const gchar *start, gsize len, gboolean own)
+{
+	struct rspamd_lua_text *t;
+
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+	t->start = start;
+	t->len = len;
+	t->own = own;
+
+	return t;
+}
+
+/*
+ * Per task cache of lua objects: a table in the registry that lives as long as
+ * the task's pool
+ */
+#define LUA_TASK_CACHE_VAR "lua_task_cache"
+
+struct lua_task_cache {
+	lua_State *L;
+	gint ref;
+};
+
+static void
+lua_task_cache_dtor (gpointer p)
+{
+	struct lua_task_cache *cache = p;
+
+	luaL_unref (cache->L, LUA_REGISTRYINDEX, cache->ref);
+}
+
+/**
+ * Push cached value for the key to the stack
+ * @return TRUE if value has been found
+ */
+static gboolean
+lua_task_cache_get (lua_State *L, struct rspamd_task *task, const gchar *key)
+{
+	struct lua_task_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_CACHE_VAR);
+
+	if (cache == NULL) {
+		return FALSE;
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_getfield (L, -1, key);
+	lua_remove (L, -2);
+
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 1);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Cache value on the top of the stack, the value remains on the stack
+ */
+static void
+lua_task_cache_set (lua_State *L, struct rspamd_task *task, const gchar *key)
+{
+	struct lua_task_cache *cache;
+
+	if (task->cfg == NULL || task->cfg->lua_state == NULL) {
+		/* We cannot unref cached values without the main state */
+		return;
+	}
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_CACHE_VAR);
+
+	if (cache == NULL) {
+		cache = rspamd_mempool_alloc (task->task_pool, sizeof (*cache));
+		cache->L = task->cfg->lua_state;
+		lua_newtable (L);
+		cache->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+		rspamd_mempool_set_variable (task->task_pool, LUA_TASK_CACHE_VAR,
+				cache, lua_task_cache_dtor);
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_pushvalue (L, -2);
+	lua_setfield (L, -2, key);
+	lua_pop (L, 1);
+}
+
 /* Task methods */
 
 static int
@@ -748,11 +854,17 @@ lua_task_insert_result (lua_State * L)
 	const gchar *symbol_name, *param;
 	double flag;
 	GList *params = NULL;
-	gint i, top;
+	gint i, top, id = -1;
 
 	if (task != NULL) {
-		symbol_name =
-			rspamd_mempool_strdup (task->task_pool, luaL_checkstring (L, 2));
+		if (lua_type (L, 2) == LUA_TNUMBER) {
+			id = lua_tonumber (L, 2);
+			symbol_name = NULL;
+		}
+		else {
+			symbol_name = rspamd_mempool_strdup (task->task_pool,
+					luaL_checkstring (L, 2));
+		}
 		flag = luaL_checknumber (L, 3);
 		top = lua_gettop (L);
 		/* Get additional options */
@@ -763,7 +875,12 @@ lua_task_insert_result (lua_State * L)
 					rspamd_mempool_strdup (task->task_pool, param));
 		}
 
-		rspamd_task_insert_result (task, symbol_name, flag, params);
+		if (symbol_name != NULL) {
+			rspamd_task_insert_result (task, symbol_name, flag, params);
+		}
+		else {
+			rspamd_task_insert_result_id (task, id, flag, params);
+		}
 	}
 	return 0;
 }
@@ -832,12 +949,23 @@ lua_task_get_urls (lua_State * L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct lua_tree_cb_data cb;
+	gchar key[32];
 
 	if (task) {
-		lua_newtable (L);
+		/* Urls might be added while processing, so size is a part of key */
+		rspamd_snprintf (key, sizeof (key), "urls:%ud",
+				g_hash_table_size (task->urls));
+
+		if (lua_task_cache_get (L, task, key)) {
+			return 1;
+		}
+
+		lua_createtable (L, g_hash_table_size (task->urls), 0);
 		cb.i = 1;
 		cb.L = L;
 		g_hash_table_foreach (task->urls, lua_tree_url_callback, &cb);
+		lua_task_cache_set (L, task, key);
+
 		return 1;
 	}
 
@@ -870,12 +998,22 @@ lua_task_get_emails (lua_State * L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct lua_tree_cb_data cb;
+	gchar key[32];
 
 	if (task) {
-		lua_newtable (L);
+		rspamd_snprintf (key, sizeof (key), "emails:%ud",
+				g_hash_table_size (task->emails));
+
+		if (lua_task_cache_get (L, task, key)) {
+			return 1;
+		}
+
+		lua_createtable (L, g_hash_table_size (task->emails), 0);
 		cb.i = 1;
 		cb.L = L;
 		g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
+		lua_task_cache_set (L, task, key);
+
 		return 1;
 	}
 
@@ -892,7 +1030,11 @@ lua_task_get_text_parts (lua_State * L)
 	struct mime_text_part *part, **ppart;
 
 	if (task != NULL) {
-		lua_newtable (L);
+		if (lua_task_cache_get (L, task, "text_parts")) {
+			return 1;
+		}
+
+		lua_createtable (L, g_list_length (task->text_parts), 0);
 		cur = task->text_parts;
 		while (cur) {
 			part = cur->data;
@@ -903,6 +1045,8 @@ lua_task_get_text_parts (lua_State * L)
 			lua_rawseti (L, -2, i++);
 			cur = g_list_next (cur);
 		}
+		lua_task_cache_set (L, task, "text_parts");
+
 		return 1;
 	}
 	lua_pushnil (L);
@@ -918,7 +1062,11 @@ lua_task_get_parts (lua_State * L)
 	struct mime_part *part, **ppart;
 
 	if (task != NULL) {
-		lua_newtable (L);
+		if (lua_task_cache_get (L, task, "parts")) {
+			return 1;
+		}
+
+		lua_createtable (L, g_list_length (task->parts), 0);
 		cur = task->parts;
 		while (cur) {
 			part = cur->data;
@@ -929,6 +1077,8 @@ lua_task_get_parts (lua_State * L)
 			lua_rawseti (L, -2, i++);
 			cur = g_list_next (cur);
 		}
+		lua_task_cache_set (L, task, "parts");
+
 		return 1;
 	}
 	lua_pushnil (L);
@@ -1098,6 +1248,7 @@ lua_task_get_header_common (lua_State *L, gboolean full, gboolean raw)
 	gboolean strong = FALSE;
 	struct rspamd_task *task = lua_check_task (L, 1);
 	const gchar *name;
+	gchar *key;
 
 	name = luaL_checkstring (L, 2);
 
@@ -1105,6 +1256,25 @@ lua_task_get_header_common (lua_State *L, gboolean full, gboolean raw)
 		if (lua_gettop (L) == 3) {
 			strong = lua_toboolean (L, 3);
 		}
+
+		if (full) {
+			/* Tables of full headers are cached */
+			key = g_strdup_printf ("hdr:%d:%s", strong, name);
+
+			if (!lua_task_cache_get (L, task, key)) {
+				rspamd_lua_push_header (L, task->raw_headers, name, strong,
+						full, raw);
+
+				if (!lua_isnil (L, -1)) {
+					lua_task_cache_set (L, task, key);
+				}
+			}
+
+			g_free (key);
+
+			return 1;
+		}
+
 		return rspamd_lua_push_header (L, task->raw_headers, name, strong, full, raw);
 	}
 	lua_pushnil (L);
@@ -1129,6 +1299,43 @@ lua_task_get_header_raw (lua_State * L)
 	return lua_task_get_header_common (L, FALSE, TRUE);
 }
 
+static gint
+lua_task_get_header_text (lua_State * L)
+{
+	gboolean strong = FALSE;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct raw_header *rh;
+	const gchar *name;
+
+	name = luaL_checkstring (L, 2);
+
+	if (name && task) {
+		if (lua_gettop (L) == 3) {
+			strong = lua_toboolean (L, 3);
+		}
+
+		rh = g_hash_table_lookup (task->raw_headers, name);
+
+		while (rh) {
+			if (rh->name != NULL && (!strong || strcmp (rh->name, name) == 0)) {
+				if (rh->value) {
+					lua_new_text (L, rh->value, strlen (rh->value), FALSE);
+				}
+				else {
+					lua_pushnil (L);
+				}
+
+				return 1;
+			}
+
+			rh = rh->next;
+		}
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
 static gint
 lua_task_get_raw_headers (lua_State *L)
 {
@@ -2135,6 +2342,102 @@ lua_text_gc (lua_State *L)
 	return 0;
 }
 
+/* FFI accessors */
+const gchar *
+rspamd_ffi_task_get_from_ip (void *ud)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ud;
+
+	if (task->from_addr == NULL) {
+		return NULL;
+	}
+
+	return rspamd_inet_address_to_string (task->from_addr);
+}
+
+gint
+rspamd_ffi_task_get_score (void *ud, const gchar *metric, gdouble *score)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ud;
+	struct metric_result *metric_res;
+
+	metric_res = g_hash_table_lookup (task->results,
+			metric ? metric : DEFAULT_METRIC);
+
+	if (metric_res == NULL) {
+		return 0;
+	}
+
+	*score = metric_res->score;
+
+	return 1;
+}
+
+const gchar *
+rspamd_ffi_task_get_header (void *ud, const gchar *name, gint strong,
+		gint raw, guint idx, gsize *len)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ud;
+	struct raw_header *rh;
+	const gchar *val;
+
+	rh = g_hash_table_lookup (task->raw_headers, name);
+
+	for (; rh != NULL; rh = rh->next) {
+		if (rh->name == NULL || (strong && strcmp (rh->name, name) != 0)) {
+			continue;
+		}
+
+		if (idx -- == 0) {
+			/* The same values as `task:get_header` and `task:get_header_raw` */
+			val = raw ? rh->decoded : rh->value;
+
+			if (val != NULL) {
+				*len = strlen (val);
+			}
+
+			return val;
+		}
+	}
+
+	return NULL;
+}
+
+struct rspamd_ffi_urls_cbdata {
+	struct rspamd_ffi_str *urls;
+	guint max;
+	guint cur;
+};
+
+static void
+rspamd_ffi_urls_callback (gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_ffi_urls_cbdata *cbd = ud;
+	struct rspamd_url *url = value;
+
+	if (cbd->cur < cbd->max) {
+		cbd->urls[cbd->cur].start = url->string;
+		cbd->urls[cbd->cur].len = url->urllen;
+		cbd->cur ++;
+	}
+}
+
+guint
+rspamd_ffi_task_get_urls (void *ud, struct rspamd_ffi_str *urls, guint max)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ud;
+	struct rspamd_ffi_urls_cbdata cbd;
+
+	if (urls != NULL && max > 0) {
+		cbd.urls = urls;
+		cbd.max = max;
+		cbd.cur = 0;
+		g_hash_table_foreach (task->urls, rspamd_ffi_urls_callback, &cbd);
+	}
+
+	return g_hash_table_size (task->urls);
+}
+
 /* Init part */
 
 static gint
@@ -35,6 +35,7 @@
  * - round-robin: balance upstreams one by one selecting accordingly to their weight
  * - hash: use stable hashing algorithm to distribute values according to some static strings
  * - master-slave: always prefer upstream with higher priority unless it is not available
+ * - latency: prefer upstreams with lower latency and less requests in flight
  *
  * Here is an example of upstreams manipulations:
  * @example
@@ -65,12 +66,14 @@ LUA_FUNCTION_DEF (upstream_list, destroy);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_by_hash);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_round_robin);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_master_slave);
+LUA_FUNCTION_DEF (upstream_list, get_upstream_by_latency);
 
 static const struct luaL_reg upstream_list_m[] = {
 
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_hash),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_round_robin),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_master_slave),
+	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_latency),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_upstream_list_destroy},
 	{NULL, NULL}
@@ -83,11 +86,13 @@ static const struct luaL_reg upstream_list_f[] = {
 /* Upstream functions */
 LUA_FUNCTION_DEF (upstream, ok);
 LUA_FUNCTION_DEF (upstream, fail);
+LUA_FUNCTION_DEF (upstream, release);
 LUA_FUNCTION_DEF (upstream, get_addr);
 
 static const struct luaL_reg upstream_m[] = {
 	LUA_INTERFACE_DEF (upstream, ok),
 	LUA_INTERFACE_DEF (upstream, fail),
+	LUA_INTERFACE_DEF (upstream, release),
 	LUA_INTERFACE_DEF (upstream, get_addr),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
@@ -141,8 +146,9 @@ lua_upstream_fail (lua_State *L)
 }
 
 /***
- * @method upstream:ok()
+ * @method upstream:ok([latency])
  * Indicates upstream success. Resets errors count for an upstream.
+ * @param {number} latency optional latency of a request in seconds
  */
 static gint
 lua_upstream_ok (lua_State *L)
@@ -150,12 +156,32 @@ lua_upstream_ok (lua_State *L)
 	struct upstream *up = lua_check_upstream (L);
 
 	if (up) {
+		if (lua_type (L, 2) == LUA_TNUMBER) {
+			rspamd_upstream_latency (up, lua_tonumber (L, 2));
+		}
 		rspamd_upstream_ok (up);
 	}
 
 	return 0;
 }
 
+/***
+ * @method upstream:release()
+ * Finishes a request to an upstream selected by `get_upstream_by_latency`,
+ * it must be called once after `upstream:ok(latency)` or `upstream:fail()`.
+ */
+static gint
+lua_upstream_release (lua_State *L)
+{
+	struct upstream *up = lua_check_upstream (L);
+
+	if (up) {
+		rspamd_upstream_release (up);
+	}
+
+	return 0;
+}
+
 /* Upstream list class */
 
 static struct upstream_list *
@@ -337,6 +363,40 @@ lua_upstream_list_get_upstream_master_slave (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method upstream_list:get_upstream_by_latency()
+ * Get upstream with the lowest latency multiplied by requests in flight among
+ * two random upstreams. A request to the selected upstream must be finished
+ * by `upstream:ok(latency)` or `upstream:fail()` followed by
+ * `upstream:release()`.
+ * @return {upstream} upstream from a list selected by latency
+ */
+static gint
+lua_upstream_list_get_upstream_by_latency (lua_State *L)
+{
+	struct upstream_list *upl;
+	struct upstream *selected, **pselected;
+
+	upl = lua_check_upstream_list (L);
+	if (upl) {
+
+		selected = rspamd_upstream_get (upl, RSPAMD_UPSTREAM_LATENCY);
+		if (selected) {
+			pselected = lua_newuserdata (L, sizeof (struct upstream *));
+			rspamd_lua_setclass (L, "rspamd{upstream}", -1);
+			*pselected = selected;
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_upstream_list (lua_State * L)
 {
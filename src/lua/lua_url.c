@@ -51,6 +51,7 @@ LUA_FUNCTION_DEF (url, get_host);
 LUA_FUNCTION_DEF (url, get_user);
 LUA_FUNCTION_DEF (url, get_path);
 LUA_FUNCTION_DEF (url, get_text);
+LUA_FUNCTION_DEF (url, get_text_view);
 LUA_FUNCTION_DEF (url, get_tld);
 LUA_FUNCTION_DEF (url, to_table);
 LUA_FUNCTION_DEF (url, is_phished);
@@ -64,6 +65,7 @@ static const struct luaL_reg urllib_m[] = {
 	LUA_INTERFACE_DEF (url, get_user),
 	LUA_INTERFACE_DEF (url, get_path),
 	LUA_INTERFACE_DEF (url, get_text),
+	LUA_INTERFACE_DEF (url, get_text_view),
 	LUA_INTERFACE_DEF (url, get_tld),
 	LUA_INTERFACE_DEF (url, to_table),
 	LUA_INTERFACE_DEF (url, is_phished),
@@ -185,6 +187,26 @@ lua_url_get_text (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method url:get_text_view()
+ * Get full content of the url without copying
+ * @return {rspamd_text} url text that is valid while the url exists
+ */
+static gint
+lua_url_get_text_view (lua_State *L)
+{
+	struct rspamd_lua_url *url = lua_check_url (L, 1);
+
+	if (url != NULL) {
+		lua_new_text (L, url->url->string, url->url->urllen, FALSE);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 /***
  * @method url:is_phished()
  * Check whether URL is treated as phished
@@ -358,6 +358,7 @@ start_lua_worker (struct rspamd_worker *worker)
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
+	ctx->resolver->stat = worker->srv->stat;
 
 	/* Open worker's lib */
 	luaopen_lua_worker (L);
@@ -37,6 +37,7 @@
 #include "libstat/stat_api.h"
 #include "cryptobox.h"
 #include "regexp.h"
+#include "keypairs_cache.h"
 #ifdef HAVE_OPENSSL
 #include <openssl/rand.h>
 #include <openssl/err.h>
@@ -48,6 +49,9 @@
 #include <locale.h>
 #define HAVE_SETLOCALE 1
 #endif
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
 
 /* 2 seconds to fork new process in place of dead one */
 #define SOFT_FORK_TIME 2
@@ -65,6 +69,7 @@ sig_atomic_t do_reopen_log = 0;
 sig_atomic_t do_terminate = 0;
 sig_atomic_t child_dead = 0;
 sig_atomic_t got_alarm = 0;
+sig_atomic_t worker_ready = 0;
 
 #ifdef HAVE_SA_SIGINFO
 GQueue *signals_info = NULL;
@@ -86,6 +91,10 @@ static gboolean gen_keypair = FALSE;
 static gboolean encrypt_password = FALSE;
 /* List of workers that are pending to start */
 static GList *workers_pending = NULL;
+/* Reload is in progress: old workers wait for the new ones to be ready */
+static gboolean reload_pending = FALSE;
+static time_t reload_start = 0;
+static guint reload_workers = 0;
 
 #ifdef HAVE_SA_SIGINFO
 static siginfo_t static_sg[64];
@@ -166,7 +175,7 @@ sig_handler (gint signo, siginfo_t *info, void *unused)
 		do_reopen_log = 1;
 		break;
 	case SIGUSR2:
-		/* Do nothing */
+		worker_ready = 1;
 		break;
 	case SIGALRM:
 		got_alarm = 1;
@@ -424,6 +433,35 @@ set_worker_limits (struct rspamd_worker_conf *cf)
 	}
 }
 
+static void
+register_process_stat (struct rspamd_main *rspamd, pid_t pid, GQuark type)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_MAX_PROCESSES_STAT; i ++) {
+		if (rspamd->stat->processes[i].pid == 0) {
+			rspamd->stat->processes[i].type = type;
+			rspamd->stat->processes[i].private_mem = 0;
+			rspamd->stat->processes[i].shared_mem = 0;
+			rspamd->stat->processes[i].pid = pid;
+			return;
+		}
+	}
+}
+
+static void
+unregister_process_stat (struct rspamd_main *rspamd, pid_t pid)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_MAX_PROCESSES_STAT; i ++) {
+		if (rspamd->stat->processes[i].pid == pid) {
+			rspamd->stat->processes[i].pid = 0;
+			return;
+		}
+	}
+}
+
 static struct rspamd_worker *
 fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 {
@@ -478,6 +516,7 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 			/* Insert worker into worker's table, pid is index */
 			g_hash_table_insert (rspamd->workers, GSIZE_TO_POINTER (
 					cur->pid), cur);
+			register_process_stat (rspamd, cur->pid, cur->type);
 			break;
 		}
 	}
@@ -504,6 +543,33 @@ set_alarm (guint seconds)
 #endif
 }
 
+/*
+ * Compact memory of the main process before forking, so that workers do not
+ * inherit and then copy pages that hold only garbage
+ */
+static void
+prefork_compact (struct rspamd_main *rspamd)
+{
+	gsize priv, shared;
+
+	if (!rspamd->cfg->prefork_compact) {
+		return;
+	}
+
+	/* Do not let workers inherit garbage left after loading of lua rules */
+	if (rspamd->cfg->lua_state) {
+		lua_gc (rspamd->cfg->lua_state, LUA_GCCOLLECT, 0);
+	}
+#ifdef HAVE_MALLOC_TRIM
+	malloc_trim (0);
+#endif
+
+	if (rspamd_get_process_memory (getpid (), &priv, &shared)) {
+		msg_info ("memory is compacted, main process memory: %Hz private, "
+				"%Hz shared", priv, shared);
+	}
+}
+
 static void
 delay_fork (struct rspamd_worker_conf *cf)
 {
@@ -707,13 +773,56 @@ spawn_workers (struct rspamd_main *rspamd)
 	}
 }
 
+static void
+mark_old_workers (gpointer key, gpointer value, gpointer unused)
+{
+	struct rspamd_worker *w = value;
+
+	w->is_dying = TRUE;
+}
+
 static void
 kill_old_workers (gpointer key, gpointer value, gpointer unused)
 {
 	struct rspamd_worker *w = value;
 
-	kill (w->pid, SIGUSR2);
-	msg_info ("send signal to worker %P", w->pid);
+	if (w->is_dying) {
+		kill (w->pid, SIGUSR2);
+		msg_info ("send signal to worker %P", w->pid);
+	}
+}
+
+/*
+ * Old workers stop accepting and finish their connections when all workers
+ * with the new config are ready or when they failed to start in time
+ */
+static void
+check_reload (struct rspamd_main *rspamd)
+{
+	guint ready;
+
+	if (!reload_pending) {
+		return;
+	}
+
+	ready = g_atomic_int_get (&rspamd->stat->workers_ready);
+
+	if (ready >= reload_workers) {
+		msg_info ("all %ud new workers are ready, stop old workers",
+				reload_workers);
+	}
+	else if (time (NULL) - reload_start >= rspamd->cfg->reload_warmup_time) {
+		msg_warn ("only %ud of %ud new workers are ready after %.1f seconds, "
+				"stop old workers anyway", ready, reload_workers,
+				rspamd->cfg->reload_warmup_time);
+	}
+	else {
+		set_alarm (1);
+		return;
+	}
+
+	reload_pending = FALSE;
+	g_hash_table_foreach (rspamd->workers, kill_old_workers, NULL);
 }
 
 static gboolean
@@ -1023,14 +1132,13 @@ rspamd_init_main (struct rspamd_main *rspamd)
 		rspamd_mempool_suggest_size ());
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 		sizeof (struct rspamd_stat));
-	/* Create rolling history */
-	rspamd_main->history = rspamd_roll_history_new (rspamd_main->server_pool);
 }
 
 gint
 main (gint argc, gchar **argv, gchar **env)
 {
 	gint res = 0, i;
+	guint nworkers;
 	struct sigaction signals;
 	struct rspamd_worker *cur;
 	pid_t wrk;
@@ -1205,15 +1313,25 @@ main (gint argc, gchar **argv, gchar **env)
 	/* Flush log */
 	rspamd_log_flush (rspamd_main->logger);
 
-	/* Maybe read roll history */
-	if (rspamd_main->cfg->history_file) {
-		rspamd_roll_history_load (rspamd_main->history,
-			rspamd_main->cfg->history_file);
-	}
+	/* Create rolling history, it is loaded from the history file if any */
+	rspamd_main->history = rspamd_roll_history_new (rspamd_main->server_pool,
+			rspamd_main->cfg->history_rows, rspamd_main->cfg->history_file);
+	/* Time series are shared by all workers, symbols must be known here */
+	rspamd_main->ts = rspamd_ts_store_new (rspamd_main->server_pool,
+			rspamd_main->cfg);
+	/* Shared secrets of encrypted sessions are reused by all workers */
+	rspamd_keypair_cache_init_shared (rspamd_main->server_pool,
+			rspamd_main->cfg->keypair_cache_size);
 
 #if defined(WITH_GPERF_TOOLS)
 	ProfilerStop ();
 #endif
+	/* Compile maps once for all workers */
+	rspamd_map_preload (rspamd_main->cfg);
+	prefork_compact (rspamd_main);
+	register_process_stat (rspamd_main, rspamd_main->pid, rspamd_main->type);
+	rspamd_update_process_memory_stat (rspamd_main);
+
 	/* Spawn workers */
 	rspamd_main->workers = g_hash_table_new (g_direct_hash, g_direct_equal);
 	spawn_workers (rspamd_main);
@@ -1248,6 +1366,7 @@ main (gint argc, gchar **argv, gchar **env)
 
 				g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (
 						wrk));
+				unregister_process_stat (rspamd_main, wrk);
 
 				if (WIFEXITED (res) && WEXITSTATUS (res) == 0) {
 					/* Normal worker termination, do not fork one more */
@@ -1269,7 +1388,9 @@ main (gint argc, gchar **argv, gchar **env)
 							cur->pid);
 					}
 					/* Fork another worker in replace of dead one */
-					delay_fork (cur->cf);
+					if (!cur->is_dying) {
+						delay_fork (cur->cf);
+					}
 				}
 
 				g_free (cur);
@@ -1289,10 +1410,25 @@ main (gint argc, gchar **argv, gchar **env)
 				rspamd_main->workers_uid,
 				rspamd_main->workers_gid);
 			msg_info ("rspamd " RVERSION " is restarting");
-			g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
+			/* Old workers serve requests until the new ones are ready */
+			g_hash_table_foreach (rspamd_main->workers, mark_old_workers, NULL);
 			rspamd_map_remove_all (rspamd_main->cfg);
+			/* Symbols timings of old workers are saved and loaded here */
 			reread_config (rspamd_main);
+			rspamd_map_preload (rspamd_main->cfg);
+			prefork_compact (rspamd_main);
+			rspamd_update_process_memory_stat (rspamd_main);
+			nworkers = g_hash_table_size (rspamd_main->workers);
+			g_atomic_int_set (&rspamd_main->stat->workers_ready, 0);
 			spawn_workers (rspamd_main);
+			reload_workers = g_hash_table_size (rspamd_main->workers) - nworkers;
+			reload_start = time (NULL);
+			reload_pending = TRUE;
+			check_reload (rspamd_main);
+		}
+		if (worker_ready) {
+			worker_ready = 0;
+			check_reload (rspamd_main);
 		}
 		if (do_reopen_log) {
 			do_reopen_log = 0;
@@ -1305,6 +1441,7 @@ main (gint argc, gchar **argv, gchar **env)
 		if (got_alarm) {
 			got_alarm = 0;
 			fork_delayed (rspamd_main);
+			check_reload (rspamd_main);
 		}
 	}
 
@@ -1330,10 +1467,7 @@ main (gint argc, gchar **argv, gchar **env)
 	g_hash_table_foreach_remove (rspamd_main->workers, wait_for_workers, NULL);
 
 	/* Maybe save roll history */
-	if (rspamd_main->cfg->history_file) {
-		rspamd_roll_history_save (rspamd_main->history,
-			rspamd_main->cfg->history_file);
-	}
+	rspamd_roll_history_save (rspamd_main->history);
 
 	msg_info ("terminating...");
 	rspamd_symbols_cache_destroy (rspamd_main->cfg->cache);
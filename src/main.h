@@ -18,6 +18,7 @@
 #include "libserver/buffer.h"
 #include "libserver/events.h"
 #include "libserver/roll_history.h"
+#include "libserver/timeseries.h"
 #include "libserver/task.h"
 #include "libserver/worker_util.h"
 #include "libmime/filter.h"
@@ -51,6 +52,7 @@ struct rspamd_worker {
 	gboolean is_initialized;                                    /**< is initialized									*/
 	gboolean is_dying;                                          /**< if worker is going to shutdown					*/
 	gboolean pending;                                           /**< if worker is pending to run					*/
+	guint nconns;                                               /**< number of connections in progress				*/
 	struct rspamd_main *srv;                                    /**< pointer to server structure					*/
 	GQuark type;                                                /**< process type									*/
 	GHashTable *signal_events;									/**< signal events									*/
@@ -100,6 +102,9 @@ enum rspamd_fuzzy_epoch {
 	RSPAMD_FUZZY_EPOCH_MAX
 };
 
+/* Maximum number of processes with memory statistics */
+#define RSPAMD_MAX_PROCESSES_STAT 128
+
 /**
  * Server statistics
  */
@@ -113,6 +118,18 @@ struct rspamd_stat {
 	guint fuzzy_hashes_expired;                         /**< number of fuzzy hashes expired					*/
 	guint64 fuzzy_hashes_checked[RSPAMD_FUZZY_EPOCH_MAX]; /**< ammount of check requests for each epoch		*/
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX]; /**< amount of hashes found by epoch				*/
+	guint64 dns_requests;                               /**< DNS requests sent								*/
+	guint64 dns_cache_hits;                             /**< DNS replies found in cache						*/
+	guint64 dns_coalesced;                              /**< DNS requests joined to identical requests		*/
+	guint64 dns_cache_evictions;                        /**< DNS replies removed from cache					*/
+	guint64 log_dropped;                                /**< log lines dropped by async logging				*/
+	gint workers_ready;                                 /**< workers started since the last reload			*/
+	struct {
+		pid_t pid;                                      /**< pid of process, 0 for free slot				*/
+		GQuark type;                                    /**< type of process								*/
+		guint64 private_mem;                            /**< private memory sampled by the process itself	*/
+		guint64 shared_mem;                             /**< shared memory sampled by the process itself	*/
+	} processes[RSPAMD_MAX_PROCESSES_STAT];             /**< processes for memory statistics				*/
 };
 
 /**
@@ -134,6 +151,7 @@ struct rspamd_main {
 	gid_t workers_gid;                                          /**< worker's gid running to						*/
 	gboolean is_privilleged;                                    /**< true if run in privilleged mode                */
 	struct roll_history *history;                               /**< rolling history								*/
+	struct rspamd_ts_store *ts;                                 /**< time series for graphs							*/
 };
 
 /**
@@ -35,6 +35,9 @@
  * - time_jitter (number): jitter in seconds to allow time diff while checking
  * - trusted_only (flag): check signatures only for domains in 'domains' map
  * - skip_mutli (flag): skip messages with multiply dkim signatures
+ * - dkim_shared_cache_size (number): number of keys in the cache shared
+ *   between workers, 0 to disable it
+ * - dkim_shared_cache_file (string): file to keep shared cache between restarts
  */
 
 #include "config.h"
@@ -42,6 +45,7 @@
 #include "libserver/dkim.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "main.h"
 #include "utlist.h"
 
@@ -51,6 +55,8 @@
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
 #define DEFAULT_TIME_JITTER 60
+/* Enough for DER encoded 4096 bits RSA key */
+#define DEFAULT_SHARED_VALUE_SIZE 1024
 
 struct dkim_ctx {
 	struct module_ctx ctx;
@@ -60,10 +66,11 @@ struct dkim_ctx {
 
 	rspamd_mempool_t *dkim_pool;
 	radix_compressed_t *whitelist_ip;
-	GHashTable *dkim_domains;
+	struct rspamd_map_hash *dkim_domains;
 	guint strict_multiplier;
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
+	struct rspamd_shm_cache *shared_cache;
 	gboolean trusted_only;
 	gboolean skip_multi;
 };
@@ -113,8 +120,10 @@ dkim_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value;
 	gint res = TRUE, cb_id;
-	guint cache_size, cache_expire;
+	guint cache_size, cache_expire, shared_size;
+	const gchar *shared_file = NULL;
 	gboolean got_trusted = FALSE;
+	GError *err = NULL;
 
 	dkim_module_ctx->whitelist_ip = radix_create_compressed ();
 
@@ -156,6 +165,19 @@ dkim_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "dkim",
+		"dkim_shared_cache_size")) != NULL) {
+		shared_size = ucl_obj_toint (value);
+	}
+	else {
+		shared_size = cache_size;
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "dkim",
+		"dkim_shared_cache_file")) != NULL) {
+		shared_file = ucl_obj_tostring (value);
+	}
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "dkim", "time_jitter")) != NULL) {
 		dkim_module_ctx->time_jitter = ucl_obj_todouble (value);
@@ -244,6 +266,18 @@ dkim_module_config (struct rspamd_config *cfg)
 				g_free,
 				(GDestroyNotify)rspamd_dkim_key_free);
 
+		/* Shared cache is kept on reload if its parameters are the same */
+		dkim_module_ctx->shared_cache = rspamd_shm_cache_reuse (
+				dkim_module_ctx->shared_cache,
+				shared_size,
+				DEFAULT_SHARED_VALUE_SIZE,
+				shared_file,
+				&err);
+
+		if (err != NULL) {
+			msg_err ("cannot create shared dkim cache: %e", err);
+			g_error_free (err);
+		}
 
 #ifndef HAVE_OPENSSL
 		msg_warn (
@@ -258,16 +292,17 @@ gint
 dkim_module_reconfig (struct rspamd_config *cfg)
 {
 	struct module_ctx saved_ctx;
+	struct rspamd_shm_cache *saved_cache;
 
 	saved_ctx = dkim_module_ctx->ctx;
+	saved_cache = dkim_module_ctx->shared_cache;
 	rspamd_mempool_delete (dkim_module_ctx->dkim_pool);
 	radix_destroy_compressed (dkim_module_ctx->whitelist_ip);
-	if (dkim_module_ctx->dkim_domains) {
-		g_hash_table_destroy (dkim_module_ctx->dkim_domains);
-	}
+	rspamd_map_hash_destroy (dkim_module_ctx->dkim_domains);
 
 	memset (dkim_module_ctx, 0, sizeof (*dkim_module_ctx));
 	dkim_module_ctx->ctx = saved_ctx;
+	dkim_module_ctx->shared_cache = saved_cache;
 	dkim_module_ctx->dkim_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
 
@@ -320,7 +355,7 @@ dkim_module_check (struct dkim_check_result *res)
 			if (dkim_module_ctx->dkim_domains != NULL) {
 				/* Perform strict check */
 				if ((strict_value =
-						g_hash_table_lookup (dkim_module_ctx->dkim_domains,
+						rspamd_map_hash_lookup (dkim_module_ctx->dkim_domains,
 								cur->ctx->domain)) != NULL) {
 					if (!dkim_module_parse_strict (strict_value, &cur->mult_allow,
 							&cur->mult_deny)) {
@@ -402,6 +437,14 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
 			g_strdup (ctx->dns_key),
 			key, res->task->tv.tv_sec, key->ttl);
+
+		if (dkim_module_ctx->shared_cache != NULL) {
+			rspamd_shm_cache_insert (dkim_module_ctx->shared_cache,
+				ctx->dns_key, strlen (ctx->dns_key),
+				key->keydata, key->decoded_len,
+				res->task->tv.tv_sec, key->ttl);
+		}
+
 		res->key = key;
 	}
 	else {
@@ -419,6 +462,51 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 	dkim_module_check (res);
 }
 
+/*
+ * Find key in the local cache and then in the cache shared between workers
+ */
+static rspamd_dkim_key_t *
+dkim_module_lookup_key (rspamd_dkim_context_t *ctx, struct rspamd_task *task)
+{
+	rspamd_dkim_key_t *key;
+	guchar *data;
+	gsize len;
+	guint ttl;
+	GError *err = NULL;
+
+	key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
+			ctx->dns_key,
+			task->tv.tv_sec);
+
+	if (key == NULL && dkim_module_ctx->shared_cache != NULL) {
+		data = rspamd_shm_cache_lookup (dkim_module_ctx->shared_cache,
+				ctx->dns_key, strlen (ctx->dns_key), task->tv.tv_sec,
+				&len, &ttl);
+
+		if (data != NULL) {
+			key = rspamd_dkim_key_from_der (data, len, ttl, &err);
+			g_free (data);
+
+			if (key != NULL) {
+				debug_task ("found key for %s in shared cache", ctx->dns_key);
+				rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+						g_strdup (ctx->dns_key),
+						key, task->tv.tv_sec, ttl);
+			}
+			else {
+				msg_info ("cannot load cached key for %s: %e", ctx->dns_key,
+						err);
+
+				if (err != NULL) {
+					g_error_free (err);
+				}
+			}
+		}
+	}
+
+	return key;
+}
+
 static void
 dkim_symbol_callback (struct rspamd_task *task, void *unused)
 {
@@ -485,7 +573,7 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 
 					if (dkim_module_ctx->trusted_only &&
 							(dkim_module_ctx->dkim_domains == NULL ||
-									g_hash_table_lookup (dkim_module_ctx->dkim_domains,
+									rspamd_map_hash_lookup (dkim_module_ctx->dkim_domains,
 											ctx->domain) == NULL)) {
 						msg_debug ("skip dkim check for %s domain", ctx->domain);
 						hlist = g_list_next (hlist);
@@ -493,9 +581,7 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 						continue;
 					}
 
-					key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
-							ctx->dns_key,
-							task->tv.tv_sec);
+					key = dkim_module_lookup_key (ctx, task);
 					if (key != NULL) {
 						debug_task ("found key for %s in cache", ctx->dns_key);
 						cur->key = key;
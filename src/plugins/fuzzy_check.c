@@ -79,6 +79,7 @@ struct fuzzy_rule {
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
+	gboolean multi_commands;
 };
 
 struct fuzzy_ctx {
@@ -103,6 +104,8 @@ struct fuzzy_client_session {
 	struct rspamd_task *task;
 	struct upstream *server;
 	struct fuzzy_rule *rule;
+	gdouble start;
+	gboolean completed;
 	gint fd;
 };
 
@@ -336,6 +339,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj, gint cb_id
 	if ((value = ucl_object_find_key (obj, "skip_unknown")) != NULL) {
 		rule->skip_unknown = ucl_obj_toboolean (value);
 	}
+	if ((value = ucl_object_find_key (obj, "multi_commands")) != NULL) {
+		rule->multi_commands = ucl_obj_toboolean (value);
+	}
 
 	if ((value = ucl_object_find_key (obj, "servers")) != NULL) {
 		rule->servers = rspamd_upstreams_create ();
@@ -519,6 +525,13 @@ fuzzy_io_fin (void *ud)
 {
 	struct fuzzy_client_session *session = ud;
 
+	/* Session can be destroyed before any reply has been received */
+	if (!session->completed) {
+		rspamd_upstream_fail (session->server);
+	}
+
+	rspamd_upstream_release (session->server);
+
 	if (session->commands) {
 		g_ptr_array_free (session->commands, TRUE);
 	}
@@ -607,7 +620,8 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 
 	cmd->tag = ottery_rand_uint32 ();
 	cmd->cmd = c;
-	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->version = rule->multi_commands ? RSPAMD_FUZZY_VERSION_MULTI :
+			RSPAMD_FUZZY_VERSION;
 	if (c != FUZZY_CHECK) {
 		cmd->flag = flag;
 		cmd->value = weight;
@@ -631,7 +645,8 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 
 	cmd = rspamd_mempool_alloc0 (pool, sizeof (*cmd));
 	cmd->cmd = c;
-	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->version = rule->multi_commands ? RSPAMD_FUZZY_VERSION_MULTI :
+			RSPAMD_FUZZY_VERSION;
 	if (c != FUZZY_CHECK) {
 		cmd->flag = flag;
 		cmd->value = weight;
@@ -681,19 +696,42 @@ fuzzy_cmd_to_wire (gint fd, const struct rspamd_fuzzy_cmd *cmd, gsize len)
 }
 
 static gboolean
-fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
+fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v, gboolean multi)
 {
 	guint i;
 	const struct rspamd_fuzzy_cmd *cmd;
-	gsize len;
+	guchar packet[RSPAMD_FUZZY_MAX_PACKET];
+	gsize len, pos = 0;
 
 	for (i = 0; i < v->len; i ++) {
 		cmd = g_ptr_array_index (v, i);
 		len = cmd->shingles_count > 0 ? sizeof (struct rspamd_fuzzy_shingle_cmd) :
 				sizeof (struct rspamd_fuzzy_cmd);
-		if (!fuzzy_cmd_to_wire (fd, cmd, len)) {
-			return FALSE;
+
+		if (!multi) {
+			if (!fuzzy_cmd_to_wire (fd, cmd, len)) {
+				return FALSE;
+			}
+
+			continue;
 		}
+
+		/* Pack as many commands as possible to a single datagram */
+		if (pos + len > sizeof (packet)) {
+			if (!fuzzy_cmd_to_wire (fd, (struct rspamd_fuzzy_cmd *)packet,
+					pos)) {
+				return FALSE;
+			}
+
+			pos = 0;
+		}
+
+		memcpy (packet + pos, cmd, len);
+		pos += len;
+	}
+
+	if (pos > 0) {
+		return fuzzy_cmd_to_wire (fd, (struct rspamd_fuzzy_cmd *)packet, pos);
 	}
 
 	return TRUE;
@@ -742,13 +780,15 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 	const struct rspamd_fuzzy_reply *rep;
 	struct fuzzy_mapping *map;
 	guchar buf[2048], *p;
+	gchar optbuf[64];
 	const gchar *symbol;
 	gint r;
-	double nval;
+	double nval, latency;
 	gint ret = -1;
 
 	if (what == EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+				session->rule->multi_commands)) {
 			ret = -1;
 		}
 		else {
@@ -792,8 +832,9 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 							rep->flag,
 							map == NULL ? "(unknown)" : "");
 					if (map != NULL || !session->rule->skip_unknown) {
-						rspamd_snprintf (buf,
-								sizeof (buf),
+						/* Buffer is still being parsed for the next replies */
+						rspamd_snprintf (optbuf,
+								sizeof (optbuf),
 								"%d: %.2f / %.2f",
 								rep->flag,
 								rep->prob,
@@ -803,7 +844,7 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 								nval,
 								g_list_prepend (NULL,
 									rspamd_mempool_strdup (
-										session->task->task_pool, buf)));
+										session->task->task_pool, optbuf)));
 					}
 				}
 				ret = 1;
@@ -823,14 +864,21 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 			rspamd_upstream_name (session->server),
 			errno,
 			strerror (errno));
-		rspamd_upstream_fail (session->server);
+		/* Upstream failure is accounted by fuzzy_io_fin */
 		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 	}
-	else {
-		rspamd_upstream_ok (session->server);
-		if (session->commands->len == 0) {
-			rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
+	else if (session->commands->len == 0) {
+		/* All replies are received */
+		session->completed = TRUE;
+		latency = rspamd_get_ticks () - session->start;
+		rspamd_upstream_latency (session->server, latency);
+
+		if (session->task->worker && session->task->worker->srv) {
+			rspamd_ts_add_latency (session->task->worker->srv->ts, "fuzzy",
+					latency);
 		}
+		rspamd_upstream_ok (session->server);
+		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 	}
 }
 
@@ -847,7 +895,8 @@ fuzzy_learn_callback (gint fd, short what, void *arg)
 
 	if (what == EV_WRITE) {
 		/* Send commands to storage */
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+				session->rule->multi_commands)) {
 			if (*(session->err) == NULL) {
 				g_set_error (session->err,
 					g_quark_from_static_string ("fuzzy check"),
@@ -1093,7 +1142,7 @@ register_fuzzy_client_call (struct rspamd_task *task,
 	gint sock;
 
 	/* Get upstream */
-	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN);
+	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_LATENCY);
 	if (selected) {
 		if ((sock = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
 				SOCK_DGRAM, TRUE)) == -1) {
@@ -1101,6 +1150,8 @@ register_fuzzy_client_call (struct rspamd_task *task,
 				rspamd_upstream_name (selected),
 				errno,
 				strerror (errno));
+			rspamd_upstream_fail (selected);
+			rspamd_upstream_release (selected);
 		}
 		else {
 			/* Create session for a socket */
@@ -1116,6 +1167,8 @@ register_fuzzy_client_call (struct rspamd_task *task,
 			session->fd = sock;
 			session->server = selected;
 			session->rule = rule;
+			session->start = rspamd_get_ticks ();
+			session->completed = FALSE;
 			event_add (&session->ev, &session->tv);
 			rspamd_session_add_event (task->s,
 				fuzzy_io_fin,
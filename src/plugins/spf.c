@@ -30,6 +30,9 @@
  * - symbol_fail (string): symbol to insert (default: 'R_SPF_FAIL')
  * - symbol_softfail (string): symbol to insert (default: 'R_SPF_SOFTFAIL')
  * - whitelist (map): map of whitelisted networks
+ * - spf_shared_cache_size (number): number of records in the cache shared
+ *   between workers, 0 to disable it
+ * - spf_shared_cache_file (string): file to keep shared cache between restarts
  */
 
 #include "config.h"
@@ -37,6 +40,7 @@
 #include "libserver/spf.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "main.h"
 
 #define DEFAULT_SYMBOL_FAIL "R_SPF_FAIL"
@@ -45,6 +49,7 @@
 #define DEFAULT_SYMBOL_ALLOW "R_SPF_ALLOW"
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
+#define DEFAULT_SHARED_VALUE_SIZE 4096
 
 struct spf_ctx {
 	struct module_ctx ctx;
@@ -56,6 +61,7 @@ struct spf_ctx {
 	rspamd_mempool_t *spf_pool;
 	radix_compressed_t *whitelist_ip;
 	rspamd_lru_hash_t *spf_hash;
+	struct rspamd_shm_cache *shared_cache;
 };
 
 static struct spf_ctx *spf_module_ctx = NULL;
@@ -90,7 +96,7 @@ spf_plugin_fin (gpointer ud)
 gint
 spf_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 {
-	spf_module_ctx = g_malloc (sizeof (struct spf_ctx));
+	spf_module_ctx = g_malloc0 (sizeof (struct spf_ctx));
 
 	spf_module_ctx->spf_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
@@ -106,7 +112,9 @@ spf_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value;
 	gint res = TRUE, cb_id;
-	guint cache_size, cache_expire;
+	guint cache_size, cache_expire, shared_size;
+	const gchar *shared_file = NULL;
+	GError *err = NULL;
 
 	spf_module_ctx->whitelist_ip = radix_create_compressed ();
 
@@ -153,6 +161,19 @@ spf_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf",
+		"spf_shared_cache_size")) != NULL) {
+		shared_size = ucl_obj_toint (value);
+	}
+	else {
+		shared_size = cache_size;
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf",
+		"spf_shared_cache_file")) != NULL) {
+		shared_file = ucl_obj_tostring (value);
+	}
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "spf", "whitelist")) != NULL) {
 		if (!rspamd_map_add (cfg, ucl_obj_tostring (value),
@@ -181,6 +202,19 @@ spf_module_config (struct rspamd_config *cfg)
 			NULL,
 			(GDestroyNotify)spf_record_unref);
 
+	/* Shared cache is kept on reload if its parameters are the same */
+	spf_module_ctx->shared_cache = rspamd_shm_cache_reuse (
+			spf_module_ctx->shared_cache,
+			shared_size,
+			DEFAULT_SHARED_VALUE_SIZE,
+			shared_file,
+			&err);
+
+	if (err != NULL) {
+		msg_err ("cannot create shared spf cache: %e", err);
+		g_error_free (err);
+	}
+
 	return res;
 }
 
@@ -188,127 +222,104 @@ gint
 spf_module_reconfig (struct rspamd_config *cfg)
 {
 	struct module_ctx saved_ctx;
+	struct rspamd_shm_cache *saved_cache;
 
 	saved_ctx = spf_module_ctx->ctx;
+	saved_cache = spf_module_ctx->shared_cache;
 	rspamd_mempool_delete (spf_module_ctx->spf_pool);
 	radix_destroy_compressed (spf_module_ctx->whitelist_ip);
 	memset (spf_module_ctx, 0, sizeof (*spf_module_ctx));
 	spf_module_ctx->ctx = saved_ctx;
+	spf_module_ctx->shared_cache = saved_cache;
 	spf_module_ctx->spf_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
 
 	return spf_module_config (cfg);
 }
 
-static gboolean
+static void
 spf_check_element (struct spf_addr *addr, struct rspamd_task *task)
 {
-	gboolean res = FALSE;
-	const guint8 *s, *d;
 	gchar *spf_result;
-	guint af, mask, bmask, addrlen;
 	const gchar *spf_message, *spf_symbol;
 	GList *opts = NULL;
 
-	if (task->from_addr == NULL) {
-		return FALSE;
+	spf_result = rspamd_mempool_strdup (task->task_pool, addr->spf_string);
+	opts = g_list_prepend (opts, spf_result);
+	switch (addr->mech) {
+	case SPF_FAIL:
+		spf_symbol = spf_module_ctx->symbol_fail;
+		spf_message = "(SPF): spf fail";
+		break;
+	case SPF_SOFT_FAIL:
+		spf_symbol = spf_module_ctx->symbol_softfail;
+		spf_message = "(SPF): spf softfail";
+		break;
+	case SPF_NEUTRAL:
+		spf_symbol = spf_module_ctx->symbol_neutral;
+		spf_message = "(SPF): spf neutral";
+		break;
+	default:
+		spf_symbol = spf_module_ctx->symbol_allow;
+		spf_message = "(SPF): spf allow";
+		break;
 	}
-
-	af = rspamd_inet_address_get_af (task->from_addr);
-	/* Basic comparing algorithm */
-	if (((addr->flags & RSPAMD_SPF_FLAG_IPV6) && af == AF_INET6) ||
-		((addr->flags & RSPAMD_SPF_FLAG_IPV4) && af == AF_INET)) {
-		d = rspamd_inet_address_get_radix_key (task->from_addr, &addrlen);
-
-		if (af == AF_INET6) {
-			s = (const guint8 *)addr->addr6;
-			mask = addr->m.dual.mask_v6;
-		}
-		else {
-			s = (const guint8 *)addr->addr4;
-			mask = addr->m.dual.mask_v4;
-		}
-
-		/* Compare the first bytes */
-		bmask = mask / CHAR_BIT;
-		if (bmask > addrlen) {
-			msg_info ("bad mask length: %d", mask);
-		}
-		else if (memcmp (s, d, bmask) == 0) {
-
-			if (bmask * CHAR_BIT != mask) {
-				/* Compare the remaining bits */
-				s += bmask;
-				d += bmask;
-				mask = (0xff << (CHAR_BIT - (mask - bmask * 8))) & 0xff;
-				if ((*s & mask) == (*d & mask)) {
-					res = TRUE;
-				}
-			}
-			else {
-				res = TRUE;
-			}
-		}
-	}
-	else {
-		if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
-			res = TRUE;
-		}
-		else {
-			res = FALSE;
-		}
-	}
-
-	if (res) {
-		spf_result = rspamd_mempool_strdup (task->task_pool, addr->spf_string);
-		opts = g_list_prepend (opts, spf_result);
-		switch (addr->mech) {
-		case SPF_FAIL:
-			spf_symbol = spf_module_ctx->symbol_fail;
-			spf_message = "(SPF): spf fail";
-			break;
-		case SPF_SOFT_FAIL:
-			spf_symbol = spf_module_ctx->symbol_softfail;
-			spf_message = "(SPF): spf softfail";
-			break;
-		case SPF_NEUTRAL:
-			spf_symbol = spf_module_ctx->symbol_neutral;
-			spf_message = "(SPF): spf neutral";
-			break;
-		default:
-			spf_symbol = spf_module_ctx->symbol_allow;
-			spf_message = "(SPF): spf allow";
-			break;
-		}
-		rspamd_task_insert_result (task,
-				spf_symbol,
-				1,
-				opts);
-		task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
-		return TRUE;
-	}
-
-	return FALSE;
+	rspamd_task_insert_result (task,
+			spf_symbol,
+			1,
+			opts);
+	task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
 }
 
 static void
 spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
 {
-	guint i;
 	struct spf_addr *addr;
 
-	for (i = 0; i < rec->elts->len; i ++) {
-		addr = &g_array_index (rec->elts, struct spf_addr, i);
-		if (spf_check_element (addr, task)) {
-			break;
+	if ((addr = spf_record_match (rec, task->from_addr)) != NULL) {
+		spf_check_element (addr, task);
+	}
+}
+
+/*
+ * Find record in the local cache and then in the cache shared between workers
+ */
+static struct spf_resolved *
+spf_cache_lookup (const gchar *domain, struct rspamd_task *task)
+{
+	struct spf_resolved *l;
+	guchar *data;
+	gsize len;
+	guint ttl;
+
+	l = rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
+			task->tv.tv_sec);
+
+	if (l == NULL && spf_module_ctx->shared_cache != NULL) {
+		data = rspamd_shm_cache_lookup (spf_module_ctx->shared_cache,
+				domain, strlen (domain), task->tv.tv_sec, &len, &ttl);
+
+		if (data != NULL) {
+			l = spf_record_deserialize (data, len);
+			g_free (data);
+
+			if (l != NULL) {
+				debug_task ("found spf record for %s in shared cache", domain);
+				/* Hash owns the reference */
+				rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
+						l->domain, l, task->tv.tv_sec, ttl);
+			}
 		}
 	}
+
+	return l;
 }
 
 static void
 spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task)
 {
 	struct spf_resolved *l;
+	GByteArray *ser;
 
 	if (record && record->elts->len > 0 && record->domain) {
 
@@ -321,6 +332,14 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task)
 				record->domain, l,
 				task->tv.tv_sec, record->ttl);
 
+			if (spf_module_ctx->shared_cache != NULL) {
+				ser = spf_record_serialize (record);
+				rspamd_shm_cache_insert (spf_module_ctx->shared_cache,
+						record->domain, strlen (record->domain),
+						ser->data, ser->len,
+						task->tv.tv_sec, record->ttl);
+				g_byte_array_free (ser, TRUE);
+			}
 		}
 		spf_record_ref (l);
 		spf_check_list (l, task);
@@ -341,9 +360,7 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 			task->from_addr) == RADIX_NO_VALUE) {
 		domain = get_spf_domain (task);
 		if (domain) {
-			if ((l =
-				rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
-				task->tv.tv_sec)) != NULL) {
+			if ((l = spf_cache_lookup (domain, task)) != NULL) {
 				spf_record_ref (l);
 				spf_check_list (l, task);
 				spf_record_unref (l);
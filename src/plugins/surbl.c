@@ -282,16 +282,12 @@ surbl_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 	surbl_module_ctx->tld2_file = NULL;
 	surbl_module_ctx->whitelist_file = NULL;
 	surbl_module_ctx->redirectors = NULL;
-	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	/* Whitelist is compiled by map */
+	surbl_module_ctx->whitelist = NULL;
 	/* Zero exceptions hashes */
 	surbl_module_ctx->exceptions = rspamd_mempool_alloc0 (
 		surbl_module_ctx->surbl_pool,
 		MAX_LEVELS * sizeof (GHashTable *));
-	/* Register destructors */
-	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_destroy,
-		surbl_module_ctx->whitelist);
 
 	*ctx = (struct module_ctx *)surbl_module_ctx;
 
@@ -616,16 +612,13 @@ surbl_module_reconfig (struct rspamd_config *cfg)
 	surbl_module_ctx->tld2_file = NULL;
 	surbl_module_ctx->whitelist_file = NULL;
 	surbl_module_ctx->redirectors = NULL;
-	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	rspamd_map_hash_destroy (surbl_module_ctx->whitelist);
+	surbl_module_ctx->whitelist = NULL;
 	/* Zero exceptions hashes */
 	surbl_module_ctx->exceptions = rspamd_mempool_alloc0 (
 		surbl_module_ctx->surbl_pool,
 		MAX_LEVELS * sizeof (GHashTable *));
 	/* Register destructors */
-	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_destroy,
-		surbl_module_ctx->whitelist);
 	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_destroy,
 		surbl_module_ctx->redirector_hosts);
@@ -809,7 +802,7 @@ format_surbl_request (rspamd_mempool_t * pool,
 	}
 
 	if (!forced &&
-		g_hash_table_lookup (surbl_module_ctx->whitelist, result) != NULL) {
+		rspamd_map_hash_lookup (surbl_module_ctx->whitelist, result) != NULL) {
 		msg_debug ("url %s is whitelisted", result);
 		g_set_error (err, SURBL_ERROR,
 			WHITELIST_ERROR,
@@ -29,7 +29,7 @@ struct surbl_ctx {
 	const gchar *whitelist_file;
 	const gchar *redirector_symbol;
 	GHashTable **exceptions;
-	GHashTable *whitelist;
+	struct rspamd_map_hash *whitelist;
 	GHashTable *redirector_hosts;
 	void *redirector_map_data;
 	ac_trie_t *redirector_trie;
@@ -37,6 +37,7 @@
 #include "libmime/message.h"
 #include "main.h"
 #include "keypairs_cache.h"
+#include "thread_pool.h"
 
 #include "lua/lua_common.h"
 
@@ -54,7 +55,8 @@ worker_t normal_worker = {
 	FALSE,                      /* Non unique */
 	FALSE,                      /* Non threaded */
 	TRUE,                       /* Killable */
-	SOCK_STREAM                 /* TCP socket */
+	SOCK_STREAM,                /* TCP socket */
+	TRUE                        /* Counts connections */
 };
 
 /*
@@ -73,8 +75,6 @@ struct rspamd_worker_ctx {
 	gboolean allow_learn;
 	/* DNS resolver */
 	struct rspamd_dns_resolver *resolver;
-	/* Current tasks */
-	guint32 tasks;
 	/* Limit of tasks */
 	guint32 max_tasks;
 	/* Events base */
@@ -83,6 +83,10 @@ struct rspamd_worker_ctx {
 	gpointer key;
 	/* Keys cache */
 	struct rspamd_keypair_cache *keys_cache;
+	/* Number of threads for CPU bound stages */
+	guint32 threads;
+	/* Threads pool */
+	struct rspamd_thread_pool *cpu_pool;
 };
 
 /*
@@ -91,7 +95,7 @@ struct rspamd_worker_ctx {
 static void
 reduce_tasks_count (gpointer arg)
 {
-	guint32 *tasks = arg;
+	guint *tasks = arg;
 
 	(*tasks)--;
 }
@@ -168,9 +172,9 @@ accept_socket (gint fd, short what, void *arg)
 
 	ctx = worker->ctx;
 
-	if (ctx->max_tasks != 0 && ctx->tasks > ctx->max_tasks) {
-		msg_info ("current tasks is now: %uD while maximum is: %uD",
-			ctx->tasks,
+	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
+		msg_info ("current tasks is now: %ud while maximum is: %uD",
+			worker->nconns,
 			ctx->max_tasks);
 		return;
 	}
@@ -213,9 +217,10 @@ accept_socket (gint fd, short what, void *arg)
 		RSPAMD_HTTP_SERVER,
 		ctx->keys_cache);
 	new_task->ev_base = ctx->ev_base;
-	ctx->tasks++;
+	new_task->cpu_pool = ctx->cpu_pool;
+	worker->nconns++;
 	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t)reduce_tasks_count, &ctx->tasks);
+		(rspamd_mempool_destruct_t)reduce_tasks_count, &worker->nconns);
 
 	/* Set up async session */
 	new_task->s = rspamd_session_create (new_task->task_pool, rspamd_task_fin,
@@ -276,6 +281,11 @@ init_worker (struct rspamd_config *cfg)
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
 		key), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "threads",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		threads), RSPAMD_CL_FLAG_INT_32);
+
 	return ctx;
 }
 
@@ -296,6 +306,7 @@ start_worker (struct rspamd_worker *worker)
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
+	ctx->resolver->stat = worker->srv->stat;
 
 	rspamd_upstreams_library_init (ctx->resolver->r, ctx->ev_base);
 	rspamd_upstreams_library_config (worker->srv->cfg);
@@ -303,6 +314,19 @@ start_worker (struct rspamd_worker *worker)
 	/* XXX: stupid default */
 	ctx->keys_cache = rspamd_keypair_cache_new (256);
 
+	if (ctx->threads > 0) {
+		GError *err = NULL;
+
+		ctx->cpu_pool = rspamd_thread_pool_new (ctx->threads, ctx->ev_base,
+				&err);
+
+		if (ctx->cpu_pool == NULL) {
+			msg_err ("cannot create threads pool: %e, parse messages in the "
+					"main thread", err);
+			g_error_free (err);
+		}
+	}
+
 	event_base_loop (ctx->ev_base, 0);
 
 	g_mime_shutdown ();
@@ -314,6 +338,7 @@ start_worker (struct rspamd_worker *worker)
 	}
 
 	rspamd_keypair_cache_destroy (ctx->keys_cache);
+	rspamd_thread_pool_destroy (ctx->cpu_pool);
 
 	exit (EXIT_SUCCESS);
 }
@@ -87,6 +87,10 @@ context("Rspamd expressions", function()
        {'F && ((A + B + C + D) > 1)', 0},
        {'(E) && ((B + B + B + B) >= 1)', 0},
        {'!!C', 1},
+       {'(A + B) > 1', 0},
+       {'(A + C + E) > 2', 1},
+       {'(A + C + E) < 3 || F', 0},
+       {'B | 1', 1},
     }
     for _,c in ipairs(cases) do
       local expr,err = rspamd_expression.create(c[1], 
@@ -0,0 +1,140 @@
+-- FFI accessors tests and benchmark against classic task methods
+
+context("FFI task accessors", function()
+  local rspamd_ffi = require("rspamd_ffi")
+  local rspamd_task = require("rspamd_task")
+  local rspamd_util = require("rspamd_util")
+  local rspamd_regexp = require("rspamd_regexp")
+  local ffi = require("ffi")
+  ffi.cdef[[
+  void rspamd_url_init (const char *tld_file);
+  ]]
+
+  local test_dir = string.gsub(debug.getinfo(1).source, "^@(.+/)[^/]+$", "%1")
+  ffi.C.rspamd_url_init(string.format('%s/%s', test_dir, "test_tld.dat"))
+
+  local config = {
+    options = {
+      url_tld = string.format('%s/%s', test_dir, "test_tld.dat"),
+    },
+    logging = {
+      type = 'console',
+      level = 'error'
+    },
+    metric = {
+      name = 'default',
+      actions = {
+        reject = 100500,
+      },
+      unknown_weight = 1
+    }
+  }
+
+  local msg = [[
+From: Some Sender <sender@example.com>
+To: <nobody@example.com>
+Subject: Cheap viagra and other stuff
+Received: from mail.example.com (mail.example.com [192.168.1.1])
+	by mx.example.net with ESMTP id 12345
+Received: from localhost (localhost [127.0.0.1])
+	by mail.example.com with SMTP id 54321
+Message-Id: <12345@mail.example.com>
+X-Mailer: Microsoft Outlook Express 6.00.2800.1106
+Content-Type: text/plain
+
+Visit http://example.com/buy and http://test.example.org/unsubscribe today.
+]]
+
+  -- Header rules in the way SpamAssassin plugin defines them
+  local rules = {
+    {'Subject', '/viagra/i'},
+    {'Subject', '/\\bcheap\\b/i'},
+    {'Subject', '/^\\s*$/'},
+    {'From', '/example\\.com/'},
+    {'From', '/\\d{5,}@/'},
+    {'To', '/undisclosed/i'},
+    {'Received', '/localhost/'},
+    {'Received', '/\\[10\\./'},
+    {'Message-Id', '/@localhost/'},
+    {'X-Mailer', '/Outlook Express/'},
+    {'X-Mailer', '/The Bat/'},
+    {'X-Spam-Flag', '/YES/'},
+  }
+
+  for _,r in ipairs(rules) do
+    r[3] = rspamd_regexp.create_cached(r[2])
+  end
+
+  -- Classic path: the same calls as spamassassin.lua does for header rules
+  local function classic_match(task, r)
+    local hdr = task:get_header_full(r[1])
+    local str = ''
+    if hdr then
+      for _,rh in ipairs(hdr) do
+        str = str .. rh['decoded']
+      end
+    end
+    if str == '' then return false end
+    return r[3]:match(str) == true
+  end
+
+  local function ffi_match(task, r)
+    return rspamd_ffi.header_match(task, r[1], r[3])
+  end
+
+  local function make_task()
+    local cfg = rspamd_util.config_from_ucl(config)
+    assert_not_nil(cfg)
+    local task = rspamd_task.create_from_buffer(msg)
+    task:set_cfg(cfg)
+    assert_true(task:process_message())
+    return task
+  end
+
+  test("FFI results are equal to classic ones", function()
+    assert_not_nil(rspamd_ffi)
+    local task = make_task()
+
+    for _,r in ipairs(rules) do
+      assert_equal(ffi_match(task, r), classic_match(task, r),
+        string.format("'%s' for %s", r[2], r[1]))
+    end
+
+    assert_equal(rspamd_ffi.header(task, 'Subject'), task:get_header('Subject'))
+    assert_equal(rspamd_ffi.header(task, 'Received', false, false, 2),
+      task:get_header_full('Received')[2]['value'])
+    assert_nil(rspamd_ffi.header(task, 'X-Spam-Flag'))
+    assert_nil(rspamd_ffi.score(task, 'nonexistent'))
+
+    local n = 0
+    for p, len in rspamd_ffi.urls(task) do
+      assert_not_nil(ffi.string(p, len):find('example'))
+      n = n + 1
+    end
+    assert_equal(n, #task:get_urls())
+  end)
+
+  test("Benchmark FFI and classic header rules", function()
+    local task = make_task()
+    local iters = 2000
+
+    local function bench(f)
+      local t1 = os.clock()
+      local matched = 0
+      for _ = 1, iters do
+        for _,r in ipairs(rules) do
+          if f(task, r) then matched = matched + 1 end
+        end
+      end
+      return os.clock() - t1, matched
+    end
+
+    local classic_time, classic_matched = bench(classic_match)
+    local ffi_time, ffi_matched = bench(ffi_match)
+
+    assert_equal(ffi_matched, classic_matched)
+    print(string.format('header rules x%d: classic %.3fs, ffi %.3fs (x%.2f)',
+      iters * #rules, classic_time, ffi_time,
+      classic_time / math.max(ffi_time, 1e-6)))
+  end)
+end)
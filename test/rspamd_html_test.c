@@ -0,0 +1,201 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "tests.h"
+#include "main.h"
+#include "message.h"
+#include "html.h"
+#include "url.h"
+
+static const gchar *tld_file = BUILDROOT "/test/lua/unit/test_tld.dat";
+
+/*
+ * Parse html as a text part of a new task, the task must be freed by caller
+ */
+static struct rspamd_task *
+rspamd_html_test_parse (const gchar *html, struct mime_text_part *part,
+		GByteArray **stripped)
+{
+	struct rspamd_task *task;
+	GByteArray *src;
+
+	task = rspamd_task_new (NULL);
+	memset (part, 0, sizeof (*part));
+	src = g_byte_array_new ();
+	g_byte_array_append (src, (const guint8 *)html, strlen (html));
+
+	*stripped = rspamd_html_process_part (task, task->task_pool, part, src);
+	g_assert (*stripped != NULL);
+	g_assert (part->html != NULL);
+	g_byte_array_free (src, TRUE);
+
+	return task;
+}
+
+static gboolean
+rspamd_html_test_contains (GByteArray *buf, const gchar *str)
+{
+	return g_strstr_len ((const gchar *)buf->data, buf->len, str) != NULL;
+}
+
+static void
+rspamd_html_test_tags (void)
+{
+	struct rspamd_task *task;
+	struct mime_text_part part;
+	struct html_tag_event *ev;
+	GByteArray *stripped;
+
+	/* Balanced document */
+	task = rspamd_html_test_parse (
+			"<html><body><p>Hello <b>world</b><br/></p>"
+			"<script>var a = 1;</script></body></html>", &part, &stripped);
+	g_assert (part.html->flags & RSPAMD_HTML_FLAG_BALANCED);
+	g_assert (RSPAMD_HTML_TAG_SEEN (part.html, Tag_HTML));
+	g_assert (RSPAMD_HTML_TAG_SEEN (part.html, Tag_BODY));
+	g_assert (RSPAMD_HTML_TAG_SEEN (part.html, Tag_P));
+	g_assert (RSPAMD_HTML_TAG_SEEN (part.html, Tag_B));
+	g_assert (RSPAMD_HTML_TAG_SEEN (part.html, Tag_BR));
+	g_assert (!RSPAMD_HTML_TAG_SEEN (part.html, Tag_TABLE));
+	/* Opening and closing events for all tags except of closed BR */
+	g_assert (part.html->tags->len == 11);
+	ev = &g_array_index (part.html->tags, struct html_tag_event, 0);
+	g_assert (ev->id == Tag_HTML && ev->flags == 0);
+	ev = &g_array_index (part.html->tags, struct html_tag_event, 5);
+	g_assert (ev->id == Tag_BR && (ev->flags & FL_CLOSED));
+	ev = &g_array_index (part.html->tags, struct html_tag_event, 10);
+	g_assert (ev->id == Tag_HTML && (ev->flags & FL_CLOSING));
+	/* Tags are stripped, content of scripts is skipped */
+	g_assert (rspamd_html_test_contains (stripped, "Hello world"));
+	g_assert (!rspamd_html_test_contains (stripped, "<b>"));
+	g_assert (!rspamd_html_test_contains (stripped, "var a"));
+	g_byte_array_free (stripped, TRUE);
+	rspamd_task_free (task, FALSE);
+
+	/* Closing tag without opening one */
+	task = rspamd_html_test_parse ("<div><b>text</div></span>", &part,
+			&stripped);
+	g_assert (!(part.html->flags & RSPAMD_HTML_FLAG_BALANCED));
+	g_byte_array_free (stripped, TRUE);
+	rspamd_task_free (task, FALSE);
+
+	/* Tag that requires end tag is not closed */
+	task = rspamd_html_test_parse ("<div><span>text</div>", &part,
+			&stripped);
+	g_assert (!(part.html->flags & RSPAMD_HTML_FLAG_BALANCED));
+	g_byte_array_free (stripped, TRUE);
+	rspamd_task_free (task, FALSE);
+
+	/* Empty tags and tags with optional end tags do not break balance */
+	task = rspamd_html_test_parse (
+			"<html><head><meta http-equiv=\"Content-Type\" content=\"text/html\">"
+			"</head><body><p>line<br>next<img src=\"a.png\"><hr>"
+			"<ul><li>one<li>two</ul><p>unclosed</p></p></body></html>",
+			&part, &stripped);
+	g_assert (part.html->flags & RSPAMD_HTML_FLAG_BALANCED);
+	g_assert (RSPAMD_HTML_TAG_SEEN (part.html, Tag_BR));
+	g_assert (RSPAMD_HTML_TAG_SEEN (part.html, Tag_IMG));
+	g_byte_array_free (stripped, TRUE);
+	rspamd_task_free (task, FALSE);
+
+	/* Entities are decoded in text and do not produce tags */
+	task = rspamd_html_test_parse ("<p>&lt;b&gt; &amp; text</p>", &part,
+			&stripped);
+	g_assert (rspamd_html_test_contains (stripped, "<b> & text"));
+	g_assert (!RSPAMD_HTML_TAG_SEEN (part.html, Tag_B));
+	g_assert (part.html->tags->len == 2);
+	g_byte_array_free (stripped, TRUE);
+	rspamd_task_free (task, FALSE);
+}
+
+static void
+rspamd_html_test_tag_names (void)
+{
+	struct html_tag *tag;
+
+	tag = get_tag_by_name ("a");
+	g_assert (tag != NULL && tag->id == Tag_A);
+	tag = get_tag_by_name ("IMG");
+	g_assert (tag != NULL && tag->id == Tag_IMG);
+	tag = get_tag_by_name ("Table");
+	g_assert (tag != NULL && tag->id == Tag_TABLE);
+	tag = get_tag_by_name ("span");
+	g_assert (tag != NULL && tag->id == Tag_SPAN);
+	/* Prefixes, unknown and too long names are not matched */
+	g_assert (get_tag_by_name ("tabl") == NULL);
+	g_assert (get_tag_by_name ("some_tag") == NULL);
+	g_assert (get_tag_by_name ("") == NULL);
+	g_assert (get_tag_by_name ("averyveryverylongnonexistingtagname") == NULL);
+}
+
+static void
+rspamd_html_test_urls (void)
+{
+	struct rspamd_task *task;
+	struct mime_text_part part;
+	GByteArray *stripped;
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_url *url;
+	guint nphished = 0;
+
+	rspamd_url_init (tld_file);
+
+	task = rspamd_html_test_parse (
+			"<a href=\"http://example.com/path\">click</a>"
+			"<img src='http://images.example.org/i.png'>"
+			"<a href=mailto:user@example.net>mail</a>"
+			"<a href=\"/relative\">relative</a>"
+			"<a href=\"http://evil.com/\">http://bank.org/</a>",
+			&part, &stripped);
+
+	g_assert (g_hash_table_size (task->urls) == 3);
+	g_assert (g_hash_table_size (task->emails) == 1);
+
+	g_hash_table_iter_init (&it, task->urls);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+
+		if (url->is_phished) {
+			g_assert (url->hostlen == sizeof ("evil.com") - 1);
+			g_assert (memcmp (url->host, "evil.com", url->hostlen) == 0);
+			g_assert (url->phished_url != NULL);
+			nphished ++;
+		}
+	}
+
+	g_assert (nphished == 1);
+	g_assert (rspamd_html_test_contains (stripped, "click"));
+	g_byte_array_free (stripped, TRUE);
+	rspamd_task_free (task, FALSE);
+}
+
+void
+rspamd_html_test_func (void)
+{
+	rspamd_html_test_tags ();
+	rspamd_html_test_tag_names ();
+	rspamd_html_test_urls ();
+}
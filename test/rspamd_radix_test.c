@@ -78,11 +78,13 @@ struct _tv {
 static void
 rspamd_radix_text_vec (void)
 {
-	radix_compressed_t *tree = radix_create_compressed ();
+	radix_compressed_t *tree = radix_create_compressed (), *flat_tree;
 	struct _tv *t = &test_vec[0];
 	struct in_addr ina;
 	struct in6_addr in6a;
 	gulong i, val;
+	guchar *flat;
+	gsize flen;
 
 	while (t->ip != NULL) {
 		t->addr = g_malloc (sizeof (in6a));
@@ -134,6 +136,24 @@ rspamd_radix_text_vec (void)
 		t ++;
 	}
 
+	/* Flat trie must give the same results */
+	flat = radix_flatten_compressed (tree, &flen);
+	flat_tree = radix_create_flat (flat, flen, FALSE);
+	g_assert (flat_tree != NULL);
+	g_assert (radix_get_size (flat_tree) == radix_get_size (tree));
+
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		g_assert (radix_find_compressed (flat_tree, t->addr, t->len) ==
+				radix_find_compressed (tree, t->addr, t->len));
+		if (t->nip != NULL) {
+			g_assert (radix_find_compressed (flat_tree, t->naddr, t->len) ==
+					radix_find_compressed (tree, t->naddr, t->len));
+		}
+		t ++;
+	}
+
+	radix_destroy_compressed (flat_tree);
 	radix_destroy_compressed (tree);
 }
 
@@ -143,7 +163,10 @@ rspamd_radix_test_func (void)
 #if 0
 	radix_tree_t *tree = radix_tree_create ();
 #endif
-	radix_compressed_t *comp_tree = radix_create_compressed ();
+	radix_compressed_t *comp_tree = radix_create_compressed_flattenable (),
+			*flat_tree;
+	guchar *flat;
+	gsize flen;
 	struct {
 		guint32 addr;
 		guint32 mask;
@@ -241,6 +264,85 @@ rspamd_radix_test_func (void)
 	diff = (ts2 - ts1) * 1000.0;
 
 	msg_info ("Checked %z elements in %.6f ms", nelts, diff);
+
+	msg_info ("multibit tables performance (%z elts)", nelts);
+	ts1 = rspamd_get_ticks ();
+	flat = radix_flatten_compressed (comp_tree, &flen);
+	flat_tree = radix_create_flat (flat, flen, FALSE);
+	g_assert (flat_tree != NULL);
+	ts2 = rspamd_get_ticks ();
+	diff = (ts2 - ts1) * 1000.0;
+
+	msg_info ("Compiled %z elements to %z bytes in %.6f ms", nelts, flen, diff);
+
+	ts1 = rspamd_get_ticks ();
+	for (lc = 0; lc < lookup_cycles; lc ++) {
+		for (i = 0; i < nelts; i ++) {
+			if (radix_find_compressed (flat_tree, addrs[i].addr6,
+					sizeof (addrs[i].addr6)) == RADIX_NO_VALUE) {
+				all_good = FALSE;
+			}
+		}
+	}
+	ts2 = rspamd_get_ticks ();
+	diff = (ts2 - ts1) * 1000.0;
+
+	g_assert (all_good);
+	msg_info ("Checked %z elements in %.6f ms", nelts, diff);
+	radix_destroy_compressed (flat_tree);
+	radix_destroy_compressed (comp_tree);
+
+	/* IPv4 lookups */
+	comp_tree = radix_create_compressed_flattenable ();
+	for (i = 0; i < nelts; i ++) {
+		radix_insert_compressed (comp_tree, (guint8 *)&addrs[i].addr,
+				sizeof (addrs[i].addr), 32 - addrs[i].mask, i);
+	}
+
+	flat = radix_flatten_compressed (comp_tree, &flen);
+	flat_tree = radix_create_flat (flat, flen, FALSE);
+	g_assert (flat_tree != NULL);
+
+	ts1 = rspamd_get_ticks ();
+	for (lc = 0; lc < lookup_cycles; lc ++) {
+		for (i = 0; i < nelts; i ++) {
+			if (radix_find_compressed (comp_tree, (guint8 *)&addrs[i].addr,
+					sizeof (addrs[i].addr)) == RADIX_NO_VALUE) {
+				all_good = FALSE;
+			}
+		}
+	}
+	ts2 = rspamd_get_ticks ();
+	diff = (ts2 - ts1) * 1000.0;
+
+	g_assert (all_good);
+	msg_info ("Checked %z IPv4 elements in trie in %.6f ms", nelts, diff);
+
+	ts1 = rspamd_get_ticks ();
+	for (lc = 0; lc < lookup_cycles; lc ++) {
+		for (i = 0; i < nelts; i ++) {
+			if (radix_find_compressed (flat_tree, (guint8 *)&addrs[i].addr,
+					sizeof (addrs[i].addr)) == RADIX_NO_VALUE) {
+				all_good = FALSE;
+			}
+		}
+	}
+	ts2 = rspamd_get_ticks ();
+	diff = (ts2 - ts1) * 1000.0;
+
+	g_assert (all_good);
+	msg_info ("Checked %z IPv4 elements in multibit tables in %.6f ms",
+			nelts, diff);
+
+	/* Results must be the same */
+	for (i = 0; i < nelts; i ++) {
+		g_assert (radix_find_compressed (flat_tree, (guint8 *)&addrs[i].addr,
+				sizeof (addrs[i].addr)) ==
+				radix_find_compressed (comp_tree, (guint8 *)&addrs[i].addr,
+				sizeof (addrs[i].addr)));
+	}
+
+	radix_destroy_compressed (flat_tree);
 	radix_destroy_compressed (comp_tree);
 
 	g_free (addrs);
@@ -26,6 +26,7 @@
 #include "shingles.h"
 #include "fstring.h"
 #include "ottery.h"
+#include "cryptobox.h"
 
 static void
 generate_random_string (char *begin, size_t len)
@@ -86,11 +87,18 @@ free_fuzzy_words (GArray *ar)
 	}
 }
 
+static guint64
+test_min_filter (guint64 *input, gsize count,
+		gint shno, const guchar *key, gpointer ud)
+{
+	return rspamd_shingles_default_filter (input, count, shno, key, ud);
+}
+
 static void
 test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 {
 	GArray *input;
-	struct rspamd_shingle *sgl, *sgl_permuted;
+	struct rspamd_shingle *sgl, *sgl_permuted, *sgl_custom;
 	gdouble res;
 	guchar key[16];
 	gdouble ts1, ts2;
@@ -101,6 +109,11 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	sgl = rspamd_shingles_generate (input, key, NULL,
 			rspamd_shingles_default_filter, NULL);
 	ts2 = rspamd_get_ticks ();
+	/* Running minima must be equal to the filtered hashes */
+	sgl_custom = rspamd_shingles_generate (input, key, NULL,
+			test_min_filter, NULL);
+	g_assert (memcmp (sgl->hashes, sgl_custom->hashes,
+			sizeof (sgl->hashes)) == 0);
 	permute_vector (input, perm_factor);
 	sgl_permuted = rspamd_shingles_generate (input, key, NULL,
 			rspamd_shingles_default_filter, NULL);
@@ -114,11 +127,48 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	free_fuzzy_words (input);
 	g_free (sgl);
 	g_free (sgl_permuted);
+	g_free (sgl_custom);
+}
+
+/*
+ * Multi key siphash must be equal to siphash-2-4 calculated for each key
+ */
+static void
+test_siphash_multi (void)
+{
+	rspamd_sipkey_t keys[RSPAMD_SHINGLE_SIZE];
+	guint64 multi[RSPAMD_SHINGLE_SIZE], single;
+	guchar buf[131];
+	guint len, nkeys, i, round;
+
+	for (round = 0; round < 8; round ++) {
+		ottery_rand_bytes (keys, sizeof (keys));
+		ottery_rand_bytes (buf, sizeof (buf));
+
+		/* All tail lengths for each number of keys including odd ones */
+		for (len = 0; len <= sizeof (buf); len ++) {
+			nkeys = 1 + (len + round) % RSPAMD_SHINGLE_SIZE;
+			memset (multi, 0, sizeof (multi));
+			rspamd_cryptobox_siphash_multi (multi, buf, len, keys, nkeys);
+
+			for (i = 0; i < nkeys; i ++) {
+				rspamd_cryptobox_siphash ((guchar *)&single, buf, len,
+						keys[i]);
+				g_assert (memcmp (&single, &multi[i], sizeof (single)) == 0);
+			}
+
+			/* Hashes after nkeys are not touched */
+			for (; i < RSPAMD_SHINGLE_SIZE; i ++) {
+				g_assert (multi[i] == 0);
+			}
+		}
+	}
 }
 
 void
 rspamd_shingles_test_func (void)
 {
+	test_siphash_multi ();
 	//test_case (5, 100, 0.5);
 	test_case (200, 10, 0.1);
 	test_case (500, 20, 0.01);
@@ -0,0 +1,141 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "tests.h"
+#include "main.h"
+#include "shm_cache.h"
+
+static void
+rspamd_shm_cache_test_value (struct rspamd_shm_cache *c, const gchar *key,
+		time_t now, const gchar *expected)
+{
+	gchar *data;
+	gsize vlen;
+
+	data = rspamd_shm_cache_lookup (c, key, strlen (key), now, &vlen, NULL);
+
+	if (expected == NULL) {
+		g_assert (data == NULL);
+	}
+	else {
+		g_assert (data != NULL);
+		g_assert (vlen == strlen (expected));
+		g_assert (memcmp (data, expected, vlen) == 0);
+		g_free (data);
+	}
+}
+
+void
+rspamd_shm_cache_test_func (void)
+{
+	struct rspamd_shm_cache *c, *nc;
+	GError *err = NULL;
+	gchar path[] = "/tmp/rspamd-shm-cache-XXXXXX", key[32];
+	time_t now = time (NULL);
+	guint i, found = 0, ttl;
+	gsize vlen;
+	gpointer data;
+	gint fd;
+
+	/* Anonymous cache */
+	c = rspamd_shm_cache_new (64, 32, NULL, &err);
+	g_assert (c != NULL);
+	rspamd_shm_cache_test_value (c, "key", now, NULL);
+	g_assert (rspamd_shm_cache_insert (c, "key", 3, "value", 5, now, 10));
+	rspamd_shm_cache_test_value (c, "key", now, "value");
+	data = rspamd_shm_cache_lookup (c, "key", 3, now + 4, &vlen, &ttl);
+	g_assert (data != NULL);
+	g_assert (ttl == 6);
+	g_free (data);
+	/* Expired */
+	rspamd_shm_cache_test_value (c, "key", now + 10, NULL);
+	/* Replace value */
+	g_assert (rspamd_shm_cache_insert (c, "key", 3, "other", 5, now, 10));
+	rspamd_shm_cache_test_value (c, "key", now, "other");
+	/* Too long values and zero ttl are not inserted */
+	memset (key, 'a', sizeof (key));
+	g_assert (!rspamd_shm_cache_insert (c, "big", 3, key, sizeof (key) + 1,
+			now, 10));
+	g_assert (!rspamd_shm_cache_insert (c, "zero", 4, "v", 1, now, 0));
+
+	/* Eviction keeps the cache usable when it is overfilled */
+	for (i = 0; i < 256; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		g_assert (rspamd_shm_cache_insert (c, key, strlen (key), key,
+				strlen (key), now, 10));
+	}
+
+	for (i = 0; i < 256; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		data = rspamd_shm_cache_lookup (c, key, strlen (key), now, &vlen, NULL);
+
+		if (data != NULL) {
+			g_assert (vlen == strlen (key));
+			g_assert (memcmp (data, key, vlen) == 0);
+			g_free (data);
+			found ++;
+		}
+	}
+
+	g_assert (found > 0 && found <= 64);
+
+	/* Reuse with the same geometry keeps cache */
+	nc = rspamd_shm_cache_reuse (c, 64, 32, NULL, &err);
+	g_assert (nc == c);
+	c = rspamd_shm_cache_reuse (nc, 0, 32, NULL, &err);
+	g_assert (c == NULL);
+
+	/* File backed cache survives restarts */
+	fd = mkstemp (path);
+	g_assert (fd != -1);
+	close (fd);
+
+	c = rspamd_shm_cache_new (64, 32, path, &err);
+	g_assert (c != NULL);
+	g_assert (rspamd_shm_cache_insert (c, "key", 3, "value", 5, now, 10));
+	rspamd_shm_cache_destroy (c);
+
+	c = rspamd_shm_cache_new (64, 32, path, &err);
+	g_assert (c != NULL);
+	rspamd_shm_cache_test_value (c, "key", now, "value");
+
+	/*
+	 * Changed geometry creates a new file, whilst the old mapping, that is
+	 * used by workers of the previous configuration, stays intact
+	 */
+	nc = rspamd_shm_cache_new (128, 32, path, &err);
+	g_assert (nc != NULL);
+	rspamd_shm_cache_test_value (nc, "key", now, NULL);
+	rspamd_shm_cache_test_value (c, "key", now, "value");
+	g_assert (rspamd_shm_cache_insert (c, "old", 3, "value", 5, now, 10));
+	rspamd_shm_cache_test_value (nc, "old", now, NULL);
+	rspamd_shm_cache_destroy (c);
+
+	c = rspamd_shm_cache_reuse (nc, 128, 64, path, &err);
+	g_assert (c != NULL);
+	rspamd_shm_cache_test_value (c, "key", now, NULL);
+	rspamd_shm_cache_destroy (c);
+
+	unlink (path);
+}
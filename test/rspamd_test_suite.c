@@ -54,6 +54,11 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/upstream", rspamd_upstream_test_func);
 	g_test_add_func ("/rspamd/shingles", rspamd_shingles_test_func);
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
+	g_test_add_func ("/rspamd/timeseries", rspamd_timeseries_test_func);
+	g_test_add_func ("/rspamd/shm_cache", rspamd_shm_cache_test_func);
+	g_test_add_func ("/rspamd/thread_pool", rspamd_thread_pool_test_func);
+	g_test_add_func ("/rspamd/html", rspamd_html_test_func);
+	/* Lua tests exit the process, so tests added after them are not run */
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/crypto", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
@@ -0,0 +1,134 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "tests.h"
+#include "main.h"
+#include "thread_pool.h"
+
+#define TEST_JOBS 64
+
+struct thread_pool_test_ctx {
+	struct event_base *ev_base;
+	GThread *loop_thread;
+	volatile gint executed;
+	gint finished;
+	gint expected;
+	gboolean wrong_thread;
+};
+
+static void
+rspamd_thread_pool_test_job (gpointer ud)
+{
+	struct thread_pool_test_ctx *ctx = ud;
+
+	if (g_thread_self () == ctx->loop_thread) {
+		ctx->wrong_thread = TRUE;
+	}
+
+	usleep (1000);
+	g_atomic_int_inc (&ctx->executed);
+}
+
+static void
+rspamd_thread_pool_test_fin (gpointer ud)
+{
+	struct thread_pool_test_ctx *ctx = ud;
+
+	if (g_thread_self () != ctx->loop_thread) {
+		ctx->wrong_thread = TRUE;
+	}
+
+	ctx->finished ++;
+
+	if (ctx->finished == ctx->expected) {
+		event_base_loopexit (ctx->ev_base, NULL);
+	}
+}
+
+static void
+rspamd_thread_pool_test_timeout (gint fd, short what, gpointer ud)
+{
+	struct thread_pool_test_ctx *ctx = ud;
+
+	event_base_loopexit (ctx->ev_base, NULL);
+}
+
+void
+rspamd_thread_pool_test_func (void)
+{
+	struct thread_pool_test_ctx ctx;
+	struct rspamd_thread_pool *pool;
+	struct rspamd_thread_pool_job *job;
+	struct event ev;
+	struct timeval tv;
+	GError *err = NULL;
+	gint i;
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.ev_base = event_init ();
+	ctx.loop_thread = g_thread_self ();
+
+	pool = rspamd_thread_pool_new (4, ctx.ev_base, &err);
+	g_assert (pool != NULL);
+
+	/* Jobs are executed by pool threads and finalized in the event loop */
+	ctx.expected = TEST_JOBS;
+
+	for (i = 0; i < TEST_JOBS; i ++) {
+		rspamd_thread_pool_push (pool, rspamd_thread_pool_test_job,
+				rspamd_thread_pool_test_fin, &ctx);
+	}
+
+	evtimer_set (&ev, rspamd_thread_pool_test_timeout, &ctx);
+	event_base_set (ctx.ev_base, &ev);
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	event_add (&ev, &tv);
+
+	event_base_loop (ctx.ev_base, 0);
+	event_del (&ev);
+
+	g_assert (g_atomic_int_get (&ctx.executed) == TEST_JOBS);
+	g_assert (ctx.finished == TEST_JOBS);
+	g_assert (!ctx.wrong_thread);
+
+	/* Waited job is done, but its finalizer is not called */
+	job = rspamd_thread_pool_push (pool, rspamd_thread_pool_test_job,
+			rspamd_thread_pool_test_fin, &ctx);
+	rspamd_thread_pool_job_wait (pool, job);
+	g_assert (g_atomic_int_get (&ctx.executed) == TEST_JOBS + 1);
+	event_base_loop (ctx.ev_base, EVLOOP_NONBLOCK);
+	g_assert (ctx.finished == TEST_JOBS);
+
+	/* Destruction waits for pending jobs and does not call finalizers */
+	for (i = 0; i < TEST_JOBS; i ++) {
+		rspamd_thread_pool_push (pool, rspamd_thread_pool_test_job,
+				rspamd_thread_pool_test_fin, &ctx);
+	}
+
+	rspamd_thread_pool_destroy (pool);
+	g_assert (g_atomic_int_get (&ctx.executed) == TEST_JOBS * 2 + 1);
+	g_assert (ctx.finished == TEST_JOBS);
+	g_assert (!ctx.wrong_thread);
+}
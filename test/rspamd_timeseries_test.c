@@ -0,0 +1,106 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "tests.h"
+#include "main.h"
+#include "timeseries.h"
+
+struct ts_test_cbdata {
+	guint n;
+	guint64 total;
+};
+
+static void
+rspamd_ts_test_cb (time_t ts, const guint32 *values, guint nvalues,
+		gpointer ud)
+{
+	struct ts_test_cbdata *cbd = ud;
+	guint i;
+
+	cbd->n ++;
+
+	for (i = 0; i < nvalues; i ++) {
+		cbd->total += values[i];
+	}
+}
+
+void
+rspamd_timeseries_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	struct rspamd_ts_store *store;
+	struct ts_test_cbdata cbd;
+	enum rspamd_ts_series_type type;
+	guint32 buckets[RSPAMD_TS_BUCKETS];
+	guint step, i;
+	time_t now = time (NULL);
+	gdouble p;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	store = rspamd_ts_store_new (pool, NULL);
+
+	g_assert (rspamd_ts_add_counter (store, "action:reject", 10));
+	g_assert (rspamd_ts_add_counter (store, "action:reject", 5));
+	g_assert (!rspamd_ts_add_counter (store, "action:nonexistent", 1));
+	/* Histograms cannot be used as counters */
+	g_assert (!rspamd_ts_add_counter (store, "scan_time", 1));
+
+	memset (&cbd, 0, sizeof (cbd));
+	g_assert (rspamd_ts_query (store, "action:reject", now - 60, 0, &step,
+			&type, rspamd_ts_test_cb, &cbd));
+	g_assert (step == 10);
+	g_assert (type == RSPAMD_TS_COUNTER);
+	g_assert (cbd.n >= 1);
+	g_assert (cbd.total == 15);
+
+	/* Coarse levels are used for long ranges */
+	memset (&cbd, 0, sizeof (cbd));
+	g_assert (rspamd_ts_query (store, "action:reject", now - 86400 * 2, 0,
+			&step, &type, rspamd_ts_test_cb, &cbd));
+	g_assert (step == 900);
+	g_assert (cbd.total == 15);
+
+	for (i = 0; i < 100; i ++) {
+		rspamd_ts_add_latency (store, "test", 0.001);
+	}
+
+	memset (&cbd, 0, sizeof (cbd));
+	g_assert (rspamd_ts_query (store, "latency:test", now - 60, 0, &step,
+			&type, rspamd_ts_test_cb, &cbd));
+	g_assert (type == RSPAMD_TS_HISTOGRAM);
+	g_assert (cbd.total == 100);
+	g_assert (!rspamd_ts_query (store, "latency:other", now - 60, 0, &step,
+			&type, rspamd_ts_test_cb, &cbd));
+
+	/* 1000 usec belong to [512, 1024) bucket */
+	memset (buckets, 0, sizeof (buckets));
+	buckets[2] = 100;
+	p = rspamd_ts_percentile (buckets, 0.5);
+	g_assert (p >= 0.512 && p <= 1.024);
+	buckets[10] = 1;
+	p = rspamd_ts_percentile (buckets, 0.999);
+	g_assert (p > 100.0);
+
+	rspamd_mempool_delete (pool);
+}
@@ -152,6 +152,39 @@ rspamd_upstream_test_func (void)
 	}
 	rspamd_upstreams_destroy (nls);
 
+	/*
+	 * Test latency rotation: the slow upstream is selected only if there
+	 * are many requests in flight to the fast one
+	 */
+	nls = rspamd_upstreams_create ();
+	g_assert (rspamd_upstreams_parse_line (nls, "127.0.0.1,127.0.0.2", 0, NULL));
+	up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY);
+	upn = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY);
+	g_assert (up != upn);
+	rspamd_upstream_latency (up, 0.001);
+	rspamd_upstream_ok (up);
+	rspamd_upstream_release (up);
+	rspamd_upstream_latency (upn, 0.1);
+	rspamd_upstream_ok (upn);
+	rspamd_upstream_release (upn);
+
+	for (i = 0; i < 100; i ++) {
+		g_assert (rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY) == up);
+		rspamd_upstream_ok (up);
+		rspamd_upstream_release (up);
+	}
+
+	/*
+	 * Now the fast upstream is overloaded: requests are not released, and
+	 * rspamd_upstream_ok does not change the number of requests in flight
+	 */
+	for (i = 0; i < 99; i ++) {
+		g_assert (rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY) == up);
+		rspamd_upstream_ok (up);
+	}
+	g_assert (rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY) == upn);
+	rspamd_upstreams_destroy (nls);
+
 	/* Upstream fail test */
 	evtimer_set (&ev, rspamd_upstream_timeout_handler, resolver);
 	event_base_set (ev_base, &ev);
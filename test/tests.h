@@ -42,4 +42,12 @@ void rspamd_lua_test_func (void);
 
 void rspamd_cryptobox_test_func (void);
 
+void rspamd_timeseries_test_func (void);
+
+void rspamd_shm_cache_test_func (void);
+
+void rspamd_thread_pool_test_func (void);
+
+void rspamd_html_test_func (void);
+
 #endif